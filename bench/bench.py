@@ -0,0 +1,329 @@
+#!/usr/bin/env python3
+"""
+@file bench.py
+@author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+
+@brief End to end benchmark of lisod, run with make bench
+
+Starts lisod on a generated www tree and drives it with loadgen through
+the standard scenarios. Every scenario prints one JSON line: the loadgen
+results (requests/s, errors, latency percentiles) with the CPU used by
+lisod and its children during the run, its RSS after the run and its
+peak RSS. With --baseline the results are compared with an earlier run
+and every regression beyond --threshold percent is reported, the exit
+status is then 1.
+
+@version 0.1
+@date 2021-11-09
+
+@copyright Copyright (c) 2021
+"""
+
+import argparse
+import json
+import os
+import shutil
+import signal
+import socket
+import subprocess
+import sys
+import tempfile
+import time
+
+SMALL_BYTES = 1024
+MEDIUM_BYTES = 1024 * 1024
+START_TIMEOUT = 5
+
+CGI_SCRIPT = """#!/bin/sh
+cat > /dev/null
+printf 'Content-Type: text/plain\\r\\n\\r\\nhello world\\n'
+"""
+
+
+def scenarios(args):
+    """
+    @brief Scenarios to run, name and loadgen arguments
+
+    @param args command line arguments
+    @return ** list of (name, arguments) pairs
+    """
+    threads = str(args.threads)
+    seconds = str(args.seconds)
+    run = ['-t', threads, '-d', seconds]
+    cases = [
+        ('small_static', run + ['-c', '32', '-u', '/index.html']),
+        ('small_static_open', run + ['-c', '32', '-R', str(args.rate), '-u', '/index.html']),
+        ('file_1mb', run + ['-c', '8', '-u', '/1mb.bin']),
+        ('pipelined', run + ['-c', '8', '-p', '16', '-u', '/index.html']),
+        ('idle_keepalive', run + ['-c', '32', '-i', str(args.idle), '-u', '/index.html']),
+        ('cgi_hello', run + ['-c', '8', '-u', '/cgi/']),
+        ('post_upload', run + ['-c', '8', '-u', '/cgi/', '-P', str(args.post_bytes)]),
+    ]
+    if args.huge_mb > 0:
+        # a few responses take seconds each, counted rather than timed
+        cases.insert(3, ('file_huge', ['-c', '1', '-n', '2', '-u', '/huge.bin']))
+    if args.only:
+        wanted = args.only.split(',')
+        cases = [case for case in cases if case[0] in wanted]
+    return cases
+
+
+def make_www(root, args):
+    """
+    @brief Generate the www tree and the CGI script
+
+    @param root directory to fill
+    @param args command line arguments
+    @return ** str path of the www folder
+    """
+    www = os.path.join(root, 'www')
+    os.mkdir(www)
+    with open(os.path.join(www, 'index.html'), 'w') as f:
+        f.write('x' * SMALL_BYTES)
+    with open(os.path.join(www, '1mb.bin'), 'wb') as f:
+        f.write(os.urandom(MEDIUM_BYTES))
+    if args.huge_mb > 0:
+        # sparse, lisod still reads every byte of it
+        with open(os.path.join(www, 'huge.bin'), 'wb') as f:
+            f.truncate(args.huge_mb * 1024 * 1024)
+
+    script = os.path.join(root, 'hello.sh')
+    with open(script, 'w') as f:
+        f.write(CGI_SCRIPT)
+    os.chmod(script, 0o755)
+    return www
+
+
+def start_lisod(root, www, args):
+    """
+    @brief Start lisod and wait until it accepts connections
+
+    @param root directory for the log and lock files
+    @param www www folder
+    @param args command line arguments
+    @return ** int pid of the daemon
+    """
+    lock = os.path.join(root, 'lisod.lock')
+    cmd = [args.lisod, str(args.port), os.path.join(root, 'lisod.log'), lock,
+           www, os.path.join(root, 'hello.sh')] + args.server_option
+    subprocess.check_call(cmd, stdout=subprocess.DEVNULL)
+
+    deadline = time.time() + START_TIMEOUT
+    while time.time() < deadline:
+        try:
+            with open(lock) as f:
+                pid = int(f.read().strip())
+            socket.create_connection(('127.0.0.1', args.port), 1).close()
+            return pid
+        except (OSError, ValueError):
+            time.sleep(0.1)
+    raise RuntimeError('lisod did not start, see %s' % os.path.join(root, 'lisod.log'))
+
+
+def stop_lisod(pid):
+    """
+    @brief Stop lisod and wait for it to exit
+
+    @param pid pid of the daemon
+    @return ** None
+    """
+    try:
+        os.kill(pid, signal.SIGTERM)
+        deadline = time.time() + START_TIMEOUT
+        while time.time() < deadline:
+            os.kill(pid, 0)
+            time.sleep(0.1)
+        os.kill(pid, signal.SIGKILL)
+    except ProcessLookupError:
+        pass
+
+
+def proc_usage(pid):
+    """
+    @brief CPU seconds used by a process and its waited children, and its
+    current and peak RSS
+
+    @param pid process
+    @return ** tuple (cpu seconds, rss kB, peak rss kB)
+    """
+    with open('/proc/%d/stat' % pid) as f:
+        # the command name may hold spaces, fields are counted after it
+        fields = f.read().rsplit(')', 1)[1].split()
+    ticks = sum(int(field) for field in fields[11:15])
+
+    rss = peak = 0
+    with open('/proc/%d/status' % pid) as f:
+        for line in f:
+            if line.startswith('VmRSS:'):
+                rss = int(line.split()[1])
+            elif line.startswith('VmHWM:'):
+                peak = int(line.split()[1])
+    return ticks / os.sysconf('SC_CLK_TCK'), rss, peak
+
+
+def reset_peak_rss(pid):
+    """
+    @brief Restart the peak RSS of a process from its current RSS
+
+    @param pid process
+    @return ** None
+    """
+    try:
+        with open('/proc/%d/clear_refs' % pid, 'w') as f:
+            f.write('5')
+    except OSError:
+        pass
+
+
+def run_case(name, loadgen_args, pid, args):
+    """
+    @brief Run one scenario
+
+    @param name scenario name
+    @param loadgen_args arguments of loadgen
+    @param pid pid of lisod
+    @param args command line arguments
+    @return ** dict result of the scenario
+    """
+    cmd = [args.loadgen, '-j', '-N', name] + loadgen_args + ['127.0.0.1', str(args.port)]
+    reset_peak_rss(pid)
+    cpu_before = proc_usage(pid)[0]
+    started = time.time()
+    out = subprocess.run(cmd, stdout=subprocess.PIPE, check=True, universal_newlines=True).stdout
+    elapsed = time.time() - started
+    cpu_after, rss, peak = proc_usage(pid)
+
+    result = json.loads(out)
+    cpu = cpu_after - cpu_before
+    result['bench'] = 'lisod'
+    result['server'] = {
+        'cpu_pct': round(cpu * 100 / elapsed, 1),
+        'cpu_us_per_req': round(cpu * 1e6 / result['requests'], 1) if result['requests'] else 0,
+        'rss_kb': rss,
+        'peak_rss_kb': peak,
+    }
+    return result
+
+
+def load_baseline(path):
+    """
+    @brief Load the results of an earlier run, lines of other benchmarks
+    are skipped
+
+    @param path file written by an earlier run
+    @return ** dict results by scenario name
+    """
+    baseline = {}
+    with open(path) as f:
+        for line in f:
+            try:
+                result = json.loads(line)
+            except ValueError:
+                continue
+            if result.get('bench') == 'lisod':
+                baseline[result['case']] = result
+    return baseline
+
+
+def metrics(result):
+    """
+    @brief Metrics compared between runs
+
+    @param result result of a scenario
+    @return ** dict name to (value, True if higher is better)
+    """
+    return {
+        'rps': (result['rps'], True),
+        'p50_us': (result['latency_us']['p50'], False),
+        'p99_us': (result['latency_us']['p99'], False),
+        # a faster run uses more CPU, per request it should not
+        'cpu_us_per_req': (result['server']['cpu_us_per_req'], False),
+        'peak_rss_kb': (result['server']['peak_rss_kb'], False),
+    }
+
+
+def compare(result, base, threshold):
+    """
+    @brief Add the change from the baseline to a result
+
+    @param result result of a scenario
+    @param base baseline result of the scenario
+    @param threshold change in percent counted as a regression
+    @return ** list names of the regressed metrics
+    """
+    delta = {}
+    regressions = []
+    old = metrics(base)
+    for name, (value, higher_better) in metrics(result).items():
+        before = old[name][0]
+        if before <= 0:
+            continue
+        change = (value - before) * 100.0 / before
+        delta[name] = round(change, 1)
+        if (-change if higher_better else change) > threshold:
+            regressions.append(name)
+
+    failed = result['errors'] + result['timeouts'] + result['status']['5xx']
+    failed_before = base['errors'] + base['timeouts'] + base['status']['5xx']
+    if failed > 0 and failed_before == 0:
+        regressions.append('errors')
+
+    result['baseline_delta_pct'] = delta
+    result['regressions'] = regressions
+    return regressions
+
+
+def main():
+    parser = argparse.ArgumentParser(description='End to end benchmark of lisod.')
+    parser.add_argument('--lisod', default='./lisod')
+    parser.add_argument('--loadgen', default='./loadgen')
+    parser.add_argument('--port', type=int, default=18441)
+    parser.add_argument('--seconds', type=float, default=5, help='length of a timed scenario')
+    parser.add_argument('--threads', type=int, default=min(os.cpu_count() or 1, 4),
+                        help='loadgen threads')
+    parser.add_argument('--rate', type=int, default=2000, help='requests/s of the open loop scenario')
+    parser.add_argument('--idle', type=int, default=500,
+                        help='idle keep-alive connections, lisod selects on at most FD_SETSIZE (1024) fds')
+    parser.add_argument('--huge-mb', type=int, default=1024, help='size of the huge file, 0 to skip it')
+    parser.add_argument('--post-bytes', type=int, default=65536, help='body size of an upload')
+    parser.add_argument('--only', help='comma separated scenarios to run')
+    parser.add_argument('--server-option', action='append', default=[],
+                        help='name=value passed to lisod, may be repeated')
+    parser.add_argument('--out', help='also write the results to this file')
+    parser.add_argument('--baseline', help='results of an earlier run to compare with')
+    parser.add_argument('--threshold', type=float, default=10,
+                        help='change in percent reported as a regression')
+    args = parser.parse_args()
+
+    baseline = load_baseline(args.baseline) if args.baseline else {}
+    root = tempfile.mkdtemp(prefix='liso_bench_')
+    out = open(args.out, 'w') if args.out else None
+    regressed = []
+    pid = None
+    try:
+        www = make_www(root, args)
+        pid = start_lisod(root, www, args)
+        for name, loadgen_args in scenarios(args):
+            result = run_case(name, loadgen_args, pid, args)
+            if name in baseline:
+                for metric in compare(result, baseline[name], args.threshold):
+                    regressed.append('%s %s' % (name, metric))
+            line = json.dumps(result, separators=(',', ':'))
+            print(line)
+            sys.stdout.flush()
+            if out:
+                out.write(line + '\n')
+    finally:
+        if pid is not None:
+            stop_lisod(pid)
+        if out:
+            out.close()
+        shutil.rmtree(root, ignore_errors=True)
+
+    for regression in regressed:
+        sys.stderr.write('bench: regression beyond %.0f%%: %s\n' % (args.threshold, regression))
+    return 1 if regressed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+"""
+@file cgicachetests.py
+@author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+
+@brief CGI response cache tests, variants picked by Vary
+
+Start lisod with cp3/test_cgi.sh as the CGI script and the cache on:
+    ./lisod 9999 lisod.log lisod.lock www cp3/test_cgi.sh cgi_cache_bytes=1048576
+then run
+    python3 cp2/cgicachetests.py 127.0.0.1 9999
+
+@version 0.1
+@date 2021-11-09
+
+@copyright Copyright (c) 2021
+"""
+
+import os
+
+from httpcheck import exchange, parse, run
+
+
+def get(host, port, uri, headers):
+    """
+    @brief GET a URI with extra headers on a new connection
+
+    @param host server address
+    @param port server port
+    @param uri request target
+    @param headers list of "Name: value" strings
+    @return ** bytes body of the response, None if it was not a 200
+    """
+    request = 'GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n' % uri
+    request += ''.join(header + '\r\n' for header in headers) + '\r\n'
+    responses = parse(exchange(host, port, request.encode('latin-1'))[0])
+    if len(responses) != 1 or responses[0].status != 200:
+        return None
+    return responses[0].body
+
+
+def vary_uri():
+    # a URI of its own, so entries of earlier runs do not answer
+    return '/cgi/?vary&%s' % os.urandom(6).hex()
+
+
+def check_repeated_vary_names(host, port):
+    # Vary names Cookie three times, a long cookie must not grow the
+    # values past their buffer and must still hit
+    uri = vary_uri()
+    cookie = 'Cookie: ' + 'c' * 4000
+    first = get(host, port, uri, [cookie, 'Accept: text/plain'])
+    again = get(host, port, uri, [cookie, 'Accept: text/plain'])
+    if first is None or again is None:
+        return 'script request failed'
+    if first != again:
+        return 'same cookie was not served from the cache'
+    return None
+
+
+def check_whitespace_separated_names(host, port):
+    # Accept comes after a tab in Vary, it must still split variants
+    uri = vary_uri()
+    plain = get(host, port, uri, ['Cookie: a', 'Accept: text/plain'])
+    html = get(host, port, uri, ['Cookie: a', 'Accept: text/html'])
+    if plain is None or html is None:
+        return 'script request failed'
+    if plain == html:
+        return 'different Accept got the same variant'
+    if get(host, port, uri, ['Cookie: a', 'Accept: text/plain']) != plain:
+        return 'first variant was lost'
+    return None
+
+
+def check_cookie_variants(host, port):
+    uri = vary_uri()
+    a = get(host, port, uri, ['Cookie: a'])
+    b = get(host, port, uri, ['Cookie: bb'])
+    none = get(host, port, uri, [])
+    if None in (a, b, none):
+        return 'script request failed'
+    if len(set((a, b, none))) != 3:
+        return 'different cookies got the same variant'
+    if get(host, port, uri, ['cookie: a']) != a:
+        return 'header name case changed the variant'
+    return None
+
+
+if __name__ == '__main__':
+    run([
+        check_repeated_vary_names,
+        check_whitespace_separated_names,
+        check_cookie_variants,
+    ])
@@ -0,0 +1,199 @@
+#!/usr/bin/env python3
+"""
+@file cgiframetests.py
+@author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+
+@brief Framing of CGI responses, status lines, lengths and broken output
+
+Start lisod with cp3/test_cgi.sh as the CGI script, each check asks it
+for a different kind of output through the query string. Needs an
+index.html at the root of the www folder for the pipelining check. Run
+with
+    python3 cp2/cgiframetests.py 127.0.0.1 <port>
+
+@version 0.1
+@date 2021-11-09
+
+@copyright Copyright (c) 2021
+"""
+
+from httpcheck import exchange, parse, run
+
+
+def cgi(host, port, query, method='GET', version='1.1', extra=''):
+    """
+    @brief Ask the test script for one kind of output
+
+    @param host server address
+    @param port server port
+    @param query mode of cp3/test_cgi.sh
+    @param method request method
+    @param version HTTP version of the request
+    @param extra more header lines, each ending in CRLF
+    @return ** tuple (list of Response, True if the connection was closed)
+    """
+    request = '%s /cgi/?%s HTTP/%s\r\nHost: localhost\r\n%s\r\n' % (method, query, version, extra)
+    data, closed = exchange(host, port, request.encode('latin-1'))
+    return parse(data, head=(method == 'HEAD')), closed
+
+
+def expect(host, port, query, status, body, closed=False, **kwargs):
+    """
+    @brief Check the only response to a script request
+
+    @param host server address
+    @param port server port
+    @param query mode of cp3/test_cgi.sh
+    @param status expected status code
+    @param body expected body, None to skip the check
+    @param closed True if lisod should close the connection after it
+    @param kwargs passed on to cgi()
+    @return ** tuple (str error or None, Response)
+    """
+    responses, was_closed = cgi(host, port, query, **kwargs)
+    if len(responses) != 1:
+        return 'expected one response, got %d' % len(responses), None
+    response = responses[0]
+    if response.status != status:
+        return 'status %d, expected %d' % (response.status, status), response
+    if body is not None and response.body != body:
+        return 'body %r, expected %r' % (response.body, body), response
+    if was_closed != closed:
+        return 'connection %s' % ('closed' if was_closed else 'left open'), response
+    return None, response
+
+
+def check_status(host, port):
+    return expect(host, port, 'status', 201, b'created\n')[0]
+
+
+def check_lone_location(host, port):
+    error, response = expect(host, port, 'location', 302, b'')
+    if error is None and response.header('Location') != '/index.html':
+        error = 'Location %s' % response.header('Location')
+    return error
+
+
+def check_location_with_status(host, port):
+    error, response = expect(host, port, 'location_status', 301, b'moved\n')
+    if error is None and response.header('Location') != '/index.html':
+        error = 'Location %s' % response.header('Location')
+    return error
+
+
+def check_unframed_is_chunked(host, port):
+    # without a Content-Length a HTTP/1.1 body is chunked by Liso
+    error, response = expect(host, port, '', 200, None)
+    if error is None and (response.header('Transfer-Encoding') or '').lower() != 'chunked':
+        error = 'body is not chunked'
+    return error
+
+
+def check_length_cuts_body(host, port):
+    error, response = expect(host, port, 'length', 200, b'hello')
+    if error is None and response.header('Content-Length') != '5':
+        error = 'Content-Length %s' % response.header('Content-Length')
+    return error
+
+
+def check_short_body(host, port):
+    # the head is out, all Liso can do is close the connection
+    responses, closed = cgi(host, port, 'short')
+    if len(responses) != 1 or responses[0].status != 200:
+        return 'expected one 200, got %s' % [r.status for r in responses]
+    if len(responses[0].body) >= 100 or not closed:
+        return 'short body was not ended by closing the connection'
+    return None
+
+
+def check_connection_replaced(host, port):
+    error, response = expect(host, port, 'connection', 200, b'hello\n')
+    if error is None and response.header('Keep-Alive') is not None:
+        error = 'Keep-Alive from the script was passed on'
+    return error
+
+
+def check_head_block_limit(host, port):
+    error = expect(host, port, 'head=8192', 200, b'hello\n')[0]
+    if error is not None:
+        return '8192 byte header block: ' + error
+    error = expect(host, port, 'head=8193', 502, b'', closed=True)[0]
+    if error is not None:
+        return '8193 byte header block: ' + error
+    return None
+
+
+def check_bad_head(host, port):
+    return expect(host, port, 'bad_head', 502, b'', closed=True)[0]
+
+
+def check_no_output(host, port):
+    return expect(host, port, 'silent', 502, b'', closed=True)[0]
+
+
+def check_head_request(host, port):
+    for query in ('status', 'length', ''):
+        responses, closed = cgi(host, port, query, method='HEAD')
+        if len(responses) != 1 or closed:
+            return 'HEAD ?%s: %d responses, closed %s' % (query, len(responses), closed)
+    # any body bytes would have been parsed as a second response
+    return None
+
+
+def check_no_content(host, port):
+    error = expect(host, port, 'no_content', 204, b'')[0]
+    if error is None:
+        error = expect(host, port, 'not_modified', 304, b'')[0]
+    return error
+
+
+def check_http10_close_delimited(host, port):
+    error, response = expect(host, port, '', 200, None, closed=True, version='1.0')
+    if error is not None:
+        return error
+    if response.header('Transfer-Encoding') is not None:
+        return 'HTTP/1.0 client got Transfer-Encoding'
+    if not response.body.startswith(b'SCRIPT_NAME='):
+        return 'body %r' % response.body
+    return None
+
+
+def check_http10_keep_alive_unframed(host, port):
+    # no length and no chunked for a HTTP/1.0 client, only close is left
+    error, response = expect(host, port, '', 200, None, closed=True, version='1.0',
+                             extra='Connection: keep-alive\r\n')
+    if error is None and response.header('Transfer-Encoding') is not None:
+        error = 'HTTP/1.0 client got Transfer-Encoding'
+    return error
+
+
+def check_pipelined_after_cgi(host, port):
+    request = (b'GET /cgi/?length HTTP/1.1\r\nHost: localhost\r\n\r\n'
+               b'GET /cgi/?status HTTP/1.1\r\nHost: localhost\r\n\r\n'
+               b'GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n')
+    responses = parse(exchange(host, port, request)[0])
+    if [r.status for r in responses] != [200, 201, 200]:
+        return 'got %s, expected [200, 201, 200]' % [r.status for r in responses]
+    if responses[0].body != b'hello' or responses[1].body != b'created\n':
+        return 'script bodies out of order'
+    return None
+
+
+if __name__ == '__main__':
+    run([
+        check_status,
+        check_lone_location,
+        check_location_with_status,
+        check_unframed_is_chunked,
+        check_length_cuts_body,
+        check_short_body,
+        check_connection_replaced,
+        check_head_block_limit,
+        check_bad_head,
+        check_no_output,
+        check_head_request,
+        check_no_content,
+        check_http10_close_delimited,
+        check_http10_keep_alive_unframed,
+        check_pipelined_after_cgi,
+    ])
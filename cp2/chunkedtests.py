@@ -0,0 +1,184 @@
+#!/usr/bin/env python3
+"""
+@file chunkedtests.py
+@author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+
+@brief Request body framing tests, chunked bodies and Content-Length
+
+Start lisod with cp3/test_cgi.sh as the CGI script, the bodies are posted
+to /cgi/?echo which sends them back. Run with
+    python3 cp2/chunkedtests.py 127.0.0.1 <port>
+
+@version 0.1
+@date 2021-11-09
+
+@copyright Copyright (c) 2021
+"""
+
+from httpcheck import exchange, parse, run
+
+HEAD = b'POST /cgi/?echo HTTP/1.1\r\nHost: localhost\r\nTransfer-Encoding: chunked\r\n\r\n'
+
+
+def post_chunked(host, port, body):
+    """
+    @brief Post a chunked body to the echo script
+
+    @param host server address
+    @param port server port
+    @param body chunked body as sent
+    @return ** tuple (list of Response, True if the connection was closed)
+    """
+    data, closed = exchange(host, port, HEAD + body)
+    return parse(data), closed
+
+
+def expect_echo(host, port, body, expected):
+    """
+    @brief Check that a chunked body reaches the script decoded
+
+    @param host server address
+    @param port server port
+    @param body chunked body as sent
+    @param expected decoded body the script should see
+    @return ** str error, None if the body arrived intact
+    """
+    responses, closed = post_chunked(host, port, body)
+    if len(responses) != 1 or responses[0].status != 200:
+        return 'expected one 200, got %s' % [r.status for r in responses]
+    if responses[0].body != expected:
+        return 'script saw %r, expected %r' % (responses[0].body, expected)
+    if closed:
+        return 'connection closed after a valid body'
+    return None
+
+
+def expect_close(host, port, request, status):
+    """
+    @brief Check that a badly framed request is refused and the
+    connection closed, the rest of the stream can not be trusted
+
+    @param host server address
+    @param port server port
+    @param request raw request
+    @param status expected status code
+    @return ** str error, None if lisod refused it as expected
+    """
+    data, closed = exchange(host, port, request)
+    responses = parse(data)
+    if len(responses) != 1 or responses[0].status != status:
+        return 'expected one %d, got %s' % (status, [r.status for r in responses])
+    if (responses[0].header('Connection') or '').lower() != 'close':
+        return 'response says Connection: %s' % responses[0].header('Connection')
+    if not closed:
+        return 'connection left open'
+    return None
+
+
+def check_valid(host, port):
+    return expect_echo(host, port, b'5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n', b'hello world')
+
+
+def check_hex_sizes(host, port):
+    # upper and lower case digits, leading zeros
+    return expect_echo(host, port, b'A\r\n0123456789\r\n00b\r\nabcdefghijk\r\n0\r\n\r\n',
+                       b'0123456789abcdefghijk')
+
+
+def check_extensions(host, port):
+    return expect_echo(host, port, b'5;name=value\r\nhello\r\n3 ; x="a;b"\r\nabc\r\n0;last\r\n\r\n',
+                       b'helloabc')
+
+
+def check_trailers(host, port):
+    return expect_echo(host, port, b'5\r\nhello\r\n0\r\nX-Checksum: 1234\r\nX-Other: a\r\n\r\n',
+                       b'hello')
+
+
+def check_bad_hex(host, port):
+    return expect_close(host, port, HEAD + b'zz\r\nhello\r\n0\r\n\r\n', 400)
+
+
+def check_hex_prefix(host, port):
+    return expect_close(host, port, HEAD + b'0x5\r\nhello\r\n0\r\n\r\n', 400)
+
+
+def check_negative_size(host, port):
+    return expect_close(host, port, HEAD + b'-5\r\nhello\r\n0\r\n\r\n', 400)
+
+
+def check_empty_size(host, port):
+    return expect_close(host, port, HEAD + b'\r\nhello\r\n0\r\n\r\n', 400)
+
+
+def check_data_overrun(host, port):
+    # more data than the chunk size announced
+    return expect_close(host, port, HEAD + b'5\r\nhelloXX\r\n0\r\n\r\n', 400)
+
+
+def check_bad_trailer(host, port):
+    return expect_close(host, port, HEAD + b'5\r\nhello\r\n0\r\nno colon\r\n\r\n', 400)
+
+
+def check_size_overflow(host, port):
+    # would wrap a 64 bit size
+    return expect_close(host, port, HEAD + b'1' + b'0' * 20 + b'\r\nhello\r\n0\r\n\r\n', 413)
+
+
+def check_chunked_and_length(host, port):
+    request = (b'POST /cgi/?echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5\r\n'
+               b'Transfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n\r\n')
+    return expect_close(host, port, request, 400)
+
+
+def check_conflicting_length(host, port):
+    request = (b'POST /cgi/?echo HTTP/1.1\r\nHost: localhost\r\nContent-Length: 5\r\n'
+               b'Content-Length: 6\r\n\r\nhello!')
+    return expect_close(host, port, request, 400)
+
+
+def check_pipelined_after_chunked(host, port):
+    # the decoder must stop at the end of the body
+    request = HEAD + b'5\r\nhello\r\n0\r\n\r\nGET /cgi/ HTTP/1.1\r\nHost: localhost\r\n\r\n'
+    responses = parse(exchange(host, port, request)[0])
+    if [r.status for r in responses] != [200, 200]:
+        return 'expected two 200, got %s' % [r.status for r in responses]
+    if responses[0].body != b'hello':
+        return 'script saw %r' % responses[0].body
+    return None
+
+
+def check_static_post(host, port):
+    # static content takes no body, it is dropped and the next request
+    # on the connection is answered
+    for framing, body in ((b'Content-Length: 5\r\n', b'hello'),
+                          (b'Transfer-Encoding: chunked\r\n', b'5\r\nhello\r\n0\r\n\r\n'),
+                          (b'', b'')):
+        request = (b'POST /index.html HTTP/1.1\r\nHost: localhost\r\n' + framing + b'\r\n' + body +
+                   b'GET /index.html HTTP/1.1\r\nHost: localhost\r\n\r\n')
+        responses = parse(exchange(host, port, request)[0])
+        if [r.status for r in responses] != [405, 200]:
+            return 'expected 405 then 200, got %s' % [r.status for r in responses]
+        if responses[0].header('Allow') != 'GET, HEAD':
+            return '405 says Allow: %s' % responses[0].header('Allow')
+    return None
+
+
+if __name__ == '__main__':
+    run([
+        check_valid,
+        check_hex_sizes,
+        check_extensions,
+        check_trailers,
+        check_bad_hex,
+        check_hex_prefix,
+        check_negative_size,
+        check_empty_size,
+        check_data_overrun,
+        check_bad_trailer,
+        check_size_overflow,
+        check_chunked_and_length,
+        check_conflicting_length,
+        check_pipelined_after_chunked,
+        check_static_post,
+    ])
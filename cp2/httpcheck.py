@@ -0,0 +1,170 @@
+#!/usr/bin/env python3
+"""
+@file httpcheck.py
+@author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+
+@brief Helpers shared by the request level tests in this folder
+
+Requests are sent as raw bytes so malformed messages reach lisod as
+written, the reply is read until lisod closes the connection or stays
+quiet for a while.
+
+@version 0.1
+@date 2021-11-09
+
+@copyright Copyright (c) 2021
+"""
+
+import socket
+import sys
+
+RECV_TIMEOUT = 2
+
+
+class Response(object):
+    """
+    @brief One parsed response, body is left undecoded
+    """
+
+    def __init__(self, status, headers, body):
+        self.status = status
+        self.headers = headers
+        self.body = body
+
+    def header(self, name):
+        """
+        @brief Value of a header, None when it is missing
+
+        @param name header name, any case
+        @return ** str value of the first header with that name
+        """
+        for key, value in self.headers:
+            if key.lower() == name.lower():
+                return value
+        return None
+
+
+def exchange(host, port, request, timeout=RECV_TIMEOUT):
+    """
+    @brief Send a request and read everything sent back
+
+    @param host server address
+    @param port server port
+    @param request raw request bytes, may hold several requests
+    @param timeout seconds of silence before giving up on more data
+    @return ** tuple (bytes received, True if lisod closed the connection)
+    """
+    s = socket.create_connection((host, port), timeout)
+    data = b''
+    closed = False
+    try:
+        s.sendall(request)
+        while True:
+            chunk = s.recv(65536)
+            if not chunk:
+                closed = True
+                break
+            data += chunk
+    except socket.timeout:
+        pass
+    except ConnectionResetError:
+        closed = True
+    finally:
+        s.close()
+    return data, closed
+
+
+def dechunk(body):
+    """
+    @brief Decode a chunked body, trailers are dropped
+
+    @param body chunked bytes
+    @return ** tuple (decoded bytes, bytes after the body) or None if the
+    body is incomplete
+    """
+    out = b''
+    while True:
+        line_end = body.find(b'\r\n')
+        if line_end < 0:
+            return None
+        size = int(body[:line_end].split(b';')[0], 16)
+        body = body[line_end + 2:]
+        if size == 0:
+            if body.startswith(b'\r\n'):
+                return out, body[2:]
+            # trailers end with an empty line
+            end = body.find(b'\r\n\r\n')
+            if end < 0:
+                return None
+            return out, body[end + 4:]
+        if len(body) < size + 2:
+            return None
+        out += body[:size]
+        body = body[size + 2:]
+
+
+def parse(data, head=False):
+    """
+    @brief Split received bytes in to responses
+
+    @param data bytes sent by lisod
+    @param head True if the responses answer HEAD requests
+    @return ** list of Response, an incomplete last response keeps the
+    bytes that arrived
+    """
+    responses = []
+    while data:
+        end = data.find(b'\r\n\r\n')
+        if end < 0:
+            break
+        lines = data[:end].decode('latin-1').split('\r\n')
+        data = data[end + 4:]
+        status = int(lines[0].split(' ')[1])
+        headers = [tuple(part.strip() for part in line.split(':', 1)) for line in lines[1:]]
+        response = Response(status, headers, b'')
+        responses.append(response)
+
+        if head or status in (204, 304) or 100 <= status < 200:
+            continue
+        if (response.header('Transfer-Encoding') or '').lower() == 'chunked':
+            decoded = dechunk(data)
+            if decoded is None:
+                response.body = data
+                break
+            response.body, data = decoded
+        elif response.header('Content-Length') is not None:
+            length = int(response.header('Content-Length'))
+            response.body = data[:length]
+            data = data[length:]
+        else:
+            # delimited by the end of the connection
+            response.body = data
+            break
+    return responses
+
+
+def run(checks):
+    """
+    @brief Run checks against the server named on the command line, exit
+    with 1 if any failed
+
+    @param checks list of functions taking host and port, each returns
+    None when it passes or a message saying what went wrong
+    @return ** None
+    """
+    if len(sys.argv) < 3:
+        sys.stderr.write('Usage: %s <ip> <port>\n' % sys.argv[0])
+        sys.exit(1)
+    host = sys.argv[1]
+    port = int(sys.argv[2])
+
+    failed = 0
+    for check in checks:
+        error = check(host, port)
+        if error is not None:
+            sys.stderr.write('%s: %s\n' % (check.__name__, error))
+            failed += 1
+    if failed:
+        sys.stderr.write('%d of %d checks failed\n' % (failed, len(checks)))
+        sys.exit(1)
+    print('Success!')
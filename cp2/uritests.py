@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+"""
+@file uritests.py
+@author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+
+@brief URI canonicalization tests, percent escapes and dot segments
+
+Needs an index.html at the root of the www folder. Every spelling of it
+below must serve the same file and no URI may reach /etc/passwd. Run with
+    python3 cp2/uritests.py 127.0.0.1 <port>
+
+@version 0.1
+@date 2021-11-09
+
+@copyright Copyright (c) 2021
+"""
+
+from httpcheck import exchange, parse, run
+
+# deep enough to climb out of any www folder
+CLIMB = 16
+
+
+def get(host, port, uri):
+    """
+    @brief GET a URI on a new connection
+
+    @param host server address
+    @param port server port
+    @param uri request target as sent
+    @return ** Response, None if nothing was received
+    """
+    request = 'GET %s HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n' % uri
+    responses = parse(exchange(host, port, request.encode('latin-1'))[0])
+    return responses[0] if responses else None
+
+
+def expect_index(host, port, uris):
+    """
+    @brief Check that URIs all serve the root index.html
+
+    @param host server address
+    @param port server port
+    @param uris spellings of the index
+    @return ** str error, None if each served the index
+    """
+    index = get(host, port, '/index.html')
+    if index is None or index.status != 200:
+        return 'no /index.html in the www folder'
+    for uri in uris:
+        response = get(host, port, uri)
+        if response is None or response.status != 200 or response.body != index.body:
+            return '%s did not serve /index.html (%s)' % (uri, response and response.status)
+    return None
+
+
+def expect_status(host, port, uris, status):
+    """
+    @brief Check the status of each URI
+
+    @param host server address
+    @param port server port
+    @param uris URIs to get
+    @param status expected status code
+    @return ** str error, None if each got the status
+    """
+    for uri in uris:
+        response = get(host, port, uri)
+        if response is None or response.status != status:
+            return '%s answered %s, expected %d' % (uri, response and response.status, status)
+    return None
+
+
+def check_plain(host, port):
+    return expect_index(host, port, ['/', '/./index.html', '/index.html?a=b', '/index.html#top',
+                                     'http://localhost/index.html'])
+
+
+def check_empty_segments(host, port):
+    return expect_index(host, port, ['//index.html', '///index.html', '//', '/.//index.html'])
+
+
+def check_encoded(host, port):
+    return expect_index(host, port, ['/index%2ehtml', '/%69ndex.html', '/%2findex.html',
+                                     '/%2e/index.html', '/%2E/index.html'])
+
+
+def check_dot_dot_at_root(host, port):
+    # a trailing /.. above the root stays at the root
+    return expect_index(host, port, ['/..', '/../', '/../..', '/%2e%2e', '/%2E%2E/',
+                                     '/../index.html', '/%2e%2e/%2e%2e/index.html',
+                                     '/.%2e/index.html', '/..%2findex.html'])
+
+
+def check_escape(host, port):
+    uris = [
+        '/..' * CLIMB + '/etc/passwd',
+        '/%2e%2e' * CLIMB + '/etc/passwd',
+        '/%2E%2e' * CLIMB + '%2fetc%2fpasswd',
+        '/' + '..%2f' * CLIMB + 'etc/passwd',
+        '/' + '.%2e/' * CLIMB + 'etc/passwd',
+        '//..' * CLIMB + '//etc/passwd',
+        'http://localhost' + '/..' * CLIMB + '/etc/passwd',
+    ]
+    for uri in uris:
+        response = get(host, port, uri)
+        if response is not None and (response.status == 200 or b'root:' in response.body):
+            return '%s reached a file outside the www folder' % uri
+    return None
+
+
+def check_query_not_decoded(host, port):
+    # dot segments after the ? belong to the query
+    return expect_index(host, port, ['/index.html?x=/..' + '/..' * CLIMB + '/etc/passwd',
+                                     '/index.html?%2e%2e'])
+
+
+def check_bad_escapes(host, port):
+    return expect_status(host, port, ['/%zz', '/index.html%', '/index.html%2', '/%00',
+                                      '/index.html%00.txt'], 400)
+
+
+def check_missing(host, port):
+    return expect_status(host, port, ['/no_such_file', '/index.html/..x',
+                                      '/%2e%2e%2e/index.html'], 404)
+
+
+if __name__ == '__main__':
+    run([
+        check_plain,
+        check_empty_segments,
+        check_encoded,
+        check_dot_dot_at_root,
+        check_escape,
+        check_query_not_decoded,
+        check_bad_escapes,
+        check_missing,
+    ])
@@ -0,0 +1,90 @@
+#!/usr/bin/env python3
+# Minimal FastCGI responder for lisod cgi_workers=N, standard library only.
+# Liso hands the listen socket over as fd 0 and opens one connection per
+# request. The response is written to FCGI_STDOUT the same way a one-shot
+# CGI script writes it to stdout.
+
+import os
+import socket
+import struct
+
+BEGIN_REQUEST, END_REQUEST, PARAMS, STDIN, STDOUT = 1, 3, 4, 5, 6
+HEADER = struct.Struct('!BBHHBx')
+
+
+def read_exact(conn, n):
+    data = bytearray()
+    while len(data) < n:
+        part = conn.recv(n - len(data))
+        if not part:
+            raise EOFError
+        data += part
+    return bytes(data)
+
+
+def read_record(conn):
+    version, rtype, req_id, length, padding = HEADER.unpack(read_exact(conn, 8))
+    content = read_exact(conn, length)
+    read_exact(conn, padding)
+    return rtype, req_id, content
+
+
+def write_record(conn, rtype, req_id, content):
+    for i in range(0, max(len(content), 1), 65535):
+        part = content[i:i + 65535]
+        conn.sendall(HEADER.pack(1, rtype, req_id, len(part), 0) + part)
+
+
+def decode_params(data):
+    params, i = {}, 0
+    while i < len(data):
+        lengths = []
+        for _ in range(2):
+            if data[i] < 128:
+                lengths.append(data[i])
+                i += 1
+            else:
+                lengths.append(struct.unpack('!I', data[i:i + 4])[0] & 0x7fffffff)
+                i += 4
+        name = data[i:i + lengths[0]].decode('latin-1')
+        i += lengths[0]
+        params[name] = data[i:i + lengths[1]].decode('latin-1')
+        i += lengths[1]
+    return params
+
+
+def handle(conn):
+    params, body, req_id = bytearray(), bytearray(), 1
+    while True:
+        rtype, req_id, content = read_record(conn)
+        if rtype == PARAMS:
+            params += content
+        elif rtype == STDIN:
+            if not content:
+                break
+            body += content
+    env = decode_params(params)
+
+    text = 'pid %d %s %s body %d\n' % (os.getpid(), env.get('REQUEST_METHOD'),
+                                       env.get('QUERY_STRING'), len(body))
+    response = ('HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n'
+                'Content-Length: %d\r\n\r\n%s' % (len(text), text)).encode()
+    write_record(conn, STDOUT, req_id, response)
+    write_record(conn, STDOUT, req_id, b'')
+    write_record(conn, END_REQUEST, req_id, struct.pack('!IB3x', 0, 0))
+
+
+def main():
+    listener = socket.socket(fileno=0)
+    while True:
+        conn, _ = listener.accept()
+        try:
+            handle(conn)
+        except (EOFError, OSError):
+            pass
+        finally:
+            conn.close()
+
+
+if __name__ == '__main__':
+    main()
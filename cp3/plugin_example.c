@@ -0,0 +1,80 @@
+/**
+ * @file plugin_example.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Example handler plugin for LISO
+ *
+ * Build with make and start the server with plugin=./plugin_example.so
+ * /hello answers in the event loop, /slow sleeps on the plugin pool and
+ * /echo returns the request body.
+ *
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "liso_plugin.h"
+
+/**
+ * @brief Small JSON greeting, does not block
+ *
+ * @param req the request
+ * @param w response writer
+ * @param arg unused
+ * @return ** int 0 on success
+ */
+static int hello(Request *req, liso_writer *w, void *arg) {
+	char body[HTTP_FIELD_SIZE + 64];
+	int len = snprintf(body, sizeof(body), "{\"hello\": \"world\", \"method\": \"%s\"}\n",
+					   req->http_method);
+
+	liso_add_header(w, "Content-Type", "application/json");
+	return liso_write(w, body, len);
+}
+
+/**
+ * @brief Blocking handler, stands in for e.g. a database call
+ *
+ * @param req the request
+ * @param w response writer
+ * @param arg unused
+ * @return ** int 0 on success
+ */
+static int slow(Request *req, liso_writer *w, void *arg) {
+	sleep(1);
+
+	liso_add_header(w, "Content-Type", "text/plain");
+	return liso_write(w, "done\n", strlen("done\n"));
+}
+
+/**
+ * @brief Send the request body back
+ *
+ * @param req the request
+ * @param w response writer
+ * @param arg unused
+ * @return ** int 0 on success
+ */
+static int echo(Request *req, liso_writer *w, void *arg) {
+	char *type = get_header(req, "Content-Type");
+
+	if(req->message_len == 0) {
+		liso_set_status(w, 400, NULL);
+		return liso_write(w, "no body\n", strlen("no body\n"));
+	}
+	liso_add_header(w, "Content-Type", type != NULL ? type : "application/octet-stream");
+	return liso_write(w, req->message, req->message_len);
+}
+
+int liso_plugin_init(void) {
+	if(liso_register_handler("/hello", hello, NULL, 0) != 0 ||
+	   liso_register_handler("/slow", slow, NULL, LISO_HANDLER_OFFLOAD) != 0 ||
+	   liso_register_handler("/echo", echo, NULL, 0) != 0) {
+		return -1;
+	}
+	return 0;
+}
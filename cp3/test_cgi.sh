@@ -0,0 +1,61 @@
+#!/bin/sh
+# CGI script for the request level tests in cp2, the query string picks
+# what it does. Start lisod with it as the CGI script:
+#   ./lisod 9999 lisod.log lisod.lock www cp3/test_cgi.sh
+
+case "$QUERY_STRING" in
+echo)
+	# the request body back with its length
+	body=$(cat; echo x)
+	body=${body%x}
+	printf 'Content-Type: text/plain\r\nX-Body-Length: %d\r\n\r\n%s' "${#body}" "$body"
+	;;
+status)
+	printf 'Status: 201 Created\r\nContent-Type: text/plain\r\n\r\ncreated\n'
+	;;
+location)
+	# a lone Location is a redirect
+	printf 'Location: /index.html\r\n\r\n'
+	;;
+location_status)
+	printf 'Status: 301 Moved Permanently\r\nLocation: /index.html\r\nContent-Type: text/plain\r\n\r\nmoved\n'
+	;;
+length)
+	# output past the Content-Length is not part of the response
+	printf 'Content-Type: text/plain\r\nContent-Length: 5\r\n\r\nhello world'
+	;;
+short)
+	# exits before writing the whole Content-Length
+	printf 'Content-Type: text/plain\r\nContent-Length: 100\r\n\r\nhello'
+	;;
+connection)
+	# Liso decides whether the connection stays open
+	printf 'Content-Type: text/plain\r\nConnection: close\r\nKeep-Alive: timeout=1\r\n\r\nhello\n'
+	;;
+no_content)
+	printf 'Status: 204 No Content\r\n\r\nnot a body'
+	;;
+not_modified)
+	printf 'Status: 304 Not Modified\r\nContent-Length: 10\r\n\r\nnot a body'
+	;;
+head=*)
+	# header block of exactly the given size
+	pad=$((${QUERY_STRING#head=} - 37))
+	printf 'Content-Type: text/plain\r\nX-Pad: %s\r\n\r\nhello\n' "$(printf "%${pad}s" '' | tr ' ' a)"
+	;;
+bad_head)
+	printf 'Content-Type: text/plain\r\nnot a header\r\n\r\nhello\n'
+	;;
+vary*)
+	# cacheable, varies on Cookie named three times and on Accept; the
+	# pid tells a cached response from a new run
+	printf 'Content-Type: text/plain\r\nCache-Control: max-age=60\r\nVary: Cookie Cookie,cookie\tAccept\r\n\r\nrun=%s cookie=%s accept=%s\n' \
+		"$$" "${#HTTP_COOKIE}" "$HTTP_ACCEPT"
+	;;
+silent)
+	cat > /dev/null
+	;;
+*)
+	printf 'Content-Type: text/plain\r\n\r\nSCRIPT_NAME=%s PATH_INFO=%s\n' "$SCRIPT_NAME" "$PATH_INFO"
+	;;
+esac
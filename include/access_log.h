@@ -0,0 +1,72 @@
+/**
+ * @file access_log.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Binary access log of LISO, one compact record per request
+ * @version 0.1
+ * @date 2021-11-04
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _ACCESS_LOG_H_
+#define _ACCESS_LOG_H_
+
+#include <stdint.h>
+#include <netinet/in.h>
+#include "parse.h"
+
+#define ACCESS_LOG_MAGIC "LISOACC1"	// first bytes of an access log file
+#define ACCESS_URI_MAX 256			// longer URIs are truncated
+#define ACCESS_BATCH_SIZE (64 * 1024)	// bytes collected before a write
+#define ACCESS_FLUSH_SECS 1			// a batch is written at least this often
+
+struct node;
+
+enum access_methods {
+	ACCESS_METHOD_OTHER = 0,
+	ACCESS_METHOD_GET,
+	ACCESS_METHOD_HEAD,
+	ACCESS_METHOD_POST,
+};
+
+enum access_cache {
+	ACCESS_CACHE_NONE = 0,			// not looked up in the CGI cache
+	ACCESS_CACHE_HIT,
+	ACCESS_CACHE_MISS,				// the response fills the cache
+};
+
+// record as written to the file in host byte order, the URI follows it
+typedef struct {
+	uint16_t len;				// bytes of the record and its URI
+	uint16_t status;			// 0 if the client went away before the head
+	uint8_t method;				// enum access_methods
+	uint8_t cache;				// enum access_cache
+	uint16_t port;
+	uint32_t addr;				// IPv4 address in network byte order
+	uint32_t duration_us;		// request parsed to response queued
+	uint64_t time_us;			// wall clock when the response was done
+	uint64_t bytes;				// response bytes, head included
+} access_record;
+
+// request of a connection whose record is written once it is answered
+typedef struct {
+	int pending;				// a record is due for the current request
+	uint64_t start;				// latency_now() when the head was parsed
+	in_addr_t addr;				// set once for the connection
+	int method;
+	int status;
+	int cache;
+	long bytes;
+	int uri_len;
+	char uri[ACCESS_URI_MAX];
+} access_entry;
+
+int access_log_open(const char *path);
+void access_log_start(access_entry *e, Request *req);
+void access_log_end(struct node *c);
+void access_log_tick();
+void access_log_flush();
+void access_log_reopen();
+
+#endif // _ACCESS_LOG_H_
@@ -0,0 +1,41 @@
+/**
+ * @file arena.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Bump allocator for memory that lives as long as one request
+ * @version 0.1
+ * @date 2021-11-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+
+#define ARENA_MIN_BLOCK (8 * 1024)		// usable bytes of the first block of an arena
+#define ARENA_MAX_BLOCK (256 * 1024)	// largest pooled block, later blocks double up to it
+#define ARENA_POOL_BYTES (4 * 1024 * 1024)	// free blocks kept for reuse
+#define ARENA_ALIGN 16
+
+typedef struct arena_block arena_block;
+
+typedef struct arena {
+	arena_block *head;			// block allocations come from, NULL if empty
+} arena;
+
+// position in an arena to rewind to
+typedef struct arena_mark {
+	arena_block *block;
+	size_t used;
+} arena_mark;
+
+void arena_init(arena *a);
+void* arena_alloc(arena *a, size_t size);
+void* arena_grow(arena *a, void *ptr, size_t old_size, size_t new_size);
+arena_mark arena_save(arena *a);
+void arena_rewind(arena *a, arena_mark mark);
+void arena_reset(arena *a);
+
+#endif // _ARENA_H_
@@ -0,0 +1,60 @@
+/**
+ * @file cgi_cache.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Cache of CGI GET responses for LISO
+ * @version 0.1
+ * @date 2021-10-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _CGI_CACHE_H_
+#define _CGI_CACHE_H_
+
+#include <time.h>
+#include "list.h"
+
+#define CGI_CACHE_BUCKETS 256		// hash buckets of the cache
+
+// client->cache_woken after a fill ended
+#define CACHE_WOKEN_HIT 1			// response was cached, look it up
+#define CACHE_WOKEN_PASS 2			// response was not cached, run the script
+
+// output of one script run for a method and URI, one entry per variant
+typedef struct cgi_cache_entry {
+	char *key;					// method and request URI
+	unsigned int hash;
+	char *vary;					// Vary header of the response, NULL if none
+	char *vary_values;			// request values of the Vary headers
+	char *response;				// script output as the client got it
+	long len;
+	long cap;
+	time_t expires;
+	int filling;				// a script run is producing the response
+	int storing;				// output still fits the budget
+	client *waiters;			// requests for the same variant waiting on the fill
+	struct cgi_cache_entry *hnext;		// next in the hash bucket
+	struct cgi_cache_entry *lru_prev;	// more recently used
+	struct cgi_cache_entry *lru_next;	// less recently used
+} cgi_cache_entry;
+
+// CGI cache counters
+typedef struct {
+	long hits;
+	long misses;
+	long coalesced;				// misses that waited for another run
+	long stored;				// responses added to the cache
+	long evicted;				// responses dropped for space
+	long bytes;					// bytes held by the cache
+} cgi_cache_stats;
+
+extern cgi_cache_stats cgi_cache_load;
+
+int cgi_cache_lookup(client *c, Request *req, cgi_cache_entry **entry);
+void cgi_cache_append(cgi_cache_entry *entry, const char *buf, int len);
+void cgi_cache_finish(cgi_cache_entry *entry, int complete);
+void cgi_cache_cancel_wait(client *c);
+client* cgi_cache_next_woken(int *pass);
+
+#endif // _CGI_CACHE_H_
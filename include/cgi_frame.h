@@ -0,0 +1,46 @@
+/**
+ * @file cgi_frame.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Framing of CGI script output in to HTTP/1.1 responses
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _CGI_FRAME_H_
+#define _CGI_FRAME_H_
+
+#include "list.h"
+
+#define CGI_HEAD_MAX 8192			// max size of the header block of a script
+
+// how the body of a script response is delimited
+enum cgi_framing {
+	CGI_FRAME_NONE = 0,				// response has no body
+	CGI_FRAME_LENGTH,				// Content-Length from the script
+	CGI_FRAME_CHUNKED,				// chunked by Liso
+	CGI_FRAME_CLOSE,				// ends when the connection closes
+};
+
+typedef struct cgi_frame {
+	int head_done;				// response head was sent to the client
+	int framing;				// enum cgi_framing
+	int status;					// status code of the response head
+	int head_only;				// HEAD request, the body is dropped
+	int keep_alive;				// connection stays open after the response
+	int http11;					// client understands chunked
+	long body_left;				// Content-Length bytes still to pass on
+
+	int head_len;				// bytes in head
+	char head[CGI_HEAD_MAX];	// header block as the script sent it
+} cgi_frame;
+
+void cgi_frame_init(cgi_frame *f, Request *req);
+int cgi_frame_output(cgi_frame *f, client *host, const char *buf, int len);
+long cgi_frame_passthrough(cgi_frame *f);
+void cgi_frame_passed(cgi_frame *f, long len);
+int cgi_frame_end(cgi_frame *f, client *host);
+
+#endif // _CGI_FRAME_H_
@@ -0,0 +1,47 @@
+/**
+ * @file chunked.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Incremental decoder for chunked Transfer-Encoding request bodies
+ * @version 0.1
+ * @date 2021-10-22
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _CHUNKED_H_
+#define _CHUNKED_H_
+
+#include "parse.h"
+
+#define CHUNK_LINE_MAX 4096			// max size of a chunk-size or trailer line
+#define CHUNK_MAX_TRAILERS 16		// max trailer fields kept per request
+#define CHUNK_MAX_SIZE (16 * 1024 * 1024)	// max size of a single chunk
+
+/**
+ * @brief consumer of decoded body bytes, returns LISO_SUCCESS or an error
+ * which aborts decoding. A sink that can not take everything right now sets
+ * accepted to what it took and decoding pauses there.
+ */
+typedef int (*chunk_sink)(void *ctx, const char *data, int len, int *accepted);
+
+typedef struct {
+	int state;
+	int digits;				// hex digits seen on the size line
+	long chunk_left;		// bytes left in the current chunk
+	long max_chunk_size;
+	long total;				// decoded body bytes so far
+
+	int line_len;			// bytes in line (size extension or trailer)
+	char line[CHUNK_LINE_MAX];
+
+	Http_header *trailers;
+	int trailer_count;
+} chunk_decoder;
+
+void chunk_decoder_init(chunk_decoder *d, long max_chunk_size);
+int chunk_decode(chunk_decoder *d, const char *buf, int len, int *consumed,
+				 chunk_sink sink, void *ctx);
+void chunk_decoder_free(chunk_decoder *d);
+
+#endif // _CHUNKED_H_
@@ -0,0 +1,52 @@
+/**
+ * @file config.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Runtime tunables for LISO, set with name=value command line options
+ * @version 0.1
+ * @date 2021-10-23
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+
+#ifndef _CONFIG_H_
+#define _CONFIG_H_
+
+#include <stdio.h>
+
+typedef struct {
+	long rx_window;				// bytes of a connection buffered at a time
+	long tx_window;				// bytes queued for a client before its producer waits
+	long max_body;				// largest body kept in memory for a request
+	long max_body_memory;		// memory all in-memory bodies may use together
+	long max_chunk_size;		// largest chunk of a chunked body
+	long max_header_bytes;		// largest request line plus headers
+	long max_header_count;		// most header fields in a request
+	long max_uri_len;			// longest request URI
+	long header_timeout;		// seconds allowed to receive a request head
+	long header_grace;			// seconds before min_header_rate applies
+	long min_header_rate;		// bytes/sec a request head must arrive at
+	long resolve_cache_size;	// resolved URIs cached, 0 disables the cache
+	long resolve_cache_ttl;		// seconds before a cached file is stat()ed again
+	long cgi_workers;			// FastCGI workers started at boot, 0 forks per request
+	long cgi_splice;			// 1 splices script output to clients, 0 copies it
+	long cgi_max_active;		// CGI requests served at once, 0 for no limit
+	long cgi_queue_len;			// CGI requests waiting for a slot before 503
+	long cgi_queue_timeout;		// seconds a CGI request may wait for a slot
+	long cgi_cache_bytes;		// memory for cached CGI responses, 0 disables it
+	long cgi_timeout;			// seconds a CGI request may run, 0 for no limit
+	long cgi_kill_grace;		// seconds between SIGTERM and SIGKILL
+	long cgi_max_output;		// bytes of output a CGI request may send, 0 for no limit
+	long plugin_threads;		// threads running offloaded plugin handlers
+	long io_buffer_pool;		// free receive and send buffers kept for reuse
+	long log_level;				// 0 errors, 1 warnings, 2 info, 3 debug
+	long access_log_sample;		// record every Nth request, 0 disables the access log
+	long server_status;			// counters at /server-status, 0 off, 1 loopback clients, 2 all
+} liso_config;
+
+extern liso_config config;
+
+int set_config_option(const char *option);
+void print_config_options(FILE *out);
+
+#endif // _CONFIG_H_
@@ -0,0 +1,80 @@
+/**
+ * @file fcgi.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief FastCGI worker pool and record framing used by LISO for CGI
+ * @version 0.1
+ * @date 2021-10-26
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+
+#ifndef _FCGI_H_
+#define _FCGI_H_
+
+#include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
+
+#define FCGI_VERSION_1 1
+#define FCGI_HEADER_LEN 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_REQUEST_ID 1			// one request per connection
+
+// record types
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_ABORT_REQUEST 2
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+
+#define FCGI_RESPONDER 1
+
+// decoder for the records a worker sends back
+typedef struct {
+	unsigned char header[FCGI_HEADER_LEN];
+	int header_len;				// header bytes seen of the current record
+	int type;
+	int content_left;
+	int padding_left;
+	int done;					// FCGI_END_REQUEST was received
+} fcgi_stream;
+
+// writer of the records of a request, its start and the FCGI_STDIN stream
+typedef struct {
+	char *pending;				// FCGI_BEGIN_REQUEST and FCGI_PARAMS records not sent yet
+	int pending_len;
+	int pending_off;			// bytes of pending sent
+	unsigned char header[FCGI_HEADER_LEN];
+	int header_off;				// header bytes sent, FCGI_HEADER_LEN if none pending
+	int content_left;			// content bytes of the current record still to send
+	int ended;					// the empty record ending the stream was started
+} fcgi_writer;
+
+// a worker process of the pool
+typedef struct {
+	pid_t pid;					// 0 if the slot has no worker
+	int listen_fd;				// socket the worker accepts requests on, -1 if none
+	struct sockaddr_un addr;
+	int active;					// requests connected to the worker
+	time_t started;
+	time_t respawn_at;			// earliest time to respawn a crashed worker
+	int crashes;				// quick exits in a row
+	int stopping;				// got SIGTERM for a request past cgi_timeout
+	time_t kill_at;				// SIGKILL if it still runs then, 0 once sent
+} fcgi_worker;
+
+int fcgi_pool_start(const char *script, const char *sock_path, int size);
+void fcgi_pool_check(void);
+int fcgi_connect(int *worker);
+void fcgi_request_done(int worker);
+void fcgi_stop_worker(int worker);
+int fcgi_begin_request(fcgi_writer *w, char *env[]);
+void fcgi_writer_init(fcgi_writer *w);
+void fcgi_writer_release(fcgi_writer *w);
+int fcgi_send_stdin(int fd, fcgi_writer *w, const char *data, int len, int end, int *written);
+int fcgi_decode(fcgi_stream *s, char *buf, int len);
+
+#endif // _FCGI_H_
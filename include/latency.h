@@ -0,0 +1,52 @@
+/**
+ * @file latency.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Log-linear latency histograms of the phases of a request
+ * @version 0.1
+ * @date 2021-11-06
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LATENCY_H_
+#define _LATENCY_H_
+
+#include <stdint.h>
+
+#define LATENCY_SUB_BITS 5			// 32 buckets per power of two, ~3% error
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_MAX_BIT 39			// ~9 minutes in ns, longer is counted there
+#define LATENCY_BUCKETS ((LATENCY_MAX_BIT - LATENCY_SUB_BITS + 2) * LATENCY_SUB)
+
+enum latency_phases {
+	LATENCY_FIRST_BYTE = 0,		// connection accepted to its first byte
+	LATENCY_PARSE,				// parse() of a request head
+	LATENCY_FILE,				// lookup and load of a static response
+	LATENCY_CGI_SPAWN,			// start of a script or a worker request
+	LATENCY_CGI_FIRST_OUTPUT,	// script started to its first output
+	LATENCY_RESPONSE,			// request parsed to its last byte sent
+	LATENCY_PHASES,
+};
+
+// nanoseconds, bucket i counts values from latency_bucket_low(i) up to the
+// next bucket
+typedef struct {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[LATENCY_BUCKETS];
+} latency_hist;
+
+uint64_t latency_now();
+void latency_hist_record(latency_hist *h, uint64_t ns);
+void latency_hist_merge(latency_hist *dst, const latency_hist *src);
+void latency_record(int phase, uint64_t ns);
+void latency_since(int phase, uint64_t start);
+const latency_hist* latency_get(int phase);
+const char* latency_phase_name(int phase);
+uint64_t latency_percentile(const latency_hist *h, double q);
+void latency_request_dump();
+void latency_tick();
+
+#endif // _LATENCY_H_
@@ -19,15 +19,16 @@
 #include <assert.h>
 #include <strings.h>
 #include "list.h"
+#include "config.h"
 #include <arpa/inet.h>
+#include <spawn.h>
+#include <sys/select.h>
 
 // MACROS
 
 #define BAD_REQUEST_SIZE 28			// size of a bad request error 400
 #define PATH_MAX 4096
 
-#define ENV_SIZE 1024
-#define ENV_NUM 23
 
 enum liso_errors {
 	LISO_ERROR = -1,
@@ -41,18 +42,70 @@ enum liso_errors {
 	LISO_CLOSE_CONN =7,
 	LISO_CGI_START = 8,
 	LISO_CGI_END =9,
+	LISO_BODY_DONE =10,
+	LISO_PAYLOAD_TOO_LARGE =11,
+	LISO_NOT_IMPLEMENTED =12,
+	LISO_WOULD_BLOCK =13,
+	LISO_URI_TOO_LONG =14,
+	LISO_HEADERS_TOO_LARGE =15,
+	LISO_SERVICE_UNAVAILABLE =16,
+	LISO_GATEWAY_TIMEOUT =17,
+	LISO_BAD_GATEWAY =18,
+	LISO_INTERNAL_ERROR =19,
+	LISO_BAD_FRAMING =20,
+	LISO_METHOD_NOT_ALLOWED =21,
 };
 
-char* generate_reply(Request *req, char *buf, int bufsize, int *resp_size);
-char* generate_error(int error, int *resp_size, Request *req);
+// CGI admission counters
+typedef struct {
+	long active;				// CGI requests being served
+	long queued;				// CGI requests waiting for a slot
+	long max_queued;			// deepest the queue has been
+	long admitted;				// requests that got a slot after waiting
+	long rejected;				// requests refused because the queue was full
+	long expired;				// requests that waited cgi_queue_timeout
+	long timed_out;				// requests past cgi_timeout
+	long too_large;				// requests past cgi_max_output
+	long exited;				// scripts that exited with status 0
+	long failed;				// scripts that exited with another status
+	long signaled;				// scripts ended by a signal
+} cgi_stats;
+
+extern cgi_stats cgi_load;
+
+char* generate_reply(Request *req, char *buf, int bufsize, int *resp_size, arena *a);
+char* generate_error(int error, int *resp_size, Request *req, arena *a);
 int get_full_request_len(Request *req);
 int get_conn_header(Request *req);
+int get_body_framing(Request *req, long *content_len);
 int sanity_check(Request *req);
+int check_request_head(const char *buf, int len);
+int error_closes_connection(int error);
+const char* get_mime_type(const char *path);
 int start_process_cgi(Request *req, client *c);
-int wrap_process_cgi(client *cgi_client);
-int get_http_env(char* env[], Request *req, char remote_address[], int port); 
+int forward_cgi_output(client *cgi_client);
+int client_send(client *c, const char *data, int len);
+int send_error_response(client *c, int error, Request *req);
+void send_framed_output(client *c, Request *req, const char *head, int head_len,
+						const char *body, int body_len);
+int cgi_write_body(client *c, const char *data, int len, int *written);
+int cgi_end_body(client *c);
+void cgi_close_body(client *c);
+int cgi_slot_free();
+int cgi_enqueue(client *c);
+void cgi_dequeue(client *c);
+client* cgi_queue_head();
+void cgi_terminate(pid_t pid);
+void cgi_terminate_all();
+void cgi_abort_output(client *cgi_client, int error);
+int cgi_watch_children(fd_set *read_set, int maxfd);
+void cgi_check_children(fd_set *read_set);
+void execve_error_handler();
+pid_t spawn_cgi_script(const char *script, posix_spawn_file_actions_t *actions, char *env[], pid_t pgroup);
+char** build_cgi_env(Request *req, client *c);
 void print_parse_req(Request *request);
 void print_req_buf(char *buf, int len);
 int get_header_index(Http_header *header, const char* header_name, int header_count);
+char* get_header(Request *req, const char* name);
 
 #endif // _LISO_H_
\ No newline at end of file
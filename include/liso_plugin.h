@@ -0,0 +1,50 @@
+/**
+ * @file liso_plugin.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief API for in-process handler plugins of LISO
+ *
+ * A plugin is a shared object loaded with plugin=<path>. Liso calls its
+ * liso_plugin_init() once at startup, before the server daemonizes, where
+ * it registers handlers for URI prefixes. A request whose URI starts with
+ * a registered prefix is passed to the handler with its whole body, the
+ * handler fills in the response through the writer and returns.
+ *
+ * Handlers run in the event loop and must not block. A handler registered
+ * with LISO_HANDLER_OFFLOAD runs on a thread of the plugin pool instead,
+ * it may block but must not call into Liso other than through the writer.
+ *
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LISO_PLUGIN_H_
+#define _LISO_PLUGIN_H_
+
+#include <stddef.h>
+#include "parse.h"
+
+#define LISO_HANDLER_OFFLOAD 1		// handler may block, run it on the plugin pool
+#define LISO_HANDLER_LOOPBACK 2		// only clients on 127.0.0.0/8 reach it, others get 404
+
+typedef struct liso_writer liso_writer;
+
+/**
+ * @brief handler of a URI prefix. The request is read only and only valid
+ * during the call. Returns 0 once the response is written, anything else
+ * gets the client a 500.
+ */
+typedef int (*liso_handler)(Request *req, liso_writer *w, void *arg);
+
+// defined by every plugin, returns 0 on success
+int liso_plugin_init(void);
+
+int liso_register_handler(const char *prefix, liso_handler handler, void *arg, int flags);
+int liso_set_status(liso_writer *w, int status, const char *reason);
+int liso_add_header(liso_writer *w, const char *name, const char *value);
+int liso_write(liso_writer *w, const void *data, size_t len);
+char* get_header(Request *req, const char* name);
+
+#endif // _LISO_PLUGIN_H_
@@ -15,14 +15,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include "log.h"
 
-/* Define LISODEBUG to enable debug messages for this liso server */
-// #define LISODEBUG
-#ifdef LISODEBUG
-#include <stdio.h>
-#define LISOPRINTF(...) fprintf(__VA_ARGS__)
-#else
-#define LISOPRINTF(...)
-#endif
+/* Debug messages go to the log at LISO_LOG_DEBUG, they are only formatted
+ * when log_level=3 or after SIGUSR2 */
+#define LISOPRINTF(...) LISO_LOG(LISO_LOG_DEBUG, __VA_ARGS__)
 
 #endif // _LISODEBUG_H_
\ No newline at end of file
@@ -0,0 +1,65 @@
+/**
+ * @file lisotrace.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Static user level tracepoints (USDT) of LISO
+ *
+ * With <sys/sdt.h> (systemtap-sdt-dev) installed every LISO_TRACE is a
+ * probe of provider "liso" in the binary. A disabled probe is a nop
+ * instruction, but its arguments are still evaluated on every pass, so
+ * only values already at hand are passed. Strings are NUL terminated and
+ * read by the tracer, e.g.
+ *
+ *   bpftrace -e 'usdt:./lisod:liso:response_end { @[arg1] = hist(arg2); }'
+ *   bpftrace -e 'usdt:./lisod:liso:cache_miss { @[str(arg1)] = count(); }'
+ *
+ * Without it, or with -DLISO_NO_USDT, the probes compile to nothing.
+ *
+ * Probes and arguments:
+ *   conn_accept      fd, port
+ *   conn_close       fd
+ *   parse_start      fd, bytes buffered
+ *   parse_end        fd, uri (NULL if malformed)
+ *   response_start   fd, status
+ *   response_end     fd, status, response bytes
+ *   cache_hit        fd, uri
+ *   cache_miss       fd, uri
+ *   cgi_spawn        fd, pid (0 for a worker request)
+ *   cgi_exit         pid, wait status
+ *   timeout          fd, kind (enum trace_timeouts)
+ *
+ * @version 0.1
+ * @date 2021-11-07
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LISOTRACE_H_
+#define _LISOTRACE_H_
+
+#if !defined(LISO_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define LISO_USDT 1
+#endif
+#endif
+
+// kind of a timeout probe
+enum trace_timeouts {
+	TRACE_TIMEOUT_IDLE = 0,
+	TRACE_TIMEOUT_HEADER,
+	TRACE_TIMEOUT_CGI,
+	TRACE_TIMEOUT_CGI_QUEUE,
+};
+
+#ifdef LISO_USDT
+#define LISO_TRACE1(name, a) STAP_PROBE1(liso, name, a)
+#define LISO_TRACE2(name, a, b) STAP_PROBE2(liso, name, a, b)
+#define LISO_TRACE3(name, a, b, c) STAP_PROBE3(liso, name, a, b, c)
+#else
+#define LISO_TRACE1(name, a) do { } while (0)
+#define LISO_TRACE2(name, a, b) do { } while (0)
+#define LISO_TRACE3(name, a, b, c) do { } while (0)
+#endif
+
+#endif // _LISOTRACE_H_
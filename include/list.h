@@ -14,9 +14,18 @@
 
 #include <time.h>
 #include <netinet/in.h>
+#include "parse.h"
+#include "chunked.h"
+#include "fcgi.h"
+#include "access_log.h"
 
 #define BUF_SIZE 4096				// size of Liso Buffer 
 
+struct cgi_cache_entry;
+struct cgi_frame;
+struct plugin_route;
+struct plugin_job;
+
 typedef struct node {
 	int sock;
 	time_t elapsed;
@@ -24,18 +33,64 @@ typedef struct node {
 	int buf_left;
 	int alloc_num;
 	int pipeline_flag;
+	int paused;					// not read until its consumer catches up
+	time_t header_start;		// first byte of a pending request head
 	char remote_address[INET_ADDRSTRLEN];
 	int port;
 
+	// response bytes the socket did not take yet
+	char *out_buf;
+	int out_off;				// start of the queued bytes in out_buf
+	int out_len;				// bytes queued
+	int out_cap;
+	int closing;				// closed once the queued bytes are sent
+	int tx_blocked;				// socket was full for a splice, wait for it
+
+	// request whose body is still being received
+	Request *req;
+	arena arena;				// memory of the request and its response
+	int req_error;				// error to reply with once the body is read
+	int cached_reply;			// reply was sent from the CGI cache
+	long body_left;				// Content-Length bytes still expected
+	long body_reserved;			// body memory charged to this request
+	chunk_decoder *chunked;		// decoder for Transfer-Encoding: chunked
+	int body_fd;				// CGI stdin the body streams to, -1 if none
+	int body_fcgi;				// body_fd takes FastCGI records
+	fcgi_writer body_writer;	// record state of body_fd
+	int body_blocked;			// body_fd is full, wait until it is writable
+	int cgi_queued;				// waiting for a free CGI slot
+	time_t cgi_queued_at;		// when it joined the CGI queue
+	struct node *cgi_next;		// next client in the CGI queue or cache wait
+	struct cgi_cache_entry *cache_fill;	// cache entry this request's output fills
+	struct cgi_cache_entry *cache_wait;	// fill this request waits on
+	int cache_woken;			// fill ended, request not dispatched yet, CACHE_WOKEN_*
+	struct plugin_route *route;	// plugin handler of the request, NULL if none
+	struct plugin_job *plugin_job;	// offloaded handler answering this client
+	access_entry access;		// access log record of the current request
+	uint64_t accepted_at;		// accept time until the first byte came, then 0
+	uint64_t send_started;		// parse time of a response still queued, 0 if none
+	uint64_t cgi_started;		// when the script of this output was started
+
 	int is_pipe;
 	struct node *cgi_host;
+	struct node *cgi_proc;		// CGI process serving this client
+	fcgi_stream *fcgi;			// records of a pool worker, NULL for a pipe
+	int splice;					// output can be spliced to the client as is
+	struct cgi_frame *frame;	// response framing of the output
+	pid_t cgi_pid;				// one-shot script writing this output, 0 for a worker
+	int fcgi_worker;			// pool worker writing this output
+	time_t cgi_deadline;		// the output has to end by then, 0 for never
+	long cgi_sent;				// output bytes passed to the client
 	struct node *next;
 } client;
 
+client* new_client();
+void free_client(client *c);
 client* search_client(int socket);
 void add_client(client *c);
 void delete_client(client *c);
 client* check_timeout();
 void reinsert_client(client *c);
+client* get_clients();
 
 #endif // _LIST_H_
\ No newline at end of file
@@ -0,0 +1,46 @@
+/**
+ * @file log.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Asynchronous logger of LISO, records are queued in a ring and
+ * written by a background thread
+ * @version 0.1
+ * @date 2021-11-03
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#include <signal.h>
+
+#define LOG_RING_SLOTS 4096			// records queued before new ones are dropped
+#define LOG_MSG_MAX 240				// longer messages are truncated
+#define LOG_BATCH_SIZE (64 * 1024)	// bytes written by the log thread at once
+#define LOG_IDLE_MS 20				// log thread sleep when the ring is empty
+
+enum log_levels {
+	LISO_LOG_ERROR = 0,
+	LISO_LOG_WARN,
+	LISO_LOG_INFO,
+	LISO_LOG_DEBUG,
+};
+
+// records above this level are not formatted at all
+extern volatile sig_atomic_t log_level;
+
+// log a printf style message at a level, costs a compare when filtered
+#define LISO_LOG(level, ...) do {			\
+		if ((level) <= log_level) {			\
+			liso_log(level, __VA_ARGS__);	\
+		}									\
+	} while (0)
+
+void liso_log(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int log_open(const char *path);
+void log_reopen();
+void log_toggle_debug();
+long log_dropped();
+
+#endif // _LOG_H_
@@ -16,21 +16,25 @@
 #ifndef _PARSE_H_
 #define _PARSE_H_
 
+#include "arena.h"
+
 #define SUCCESS 0
+#define HTTP_FIELD_SIZE 4096		// size of URI and header name/value fields
+#define HTTP_TOKEN_SIZE 50			// size of method and version fields
 
 //Header field
 typedef struct
 {
-	char header_name[4096];
-	char header_value[4096];
+	char header_name[HTTP_FIELD_SIZE];
+	char header_value[HTTP_FIELD_SIZE];
 } Http_header;
 
 //HTTP Request Header
 typedef struct
 {
-	char http_version[50];
-	char http_method[50];
-	char http_uri[4096];
+	char http_version[HTTP_TOKEN_SIZE];
+	char http_method[HTTP_TOKEN_SIZE];
+	char http_uri[HTTP_FIELD_SIZE];
 	Http_header *headers;
 	int header_count;
 
@@ -50,13 +54,14 @@ typedef struct {
 	char *message;
 
 	int error;
+	arena *arena;				// everything above is allocated from it
 } Response;
 
-Request* parse(char *buffer, int size,int socketFd);
+Request* parse(char *buffer, int size, int socketFd, arena *a);
 
 // functions decalred in parser.y
 int yyparse();
-void set_parsing_options(char *buf, size_t i, Request *request);
+void set_parsing_options(char *buf, size_t i, Request *request, arena *a);
 void yyrestart ( FILE *input_file  );
 
 #endif
\ No newline at end of file
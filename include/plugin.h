@@ -0,0 +1,60 @@
+/**
+ * @file plugin.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Loading and running of handler plugins inside LISO
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _PLUGIN_H_
+#define _PLUGIN_H_
+
+#include "liso_plugin.h"
+#include "list.h"
+
+#define PLUGIN_MAX_ROUTES 64		// URI prefixes all plugins may register
+
+// response of a handler, a CGI style header block and the body
+struct liso_writer {
+	char *head;
+	int head_len;
+	int head_cap;
+	char *body;
+	long body_len;
+	long body_cap;
+	int status;					// 200 unless the handler set one
+	char reason[HTTP_TOKEN_SIZE];
+	int failed;					// out of memory, the response is a 500
+};
+
+// a URI prefix and its handler
+typedef struct plugin_route {
+	char *prefix;
+	int prefix_len;
+	liso_handler handler;
+	void *arg;
+	int flags;
+} plugin_route;
+
+// request of an offloaded handler
+typedef struct plugin_job {
+	client *c;					// client to answer, NULL once it closed
+	Request *req;				// heap copy owned by the job
+	plugin_route *route;
+	liso_writer w;
+	int ret;					// what the handler returned
+	struct plugin_job *next;
+} plugin_job;
+
+int plugin_load(const char *path);
+int plugin_start(long threads);
+int plugin_event_fd();
+plugin_route* plugin_find(Request *req);
+int plugin_serve(client *c, plugin_route *route, Request *req);
+void plugin_complete();
+void plugin_cancel(client *c);
+
+#endif // _PLUGIN_H_
@@ -0,0 +1,35 @@
+/**
+ * @file pool.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Pools of fixed size objects and I/O buffers
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _POOL_H_
+#define _POOL_H_
+
+#include <stddef.h>
+
+#define POOL_PAGE_SIZE 4096
+#define POOL_SLAB_SIZE (64 * 1024)	// objects are carved from slabs of this size
+#define POOL_ALIGN 64				// objects in a slab start on a cache line
+
+typedef struct pool {
+	size_t size;				// bytes of an object
+	int slab;					// objects come from slabs and are never freed
+	long max_free;				// free buffers kept, the rest is freed
+	void *free_list;			// free objects, linked through their first word
+	long free_count;
+	long in_use;
+} pool;
+
+void pool_init_slab(pool *p, size_t size);
+void pool_init_buffers(pool *p, size_t size, long max_free);
+void* pool_get(pool *p);
+void pool_put(pool *p, void *obj);
+
+#endif // _POOL_H_
@@ -0,0 +1,35 @@
+/**
+ * @file resolve.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief URI to file resolution and the resolved path cache of LISO
+ * @version 0.1
+ * @date 2021-10-25
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+
+#ifndef _RESOLVE_H_
+#define _RESOLVE_H_
+
+#include <sys/types.h>
+#include <time.h>
+
+#define INDEX_FILE "index.html"		// served for directory URIs
+
+// a URI resolved to a regular file under the www folder
+typedef struct {
+	char *uri;					// request URI as received, the cache key
+	char *path;					// file the URI resolved to
+	off_t size;
+	struct timespec mtime;
+	const char *mime;
+	time_t checked;				// last time the file was stat()ed
+	unsigned int hash;
+} resolved_file;
+
+int canonicalize_uri(const char *uri, char *out, int size);
+int resolve_uri(const char *uri, resolved_file **file);
+void invalidate_uri(resolved_file *file);
+
+#endif // _RESOLVE_H_
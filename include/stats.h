@@ -0,0 +1,37 @@
+/**
+ * @file stats.h
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * @brief Server counters of LISO and the /server-status endpoint
+ * @version 0.1
+ * @date 2021-11-05
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#define STATS_URI "/server-status"	// ?format=prometheus for the Prometheus format
+#define STATS_METHODS 4				// enum access_methods
+#define STATS_STATUS_CLASSES 6		// no response, 1xx to 5xx
+
+// counters of the event loop, it is the only thread writing them so they
+// are plain increments, kept on lines of their own away from other threads
+typedef struct {
+	long accepted;				// connections accepted
+	long closed;				// connections closed
+	long requests[STATS_METHODS];	// requests by method
+	long responses[STATS_STATUS_CLASSES];	// requests by status / 100
+	long pipelined;				// requests read behind another in one buffer
+	long bytes_in;				// bytes received from clients
+	long bytes_out;				// response bytes sent or queued
+	long idle_timeouts;			// connections closed for being idle
+	long header_timeouts;		// request heads that arrived too slowly
+} __attribute__((aligned(64))) liso_stats;
+
+extern liso_stats stats;
+
+int stats_init();
+
+#endif // _STATS_H_
@@ -0,0 +1,107 @@
+/**
+ * @file access_dump.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Print the binary access log of LISO as text
+ *
+ * Every record becomes one line,
+ *
+ *   time address:port "method uri" status bytes duration_us cache
+ *
+ * e.g. 2021-11-04 10:00:00.123456 127.0.0.1:41822 "GET /index.html" 200 178 45 -
+ * where cache is HIT or MISS for requests looked up in the CGI cache.
+ *
+ * Usage ./access_dump [access log ...], stdin is read without arguments.
+ *
+ * @version 0.1
+ * @date 2021-11-04
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <arpa/inet.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "access_log.h"
+
+static const char *methods[] = {"-", "GET", "HEAD", "POST"};
+static const char *cache_names[] = {"-", "HIT", "MISS"};
+
+/**
+ * @brief Print one record
+ *
+ * @param r the record
+ * @param uri URI of the record
+ * @param uri_len bytes of uri
+ * @return ** void
+ */
+static void print_record(access_record *r, const char *uri, int uri_len) {
+	char addr[INET_ADDRSTRLEN];
+	struct in_addr in = {.s_addr = r->addr};
+	inet_ntop(AF_INET, &in, addr, sizeof(addr));
+
+	char date[32];
+	time_t secs = r->time_us / 1000000;
+	struct tm tm;
+	gmtime_r(&secs, &tm);
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+
+	printf("%s.%06" PRIu64 " %s:%u \"%s %.*s\" %03u %" PRIu64 " %" PRIu32 " %s\n",
+		   date, r->time_us % 1000000, addr, r->port,
+		   r->method < sizeof(methods) / sizeof(methods[0]) ? methods[r->method] : "-",
+		   uri_len > 0 ? uri_len : 1, uri_len > 0 ? uri : "-",
+		   r->status, r->bytes, r->duration_us,
+		   r->cache < sizeof(cache_names) / sizeof(cache_names[0]) ? cache_names[r->cache] : "-");
+}
+
+/**
+ * @brief Print all records of an access log
+ *
+ * @param in open access log
+ * @param name name of it for errors
+ * @return ** int 0 on success, 1 if the file is not an access log or cut off
+ */
+static int dump(FILE *in, const char *name) {
+	char magic[sizeof(ACCESS_LOG_MAGIC) - 1];
+	if(fread(magic, 1, sizeof(magic), in) != sizeof(magic) ||
+		memcmp(magic, ACCESS_LOG_MAGIC, sizeof(magic)) != 0) {
+		fprintf(stderr, "%s: not a Liso access log\n", name);
+		return 1;
+	}
+
+	access_record r;
+	char uri[ACCESS_URI_MAX];
+	while(fread(&r, sizeof(r), 1, in) == 1) {
+		int uri_len = r.len - (int)sizeof(r);
+		if(uri_len < 0 || uri_len > ACCESS_URI_MAX ||
+			fread(uri, 1, uri_len, in) != (size_t)uri_len) {
+			fprintf(stderr, "%s: truncated or corrupt record\n", name);
+			return 1;
+		}
+		print_record(&r, uri, uri_len);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	if(argc < 2) {
+		return dump(stdin, "stdin");
+	}
+
+	int ret = 0;
+	for(int i = 1; i < argc; i++) {
+		FILE *in = fopen(argv[i], "rb");
+		if(in == NULL) {
+			perror(argv[i]);
+			ret = 1;
+			continue;
+		}
+		ret |= dump(in, argv[i]);
+		fclose(in);
+	}
+	return ret;
+}
@@ -0,0 +1,240 @@
+/**
+ * @file access_log.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Binary access log of LISO
+ *
+ * Every answered request gets a fixed size record with its URI appended,
+ * nothing is formatted as text on the data path. Records are collected in
+ * a batch and written with one write() once ACCESS_BATCH_SIZE bytes are
+ * collected or ACCESS_FLUSH_SECS passed, a busy server writes a thousand
+ * records or so at a time. With access_log_sample=N only every Nth request
+ * is recorded, error responses always are. access_dump turns the file in
+ * to text.
+ *
+ * Requests are answered by the event loop thread only, the batch is not
+ * locked.
+ *
+ * @version 0.1
+ * @date 2021-11-04
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include "liso.h"
+#include "access_log.h"
+#include "stats.h"
+#include "latency.h"
+#include "lisotrace.h"
+
+static char log_path[PATH_MAX];
+static int log_fd = -1;
+static volatile sig_atomic_t reopen_wanted = false;
+
+static char batch[ACCESS_BATCH_SIZE];
+static int batch_len = 0;
+static time_t last_flush = 0;
+static long sample_count = 0;		// requests since the last sampled one
+
+/**
+ * @brief Open the access log, a new file starts with ACCESS_LOG_MAGIC
+ *
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int open_log_file() {
+	int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+	if(fd < 0) {
+		return -1;
+	}
+
+	struct stat st;
+	if(fstat(fd, &st) == 0 && st.st_size == 0) {
+		write(fd, ACCESS_LOG_MAGIC, strlen(ACCESS_LOG_MAGIC));
+	}
+
+	if(log_fd >= 0) {
+		close(log_fd);
+	}
+	log_fd = fd;
+	return 0;
+}
+
+/**
+ * @brief Open the access log, nothing is recorded unless this succeeded
+ *
+ * @param path path of the access log
+ * @return ** int 0 on success, -1 otherwise
+ */
+int access_log_open(const char *path) {
+	snprintf(log_path, sizeof(log_path), "%s", path);
+	last_flush = time(NULL);
+	return open_log_file();
+}
+
+/**
+ * @brief Write the collected records, records are lost if the file is
+ * broken. Async signal safe so the batch can be saved on SIGTERM.
+ *
+ * @return ** void
+ */
+void access_log_flush() {
+	const char *buf = batch;
+	int len = batch_len;
+	while(len > 0 && log_fd >= 0) {
+		ssize_t ret = write(log_fd, buf, len);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	batch_len = 0;
+}
+
+/**
+ * @brief Reopen the access log before the next batch, e.g. after it was
+ * rotated. Async signal safe.
+ *
+ * @return ** void
+ */
+void access_log_reopen() {
+	reopen_wanted = true;
+}
+
+/**
+ * @brief Write records that waited ACCESS_FLUSH_SECS and reopen the file
+ * if asked to, called on every turn of the event loop
+ *
+ * @return ** void
+ */
+void access_log_tick() {
+	if(log_fd < 0) {
+		return;
+	}
+
+	time_t now = time(NULL);
+	if(reopen_wanted) {
+		reopen_wanted = false;
+		access_log_flush();
+		open_log_file();
+		last_flush = now;
+	} else if(batch_len > 0 && now - last_flush >= ACCESS_FLUSH_SECS) {
+		access_log_flush();
+		last_flush = now;
+	}
+}
+
+/**
+ * @brief Start the record of a request once its head is parsed
+ *
+ * @param e access state of the connection
+ * @param req the request, NULL if it could not be parsed
+ * @return ** void
+ */
+void access_log_start(access_entry *e, Request *req) {
+	// tracked even without a log file, the counters are kept from it
+	e->pending = true;
+	e->start = latency_now();
+	e->status = 0;
+	e->cache = ACCESS_CACHE_NONE;
+	e->bytes = 0;
+
+	if(req == NULL) {
+		e->method = ACCESS_METHOD_OTHER;
+		e->uri_len = 0;
+		return;
+	}
+
+	if(strcmp(req->http_method, "GET") == 0) {
+		e->method = ACCESS_METHOD_GET;
+	} else if(strcmp(req->http_method, "HEAD") == 0) {
+		e->method = ACCESS_METHOD_HEAD;
+	} else if(strcmp(req->http_method, "POST") == 0) {
+		e->method = ACCESS_METHOD_POST;
+	} else {
+		e->method = ACCESS_METHOD_OTHER;
+	}
+
+	if(log_fd < 0) {
+		e->uri_len = 0;
+		return;
+	}
+
+	// kept with the connection, a CGI response outlives the request
+	int len = strlen(req->http_uri);
+	e->uri_len = len < ACCESS_URI_MAX ? len : ACCESS_URI_MAX;
+	memcpy(e->uri, req->http_uri, e->uri_len);
+}
+
+/**
+ * @brief Count the request of a client once its response is done, or
+ * once the client went away before that, and record it in the log
+ *
+ * @param c client that sent the request
+ * @return ** void
+ */
+void access_log_end(client *c) {
+	access_entry *e = &c->access;
+	if(!e->pending) {
+		return;
+	}
+	e->pending = false;
+	LISO_TRACE3(response_end, c->sock, e->status, e->bytes);
+
+	stats.requests[e->method]++;
+	stats.responses[e->status >= 100 && e->status < 600 ? e->status / 100 : 0]++;
+
+	if(e->status != 0 && c->send_started == 0) {
+		// timed until its last byte left, an older response still queued
+		// is timed instead
+		c->send_started = e->start;
+		if(c->out_len == 0) {
+			latency_since(LATENCY_RESPONSE, c->send_started);
+			c->send_started = 0;
+		}
+	}
+
+	if(log_fd < 0) {
+		return;
+	}
+
+	if(e->status < 400 && ++sample_count < config.access_log_sample) {
+		return;
+	}
+	sample_count = 0;
+
+	int len = sizeof(access_record) + e->uri_len;
+	if(batch_len + len > ACCESS_BATCH_SIZE) {
+		access_log_flush();
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	uint64_t duration = (latency_now() - e->start) / 1000;
+
+	access_record r = {
+		.len = len,
+		.status = e->status,
+		.method = e->method,
+		.cache = e->cache,
+		.port = c->port,
+		.addr = e->addr,
+		.duration_us = duration < UINT32_MAX ? duration : UINT32_MAX,
+		.time_us = now.tv_sec * 1000000ULL + now.tv_nsec / 1000,
+		.bytes = e->bytes,
+	};
+
+	// batch_len only moves once the record is whole, see access_log_flush
+	memcpy(batch + batch_len, &r, sizeof(r));
+	memcpy(batch + batch_len + sizeof(r), e->uri, e->uri_len);
+	batch_len += len;
+}
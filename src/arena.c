@@ -0,0 +1,246 @@
+/**
+ * @file arena.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Bump allocator for memory that lives as long as one request
+ *
+ * Everything a request needs, the parsed request and its headers, the body
+ * and the response, is carved out of the arena of its connection and given
+ * back at once when the response is done. The first block of an arena has
+ * ARENA_MIN_BLOCK bytes, enough for a typical request, and every further
+ * block is twice the size of the one before up to ARENA_MAX_BLOCK, so a
+ * small request costs little and a large one takes few blocks. Blocks come
+ * from free lists by size shared by all connections so steady state
+ * traffic does not reach malloc, and an idle connection holds no blocks at
+ * all. Allocations beyond ARENA_MAX_BLOCK get a block of their own which is
+ * freed on reset.
+ *
+ * The server is single threaded, the free list is not locked.
+ *
+ * @version 0.1
+ * @date 2021-11-01
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+struct arena_block {
+	arena_block *next;			// block allocated before this one
+	size_t size;				// usable bytes after the header
+	size_t used;
+};
+
+// block header rounded up so data is aligned
+#define BLOCK_HEADER ((sizeof(arena_block) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1))
+
+#define BLOCK_CLASSES 6				// ARENA_MIN_BLOCK to ARENA_MAX_BLOCK in powers of two
+
+static arena_block *pool[BLOCK_CLASSES];	// free blocks by size
+static size_t pool_bytes = 0;
+
+static size_t align_up(size_t size) {
+	return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static char* block_data(arena_block *b) {
+	return (char *)b + BLOCK_HEADER;
+}
+
+/**
+ * @brief Free list of a pooled block size
+ *
+ * @param size ARENA_MIN_BLOCK times a power of two, at most ARENA_MAX_BLOCK
+ * @return ** int index in pool
+ */
+static int size_class(size_t size) {
+	int c = 0;
+	while(((size_t)ARENA_MIN_BLOCK << c) < size) {
+		c++;
+	}
+	return c;
+}
+
+/**
+ * @brief Get an empty block twice the size of the previous block of the
+ * arena, from the pool if there is one, or a block of its own for a large
+ * allocation
+ *
+ * @param size bytes needed
+ * @param prev block the arena took last, NULL for its first
+ * @return ** arena_block* the block, NULL if out of memory
+ */
+static arena_block* block_get(size_t size, arena_block *prev) {
+	size_t want = prev == NULL ? ARENA_MIN_BLOCK : prev->size * 2;
+	want = want < ARENA_MAX_BLOCK ? want : ARENA_MAX_BLOCK;
+	while(want < size) {
+		want *= 2;
+	}
+
+	arena_block *b;
+	if(want <= ARENA_MAX_BLOCK && pool[size_class(want)] != NULL) {
+		int c = size_class(want);
+		b = pool[c];
+		pool[c] = b->next;
+		pool_bytes -= b->size;
+	} else {
+		want = want <= ARENA_MAX_BLOCK ? want : size;
+		b = malloc(BLOCK_HEADER + want);
+		if(b == NULL) {
+			return NULL;
+		}
+		b->size = want;
+	}
+
+	b->used = 0;
+	b->next = NULL;
+	return b;
+}
+
+/**
+ * @brief Return a block to the pool, large blocks and blocks beyond
+ * ARENA_POOL_BYTES are freed
+ *
+ * @param b block
+ * @return ** void
+ */
+static void block_put(arena_block *b) {
+	if(b->size <= ARENA_MAX_BLOCK && pool_bytes + b->size <= ARENA_POOL_BYTES) {
+		int c = size_class(b->size);
+		b->next = pool[c];
+		pool[c] = b;
+		pool_bytes += b->size;
+	} else {
+		free(b);
+	}
+}
+
+/**
+ * @brief Initialize an empty arena
+ *
+ * @param a arena
+ * @return ** void
+ */
+void arena_init(arena *a) {
+	a->head = NULL;
+}
+
+/**
+ * @brief Allocate memory that lives until the arena is reset
+ *
+ * @param a arena
+ * @param size bytes to allocate
+ * @return ** void* aligned memory, NULL if out of memory
+ */
+void* arena_alloc(arena *a, size_t size) {
+	// every allocation takes space so it can be told apart from the next
+	size = size == 0 ? ARENA_ALIGN : align_up(size);
+
+	arena_block *b = a->head;
+	if(b == NULL || b->size - b->used < size) {
+		arena_block *fresh = block_get(size, b);
+		if(fresh == NULL) {
+			return NULL;
+		}
+		fresh->next = b;
+		a->head = fresh;
+		b = fresh;
+	}
+
+	void *p = block_data(b) + b->used;
+	b->used += size;
+	return p;
+}
+
+/**
+ * @brief Grow an allocation, in place if it is the last one made from the
+ * arena, by copying otherwise. The old memory stays until the reset.
+ *
+ * @param a arena
+ * @param ptr allocation to grow, NULL to allocate
+ * @param old_size size it was allocated with
+ * @param new_size size wanted
+ * @return ** void* the allocation, NULL if out of memory in which case ptr
+ * is unchanged
+ */
+void* arena_grow(arena *a, void *ptr, size_t old_size, size_t new_size) {
+	if(ptr == NULL) {
+		return arena_alloc(a, new_size);
+	}
+
+	old_size = old_size == 0 ? ARENA_ALIGN : align_up(old_size);
+	new_size = new_size == 0 ? ARENA_ALIGN : align_up(new_size);
+
+	arena_block *b = a->head;
+	if(b != NULL && (char *)ptr + old_size == block_data(b) + b->used) {
+		size_t start = (char *)ptr - block_data(b);
+		if(start + new_size <= b->size) {
+			b->used = start + new_size;
+			return ptr;
+		}
+
+		if(start == 0 && b->size > ARENA_MAX_BLOCK) {
+			// only allocation in a block of its own, realloc may avoid a copy
+			arena_block *moved = realloc(b, BLOCK_HEADER + new_size);
+			if(moved == NULL) {
+				return NULL;
+			}
+			moved->size = new_size;
+			moved->used = new_size;
+			a->head = moved;
+			return block_data(moved);
+		}
+	}
+
+	void *p = arena_alloc(a, new_size);
+	if(p == NULL) {
+		return NULL;
+	}
+	memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+	return p;
+}
+
+/**
+ * @brief Remember the current end of an arena
+ *
+ * @param a arena
+ * @return ** arena_mark mark for arena_rewind
+ */
+arena_mark arena_save(arena *a) {
+	arena_mark mark = { a->head, a->head != NULL ? a->head->used : 0 };
+	return mark;
+}
+
+/**
+ * @brief Free everything allocated since a mark was saved
+ *
+ * @param a arena
+ * @param mark mark from arena_save
+ * @return ** void
+ */
+void arena_rewind(arena *a, arena_mark mark) {
+	while(a->head != mark.block) {
+		arena_block *b = a->head;
+		a->head = b->next;
+		block_put(b);
+	}
+
+	if(a->head != NULL) {
+		a->head->used = mark.used;
+	}
+}
+
+/**
+ * @brief Free everything allocated from an arena, its blocks go back to
+ * the pool
+ *
+ * @param a arena
+ * @return ** void
+ */
+void arena_reset(arena *a) {
+	arena_mark empty = { NULL, 0 };
+	arena_rewind(a, empty);
+}
@@ -0,0 +1,474 @@
+/**
+ * @file bench_parser.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Microbenchmark driver for the LISO parser and response builders.
+ *
+ * Every corpus case is run through parse() in a tight loop the same way
+ * handle_rx() walks a receive buffer (pipelined requests are parsed one
+ * after the other), and every parsed request is then fed to
+ * generate_reply()/generate_error(). For each case and stage the driver
+ * prints one JSON object per line with ns/request, bytes/sec and heap
+ * allocations per request, so two runs can be diffed or compared with -b.
+ *
+ * Allocations are counted by linking with -Wl,--wrap for the malloc family,
+ * which only sees calls made from LISO objects and not libc internals.
+ *
+ * @version 0.1
+ * @date 2021-10-20
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <fcntl.h>
+#include <stdbool.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "liso.h"
+#include "parse.h"
+
+// Globals needed by http.c
+char LISO_PATH[PATH_MAX];
+
+// Constants
+#define BENCH_DEFAULT_ITER 20000
+#define BENCH_MAX_CASES 64
+#define BENCH_MAX_INPUT 65536
+#define BENCH_LINE_SIZE 1024
+
+/**************** BEGIN ALLOCATION COUNTING ***************/
+static unsigned long alloc_count = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+	alloc_count++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+	alloc_count++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+	alloc_count++;
+	return __real_realloc(ptr, size);
+}
+/**************** END ALLOCATION COUNTING ***************/
+
+typedef struct {
+	char name[64];
+	char *data;
+	int len;
+} bench_case;
+
+typedef struct {
+	char name[64];
+	char stage[16];
+	double ns_per_req;
+} baseline_entry;
+
+static bench_case cases[BENCH_MAX_CASES];
+static int case_count = 0;
+static baseline_entry baseline[BENCH_MAX_CASES * 2];
+static int baseline_count = 0;
+
+/**************** BEGIN SYNTHETIC CORPUS ***************/
+static const char browser_request[] =
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: www.cs.cmu.edu\r\n"
+	"Connection: keep-alive\r\n"
+	"Cache-Control: max-age=0\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 "
+	"(KHTML, like Gecko) Chrome/94.0.4606.71 Safari/537.36\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+	"image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"Cookie: _ga=GA1.2.1234567890.1633024800; _gid=GA1.2.987654321.1633024800\r\n"
+	"\r\n";
+
+static const char small_request[] =
+	"GET /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"\r\n";
+
+static const char head_request[] =
+	"HEAD /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"Connection: close\r\n"
+	"\r\n";
+
+static const char post_request[] =
+	"POST /index.html HTTP/1.1\r\n"
+	"Host: localhost\r\n"
+	"Content-Type: application/x-www-form-urlencoded\r\n"
+	"Content-Length: 27\r\n"
+	"\r\n"
+	"name=liso&course=15-441&x=1";
+
+static const char* const malformed_requests[] = {
+	"GET /index.html\r\n\r\n",
+	"GET  /index.html HTTP/1.1\r\n\r\n",
+	"GET /index.html HTTP/1.1\r\nHost localhost\r\n\r\n",
+	"GET /index.html HTTP/1.1\r\nHost: localhost\r\n",
+	"\r\n\r\n",
+	0
+};
+
+#define PIPELINE_DEPTH 8
+/**************** END SYNTHETIC CORPUS ***************/
+
+/**
+ * @brief Add a case to the corpus, the data is copied
+ *
+ * @param name name reported for the case
+ * @param data request bytes
+ * @param len number of request bytes
+ * @return ** int 0 on success, -1 otherwise
+ */
+int add_case(const char *name, const char *data, int len) {
+	if(case_count == BENCH_MAX_CASES) {
+		return -1;
+	}
+
+	bench_case *bc = &cases[case_count];
+	bc->data = __real_malloc(len);
+	if(bc->data == NULL) {
+		return -1;
+	}
+
+	snprintf(bc->name, sizeof(bc->name), "%s", name);
+	memcpy(bc->data, data, len);
+	bc->len = len;
+	case_count++;
+
+	return 0;
+}
+
+/**
+ * @brief Add a case from a file, e.g. the cp1 sample requests
+ *
+ * @param path path of the file
+ * @return ** int 0 on success, -1 otherwise
+ */
+int add_file_case(const char *path) {
+	char buf[BENCH_MAX_INPUT];
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "bench_parser: can not open %s\n", path);
+		return -1;
+	}
+
+	int len = read(fd, buf, sizeof(buf));
+	close(fd);
+	if(len <= 0) {
+		return -1;
+	}
+
+	const char *name = strrchr(path, '/');
+	return add_case(name != NULL ? name + 1 : path, buf, len);
+}
+
+/**
+ * @brief Add the built in corpus: browser headers, pipelined bursts and
+ * malformed inputs
+ *
+ * @return ** void
+ */
+void add_synthetic_cases() {
+	char buf[BENCH_MAX_INPUT];
+	int len = 0;
+
+	add_case("small_get", small_request, strlen(small_request));
+	add_case("browser_get", browser_request, strlen(browser_request));
+	add_case("head_close", head_request, strlen(head_request));
+	add_case("post_form", post_request, strlen(post_request));
+
+	// a burst of pipelined requests in one receive buffer
+	for(int i = 0; i < PIPELINE_DEPTH; i++) {
+		memcpy(buf + len, browser_request, strlen(browser_request));
+		len += strlen(browser_request);
+	}
+	add_case("pipelined_browser_x8", buf, len);
+
+	for(int i = 0; malformed_requests[i] != NULL; i++) {
+		char name[64];
+		snprintf(name, sizeof(name), "malformed_%d", i);
+		add_case(name, malformed_requests[i], strlen(malformed_requests[i]));
+	}
+}
+
+// request memory, reset after every request like a client's
+static arena bench_arena;
+
+/**
+ * @brief Walk the buffer like handle_rx and parse every request in it
+ *
+ * @param bc case to run
+ * @param reply also build the response for each parsed request
+ * @param requests [out] number of requests seen
+ * @return ** int number of parse failures
+ */
+int run_once(bench_case *bc, bool reply, int *requests) {
+	char *cur_buf = bc->data;
+	int cur_to_end_size = bc->len;
+	int failures = 0;
+
+	*requests = 0;
+	while(cur_to_end_size > 0) {
+		Request *req = parse(cur_buf, cur_to_end_size, 0, &bench_arena);
+		(*requests)++;
+
+		if(req == NULL) {
+			failures++;
+			if(reply) {
+				int resp_size;
+				generate_error(LISO_BAD_REQUEST, &resp_size, NULL, &bench_arena);
+				arena_reset(&bench_arena);
+			}
+			break;
+		}
+
+		int rlen = get_full_request_len(req);
+		if(rlen > cur_to_end_size) {
+			rlen = cur_to_end_size;
+		}
+		req->message_len = rlen - req->request_len;
+		req->message = arena_alloc(&bench_arena, req->message_len + 1);
+		memcpy(req->message, cur_buf + req->request_len, req->message_len);
+		req->message[req->message_len] = '\0';
+
+		if(reply) {
+			int resp_size;
+			int error = sanity_check(req);
+
+			if(error != LISO_SUCCESS) {
+				generate_error(error, &resp_size, req, &bench_arena);
+			} else {
+				generate_reply(req, cur_buf, rlen, &resp_size, &bench_arena);
+			}
+		}
+
+		arena_reset(&bench_arena);
+		cur_buf += rlen;
+		cur_to_end_size -= rlen;
+	}
+
+	return failures;
+}
+
+/**
+ * @brief get monotonic time in nanoseconds
+ *
+ * @return ** double time in ns
+ */
+double now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/**
+ * @brief Load a baseline written by an earlier run of this benchmark
+ *
+ * @param path path of the baseline file
+ * @return ** int number of entries loaded, -1 on error
+ */
+int load_baseline(const char *path) {
+	char line[BENCH_LINE_SIZE];
+	FILE *bf = fopen(path, "r");
+	if(bf == NULL) {
+		fprintf(stderr, "bench_parser: can not open baseline %s\n", path);
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), bf) != NULL && baseline_count < BENCH_MAX_CASES * 2) {
+		baseline_entry *be = &baseline[baseline_count];
+		char *ns = strstr(line, "\"ns_per_req\":");
+		if(ns == NULL) {
+			continue;
+		}
+
+		if(sscanf(line, "{\"bench\":\"parser\",\"case\":\"%63[^\"]\",\"stage\":\"%15[^\"]\"",
+			be->name, be->stage) == 2 &&
+			sscanf(ns, "\"ns_per_req\":%lf", &be->ns_per_req) == 1) {
+			baseline_count++;
+		}
+	}
+
+	fclose(bf);
+	return baseline_count;
+}
+
+/**
+ * @brief Find the baseline entry for a case and stage
+ *
+ * @param name case name
+ * @param stage stage name
+ * @return ** baseline_entry* entry if found, NULL otherwise
+ */
+baseline_entry* find_baseline(const char *name, const char *stage) {
+	for(int i = 0; i < baseline_count; i++) {
+		if(strcmp(baseline[i].name, name) == 0 && strcmp(baseline[i].stage, stage) == 0) {
+			return &baseline[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Run one case for one stage and print the JSON result line
+ *
+ * @param bc case to run
+ * @param reply true for the parse+reply stage, false for parse only
+ * @param iterations number of times to run the case
+ * @return ** void
+ */
+void bench_case_stage(bench_case *bc, bool reply, int iterations) {
+	const char *stage = reply ? "reply" : "parse";
+	int requests = 0;
+	int failures = 0;
+	int devnull = open("/dev/null", O_WRONLY);
+	int saved_stderr = dup(STDERR_FILENO);
+
+	// yyerror and perror are noisy for malformed and missing files
+	dup2(devnull, STDERR_FILENO);
+
+	// warm up
+	run_once(bc, reply, &requests);
+
+	unsigned long start_allocs = alloc_count;
+	double start = now_ns();
+	for(int i = 0; i < iterations; i++) {
+		failures += run_once(bc, reply, &requests);
+	}
+	double elapsed = now_ns() - start;
+	unsigned long allocs = alloc_count - start_allocs;
+
+	dup2(saved_stderr, STDERR_FILENO);
+	close(saved_stderr);
+	close(devnull);
+
+	double total_requests = (double)requests * iterations;
+	double ns_per_req = elapsed / total_requests;
+	double bytes_per_sec = (double)bc->len * iterations / (elapsed / 1e9);
+
+	printf("{\"bench\":\"parser\",\"case\":\"%s\",\"stage\":\"%s\",\"bytes\":%d,"
+		"\"requests_per_iter\":%d,\"iterations\":%d,\"parse_failures\":%d,"
+		"\"ns_per_req\":%.1f,\"bytes_per_sec\":%.0f,\"allocs_per_req\":%.2f",
+		bc->name, stage, bc->len, requests, iterations, failures,
+		ns_per_req, bytes_per_sec, allocs / total_requests);
+
+	baseline_entry *be = find_baseline(bc->name, stage);
+	if(be != NULL && be->ns_per_req > 0) {
+		printf(",\"baseline_ns_per_req\":%.1f,\"delta_pct\":%.1f",
+			be->ns_per_req, (ns_per_req - be->ns_per_req) * 100.0 / be->ns_per_req);
+	}
+	printf("}\n");
+	fflush(stdout);
+}
+
+/**
+ * @brief Create a small www tree so GET/HEAD exercise load_uri
+ *
+ * @param dir [out] directory created
+ * @return ** int 0 on success, -1 otherwise
+ */
+int make_www(char dir[PATH_MAX]) {
+	char path[PATH_MAX + 16];
+	char body[BUF_SIZE];
+
+	snprintf(dir, PATH_MAX, "/tmp/liso_bench_XXXXXX");
+	if(mkdtemp(dir) == NULL) {
+		return -1;
+	}
+
+	snprintf(path, sizeof(path), "%s/index.html", dir);
+	FILE *index = fopen(path, "w");
+	if(index == NULL) {
+		return -1;
+	}
+	memset(body, 'x', sizeof(body));
+	fwrite(body, 1, sizeof(body), index);
+	fclose(index);
+
+	return 0;
+}
+
+/**
+ * @brief remove the www tree created by make_www
+ *
+ * @param dir directory to remove
+ * @return ** void
+ */
+void remove_www(char *dir) {
+	char path[PATH_MAX + 16];
+	snprintf(path, sizeof(path), "%s/index.html", dir);
+	unlink(path);
+	rmdir(dir);
+}
+
+void usage() {
+	fprintf(stderr, "Usage ./bench_parser [-n iterations] [-b baseline] [request files...]\n");
+}
+
+/**
+ * @brief Main driver for the parser benchmark
+ *
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @return ** int
+ */
+int main(int argc, char *argv[]) {
+	int iterations = BENCH_DEFAULT_ITER;
+	int opt;
+
+	while((opt = getopt(argc, argv, "n:b:h")) != -1) {
+		switch(opt) {
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'b':
+			if(load_baseline(optarg) < 0) {
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(iterations <= 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+
+	if(make_www(LISO_PATH) != 0) {
+		fprintf(stderr, "bench_parser: can not create www folder\n");
+		return EXIT_FAILURE;
+	}
+
+	for(int i = optind; i < argc; i++) {
+		add_file_case(argv[i]);
+	}
+	add_synthetic_cases();
+
+	for(int i = 0; i < case_count; i++) {
+		bench_case_stage(&cases[i], false, iterations);
+		bench_case_stage(&cases[i], true, iterations);
+	}
+
+	remove_www(LISO_PATH);
+	return EXIT_SUCCESS;
+}
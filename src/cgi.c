@@ -3,8 +3,28 @@
  * @author Apoorv Gupta (apoorvgu@andrew.cmu.edu)
  * @brief 
  * This file contains the implementation for CGI in LISO, the LISO deamon
- * forks and runs the cgi script. The CGI script asynchronously returns the 
- * response to LISO which is then sent back to the client.
+ * spawns and runs the cgi script. The CGI script asynchronously returns the 
+ * response to LISO which forwards it to the client piece by piece as the
+ * script writes it, framed by cgi_frame so the connection can be kept
+ * open. A body with a Content-Length from a one-shot script is spliced
+ * from its stdout pipe to the client socket without being copied through
+ * LISO.
+ * 
+ * Scripts are started with posix_spawn() rather than fork(), glibc spawns
+ * with a vfork style clone that shares the address space of the server, so
+ * starting a script costs the same however large the server heap grows.
+ * Every fd of the server is close-on-exec, the script only gets the pipes
+ * set up through the spawn file actions.
+ * 
+ * At most cgi_max_active requests are served at once, later ones wait in a
+ * FIFO queue of cgi_queue_len entries that the event loop admits from as
+ * running requests finish. Output that fills a cgi_cache entry is copied
+ * in to it on its way to the client.
+ * 
+ * Every one-shot script is watched through a pidfd the event loop selects
+ * on and reaped as soon as it exits. A request gets cgi_timeout seconds
+ * and cgi_max_output bytes, a script past its deadline gets SIGTERM and
+ * cgi_kill_grace seconds later SIGKILL.
  * 
  * Initial implementation taken from 15441 P1 CP3 starter code
  * 
@@ -15,23 +35,63 @@
  * 
  */
 
+#define _GNU_SOURCE
+#include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <poll.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include "liso.h"
+#include "access_log.h"
+#include "resolve.h"
+#include "cgi_cache.h"
+#include "cgi_frame.h"
+#include "stats.h"
+#include "latency.h"
+#include "lisotrace.h"
 #include <stdbool.h>
 
 /**************** BEGIN GLOBALS ***************/
 extern char cgi_script[BUF_SIZE];
-extern FILE* fp;
+extern int server_port;
+extern const char LISO_NAME[];
+
+cgi_stats cgi_load;
+
+// clients waiting for a CGI slot, oldest first
+static client *queue_head = NULL;
+static client *queue_tail = NULL;
+
+// a one-shot script that has not been reaped yet
+typedef struct cgi_child {
+    pid_t pid;
+    int pidfd;                  // readable once the script exited, -1 without pidfd support
+    time_t deadline;            // SIGTERM is sent at this time, 0 for never
+    time_t kill_at;             // SIGKILL follows at this time once terminated
+    int killed;                 // SIGKILL was sent
+    struct cgi_child *next;
+} cgi_child;
+
+static cgi_child *children = NULL;
 /**************** BEGIN GLOBALS ***************/
 
 /**************** BEGIN CONSTANTS ***************/
 
 #define ARG_NUM 2
 #define BUF_SIZE 4096
+#define SIZE_STRING_BUF_SIZE 50
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434      // Linux 5.3, missing from older headers
+#endif
 
 /**************** END CONSTANTS ***************/
 
@@ -123,163 +183,1128 @@ processes.\n");
 }
 /**************** END UTILITY FUNCTIONS ***************/
 
+/**************** BEGIN CGI ENVIRONMENT ***************/
+/* The environment is built in one arena that is reused for every request,
+ * the script copies it on exec and a worker gets it as FCGI_PARAMS before
+ * the next request is started. Variables are recorded as offsets while
+ * the arena may still move and turned in to pointers at the end. */
+static char *env_arena = NULL;
+static size_t env_arena_cap = 0;
+static size_t env_arena_used = 0;
+static size_t *env_offsets = NULL;
+static char **env_vars = NULL;
+static int env_cap = 0;
+static int env_count = 0;
+
+#define ENV_REMOVED ((size_t)-1)		// offset of a variable merged in to a later one
+
+/**
+ * @brief Make room for one more variable of len bytes
+ * 
+ * @param len bytes of the variable including its terminator
+ * @return ** int LISO_SUCCESS on success, LISO_MEM_FAIL otherwise
+ */
+static int env_reserve(size_t len) {
+    if (env_arena_used + len > env_arena_cap)
+    {
+        size_t cap = env_arena_cap == 0 ? BUF_SIZE : env_arena_cap;
+        while (cap < env_arena_used + len)
+        {
+            cap *= 2;
+        }
+        char *arena = realloc(env_arena, cap);
+        if (arena == NULL)
+        {
+            return LISO_MEM_FAIL;
+        }
+        env_arena = arena;
+        env_arena_cap = cap;
+    }
+
+    if (env_count + 1 >= env_cap)
+    {
+        int cap = env_cap == 0 ? 64 : env_cap * 2;
+        size_t *offsets = realloc(env_offsets, sizeof(size_t) * cap);
+        if (offsets == NULL)
+        {
+            return LISO_MEM_FAIL;
+        }
+        env_offsets = offsets;
+        char **vars = realloc(env_vars, sizeof(char *) * cap);
+        if (vars == NULL)
+        {
+            return LISO_MEM_FAIL;
+        }
+        env_vars = vars;
+        env_cap = cap;
+    }
+    return LISO_SUCCESS;
+}
+
+/**
+ * @brief Append NAME=value to the environment
+ * 
+ * @param name variable name
+ * @param value value, need not be terminated
+ * @param value_len bytes of value
+ * @return ** int LISO_SUCCESS on success, LISO_MEM_FAIL otherwise
+ */
+static int env_add(const char *name, const char *value, size_t value_len) {
+    size_t name_len = strlen(name);
+    if (env_reserve(name_len + value_len + 2) != LISO_SUCCESS)
+    {
+        return LISO_MEM_FAIL;
+    }
+
+    char *w = env_arena + env_arena_used;
+    memcpy(w, name, name_len);
+    w[name_len] = '=';
+    memcpy(w + name_len + 1, value, value_len);
+    w[name_len + 1 + value_len] = '\0';
+
+    env_offsets[env_count++] = env_arena_used;
+    env_arena_used += name_len + value_len + 2;
+    return LISO_SUCCESS;
+}
+
+/**
+ * @brief Export a request header as HTTP_<NAME> (RFC 3875 4.1.18), the
+ * name is upper cased with '-' turned in to '_'. A repeated header is
+ * merged with the earlier one as a comma separated list.
+ * 
+ * @param header request header
+ * @return ** int LISO_SUCCESS on success, LISO_MEM_FAIL otherwise
+ */
+static int env_add_header(Http_header *header) {
+    char name[HTTP_FIELD_SIZE + 5] = "HTTP_";
+    size_t len = 5;
+
+    for (char *p = header->header_name; *p; p++)
+    {
+        if (!isalnum((unsigned char)*p) && *p != '-')
+        {
+            // not a name a script could look up
+            return LISO_SUCCESS;
+        }
+        name[len++] = *p == '-' ? '_' : toupper((unsigned char)*p);
+    }
+    name[len] = '\0';
+
+    /* the body headers have variables of their own, credentials are not
+     * handed to scripts and HTTP_PROXY would be taken for a proxy setting */
+    if (strcmp(name, "HTTP_CONTENT_LENGTH") == 0 || strcmp(name, "HTTP_CONTENT_TYPE") == 0 ||
+        strcmp(name, "HTTP_AUTHORIZATION") == 0 || strcmp(name, "HTTP_PROXY_AUTHORIZATION") == 0 ||
+        strcmp(name, "HTTP_PROXY") == 0)
+    {
+        return LISO_SUCCESS;
+    }
+
+    const char *value = header->header_value;
+    size_t value_len = strlen(value);
+
+    for (int i = 0; i < env_count; i++)
+    {
+        if (env_offsets[i] == ENV_REMOVED)
+        {
+            continue;
+        }
+
+        char *var = env_arena + env_offsets[i];
+        if (strncmp(var, name, len) != 0 || var[len] != '=')
+        {
+            continue;
+        }
+
+        // same header seen before, the merged value goes at the end
+        size_t old_len = strlen(var + len + 1);
+        if (env_reserve(len + old_len + value_len + 4) != LISO_SUCCESS)
+        {
+            return LISO_MEM_FAIL;
+        }
+        var = env_arena + env_offsets[i];
+        env_offsets[i] = ENV_REMOVED;
+
+        char *w = env_arena + env_arena_used;
+        memcpy(w, var, len + 1 + old_len);
+        w += len + 1 + old_len;
+        memcpy(w, ", ", 2);
+        memcpy(w + 2, value, value_len + 1);
+
+        env_offsets[env_count++] = env_arena_used;
+        env_arena_used += len + old_len + value_len + 4;
+        return LISO_SUCCESS;
+    }
+
+    return env_add(name, value, value_len);
+}
+
+/**
+ * @brief Build the CGI environment of a request (RFC 3875 4.1)
+ * 
+ * SCRIPT_NAME is the path up to and including /cgi, PATH_INFO the
+ * percent-decoded rest of the path and QUERY_STRING what follows the '?'.
+ * Every request header is passed on as an HTTP_ variable.
+ * 
+ * @param req the request
+ * @param c the client that sent it
+ * @return ** char** NULL terminated environment, valid until the next call,
+ * NULL if out of memory
+ */
+char** build_cgi_env(Request *req, client *c) {
+    char path[HTTP_FIELD_SIZE];
+    char port[SIZE_STRING_BUF_SIZE];
+    int error = LISO_SUCCESS;
+
+    env_arena_used = 0;
+    env_count = 0;
+
+    const char *uri = req->http_uri;
+    const char *query = strchr(uri, '?');
+    size_t uri_path_len = query != NULL ? (size_t)(query - uri) : strcspn(uri, "#");
+    const char *query_end = query == NULL ? NULL : query + 1 + strcspn(query + 1, "#");
+
+    // split the path after /cgi, decoded if the URI allows it
+    const char *script = path;
+    if (canonicalize_uri(uri, path, sizeof(path)) != LISO_SUCCESS || strstr(path, "/cgi/") == NULL)
+    {
+        snprintf(path, sizeof(path), "%.*s", (int)uri_path_len, uri);
+    }
+    const char *cgi = strstr(script, "/cgi/");
+    size_t script_len = cgi != NULL ? (size_t)(cgi - script) + 4 : strlen(script);
+
+    char *header = get_header(req, "Content-Length");
+    error |= env_add("CONTENT_LENGTH", header ? header : "", header ? strlen(header) : 0);
+    header = get_header(req, "Content-Type");
+    error |= env_add("CONTENT_TYPE", header ? header : "", header ? strlen(header) : 0);
+    error |= env_add("GATEWAY_INTERFACE", "CGI/1.1", 7);
+    error |= env_add("PATH_INFO", script + script_len, strlen(script + script_len));
+    error |= env_add("QUERY_STRING", query ? query + 1 : "", query ? (size_t)(query_end - query - 1) : 0);
+    error |= env_add("REMOTE_ADDR", c->remote_address, strlen(c->remote_address));
+    snprintf(port, sizeof(port), "%d", c->port);
+    error |= env_add("REMOTE_PORT", port, strlen(port));
+    error |= env_add("REQUEST_METHOD", req->http_method, strlen(req->http_method));
+    error |= env_add("REQUEST_URI", uri, strlen(uri));
+    error |= env_add("SCRIPT_NAME", script, script_len);
+
+    header = get_header(req, "Host");
+    if (header != NULL)
+    {
+        error |= env_add("SERVER_NAME", header, strcspn(header, ":"));
+    }
+    snprintf(port, sizeof(port), "%d", server_port);
+    error |= env_add("SERVER_PORT", port, strlen(port));
+    error |= env_add("SERVER_PROTOCOL", req->http_version, strlen(req->http_version));
+    error |= env_add("SERVER_SOFTWARE", LISO_NAME, strlen(LISO_NAME));
+
+    for (int i = 0; i < req->header_count && error == LISO_SUCCESS; i++)
+    {
+        error = env_add_header(&req->headers[i]);
+    }
+
+    if (error != LISO_SUCCESS)
+    {
+        return NULL;
+    }
+
+    // the arena is final now, hand out pointers
+    int n = 0;
+    for (int i = 0; i < env_count; i++)
+    {
+        if (env_offsets[i] != ENV_REMOVED)
+        {
+            env_vars[n++] = env_arena + env_offsets[i];
+        }
+    }
+    env_vars[n] = NULL;
+
+    return env_vars;
+}
+/**************** END CGI ENVIRONMENT ***************/
+
+
+/**
+ * @brief Add the client node that reads the output of a CGI request
+ * 
+ * @param c the client that sent the request
+ * @param fd fd the script output is read from
+ * @param fcgi true if fd is a connection to a pool worker
+ * @return ** int fd on success, LISO_ERROR otherwise
+ */
+int add_cgi_client(client *c, int fd, int fcgi) {
+    client *cgi_client = new_client();
+    assert(cgi_client != NULL);
+    cgi_client->sock = fd;
+    cgi_client->cgi_host = c;
+    cgi_client->pipeline_flag = false;
+    cgi_client->is_pipe = true;
+    cgi_client->body_fd = -1;
+    cgi_client->cgi_deadline = config.cgi_timeout > 0 ? time(NULL) + config.cgi_timeout : 0;
+    cgi_client->cgi_started = latency_now();
+
+    if (fcgi)
+    {
+        cgi_client->fcgi = calloc(1, sizeof(fcgi_stream));
+        assert(cgi_client->fcgi != NULL);
+    }
+    else
+    {
+        // output is read as it becomes ready, never waited for
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        // output going in to the cache has to pass through Liso
+        cgi_client->splice = config.cgi_splice && c->cache_fill == NULL;
+    }
+
+    // the response is framed for the request that started the script
+    cgi_client->frame = malloc(sizeof(cgi_frame));
+    assert(cgi_client->frame != NULL);
+    cgi_frame_init(cgi_client->frame, c->req);
+
+    cgi_client->cache_fill = c->cache_fill;
+    c->cache_fill = NULL;
+    c->cgi_proc = cgi_client;
+    add_client(cgi_client);
+
+    // the slot is held until the output is finished
+    cgi_load.active++;
+
+    return fd;
+}
+
+/**
+ * @brief Check if another CGI request may start now
+ * 
+ * @return ** int true if a slot is free
+ */
+int cgi_slot_free() {
+    return config.cgi_max_active == 0 || cgi_load.active < config.cgi_max_active;
+}
+
+/**
+ * @brief Queue a client for a CGI slot, its request is started once the
+ * requests ahead of it got one
+ * 
+ * @param c client whose request waits
+ * @return ** int LISO_SUCCESS if queued, LISO_SERVICE_UNAVAILABLE if the
+ * queue is full
+ */
+int cgi_enqueue(client *c) {
+    if (cgi_load.queued >= config.cgi_queue_len)
+    {
+        cgi_load.rejected++;
+        LISO_LOG(LISO_LOG_WARN, "CGI queue full, %ld running %ld waiting\n",
+                cgi_load.active, cgi_load.queued);
+        return LISO_SERVICE_UNAVAILABLE;
+    }
+
+    c->cgi_queued = true;
+    c->cgi_queued_at = time(NULL);
+    c->cgi_next = NULL;
+    if (queue_tail == NULL)
+    {
+        queue_head = c;
+    }
+    else
+    {
+        queue_tail->cgi_next = c;
+    }
+    queue_tail = c;
+
+    cgi_load.queued++;
+    if (cgi_load.queued > cgi_load.max_queued)
+    {
+        cgi_load.max_queued = cgi_load.queued;
+    }
+    return LISO_SUCCESS;
+}
+
+/**
+ * @brief Take a client out of the CGI queue, nothing is done if it is not
+ * queued
+ * 
+ * @param c client to remove
+ * @return ** void 
+ */
+void cgi_dequeue(client *c) {
+    if (!c->cgi_queued)
+    {
+        return;
+    }
+
+    client *prev = NULL;
+    for (client *cur = queue_head; cur != NULL; prev = cur, cur = cur->cgi_next)
+    {
+        if (cur != c)
+        {
+            continue;
+        }
+
+        if (prev == NULL)
+        {
+            queue_head = c->cgi_next;
+        }
+        else
+        {
+            prev->cgi_next = c->cgi_next;
+        }
+        if (queue_tail == c)
+        {
+            queue_tail = prev;
+        }
+        break;
+    }
+
+    c->cgi_queued = false;
+    c->cgi_next = NULL;
+    cgi_load.queued--;
+}
+
+/**
+ * @brief Get the client that has waited longest for a CGI slot
+ * 
+ * @return ** client* head of the queue, NULL if it is empty
+ */
+client* cgi_queue_head() {
+    return queue_head;
+}
+
+/**
+ * @brief Start watching a freshly spawned script
+ * 
+ * @param pid pid of the script
+ * @return ** void 
+ */
+static void watch_child(pid_t pid) {
+    cgi_child *child = malloc(sizeof(cgi_child));
+    if (child == NULL)
+    {
+        // it will be a zombie until the server exits, nothing worse
+        return;
+    }
+
+    child->pid = pid;
+    // pidfd_open always sets close-on-exec, later scripts never see it
+    child->pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (child->pidfd >= FD_SETSIZE)
+    {
+        // select() can not watch it, the script is polled instead
+        close(child->pidfd);
+        child->pidfd = -1;
+    }
+    child->deadline = config.cgi_timeout > 0 ? time(NULL) + config.cgi_timeout : 0;
+    child->kill_at = 0;
+    child->killed = false;
+    child->next = children;
+    children = child;
+}
+
+/**
+ * @brief Ask a script and the processes it started to stop, they are
+ * killed if the script does not within cgi_kill_grace seconds
+ * 
+ * @param pid pid of the script
+ * @return ** void 
+ */
+void cgi_terminate(pid_t pid) {
+    for (cgi_child *child = children; child != NULL; child = child->next)
+    {
+        if (child->pid == pid && child->kill_at == 0)
+        {
+            LISOPRINTF("terminating CGI script %d\n", pid);
+            kill(-pid, SIGTERM);
+            child->kill_at = time(NULL) + config.cgi_kill_grace;
+        }
+    }
+}
+
+/**
+ * @brief Ask every running script and the processes it started to stop
+ * when the server shuts down, each runs in a process group of its own so
+ * signalling the group of the server misses them. Only kill() is used, it
+ * is called from the SIGTERM handler.
+ * 
+ * @return ** void 
+ */
+void cgi_terminate_all() {
+    for (cgi_child *child = children; child != NULL; child = child->next)
+    {
+        kill(-child->pid, SIGTERM);
+    }
+}
+
+/**
+ * @brief Add the pidfds of running scripts to a select set
+ * 
+ * @param read_set set to add to
+ * @param maxfd highest fd in read_set so far
+ * @return ** int highest fd in read_set
+ */
+int cgi_watch_children(fd_set *read_set, int maxfd) {
+    for (cgi_child *child = children; child != NULL; child = child->next)
+    {
+        if (child->pidfd >= 0)
+        {
+            FD_SET(child->pidfd, read_set);
+            maxfd = child->pidfd > maxfd ? child->pidfd : maxfd;
+        }
+    }
+    return maxfd;
+}
+
+/**
+ * @brief Record how a script ended
+ * 
+ * @param pid pid of the script
+ * @param status status from waitpid
+ * @return ** void 
+ */
+static void record_exit(pid_t pid, int status) {
+    LISO_TRACE2(cgi_exit, pid, status);
+    if (WIFSIGNALED(status))
+    {
+        cgi_load.signaled++;
+        LISO_LOG(LISO_LOG_WARN, "CGI script %d killed by signal %d\n", pid, WTERMSIG(status));
+    }
+    else if (WEXITSTATUS(status) != 0)
+    {
+        cgi_load.failed++;
+        LISO_LOG(LISO_LOG_INFO, "CGI script %d exited with %d\n", pid, WEXITSTATUS(status));
+    }
+    else
+    {
+        cgi_load.exited++;
+    }
+}
+
+/**
+ * @brief Reap scripts that exited and escalate on the ones past their
+ * deadline. The pidfds are cleared from the set so the caller does not
+ * take them for clients. Scripts without a pidfd are polled.
+ * 
+ * @param read_set fds select() found readable
+ * @return ** void 
+ */
+void cgi_check_children(fd_set *read_set) {
+    time_t now = time(NULL);
+    cgi_child **link = &children;
+
+    while (*link != NULL)
+    {
+        cgi_child *child = *link;
+        int ready = child->pidfd < 0 || FD_ISSET(child->pidfd, read_set);
+        if (child->pidfd >= 0)
+        {
+            FD_CLR(child->pidfd, read_set);
+        }
+
+        int status;
+        pid_t ret = ready ? waitpid(child->pid, &status, WNOHANG) : 0;
+        if (ret != 0)
+        {
+            if (ret == child->pid)
+            {
+                record_exit(child->pid, status);
+            }
+            if (child->pidfd >= 0)
+            {
+                close(child->pidfd);
+            }
+            *link = child->next;
+            free(child);
+            continue;
+        }
+
+        if (child->deadline != 0 && now >= child->deadline && child->kill_at == 0)
+        {
+            // still running after its output ended or timed out
+            cgi_terminate(child->pid);
+        }
+        else if (child->kill_at != 0 && now >= child->kill_at && !child->killed)
+        {
+            LISOPRINTF("killing CGI script %d\n", child->pid);
+            kill(-child->pid, SIGKILL);
+            child->killed = true;
+        }
+        link = &child->next;
+    }
+}
+
+/**
+ * @brief Report a script that can not be started because one of its fds
+ * is beyond what select() can watch
+ * 
+ * @param fd the fd
+ * @return ** void 
+ */
+static void cgi_fd_limit(int fd) {
+    LISO_LOG(LISO_LOG_WARN, "CGI request refused, fd %d is beyond the %d select() can watch\n",
+             fd, FD_SETSIZE);
+}
+
+/**
+ * @brief Start a CGI request on a worker of the pool
+ * 
+ * @param env CGI environment of the request
+ * @param c the client that sent the request
+ * @return ** int fd which will have the script response or LISO_ERROR otherwise
+ */
+int start_fcgi_request(char *env[], client *c) {
+    int worker;
+    int fd = fcgi_connect(&worker);
+    if (fd < 0)
+    {
+        return LISO_ERROR;
+    }
+
+    fcgi_writer_init(&c->body_writer);
+    c->body_fcgi = true;
+    if (fd >= FD_SETSIZE)
+    {
+        cgi_fd_limit(fd);
+    }
+    else if (fcgi_begin_request(&c->body_writer, env) == LISO_SUCCESS)
+    {
+        /* the body goes out as FCGI_STDIN records on its own copy of the fd
+         * so it can be closed independently of the response side, the copy
+         * must not leak in to scripts or respawned workers */
+        c->body_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+        if (c->body_fd >= FD_SETSIZE)
+        {
+            cgi_fd_limit(c->body_fd);
+            close(c->body_fd);
+            c->body_fd = -1;
+        }
+    }
+
+    // the worker gets the request start now if its socket takes it
+    int written;
+    if (c->body_fd < 0 ||
+        fcgi_send_stdin(c->body_fd, &c->body_writer, NULL, 0, false, &written) == LISO_ERROR)
+    {
+        cgi_close_body(c);
+        fcgi_request_done(worker);
+        close(fd);
+        return LISO_ERROR;
+    }
+
+    fd = add_cgi_client(c, fd, true);
+    c->cgi_proc->fcgi_worker = worker;
+    return fd;
+}
+
+/**
+ * @brief Spawn the CGI script with default signal handling, the fds it
+ * gets are set up by the file actions
+ * 
+ * @param script path of the script
+ * @param actions fd setup of the child
+ * @param env environment of the script
+ * @param pgroup process group of the script, 0 for a group of its own
+ * @return ** pid_t pid of the script or LISO_ERROR
+ */
+pid_t spawn_cgi_script(const char *script, posix_spawn_file_actions_t *actions, char *env[], pid_t pgroup) {
+    posix_spawnattr_t attr;
+    sigset_t defaults;
+    char* arg[ARG_NUM];
+    pid_t pid;
+
+    arg[0] = (char *)script;
+    arg[1] = NULL;
+
+    /* the server ignores SIGPIPE and SIGCHLD, the script should not */
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    sigaddset(&defaults, SIGCHLD);
+
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+    posix_spawnattr_setpgroup(&attr, pgroup);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+
+    int ret = posix_spawn(&pid, script, actions, &attr, arg, env);
+    posix_spawnattr_destroy(&attr);
+
+    if (ret != 0)
+    {
+        errno = ret;
+        execve_error_handler();
+        LISO_LOG(LISO_LOG_ERROR, "Error spawning CGI script %s\n", script);
+        return LISO_ERROR;
+    }
+
+    return pid;
+}
 
 /**
- * @brief Start processing a CGI request
+ * @brief Start processing a CGI request. The request body is not written
+ * here, the script stdin is left open in c->body_fd so the body can be
+ * streamed to it as it arrives and closed once it is complete.
+ * 
+ * With cgi_workers set the request goes to the worker pool, otherwise the
+ * script is started for this request alone.
  * 
  * @param req the request recieved
  * @param c the client that sent the request
  * @return ** int fd which will have the script response or LISO_ERROR otherwise
  */
 int start_process_cgi(Request *req, client *c) {
-    LISOPRINTF(fp, "inside %s", __func__);
+    LISOPRINTF("inside %s", __func__);
     print_parse_req(req);
     /*************** BEGIN VARIABLE DECLARATIONS **************/
     pid_t pid;
     int stdin_pipe[2];
     int stdout_pipe[2];
+    posix_spawn_file_actions_t actions;
 
+    uint64_t spawn_start = latency_now();
     /*************** END VARIABLE DECLARATIONS **************/
 
-	// create environment variables
-	char* env[ENV_NUM];
-    get_http_env(env, req, c->remote_address, c->port);
+    // create environment variables
+    char **env = build_cgi_env(req, c);
+    if (env == NULL)
+    {
+        return LISO_ERROR;
+    }
 
-    char* arg[ARG_NUM];
-    arg[0] = cgi_script;
-    arg[1] = NULL;
+    if (config.cgi_workers > 0)
+    {
+        int fd = start_fcgi_request(env, c);
+        if (fd >= 0)
+        {
+            latency_since(LATENCY_CGI_SPAWN, spawn_start);
+            LISO_TRACE2(cgi_spawn, c->sock, 0);
+        }
+        return fd;
+    }
 
     /*************** BEGIN PIPE **************/
-    /* 0 can be read from, 1 can be written to */
-    if (pipe(stdin_pipe) < 0)
+    /* 0 can be read from, 1 can be written to. CLOEXEC keeps other
+     * scripts from holding our end of the pipes open, dup2 clears it
+     * for the child's stdin and stdout */
+    if (pipe2(stdin_pipe, O_CLOEXEC) < 0)
     {
         fprintf(stderr, "Error piping for stdin.\n");
         return LISO_ERROR;
     }
 
-    if (pipe(stdout_pipe) < 0)
+    if (pipe2(stdout_pipe, O_CLOEXEC) < 0)
     {
         fprintf(stderr, "Error piping for stdout.\n");
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        return LISO_ERROR;
+    }
+
+    // the server ends are watched by select()
+    if (stdin_pipe[1] >= FD_SETSIZE || stdout_pipe[0] >= FD_SETSIZE)
+    {
+        cgi_fd_limit(stdin_pipe[1] > stdout_pipe[0] ? stdin_pipe[1] : stdout_pipe[0]);
+        close(stdin_pipe[0]);
+        close(stdin_pipe[1]);
+        close(stdout_pipe[0]);
+        close(stdout_pipe[1]);
         return LISO_ERROR;
     }
     /*************** END PIPE **************/
 
-    /*************** BEGIN FORK **************/
-    int ppid = getpid();
-    pid = fork();
-    /* not good */
+    /*************** BEGIN SPAWN **************/
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, stdout_pipe[1], fileno(stdout));
+    posix_spawn_file_actions_adddup2(&actions, stdin_pipe[0], fileno(stdin));
+    /* you should probably do something with stderr */
+
+    /* own group so that a timeout also stops whatever the script started */
+    pid = spawn_cgi_script(cgi_script, &actions, env, 0);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(stdout_pipe[1]);
+    close(stdin_pipe[0]);
+
     if (pid < 0)
     {
-        fprintf(stderr, "Something really bad happened when fork()ing.\n");
+        close(stdin_pipe[1]);
+        close(stdout_pipe[0]);
         return LISO_ERROR;
     }
+    /*************** END SPAWN **************/
 
-    /* child, setup environment, execve */
-    if (pid == 0)
+    LISOPRINTF("Parent: Heading to select() loop.\n");
+
+    watch_child(pid);
+
+    /* body is streamed to stdin_pipe[1] by the caller as the script
+     * drains it, a full pipe never blocks the server */
+    c->body_fd = stdin_pipe[1];
+    c->body_fcgi = false;
+    fcntl(c->body_fd, F_SETFL, fcntl(c->body_fd, F_GETFL) | O_NONBLOCK);
+
+    int fd = add_cgi_client(c, stdout_pipe[0], false);
+    c->cgi_proc->cgi_pid = pid;
+    latency_since(LATENCY_CGI_SPAWN, spawn_start);
+    LISO_TRACE2(cgi_spawn, c->sock, pid);
+    return fd;
+}
+
+/**
+ * @brief Write request body bytes to the script serving a client without
+ * blocking
+ * 
+ * @param c client whose request is being served
+ * @param data body bytes
+ * @param len number of bytes
+ * @param written [out] bytes the script took
+ * @return ** int LISO_SUCCESS if everything was written, LISO_WOULD_BLOCK
+ * if the script stdin is full, LISO_ERROR if the script stopped reading
+ */
+int cgi_write_body(client *c, const char *data, int len, int *written)
+{
+    if (c->body_fcgi)
     {
-        /*************** BEGIN EXECVE ****************/
-        close(stdout_pipe[0]);
-        close(stdin_pipe[1]);
-        dup2(stdout_pipe[1], fileno(stdout));
-        dup2(stdin_pipe[0], fileno(stdin));
-        setpgid(getpid(), ppid);
-        /* you should probably do something with stderr */
+        return fcgi_send_stdin(c->body_fd, &c->body_writer, data, len, false, written);
+    }
 
-        /* pretty much no matter what, if it returns bad things happened... */
-        if (execve(cgi_script, arg, env))
+    *written = 0;
+    while (len > 0)
+    {
+        int ret = write(c->body_fd, data, len);
+        if (ret < 0)
         {
-            execve_error_handler();
-            fprintf(fp, "Error executing execve syscall with filename %s\n", cgi_script);
-            exit(-1);
+            return errno == EAGAIN ? LISO_WOULD_BLOCK : LISO_ERROR;
         }
-        /*************** END EXECVE ****************/ 
+        data += ret;
+        len -= ret;
+        *written += ret;
     }
+    return LISO_SUCCESS;
+}
 
-    if (pid > 0)
+/**
+ * @brief End the request body sent to the script, a pipe is closed and a
+ * worker gets the empty FCGI_STDIN record
+ * 
+ * @param c client whose request is being served
+ * @return ** int LISO_SUCCESS on success, LISO_WOULD_BLOCK if the end of
+ * the body can not be sent yet
+ */
+int cgi_end_body(client *c)
+{
+    if (c->body_fd >= 0 && c->body_fcgi)
     {
-        // free envp
-        fprintf(fp, "Parent: Heading to select() loop.\n");
-        close(stdout_pipe[1]);
-        close(stdin_pipe[0]);
-
-        if (write(stdin_pipe[1], req->message, req->message_len) < 0)
+        int written;
+        int ret = fcgi_send_stdin(c->body_fd, &c->body_writer, NULL, 0, true, &written);
+        if (ret == LISO_WOULD_BLOCK)
         {
-            fprintf(stderr, "Error writing to spawned CGI program.\n");
-            return EXIT_FAILURE;
+            return ret;
         }
+    }
+
+    cgi_close_body(c);
+    return LISO_SUCCESS;
+}
+
+/**
+ * @brief Stop sending the request body to the script
+ * 
+ * @param c client whose request is being served
+ * @return ** void 
+ */
+void cgi_close_body(client *c)
+{
+    if (c->body_fcgi)
+    {
+        // records the worker did not take are dropped with the body
+        fcgi_writer_release(&c->body_writer);
+    }
 
-        close(stdin_pipe[1]); /* finished writing to spawn */
-		close(stdin_pipe[1]);
+    if (c->body_fd < 0)
+    {
+        return;
+    }
 
-        client *cgi_client = malloc(sizeof(client));
-        cgi_client->sock = stdout_pipe[0];
-        cgi_client->cgi_host = c;
-        cgi_client->pipeline_flag = false;
+    close(c->body_fd);
+    c->body_fd = -1;
+    c->body_blocked = false;
+}
 
-        add_client(cgi_client);
+/**
+ * @brief Read script output without blocking, worker connections are
+ * non-blocking from the start
+ * 
+ * @param cgi_client node of the script output
+ * @param buf where to read to
+ * @param len size of buf
+ * @return ** int bytes read, 0 at EOF, negative on error
+ */
+static int read_cgi_output(client *cgi_client, char *buf, int len) {
+    if (cgi_client->fcgi != NULL)
+    {
+        return recv(cgi_client->sock, buf, len, MSG_DONTWAIT);
+    }
+    return read(cgi_client->sock, buf, len);
+}
+
+/**
+ * @brief Close the output of a CGI request once it is complete or nobody
+ * is waiting for it any more. A complete response leaves the connection
+ * open for the next request if its framing allows, otherwise the client
+ * gets error if it did not get a response head yet and is closed.
+ * 
+ * @param cgi_client node of the script output
+ * @param error LISO_SUCCESS if the script output ended normally, the error
+ * to reply with otherwise, LISO_CLOSE_CONN to close without a reply
+ * @return ** void 
+ */
+static void finish_cgi_output(client *cgi_client, int error) {
+    client *host = cgi_client->cgi_host;
+
+    close(cgi_client->sock);
+    cgi_load.active--;
+    if (cgi_client->fcgi != NULL)
+    {
+        fcgi_request_done(cgi_client->fcgi_worker);
+    }
+
+    if (host != NULL)
+    {
+        if (error == LISO_SUCCESS)
+        {
+            error = cgi_frame_end(cgi_client->frame, host);
+        }
 
-        for(int i = 0; i < ENV_NUM; i++) {
-            free(env[i]);
+        if (error != LISO_SUCCESS)
+        {
+            if (error != LISO_CLOSE_CONN && !cgi_client->frame->head_done)
+            {
+                send_error_response(host, error, NULL);
+            }
+            // the response could not be finished, its end is unknown
+            host->closing = true;
+        }
+        else if (!cgi_client->frame->keep_alive)
+        {
+            host->closing = true;
         }
+        host->cgi_proc = NULL;
+        access_log_end(host);
+        // carry on with requests pipelined behind this one
+        reinsert_client(host);
+    }
+
+    if (cgi_client->cache_fill != NULL)
+    {
+        cgi_cache_finish(cgi_client->cache_fill, error == LISO_SUCCESS);
+        cgi_client->cache_fill = NULL;
+    }
+
+    cgi_client->cgi_host = NULL;
+    delete_client(cgi_client);
+    free(cgi_client->fcgi);
+    free(cgi_client->frame);
+    free_client(cgi_client);
+}
+
+/**
+ * @brief Move script output from the stdout pipe straight to the client
+ * socket with splice(), the bytes never pass through user space. Only body
+ * bytes the framing passes on unchanged are moved.
+ * 
+ * @param cgi_client node of the script output, must be a pipe
+ * @param host client the output goes to, nothing may be queued for it
+ * @return ** int LISO_SUCCESS if bytes were moved, LISO_WOULD_BLOCK if the
+ * pipe is empty or the socket full, LISO_CGI_END at EOF, LISO_ERROR if the
+ * connection is broken
+ */
+static int splice_cgi_output(client *cgi_client, client *host) {
+    long len = cgi_frame_passthrough(cgi_client->frame);
+    if (len > config.tx_window)
+    {
+        len = config.tx_window;
+    }
+
+    ssize_t ret = splice(cgi_client->sock, NULL, host->sock, NULL,
+                         len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret > 0)
+    {
+        cgi_client->cgi_sent += ret;
+        host->access.bytes += ret;
+        stats.bytes_out += ret;
+        cgi_frame_passed(cgi_client->frame, ret);
+        return LISO_SUCCESS;
+    }
+
+    if (ret == 0)
+    {
+        return LISO_CGI_END;
+    }
+
+    if (errno != EAGAIN)
+    {
+        perror("splice recieved an error");
+        return LISO_ERROR;
+    }
 
-		return stdout_pipe[0];
-	}
+    // either the pipe is empty or the socket is full, a full socket has
+    // to drain before the script is read again
+    struct pollfd pfd = {.fd = host->sock, .events = POLLOUT};
+    if (poll(&pfd, 1, 0) == 0)
+    {
+        host->tx_blocked = true;
+    }
+    return LISO_WOULD_BLOCK;
+}
 
-    return LISO_ERROR;
+/**
+ * @brief Stop a CGI request before its output ended, the script is
+ * terminated, or the pool worker restarted if it is past cgi_timeout, and
+ * whatever it still writes is dropped
+ * 
+ * @param cgi_client node of the script output
+ * @param error error for a client that got no response head yet
+ * @return ** void 
+ */
+void cgi_abort_output(client *cgi_client, int error) {
+    if (cgi_client->cgi_pid > 0)
+    {
+        cgi_terminate(cgi_client->cgi_pid);
+    }
+    else if (cgi_client->fcgi != NULL && error == LISO_GATEWAY_TIMEOUT)
+    {
+        // the worker is stuck on the request, nothing else reaches it
+        fcgi_stop_worker(cgi_client->fcgi_worker);
+    }
+    finish_cgi_output(cgi_client, error);
 }
 
 /**
- * @brief Wrap up the CGI response started earlier and send the response back
- * to the client
+ * @brief Check a request against cgi_max_output, a request over it is
+ * aborted and its client closed since the response can not be completed
  * 
- * @param cgi_client the pipefd of CGI script
- * @return ** int LISO_SUCCESS on success negative otherwise
+ * @param cgi_client node of the script output
+ * @return ** int true if the request was aborted
  */
-int wrap_process_cgi(client *cgi_client) {
+static int output_over_limit(client *cgi_client) {
+    if (config.cgi_max_output == 0 || cgi_client->cgi_sent <= config.cgi_max_output)
+    {
+        return false;
+    }
+
+    LISO_LOG(LISO_LOG_WARN, "CGI output over %ld bytes, closing socket %d\n",
+            config.cgi_max_output, cgi_client->cgi_host->sock);
+    cgi_load.too_large++;
+    cgi_abort_output(cgi_client, LISO_BAD_GATEWAY);
+    return true;
+}
+
+/**
+ * @brief Forward script output that is ready to the client as it arrives,
+ * framed by cgi_frame. Reading stops once the client has tx_window bytes
+ * queued, the event loop does not poll the script again until the client
+ * caught up.
+ * 
+ * @param cgi_client node of the script output
+ * @return ** int LISO_CGI_END once the output is complete, LISO_SUCCESS if
+ * more is expected
+ */
+int forward_cgi_output(client *cgi_client) {
 
     assert(cgi_client != NULL);
-    assert(cgi_client->cgi_host != NULL);
-
-	int readret;
-	char *resp_buf = malloc(BUF_SIZE);
-    assert(resp_buf != NULL);
-    int resp_size = 0;
-    int incr = 2;
-
-	/* you want to be looping with select() telling you when to read */
-	while((readret = read(cgi_client->sock, resp_buf, BUF_SIZE-1)) > 0)
-	{
-        if(readret == BUF_SIZE-1) {
-            resp_buf = realloc(resp_buf, BUF_SIZE* incr);
-            assert(resp_buf != NULL);
-        }
-        resp_size+=readret;
-        resp_buf[resp_size] = '\0'; /* nul-terminate string */
-		LISOPRINTF(fp, "Got from CGI: %s\n", resp_buf);
-	}
-
-    LISOPRINTF(fp,"printing output of cgi script\n");
-    print_req_buf(resp_buf, resp_size);
-
-	close(cgi_client->sock);
-
-	if (readret == 0)
-	{
-		LISOPRINTF(fp, "CGI spawned process returned with EOF as expected.\n");
-	}
-
-	if (send(cgi_client->cgi_host->sock, resp_buf, resp_size, 0) != resp_size)
-	{
-		fprintf(stderr, "Error sending to client.\n");
-		perror("send recieved an error");
-		free(resp_buf);
-		return -1;
-	}
 
-    cgi_client->cgi_host = NULL;
-    delete_client(cgi_client);
-    free(cgi_client);
+    char buf[BUF_SIZE];
+    client *host = cgi_client->cgi_host;
+
+    if (host == NULL)
+    {
+        // the client went away while the script was running
+        LISOPRINTF("dropping CGI output, client closed\n");
+        finish_cgi_output(cgi_client, LISO_CLOSE_CONN);
+        return LISO_CGI_END;
+    }
+
+    while (host->out_len < config.tx_window && !host->tx_blocked)
+    {
+        if (cgi_client->splice && host->out_len == 0 &&
+            cgi_frame_passthrough(cgi_client->frame) > 0)
+        {
+            int ret = splice_cgi_output(cgi_client, host);
+            if (ret == LISO_SUCCESS)
+            {
+                if (output_over_limit(cgi_client))
+                {
+                    return LISO_CGI_END;
+                }
+                // output is flowing, neither end is idle
+                reinsert_client(host);
+                continue;
+            }
+            if (ret == LISO_WOULD_BLOCK)
+            {
+                reinsert_client(cgi_client);
+                return LISO_SUCCESS;
+            }
+            finish_cgi_output(cgi_client, ret == LISO_CGI_END ? LISO_SUCCESS : LISO_CLOSE_CONN);
+            return LISO_CGI_END;
+        }
+
+        int readret = read_cgi_output(cgi_client, buf, sizeof(buf));
+        if (readret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        {
+            // nothing more right now
+            reinsert_client(cgi_client);
+            return LISO_SUCCESS;
+        }
+
+        if (readret <= 0)
+        {
+            LISOPRINTF("CGI spawned process returned with EOF as expected.\n");
+            // a worker has to end its request with FCGI_END_REQUEST
+            int complete = readret == 0 && cgi_client->fcgi == NULL;
+            finish_cgi_output(cgi_client, complete ? LISO_SUCCESS : LISO_BAD_GATEWAY);
+            return LISO_CGI_END;
+        }
+
+        if (cgi_client->fcgi != NULL)
+        {
+            // keep only what the worker wrote to FCGI_STDOUT
+            readret = fcgi_decode(cgi_client->fcgi, buf, readret);
+            if (readret < 0)
+            {
+                LISOPRINTF("bad record from CGI worker\n");
+                finish_cgi_output(cgi_client, LISO_BAD_GATEWAY);
+                return LISO_CGI_END;
+            }
+        }
 
-    free(resp_buf);
+        LISOPRINTF("Got from CGI: %.*s\n", readret, buf);
+        if (cgi_client->cgi_sent == 0 && readret > 0)
+        {
+            latency_since(LATENCY_CGI_FIRST_OUTPUT, cgi_client->cgi_started);
+        }
+        cgi_client->cgi_sent += readret;
+        if (output_over_limit(cgi_client))
+        {
+            return LISO_CGI_END;
+        }
+
+        if (cgi_client->cache_fill != NULL)
+        {
+            cgi_cache_append(cgi_client->cache_fill, buf, readret);
+        }
+
+        int ret = cgi_frame_output(cgi_client->frame, host, buf, readret);
+        if (ret != LISO_SUCCESS)
+        {
+            LISOPRINTF("CGI output not sent, error %d\n", ret);
+            cgi_abort_output(cgi_client, ret);
+            return LISO_CGI_END;
+        }
+        reinsert_client(host);
+
+        if (cgi_client->fcgi != NULL && cgi_client->fcgi->done)
+        {
+            finish_cgi_output(cgi_client, LISO_SUCCESS);
+            return LISO_CGI_END;
+        }
+    }
+
+    reinsert_client(cgi_client);
     return LISO_SUCCESS;
-}
\ No newline at end of file
+}
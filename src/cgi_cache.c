@@ -0,0 +1,645 @@
+/**
+ * @file cgi_cache.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Cache of CGI GET responses
+ *
+ * Output of a GET request to the CGI script is kept when the script marks
+ * it cacheable with Cache-Control max-age (or s-maxage), later requests
+ * for the same method and URI are answered from memory until it expires.
+ * Responses with no-store, no-cache or private, a status other than 200 or
+ * Vary: * are never kept. For other Vary headers the request values are
+ * stored with the response, every set of values is a variant with an
+ * entry of its own under the same key.
+ *
+ * A miss leaves a filling entry in the table. Requests for the same key
+ * that arrive while the script runs wait on the entry instead of starting
+ * scripts of their own, unless a stored variant shows the response varies
+ * on headers they differ in. They are woken once the fill ends and either
+ * look up the new response again or, if it could not be cached, all go to
+ * the script at once.
+ *
+ * All responses together use at most cgi_cache_bytes, the least recently
+ * used ones are evicted to make room.
+ *
+ * @version 0.1
+ * @date 2021-10-28
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include "liso.h"
+#include "cgi_cache.h"
+
+// Globals
+cgi_cache_stats cgi_cache_load;
+
+static cgi_cache_entry *buckets[CGI_CACHE_BUCKETS];
+static cgi_cache_entry *lru_head = NULL;
+static cgi_cache_entry *lru_tail = NULL;
+
+// waiters whose fill ended, linked through cgi_next
+static client *woken_head = NULL;
+static client *woken_tail = NULL;
+
+/**
+ * @brief FNV-1a hash of a string
+ *
+ * @param str string to hash
+ * @return ** unsigned int hash
+ */
+static unsigned int hash_key(const char *str) {
+	unsigned int hash = 2166136261u;
+	while(*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @brief Flatten the headers of a request to "name:value\n" lines with
+ * lower case names, Vary is matched against these
+ *
+ * @param req request to take the headers from
+ * @return ** char* allocated string, NULL if out of memory
+ */
+static char* flatten_headers(Request *req) {
+	long size = 1;
+	for(int i = 0; i < req->header_count; i++) {
+		size += strlen(req->headers[i].header_name) + strlen(req->headers[i].header_value) + 2;
+	}
+
+	char *out = malloc(size);
+	if(out == NULL) {
+		return NULL;
+	}
+
+	char *w = out;
+	for(int i = 0; i < req->header_count; i++) {
+		for(char *n = req->headers[i].header_name; *n; n++) {
+			*w++ = tolower((unsigned char)*n);
+		}
+		w += sprintf(w, ":%s\n", req->headers[i].header_value);
+	}
+	*w = '\0';
+	return out;
+}
+
+/**
+ * @brief Check whether a "name:value\n" list already holds a name
+ *
+ * @param lines lines written so far
+ * @param name lower case header name
+ * @param len length of name
+ * @return ** int true if a line starts with name
+ */
+static int has_name(const char *lines, const char *name, int len) {
+	for(const char *line = lines; *line; line = strchr(line, '\n') + 1) {
+		if(strncmp(line, name, len) == 0 && line[len] == ':') {
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Pick the values of the headers named in a Vary header out of
+ * flattened request headers
+ *
+ * Names may be separated by commas or white space, a name listed more
+ * than once is picked once.
+ *
+ * @param vary comma separated header names
+ * @param headers flattened request headers
+ * @return ** char* allocated "name:value\n" lines in Vary order, NULL if
+ * out of memory
+ */
+static char* select_vary(const char *vary, const char *headers) {
+	long size = 64;
+	long used = 0;
+	char *out = malloc(size);
+	if(out == NULL) {
+		return NULL;
+	}
+	out[0] = '\0';
+
+	const char *p = vary;
+	while(*p) {
+		while(*p == ',' || *p == ' ' || *p == '\t') {
+			p++;
+		}
+		const char *end = p;
+		while(*end && *end != ',' && *end != ' ' && *end != '\t') {
+			end++;
+		}
+		if(end == p) {
+			break;
+		}
+
+		char name[HTTP_TOKEN_SIZE];
+		int len = end - p < HTTP_TOKEN_SIZE - 1 ? end - p : HTTP_TOKEN_SIZE - 1;
+		for(int i = 0; i < len; i++) {
+			name[i] = tolower((unsigned char)p[i]);
+		}
+		name[len] = '\0';
+		p = end;
+
+		if(has_name(out, name, len)) {
+			continue;
+		}
+
+		// a missing header matches only a missing header
+		const char *value = "";
+		int value_len = 0;
+		for(const char *line = headers; *line; line = strchr(line, '\n') + 1) {
+			if(strncmp(line, name, len) == 0 && line[len] == ':') {
+				value = line + len + 1;
+				value_len = strchr(value, '\n') - value;
+				break;
+			}
+		}
+
+		// grow for "name:value\n" and the terminator
+		long need = used + len + value_len + 3;
+		if(need > size) {
+			while(size < need) {
+				size *= 2;
+			}
+			char *grown = realloc(out, size);
+			if(grown == NULL) {
+				free(out);
+				return NULL;
+			}
+			out = grown;
+		}
+
+		memcpy(out + used, name, len);
+		used += len;
+		out[used++] = ':';
+		memcpy(out + used, value, value_len);
+		used += value_len;
+		out[used++] = '\n';
+		out[used] = '\0';
+	}
+	return out;
+}
+
+/**
+ * @brief Check whether a request gets a variant of a response
+ *
+ * @param vary Vary header of the response
+ * @param values request values the variant was stored for, or the
+ * flattened request headers of a fill
+ * @param filling true if values are flattened request headers
+ * @param req the request
+ * @param headers [in,out] flattened headers of req, made on first use
+ * @return ** int true if the variant matches, false otherwise or if out
+ * of memory
+ */
+static int variant_matches(const char *vary, const char *values, int filling,
+						   Request *req, char **headers) {
+	if(*headers == NULL) {
+		*headers = flatten_headers(req);
+		if(*headers == NULL) {
+			return false;
+		}
+	}
+
+	char *mine = select_vary(vary, *headers);
+	char *theirs = filling ? select_vary(vary, values) : NULL;
+	if(filling) {
+		values = theirs;
+	}
+	int match = mine != NULL && values != NULL && strcmp(mine, values) == 0;
+	free(mine);
+	free(theirs);
+	return match;
+}
+
+/**
+ * @brief Remove an entry from the LRU list
+ *
+ * @param e entry to remove
+ * @return ** void
+ */
+static void lru_unlink(cgi_cache_entry *e) {
+	if(e->lru_prev != NULL) {
+		e->lru_prev->lru_next = e->lru_next;
+	} else if(lru_head == e) {
+		lru_head = e->lru_next;
+	}
+	if(e->lru_next != NULL) {
+		e->lru_next->lru_prev = e->lru_prev;
+	} else if(lru_tail == e) {
+		lru_tail = e->lru_prev;
+	}
+	e->lru_prev = e->lru_next = NULL;
+}
+
+/**
+ * @brief Make an entry the most recently used
+ *
+ * @param e entry to move
+ * @return ** void
+ */
+static void lru_push(cgi_cache_entry *e) {
+	e->lru_next = lru_head;
+	if(lru_head != NULL) {
+		lru_head->lru_prev = e;
+	}
+	lru_head = e;
+	if(lru_tail == NULL) {
+		lru_tail = e;
+	}
+}
+
+/**
+ * @brief Bytes an entry is charged against cgi_cache_bytes
+ *
+ * @param e entry
+ * @return ** long size
+ */
+static long entry_size(cgi_cache_entry *e) {
+	return e->len + strlen(e->key) + sizeof(cgi_cache_entry);
+}
+
+/**
+ * @brief Take an entry out of the cache and free it, the entry must not
+ * have waiters
+ *
+ * @param e entry to drop
+ * @return ** void
+ */
+static void drop_entry(cgi_cache_entry *e) {
+	cgi_cache_entry **link = &buckets[e->hash % CGI_CACHE_BUCKETS];
+	while(*link != e) {
+		link = &(*link)->hnext;
+	}
+	*link = e->hnext;
+
+	if(!e->filling) {
+		// only complete responses are in the LRU and charged
+		lru_unlink(e);
+		cgi_cache_load.bytes -= entry_size(e);
+	}
+
+	free(e->key);
+	free(e->vary);
+	free(e->vary_values);
+	free(e->response);
+	free(e);
+}
+
+/**
+ * @brief Move the requests waiting on a fill to the woken list
+ *
+ * @param e entry whose fill ended
+ * @param stored true if the response was cached
+ * @return ** void
+ */
+static void wake_waiters(cgi_cache_entry *e, int stored) {
+	while(e->waiters != NULL) {
+		client *c = e->waiters;
+		e->waiters = c->cgi_next;
+
+		c->cache_wait = NULL;
+		c->cache_woken = stored ? CACHE_WOKEN_HIT : CACHE_WOKEN_PASS;
+		c->cgi_next = NULL;
+		if(woken_tail == NULL) {
+			woken_head = c;
+		} else {
+			woken_tail->cgi_next = c;
+		}
+		woken_tail = c;
+	}
+}
+
+/**
+ * @brief Look up the response for a request
+ *
+ * @param c client that sent the request
+ * @param req the request
+ * @param entry [out] cached response on a hit, entry to fill on a miss,
+ * NULL if the response is not going to be cached
+ * @return ** int LISO_SUCCESS on a hit, LISO_WOULD_BLOCK if c now waits
+ * for another run of the script, LISO_LOAD_FAILED on a miss
+ */
+int cgi_cache_lookup(client *c, Request *req, cgi_cache_entry **entry) {
+	char key[HTTP_TOKEN_SIZE + HTTP_FIELD_SIZE + 1];
+
+	*entry = NULL;
+	if(config.cgi_cache_bytes == 0 || strcasecmp(req->http_method, "GET") != 0) {
+		return LISO_LOAD_FAILED;
+	}
+
+	snprintf(key, sizeof(key), "%s %s", req->http_method, req->http_uri);
+	unsigned int hash = hash_key(key);
+	time_t now = time(NULL);
+	char *headers = NULL;			// flattened request headers, once needed
+	const char *vary = NULL;		// Vary of a stored variant of the key
+	cgi_cache_entry *e, *next;
+
+	for(e = buckets[hash % CGI_CACHE_BUCKETS]; e != NULL; e = next) {
+		next = e->hnext;
+		if(e->filling || e->hash != hash || strcmp(e->key, key) != 0) {
+			continue;
+		}
+		if(now >= e->expires) {
+			drop_entry(e);
+			continue;
+		}
+
+		if(e->vary == NULL || variant_matches(e->vary, e->vary_values, false, req, &headers)) {
+			free(headers);
+			lru_unlink(e);
+			lru_push(e);
+			cgi_cache_load.hits++;
+			*entry = e;
+			return LISO_SUCCESS;
+		}
+		vary = e->vary;
+	}
+
+	/* the script is running for this key already, wait for it unless a
+	 * stored variant shows the two requests get different responses */
+	for(e = buckets[hash % CGI_CACHE_BUCKETS]; e != NULL; e = e->hnext) {
+		if(!e->filling || e->hash != hash || strcmp(e->key, key) != 0) {
+			continue;
+		}
+		if(vary != NULL && !variant_matches(vary, e->vary_values, true, req, &headers)) {
+			continue;
+		}
+
+		free(headers);
+		c->cache_wait = e;
+		c->cgi_next = NULL;
+		client **tail = &e->waiters;
+		while(*tail != NULL) {
+			tail = &(*tail)->cgi_next;
+		}
+		*tail = c;
+		cgi_cache_load.coalesced++;
+		return LISO_WOULD_BLOCK;
+	}
+	cgi_cache_load.misses++;
+
+	e = calloc(1, sizeof(cgi_cache_entry));
+	if(e == NULL) {
+		free(headers);
+		return LISO_LOAD_FAILED;
+	}
+	e->key = strdup(key);
+	// the request headers are kept until the response says which vary
+	e->vary_values = headers != NULL ? headers : flatten_headers(req);
+	if(e->key == NULL || e->vary_values == NULL) {
+		free(e->key);
+		free(e->vary_values);
+		free(e);
+		return LISO_LOAD_FAILED;
+	}
+	e->hash = hash;
+	e->filling = true;
+	e->storing = true;
+	e->hnext = buckets[hash % CGI_CACHE_BUCKETS];
+	buckets[hash % CGI_CACHE_BUCKETS] = e;
+
+	*entry = e;
+	return LISO_LOAD_FAILED;
+}
+
+/**
+ * @brief Add script output to an entry being filled, a response that
+ * grows past cgi_cache_bytes is not kept
+ *
+ * @param entry entry being filled
+ * @param buf output bytes
+ * @param len number of bytes
+ * @return ** void
+ */
+void cgi_cache_append(cgi_cache_entry *entry, const char *buf, int len) {
+	if(!entry->storing) {
+		return;
+	}
+
+	if(entry->len + len > config.cgi_cache_bytes) {
+		LISOPRINTF("%s response of %s too large to cache\n", __func__, entry->key);
+		entry->storing = false;
+		free(entry->response);
+		entry->response = NULL;
+		entry->len = entry->cap = 0;
+		return;
+	}
+
+	if(entry->len + len > entry->cap) {
+		long cap = entry->cap == 0 ? BUF_SIZE : entry->cap;
+		while(cap < entry->len + len) {
+			cap *= 2;
+		}
+		char *response = realloc(entry->response, cap);
+		if(response == NULL) {
+			entry->storing = false;
+			return;
+		}
+		entry->response = response;
+		entry->cap = cap;
+	}
+
+	memcpy(entry->response + entry->len, buf, len);
+	entry->len += len;
+}
+
+/**
+ * @brief Check the header block of a response for status, Cache-Control
+ * and Vary. Both NPH output with a status line and plain CGI headers with
+ * an optional Status header are understood.
+ *
+ * @param e filled entry
+ * @return ** long seconds the response stays fresh, 0 if it must not be
+ * cached
+ */
+static long response_max_age(cgi_cache_entry *e) {
+	int status = 200;
+	long max_age = 0;
+	long s_maxage = -1;
+	char line[HTTP_FIELD_SIZE];
+
+	long pos = 0;
+	while(pos < e->len) {
+		char *nl = memchr(e->response + pos, '\n', e->len - pos);
+		if(nl == NULL) {
+			// header block never ended
+			return 0;
+		}
+
+		long line_len = nl - (e->response + pos);
+		if(line_len > 0 && nl[-1] == '\r') {
+			line_len--;
+		}
+		if(line_len == 0) {
+			break;
+		}
+		if(line_len >= HTTP_FIELD_SIZE) {
+			line_len = HTTP_FIELD_SIZE - 1;
+		}
+		memcpy(line, e->response + pos, line_len);
+		line[line_len] = '\0';
+		int first = pos == 0;
+		pos = nl - e->response + 1;
+
+		char *value = strchr(line, ':');
+		if(first && strncmp(line, "HTTP/", 5) == 0) {
+			char *code = strchr(line, ' ');
+			status = code == NULL ? 0 : atoi(code + 1);
+			continue;
+		}
+		if(value == NULL) {
+			continue;
+		}
+		*value++ = '\0';
+		while(*value == ' ' || *value == '\t') {
+			value++;
+		}
+
+		if(strcasecmp(line, "Status") == 0) {
+			status = atoi(value);
+		} else if(strcasecmp(line, "Vary") == 0) {
+			if(strchr(value, '*') != NULL) {
+				return 0;
+			}
+			free(e->vary);
+			e->vary = strdup(value);
+			if(e->vary == NULL) {
+				return 0;
+			}
+		} else if(strcasecmp(line, "Cache-Control") == 0) {
+			for(char *tok = strtok(value, ", \t"); tok != NULL; tok = strtok(NULL, ", \t")) {
+				if(strcasecmp(tok, "no-store") == 0 || strcasecmp(tok, "no-cache") == 0 ||
+				   strcasecmp(tok, "private") == 0) {
+					return 0;
+				}
+				if(strncasecmp(tok, "max-age=", 8) == 0) {
+					max_age = atol(tok + 8);
+				} else if(strncasecmp(tok, "s-maxage=", 9) == 0) {
+					s_maxage = atol(tok + 9);
+				}
+			}
+		}
+	}
+
+	if(status != 200) {
+		return 0;
+	}
+
+	// Liso is a shared cache, s-maxage wins over max-age
+	return s_maxage >= 0 ? s_maxage : max_age;
+}
+
+/**
+ * @brief End the fill of an entry, the response is kept if the script
+ * finished and marked it cacheable, requests waiting on it are woken
+ *
+ * @param entry entry being filled
+ * @param complete true if the script output ended normally
+ * @return ** void
+ */
+void cgi_cache_finish(cgi_cache_entry *entry, int complete) {
+	long max_age = complete && entry->storing ? response_max_age(entry) : 0;
+	char *values = NULL;
+	if(max_age > 0) {
+		values = entry->vary == NULL ? strdup("") : select_vary(entry->vary, entry->vary_values);
+	}
+
+	wake_waiters(entry, values != NULL);
+	if(values == NULL) {
+		drop_entry(entry);
+		return;
+	}
+	free(entry->vary_values);
+	entry->vary_values = values;
+
+	entry->filling = false;
+	entry->expires = time(NULL) + max_age;
+
+	// the same variant stored by a run that ended earlier is replaced
+	cgi_cache_entry *next;
+	for(cgi_cache_entry *e = buckets[entry->hash % CGI_CACHE_BUCKETS]; e != NULL; e = next) {
+		next = e->hnext;
+		if(e != entry && !e->filling && e->hash == entry->hash &&
+		   strcmp(e->key, entry->key) == 0 && strcmp(e->vary_values, values) == 0) {
+			drop_entry(e);
+		}
+	}
+
+	// make room, least recently used first
+	long size = entry_size(entry);
+	while(lru_tail != NULL && cgi_cache_load.bytes + size > config.cgi_cache_bytes) {
+		cgi_cache_load.evicted++;
+		drop_entry(lru_tail);
+	}
+
+	lru_push(entry);
+	cgi_cache_load.bytes += size;
+	cgi_cache_load.stored++;
+	LISOPRINTF("%s cached %s for %ld seconds\n", __func__, entry->key, max_age);
+}
+
+/**
+ * @brief Forget a request that waits on a fill or was woken but not
+ * dispatched yet, e.g. when its client closes
+ *
+ * @param c client of the request
+ * @return ** void
+ */
+void cgi_cache_cancel_wait(client *c) {
+	client **list;
+	client *prev = NULL;
+
+	if(c->cache_wait != NULL) {
+		list = &c->cache_wait->waiters;
+	} else if(c->cache_woken) {
+		list = &woken_head;
+	} else {
+		return;
+	}
+
+	for(client **link = list; *link != NULL; prev = *link, link = &(*link)->cgi_next) {
+		if(*link == c) {
+			*link = c->cgi_next;
+			break;
+		}
+	}
+	if(c->cache_woken && woken_tail == c) {
+		woken_tail = prev;
+	}
+
+	c->cache_wait = NULL;
+	c->cache_woken = false;
+	c->cgi_next = NULL;
+}
+
+/**
+ * @brief Take the next request whose fill ended
+ *
+ * @param pass [out] true if the fill was not cached and the request should
+ * go to the script without another lookup
+ * @return ** client* client of the request, NULL if there is none
+ */
+client* cgi_cache_next_woken(int *pass) {
+	client *c = woken_head;
+	if(c == NULL) {
+		return NULL;
+	}
+
+	*pass = c->cache_woken == CACHE_WOKEN_PASS;
+	woken_head = c->cgi_next;
+	if(woken_head == NULL) {
+		woken_tail = NULL;
+	}
+	c->cgi_next = NULL;
+	c->cache_woken = false;
+	return c;
+}
@@ -0,0 +1,521 @@
+/**
+ * @file cgi_frame.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Framing of CGI script output in to HTTP/1.1 responses
+ *
+ * A script starts its output with a header block, either CGI headers with
+ * an optional Status (and Location) header or, for NPH scripts, a full
+ * status line and headers. The block is collected and parsed, the client
+ * gets a response head written by Liso with the status of the script, its
+ * headers and the framing of the body. Connection, Keep-Alive and
+ * Content-Length of the script are replaced.
+ *
+ * With a Content-Length from the script exactly that many body bytes are
+ * passed on, otherwise the body is sent chunked so that the end of the
+ * response is known and the connection stays open for the next request.
+ * Only HTTP/1.0 clients and scripts that send their own Transfer-Encoding
+ * get a body that ends by closing the connection.
+ *
+ * @version 0.1
+ * @date 2021-10-30
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <time.h>
+#include "liso.h"
+#include "cgi_frame.h"
+#include "lisotrace.h"
+
+// Globals
+extern const char LISO_NAME[];
+
+#define CGI_FRAME_CHUNK (4 * BUF_SIZE)		// max body bytes in one chunk
+
+// response head, each script header grows by at most ": " and "\r",
+// followed by the body bytes that came with the header block
+static char head_fields[2 * CGI_HEAD_MAX];
+static char head_out[2 * CGI_HEAD_MAX + BUF_SIZE];
+
+// a chunk with its size line and CRLF, sent in one go
+static char chunk_buf[CGI_FRAME_CHUNK + 16];
+
+/**
+ * @brief Reason phrase for a status the script gave without one
+ *
+ * @param code status code
+ * @return ** const char* reason, "" if unknown
+ */
+static const char* status_reason(int code) {
+	switch(code) {
+	case 200: return "OK";
+	case 201: return "Created";
+	case 204: return "No Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 303: return "See Other";
+	case 304: return "Not Modified";
+	case 307: return "Temporary Redirect";
+	case 400: return "Bad Request";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 500: return "Internal Server Error";
+	case 503: return "Service Unavailable";
+	default: return "";
+	}
+}
+
+/**
+ * @brief Check a header name of the script output
+ *
+ * @param name start of the name
+ * @param len length of the name
+ * @param want name to compare with
+ * @return ** int true if they match, ignoring case
+ */
+static int name_is(const char *name, int len, const char *want) {
+	return len == (int)strlen(want) && strncasecmp(name, want, len) == 0;
+}
+
+/**
+ * @brief Append to a response head buffer
+ *
+ * @param out buffer
+ * @param size size of buffer
+ * @param count [in,out] bytes used in buffer
+ * @param fmt printf format
+ * @return ** int LISO_SUCCESS, LISO_BAD_GATEWAY if it does not fit
+ */
+static int head_printf(char *out, int size, int *count, const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	int n = vsnprintf(out + *count, size - *count, fmt, args);
+	va_end(args);
+
+	if(n < 0 || n >= size - *count) {
+		return LISO_BAD_GATEWAY;
+	}
+	*count += n;
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Find the blank line that ends the header block, LF and CRLF line
+ * ends are both accepted
+ *
+ * @param f framing state
+ * @param from offset to start looking at
+ * @return ** int offset of the first body byte, -1 if the block has not
+ * ended yet
+ */
+static int find_head_end(cgi_frame *f, int from) {
+	if(from == 0 && f->head_len >= 1 && f->head[0] == '\n') {
+		return 1;
+	}
+	if(from == 0 && f->head_len >= 2 && f->head[0] == '\r' && f->head[1] == '\n') {
+		return 2;
+	}
+
+	for(int i = from; i < f->head_len; i++) {
+		if(f->head[i] != '\n') {
+			continue;
+		}
+		if(i + 1 < f->head_len && f->head[i + 1] == '\n') {
+			return i + 2;
+		}
+		if(i + 2 < f->head_len && f->head[i + 1] == '\r' && f->head[i + 2] == '\n') {
+			return i + 3;
+		}
+	}
+	return -1;
+}
+
+/**
+ * @brief Parse the header block of the script and write the response head
+ * to head_out, the framing of the body is decided here
+ *
+ * @param f framing state
+ * @param end length of the header block
+ * @param head_len [out] bytes of the response head
+ * @return ** int LISO_SUCCESS, LISO_BAD_GATEWAY if the header block is
+ * malformed
+ */
+static int build_head(cgi_frame *f, int end, int *head_len) {
+	const char *status = NULL;
+	int status_len = 0;
+	long content_length = -1;
+	int location = false;
+	int script_framed = false;
+	int has_server = false;
+	int has_date = false;
+	int fields = 0;
+
+	int pos = 0;
+	int first = true;
+	while(pos < end) {
+		const char *line = f->head + pos;
+		const char *nl = memchr(line, '\n', end - pos);
+		int line_len = nl - line;
+		if(line_len > 0 && line[line_len - 1] == '\r') {
+			line_len--;
+		}
+		pos = nl - f->head + 1;
+		if(line_len == 0) {
+			break;
+		}
+
+		if(first && line_len > 5 && strncmp(line, "HTTP/", 5) == 0) {
+			// NPH status line, version SP code SP reason
+			const char *sp = memchr(line, ' ', line_len);
+			if(sp == NULL) {
+				return LISO_BAD_GATEWAY;
+			}
+			status = sp + 1;
+			status_len = line + line_len - status;
+			first = false;
+			continue;
+		}
+		first = false;
+
+		const char *colon = memchr(line, ':', line_len);
+		if(colon == NULL || colon == line) {
+			return LISO_BAD_GATEWAY;
+		}
+		int name_len = colon - line;
+		const char *value = colon + 1;
+		int value_len = line + line_len - value;
+		while(value_len > 0 && (*value == ' ' || *value == '\t')) {
+			value++;
+			value_len--;
+		}
+		while(value_len > 0 && (value[value_len - 1] == ' ' || value[value_len - 1] == '\t')) {
+			value_len--;
+		}
+
+		if(name_is(line, name_len, "Status")) {
+			status = value;
+			status_len = value_len;
+			continue;
+		}
+		if(name_is(line, name_len, "Content-Length")) {
+			char digits[HTTP_TOKEN_SIZE];
+			char *stop;
+			if(value_len == 0 || value_len >= HTTP_TOKEN_SIZE) {
+				return LISO_BAD_GATEWAY;
+			}
+			memcpy(digits, value, value_len);
+			digits[value_len] = '\0';
+			content_length = strtol(digits, &stop, 10);
+			if(*stop != '\0' || content_length < 0 || content_length == LONG_MAX) {
+				return LISO_BAD_GATEWAY;
+			}
+			continue;
+		}
+		if(name_is(line, name_len, "Connection") || name_is(line, name_len, "Keep-Alive")) {
+			// hop by hop, Liso decides about the connection
+			continue;
+		}
+
+		if(name_is(line, name_len, "Transfer-Encoding")) {
+			script_framed = true;
+		} else if(name_is(line, name_len, "Location")) {
+			location = true;
+		} else if(name_is(line, name_len, "Server")) {
+			has_server = true;
+		} else if(name_is(line, name_len, "Date")) {
+			has_date = true;
+		}
+
+		if(head_printf(head_fields, sizeof(head_fields), &fields, "%.*s: %.*s\r\n",
+					   name_len, line, value_len, value) != LISO_SUCCESS) {
+			return LISO_BAD_GATEWAY;
+		}
+	}
+
+	// status, a Location alone redirects
+	char status_buf[HTTP_TOKEN_SIZE];
+	if(status == NULL) {
+		snprintf(status_buf, sizeof(status_buf), "%s", location ? "302 Found" : "200 OK");
+	} else {
+		if(status_len >= HTTP_TOKEN_SIZE) {
+			status_len = HTTP_TOKEN_SIZE - 1;
+		}
+		memcpy(status_buf, status, status_len);
+		status_buf[status_len] = '\0';
+	}
+	int code = atoi(status_buf);
+	if(code < 100 || code > 599) {
+		return LISO_BAD_GATEWAY;
+	}
+	if(strchr(status_buf, ' ') == NULL) {
+		snprintf(status_buf, sizeof(status_buf), "%d %s", code, status_reason(code));
+	}
+
+	f->status = code;
+
+	if(f->head_only || code < 200 || code == 204 || code == 304) {
+		// the response has no body whatever the script writes
+		f->head_only = true;
+	}
+
+	int count = 0;
+	head_printf(head_out, sizeof(head_out), &count, "HTTP/1.1 %s\r\n", status_buf);
+	if(!has_server) {
+		head_printf(head_out, sizeof(head_out), &count, "Server: %s\r\n", LISO_NAME);
+	}
+	if(!has_date) {
+		char date[HTTP_TOKEN_SIZE];
+		time_t now = time(NULL);
+		struct tm tm = *gmtime(&now);
+		strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S %Z", &tm);
+		head_printf(head_out, sizeof(head_out), &count, "Date: %s\r\n", date);
+	}
+	head_printf(head_out, sizeof(head_out), &count, "%.*s", fields, head_fields);
+
+	if(script_framed) {
+		// the body is already encoded by the script, it ends at EOF
+		f->framing = CGI_FRAME_CLOSE;
+		f->keep_alive = false;
+	} else if(content_length >= 0) {
+		f->framing = CGI_FRAME_LENGTH;
+		f->body_left = content_length;
+		head_printf(head_out, sizeof(head_out), &count, "Content-Length: %ld\r\n", content_length);
+	} else if(f->head_only) {
+		f->framing = CGI_FRAME_NONE;
+	} else if(f->http11) {
+		f->framing = CGI_FRAME_CHUNKED;
+		head_printf(head_out, sizeof(head_out), &count, "Transfer-Encoding: chunked\r\n");
+	} else {
+		f->framing = CGI_FRAME_CLOSE;
+		f->keep_alive = false;
+	}
+
+	if(head_printf(head_out, sizeof(head_out), &count, "Connection: %s\r\n\r\n",
+				   f->keep_alive ? "keep-alive" : "close") != LISO_SUCCESS) {
+		return LISO_BAD_GATEWAY;
+	}
+
+	LISOPRINTF("%s status %d framing %d\n", __func__, code, f->framing);
+	*head_len = count;
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Frame body bytes of the script in to out
+ *
+ * @param f framing state
+ * @param buf body bytes
+ * @param len number of bytes, at most CGI_FRAME_CHUNK
+ * @param out where the framed bytes go, len + 16 bytes at least
+ * @return ** int number of bytes written to out
+ */
+static int frame_body(cgi_frame *f, const char *buf, int len, char *out) {
+	if(len == 0 || f->head_only) {
+		return 0;
+	}
+
+	switch(f->framing) {
+	case CGI_FRAME_LENGTH:
+		// anything past Content-Length is dropped
+		len = len < f->body_left ? len : f->body_left;
+		f->body_left -= len;
+		memcpy(out, buf, len);
+		return len;
+	case CGI_FRAME_CLOSE:
+		memcpy(out, buf, len);
+		return len;
+	case CGI_FRAME_CHUNKED: {
+		int size = sprintf(out, "%x\r\n", len);
+		memcpy(out + size, buf, len);
+		memcpy(out + size + len, "\r\n", 2);
+		return size + len + 2;
+	}
+	default:
+		return 0;
+	}
+}
+
+/**
+ * @brief Pass body bytes of the script on to the client in the framing of
+ * the response
+ *
+ * @param f framing state
+ * @param host client the response goes to
+ * @param buf body bytes
+ * @param len number of bytes
+ * @return ** int LISO_SUCCESS, LISO_CLOSE_CONN if the client connection is
+ * broken
+ */
+static int send_body(cgi_frame *f, client *host, const char *buf, int len) {
+	int ret = LISO_SUCCESS;
+
+	if(len == 0 || f->head_only) {
+		return LISO_SUCCESS;
+	}
+
+	switch(f->framing) {
+	case CGI_FRAME_LENGTH: {
+		// anything past Content-Length is dropped
+		int n = len < f->body_left ? len : f->body_left;
+		f->body_left -= n;
+		if(n > 0) {
+			ret = client_send(host, buf, n);
+		}
+		break;
+	}
+	case CGI_FRAME_CLOSE:
+		ret = client_send(host, buf, len);
+		break;
+	case CGI_FRAME_CHUNKED:
+		while(len > 0 && ret == LISO_SUCCESS) {
+			int n = len < CGI_FRAME_CHUNK ? len : CGI_FRAME_CHUNK;
+			ret = client_send(host, chunk_buf, frame_body(f, buf, n, chunk_buf));
+			buf += n;
+			len -= n;
+		}
+		break;
+	default:
+		break;
+	}
+
+	return ret == LISO_SUCCESS ? LISO_SUCCESS : LISO_CLOSE_CONN;
+}
+
+/**
+ * @brief Start framing the output of a script for a request
+ *
+ * @param f framing state
+ * @param req request the script answers
+ * @return ** void
+ */
+void cgi_frame_init(cgi_frame *f, Request *req) {
+	f->head_done = false;
+	f->framing = CGI_FRAME_NONE;
+	f->status = 0;
+	f->body_left = 0;
+	f->head_len = 0;
+	f->head_only = strcasecmp(req->http_method, "HEAD") == 0;
+	f->http11 = strcasecmp(req->http_version, "HTTP/1.1") == 0;
+
+	if(f->http11) {
+		f->keep_alive = get_conn_header(req) != LISO_CLOSE_CONN;
+	} else {
+		// HTTP/1.0 closes unless asked not to
+		char *conn = get_header(req, "Connection");
+		f->keep_alive = conn != NULL && strcasecmp(conn, "keep-alive") == 0;
+	}
+}
+
+/**
+ * @brief Frame script output and send it to the client
+ *
+ * @param f framing state
+ * @param host client the response goes to
+ * @param buf output of the script
+ * @param len number of bytes
+ * @return ** int LISO_SUCCESS, LISO_BAD_GATEWAY if the script sent a bad
+ * header block, LISO_CLOSE_CONN if the client connection is broken
+ */
+int cgi_frame_output(cgi_frame *f, client *host, const char *buf, int len) {
+	if(!f->head_done) {
+		int from = f->head_len > 3 ? f->head_len - 3 : 0;
+		int take = len < CGI_HEAD_MAX - f->head_len ? len : CGI_HEAD_MAX - f->head_len;
+		memcpy(f->head + f->head_len, buf, take);
+		f->head_len += take;
+
+		int end = find_head_end(f, from);
+		if(end < 0) {
+			return f->head_len == CGI_HEAD_MAX ? LISO_BAD_GATEWAY : LISO_SUCCESS;
+		}
+
+		int count;
+		int ret = build_head(f, end, &count);
+		if(ret != LISO_SUCCESS) {
+			return ret;
+		}
+
+		// what followed the blank line is body already, it goes out in
+		// the same packet as the head
+		count += frame_body(f, f->head + end, f->head_len - end, head_out + count);
+		f->head_done = true;
+		host->access.status = f->status;
+		LISO_TRACE2(response_start, host->sock, f->status);
+		if(client_send(host, head_out, count) != LISO_SUCCESS) {
+			return LISO_CLOSE_CONN;
+		}
+		buf += take;
+		len -= take;
+	}
+
+	return send_body(f, host, buf, len);
+}
+
+/**
+ * @brief Bytes of script output that may go to the client unchanged now,
+ * e.g. with splice()
+ *
+ * @param f framing state
+ * @return ** long number of bytes, 0 if the output has to pass through
+ * cgi_frame_output
+ */
+long cgi_frame_passthrough(cgi_frame *f) {
+	if(!f->head_done || f->head_only) {
+		return 0;
+	}
+	if(f->framing == CGI_FRAME_LENGTH) {
+		return f->body_left;
+	}
+	if(f->framing == CGI_FRAME_CLOSE) {
+		return LONG_MAX;
+	}
+	return 0;
+}
+
+/**
+ * @brief Account for output that went to the client unchanged
+ *
+ * @param f framing state
+ * @param len number of bytes
+ * @return ** void
+ */
+void cgi_frame_passed(cgi_frame *f, long len) {
+	if(f->framing == CGI_FRAME_LENGTH) {
+		f->body_left -= len;
+	}
+}
+
+/**
+ * @brief End the response once the script output ended
+ *
+ * @param f framing state
+ * @param host client the response goes to
+ * @return ** int LISO_SUCCESS if the response is complete, the connection
+ * then takes the next request only if f->keep_alive is set,
+ * LISO_CLOSE_CONN if the response was cut short, LISO_BAD_GATEWAY if the
+ * script never finished its header block
+ */
+int cgi_frame_end(cgi_frame *f, client *host) {
+	if(!f->head_done) {
+		// output ended inside the header block
+		return LISO_BAD_GATEWAY;
+	}
+
+	if(f->framing == CGI_FRAME_CHUNKED && !f->head_only) {
+		if(client_send(host, "0\r\n\r\n", 5) != LISO_SUCCESS) {
+			return LISO_CLOSE_CONN;
+		}
+	}
+
+	if(f->framing == CGI_FRAME_LENGTH && f->body_left > 0 && !f->head_only) {
+		// the script ended short of its Content-Length
+		LISOPRINTF("%s %ld bytes of CGI body missing\n", __func__, f->body_left);
+		return LISO_CLOSE_CONN;
+	}
+
+	return LISO_SUCCESS;
+}
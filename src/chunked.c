@@ -0,0 +1,254 @@
+/**
+ * @file chunked.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Incremental decoder for chunked Transfer-Encoding (RFC 7230 4.1)
+ *
+ * The decoder is a byte driven state machine so a body can be fed to it
+ * in whatever pieces recv() returns. Decoded chunk data is handed to a
+ * sink as soon as it is seen, nothing is buffered except the current
+ * chunk-size extension or trailer line. Trailer fields are collected and
+ * merged in to the request headers by the caller once decoding is done.
+ *
+ * @version 0.1
+ * @date 2021-10-22
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <ctype.h>
+#include "chunked.h"
+#include "liso.h"
+
+// decoder states
+enum chunk_state {
+	CHUNK_SIZE = 0,		// hex chunk size
+	CHUNK_EXT,			// chunk extension up to CRLF, ignored
+	CHUNK_SIZE_LF,		// LF ending the size line
+	CHUNK_DATA,			// chunk data
+	CHUNK_DATA_CR,		// CR after chunk data
+	CHUNK_DATA_LF,		// LF after chunk data
+	CHUNK_TRAILER,		// trailer fields after last chunk
+	CHUNK_DONE,
+};
+
+/**
+ * @brief Initialize a chunk decoder
+ *
+ * @param d decoder to initialize
+ * @param max_chunk_size largest chunk accepted
+ * @return ** void
+ */
+void chunk_decoder_init(chunk_decoder *d, long max_chunk_size) {
+	assert(d != NULL);
+
+	memset(d, 0, sizeof(chunk_decoder));
+	d->state = CHUNK_SIZE;
+	d->max_chunk_size = max_chunk_size;
+}
+
+/**
+ * @brief Free memory held by a decoder, the decoder itself is not freed
+ *
+ * @param d decoder
+ * @return ** void
+ */
+void chunk_decoder_free(chunk_decoder *d) {
+	if(d->trailers != NULL) {
+		free(d->trailers);
+		d->trailers = NULL;
+	}
+	d->trailer_count = 0;
+}
+
+/**
+ * @brief Store a complete trailer line as a header
+ *
+ * @param d decoder holding the line
+ * @return ** int LISO_SUCCESS on success, LISO_BAD_FRAMING for a line
+ * without a field name, error otherwise
+ */
+int add_trailer(chunk_decoder *d) {
+	char *colon = memchr(d->line, ':', d->line_len);
+	if(colon == NULL || colon == d->line) {
+		return LISO_BAD_FRAMING;
+	}
+
+	if(d->trailer_count == CHUNK_MAX_TRAILERS) {
+		// too many trailers, drop the rest
+		LISOPRINTF("%s dropping trailer, limit reached\n", __func__);
+		return LISO_SUCCESS;
+	}
+
+	if(d->trailers == NULL) {
+		d->trailers = malloc(sizeof(Http_header) * CHUNK_MAX_TRAILERS);
+		if(d->trailers == NULL) {
+			return LISO_MEM_FAIL;
+		}
+	}
+
+	Http_header *h = &d->trailers[d->trailer_count];
+	int name_len = colon - d->line;
+	char *value = colon + 1;
+	char *end = d->line + d->line_len;
+
+	// trim optional white space around the value
+	while(value < end && (*value == ' ' || *value == '\t')) {
+		value++;
+	}
+	while(end > value && (end[-1] == ' ' || end[-1] == '\t')) {
+		end--;
+	}
+
+	memcpy(h->header_name, d->line, name_len);
+	h->header_name[name_len] = '\0';
+	memcpy(h->header_value, value, end - value);
+	h->header_value[end - value] = '\0';
+	d->trailer_count++;
+
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Decode a piece of a chunked body
+ *
+ * @param d decoder state for this body
+ * @param buf bytes received
+ * @param len number of bytes in buf
+ * @param consumed [out] bytes of buf that belong to the body
+ * @param sink consumer for decoded data
+ * @param ctx context passed to the sink
+ * @return ** int LISO_SUCCESS when more data is needed, LISO_BODY_DONE once
+ * the last chunk and trailers were read, LISO_WOULD_BLOCK if the sink took
+ * only part of the data, LISO_BAD_FRAMING if the body is malformed (the
+ * connection can not be read further), error otherwise
+ */
+int chunk_decode(chunk_decoder *d, const char *buf, int len, int *consumed,
+				 chunk_sink sink, void *ctx) {
+	int i = 0;
+	int error;
+
+	while(i < len && d->state != CHUNK_DONE) {
+		char ch = buf[i];
+
+		switch(d->state) {
+		case CHUNK_SIZE:
+			if(isxdigit((unsigned char)ch)) {
+				int digit = isdigit((unsigned char)ch) ? ch - '0' : tolower(ch) - 'a' + 10;
+				d->chunk_left = d->chunk_left * 16 + digit;
+				d->digits++;
+				if(d->chunk_left > d->max_chunk_size) {
+					return LISO_PAYLOAD_TOO_LARGE;
+				}
+			} else if(d->digits == 0) {
+				return LISO_BAD_FRAMING;
+			} else if(ch == ';' || ch == ' ' || ch == '\t') {
+				d->state = CHUNK_EXT;
+				d->line_len = 0;
+			} else if(ch == '\r') {
+				d->state = CHUNK_SIZE_LF;
+			} else {
+				return LISO_BAD_FRAMING;
+			}
+			i++;
+			break;
+
+		case CHUNK_EXT:
+			if(ch == '\r') {
+				d->state = CHUNK_SIZE_LF;
+			} else if(++d->line_len >= CHUNK_LINE_MAX) {
+				return LISO_BAD_FRAMING;
+			}
+			i++;
+			break;
+
+		case CHUNK_SIZE_LF:
+			if(ch != '\n') {
+				return LISO_BAD_FRAMING;
+			}
+			i++;
+			d->digits = 0;
+			d->line_len = 0;
+			d->state = d->chunk_left == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+			break;
+
+		case CHUNK_DATA: {
+			int n = len - i;
+			if(n > d->chunk_left) {
+				n = d->chunk_left;
+			}
+
+			int accepted = n;
+			error = sink(ctx, buf + i, n, &accepted);
+			if(error != LISO_SUCCESS) {
+				return error;
+			}
+
+			i += accepted;
+			d->total += accepted;
+			d->chunk_left -= accepted;
+			if(accepted < n) {
+				// consumer is full, continue from here later
+				*consumed = i;
+				return LISO_WOULD_BLOCK;
+			}
+			if(d->chunk_left == 0) {
+				d->state = CHUNK_DATA_CR;
+			}
+			break;
+		}
+
+		case CHUNK_DATA_CR:
+			if(ch != '\r') {
+				return LISO_BAD_FRAMING;
+			}
+			d->state = CHUNK_DATA_LF;
+			i++;
+			break;
+
+		case CHUNK_DATA_LF:
+			if(ch != '\n') {
+				return LISO_BAD_FRAMING;
+			}
+			d->state = CHUNK_SIZE;
+			i++;
+			break;
+
+		case CHUNK_TRAILER:
+			i++;
+			if(ch != '\n') {
+				if(d->line_len >= CHUNK_LINE_MAX - 1) {
+					return LISO_BAD_FRAMING;
+				}
+				d->line[d->line_len++] = ch;
+				break;
+			}
+
+			// end of a trailer line, drop the CR
+			if(d->line_len == 0 || d->line[d->line_len - 1] != '\r') {
+				return LISO_BAD_FRAMING;
+			}
+			d->line_len--;
+
+			if(d->line_len == 0) {
+				// empty line ends the body
+				d->state = CHUNK_DONE;
+				break;
+			}
+
+			error = add_trailer(d);
+			if(error != LISO_SUCCESS) {
+				return error;
+			}
+			d->line_len = 0;
+			break;
+
+		default:
+			return LISO_BAD_FRAMING;
+		}
+	}
+
+	*consumed = i;
+	return d->state == CHUNK_DONE ? LISO_BODY_DONE : LISO_SUCCESS;
+}
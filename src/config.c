@@ -0,0 +1,133 @@
+/**
+ * @file config.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * 
+ * @brief Runtime tunables for LISO. Every tunable has a default and can be
+ * overridden by passing name=value after the mandatory arguments of lisod,
+ * e.g. ./lisod 8080 log lock www cgi max_body=1048576
+ * 
+ * @version 0.1
+ * @date 2021-10-23
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "liso.h"
+#include "config.h"
+
+liso_config config = {
+	.rx_window = 8 * BUF_SIZE,
+	.tx_window = 16 * BUF_SIZE,
+	.max_body = 1024 * 1024,
+	.max_body_memory = 64 * 1024 * 1024,
+	.max_chunk_size = CHUNK_MAX_SIZE,
+	.max_header_bytes = 16 * 1024,
+	.max_header_count = 64,
+	.max_uri_len = 2048,
+	.header_timeout = 10,
+	.header_grace = 2,
+	.min_header_rate = 64,
+	.resolve_cache_size = 1024,
+	.resolve_cache_ttl = 1,
+	.cgi_workers = 0,
+	.cgi_splice = 1,
+	.cgi_max_active = 32,
+	.cgi_queue_len = 128,
+	.cgi_queue_timeout = 5,
+	.cgi_cache_bytes = 0,
+	.cgi_timeout = 30,
+	.cgi_kill_grace = 2,
+	.cgi_max_output = 0,
+	.plugin_threads = 4,
+	.io_buffer_pool = 256,
+	.log_level = LISO_LOG_INFO,
+	.access_log_sample = 1,
+	.server_status = 0,
+};
+
+typedef struct {
+	const char *name;
+	size_t offset;
+	long min;
+} config_option;
+
+static const config_option options[] = {
+	{"rx_window", offsetof(liso_config, rx_window), BUF_SIZE},
+	{"tx_window", offsetof(liso_config, tx_window), BUF_SIZE},
+	{"max_body", offsetof(liso_config, max_body), 0},
+	{"max_body_memory", offsetof(liso_config, max_body_memory), 0},
+	{"max_chunk_size", offsetof(liso_config, max_chunk_size), 1},
+	{"max_header_bytes", offsetof(liso_config, max_header_bytes), 64},
+	{"max_header_count", offsetof(liso_config, max_header_count), 1},
+	{"max_uri_len", offsetof(liso_config, max_uri_len), 1},
+	{"header_timeout", offsetof(liso_config, header_timeout), 1},
+	{"header_grace", offsetof(liso_config, header_grace), 0},
+	{"min_header_rate", offsetof(liso_config, min_header_rate), 0},
+	{"resolve_cache_size", offsetof(liso_config, resolve_cache_size), 0},
+	{"resolve_cache_ttl", offsetof(liso_config, resolve_cache_ttl), 0},
+	{"cgi_workers", offsetof(liso_config, cgi_workers), 0},
+	{"cgi_splice", offsetof(liso_config, cgi_splice), 0},
+	{"cgi_max_active", offsetof(liso_config, cgi_max_active), 0},
+	{"cgi_queue_len", offsetof(liso_config, cgi_queue_len), 0},
+	{"cgi_queue_timeout", offsetof(liso_config, cgi_queue_timeout), 1},
+	{"cgi_cache_bytes", offsetof(liso_config, cgi_cache_bytes), 0},
+	{"cgi_timeout", offsetof(liso_config, cgi_timeout), 0},
+	{"cgi_kill_grace", offsetof(liso_config, cgi_kill_grace), 0},
+	{"cgi_max_output", offsetof(liso_config, cgi_max_output), 0},
+	{"plugin_threads", offsetof(liso_config, plugin_threads), 0},
+	{"io_buffer_pool", offsetof(liso_config, io_buffer_pool), 0},
+	{"log_level", offsetof(liso_config, log_level), 0},
+	{"access_log_sample", offsetof(liso_config, access_log_sample), 0},
+	{"server_status", offsetof(liso_config, server_status), 0},
+	{NULL, 0, 0}
+};
+
+/**
+ * @brief Set a tunable from a name=value string
+ * 
+ * @param option the option string
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR for an unknown name or
+ * invalid value
+ */
+int set_config_option(const char *option) {
+	const char *eq = strchr(option, '=');
+	if(eq == NULL) {
+		return LISO_ERROR;
+	}
+
+	for(int i = 0; options[i].name != NULL; i++) {
+		if(strlen(options[i].name) != (size_t)(eq - option) ||
+			strncmp(options[i].name, option, eq - option) != 0) {
+			continue;
+		}
+
+		char *end;
+		long value = strtol(eq + 1, &end, 10);
+		if(end == eq + 1 || *end != '\0' || value < options[i].min) {
+			return LISO_ERROR;
+		}
+
+		*(long *)((char *)&config + options[i].offset) = value;
+		return LISO_SUCCESS;
+	}
+
+	return LISO_ERROR;
+}
+
+/**
+ * @brief Print all tunables with their current values
+ * 
+ * @param out stream to print to
+ * @return ** void 
+ */
+void print_config_options(FILE *out) {
+	for(int i = 0; options[i].name != NULL; i++) {
+		fprintf(out, "  %s=%ld\n", options[i].name,
+			*(long *)((char *)&config + options[i].offset));
+	}
+}
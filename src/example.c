@@ -22,8 +22,10 @@ int main(int argc, char **argv){
   int readRet = read(fd_in,buf,8192);
   //Parse the buffer to the parse function. You will need to pass the socket fd and the buffer would need to
   //be read from that fd
+  arena a;
+  arena_init(&a);
   for(int i = 0; i < 10; i++) {
-    Request *request = parse(buf,readRet,fd_in);
+    Request *request = parse(buf,readRet,fd_in,&a);
 
     if(request != NULL) {
       //Just printing everything
@@ -35,8 +37,7 @@ int main(int argc, char **argv){
         printf("Request Header\n");
         printf("Header name %s Header Value %s\n",request->headers[index].header_name,request->headers[index].header_value);
       }
-      free(request->headers);
-      free(request);
+      arena_reset(&a);
     } else {
       printf("Parse Failed\n");
     }
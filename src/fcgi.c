@@ -0,0 +1,562 @@
+/**
+ * @file fcgi.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Pool of persistent CGI workers spoken to with FastCGI
+ *
+ * Instead of forking the CGI script for every dynamic request, LISO can
+ * start cgi_workers copies of it at boot. Every worker has a Unix listen
+ * socket of its own that is handed to it as fd 0, as FastCGI applications
+ * expect, and accept()s connections from LISO on it. Every request gets
+ * its own connection to the worker with the fewest requests, so a worker
+ * only has to handle one request id per connection and LISO knows which
+ * worker serves a request.
+ *
+ * Connections are non-blocking from the start. A Unix socket connects at
+ * once or fails when the backlog of the worker is full, and the records
+ * starting a request are queued with the writer of the request body, so
+ * the event loop never waits for a worker.
+ *
+ * Workers are checked every pass of the event loop and respawned when they
+ * exit. A worker that keeps exiting right after it was started is
+ * respawned with an exponential backoff so a broken script does not turn
+ * in to a fork loop. A worker whose request runs past cgi_timeout is taken
+ * for hung and restarted, requests queued on its socket wait for the new
+ * one.
+ *
+ * @version 0.1
+ * @date 2021-10-26
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "liso.h"
+#include "fcgi.h"
+
+#define FCGI_MIN_UPTIME 2			// seconds a worker must live to not count as a crash
+#define FCGI_MAX_BACKOFF 64			// most seconds between respawns of a crashing worker
+
+// Globals
+extern char **environ;
+
+static const char *pool_script;
+static fcgi_worker *workers = NULL;
+static int pool_size = 0;
+static int next_worker = 0;			// where the search for the least busy worker starts
+
+/**
+ * @brief Remove the worker sockets from the file system at exit
+ *
+ * @return ** void
+ */
+static void fcgi_pool_cleanup(void) {
+	for(int i = 0; i < pool_size; i++) {
+		if(workers[i].listen_fd >= 0) {
+			unlink(workers[i].addr.sun_path);
+		}
+	}
+}
+
+/**
+ * @brief Create the listen socket of a worker, <sock_path>.<index>
+ *
+ * @param w worker slot
+ * @param sock_path path the worker sockets are named after
+ * @param index index of the worker
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR otherwise
+ */
+static int open_worker_socket(fcgi_worker *w, const char *sock_path, int index) {
+	w->addr.sun_family = AF_UNIX;
+	if(snprintf(w->addr.sun_path, sizeof(w->addr.sun_path), "%s.%d", sock_path, index) >=
+	   (int)sizeof(w->addr.sun_path)) {
+		fprintf(stderr, "CGI pool socket path too long %s\n", sock_path);
+		return LISO_ERROR;
+	}
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		return LISO_ERROR;
+	}
+
+	unlink(w->addr.sun_path);
+	if(bind(fd, (struct sockaddr *)&w->addr, sizeof(w->addr)) != 0 || listen(fd, 1000) != 0) {
+		fprintf(stderr, "Failed to set up CGI pool socket %s\n", w->addr.sun_path);
+		close(fd);
+		return LISO_ERROR;
+	}
+
+	w->listen_fd = fd;
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Start one worker on the pool listen socket
+ *
+ * @param w worker slot
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR otherwise
+ */
+static int spawn_worker(fcgi_worker *w) {
+	posix_spawn_file_actions_t actions;
+
+	// FastCGI applications accept on fd 0
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, w->listen_fd, 0);
+	pid_t pid = spawn_cgi_script(pool_script, &actions, environ, getpgrp());
+	posix_spawn_file_actions_destroy(&actions);
+
+	if(pid < 0) {
+		return LISO_ERROR;
+	}
+
+	LISOPRINTF("started CGI worker %d\n", pid);
+	w->pid = pid;
+	w->started = time(NULL);
+	w->stopping = false;
+	w->kill_at = 0;
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Create the worker sockets and start the workers
+ *
+ * @param script CGI script speaking FastCGI
+ * @param sock_path path the worker sockets are named after
+ * @param size number of workers
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR otherwise
+ */
+int fcgi_pool_start(const char *script, const char *sock_path, int size) {
+	workers = calloc(size, sizeof(fcgi_worker));
+	if(workers == NULL) {
+		return LISO_ERROR;
+	}
+
+	pool_script = script;
+	pool_size = size;
+	for(int i = 0; i < pool_size; i++) {
+		workers[i].listen_fd = -1;
+	}
+	atexit(fcgi_pool_cleanup);
+
+	for(int i = 0; i < pool_size; i++) {
+		if(open_worker_socket(&workers[i], sock_path, i) != LISO_SUCCESS) {
+			return LISO_ERROR;
+		}
+		spawn_worker(&workers[i]);
+	}
+
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Health check of the pool, workers that exited are noticed and
+ * respawned. Called on every pass of the event loop.
+ *
+ * @return ** void
+ */
+void fcgi_pool_check(void) {
+	time_t now = time(NULL);
+
+	for(int i = 0; i < pool_size; i++) {
+		fcgi_worker *w = &workers[i];
+
+		// an exited worker was either reaped already or is reaped here
+		if(w->pid > 0 && waitpid(w->pid, NULL, WNOHANG) != 0) {
+			LISOPRINTF("CGI worker %d exited\n", w->pid);
+			w->pid = 0;
+
+			if(w->stopping) {
+				// restarted on purpose, not a crash
+				w->respawn_at = now;
+			} else if(now - w->started < FCGI_MIN_UPTIME) {
+				int backoff = 1 << (w->crashes < 6 ? w->crashes : 6);
+				w->crashes++;
+				w->respawn_at = now + (backoff < FCGI_MAX_BACKOFF ? backoff : FCGI_MAX_BACKOFF);
+			} else {
+				w->crashes = 0;
+				w->respawn_at = now;
+			}
+		}
+
+		if(w->pid > 0 && w->kill_at != 0 && now >= w->kill_at) {
+			LISO_LOG(LISO_LOG_WARN, "killing CGI worker %d\n", w->pid);
+			kill(w->pid, SIGKILL);
+			w->kill_at = 0;
+		}
+
+		if(w->pid == 0 && now >= w->respawn_at) {
+			spawn_worker(w);
+		}
+	}
+}
+
+/**
+ * @brief Check if a worker should get a request before another, running
+ * workers come first and then the ones with fewer requests
+ *
+ * @param a worker
+ * @param b worker
+ * @return ** int true if a is less busy than b
+ */
+static int less_busy(fcgi_worker *a, fcgi_worker *b) {
+	int a_down = a->pid == 0 || a->stopping;
+	int b_down = b->pid == 0 || b->stopping;
+	if(a_down != b_down) {
+		return b_down;
+	}
+	return a->active < b->active;
+}
+
+/**
+ * @brief Open a non-blocking connection for one request to the least busy
+ * worker, a worker that is down queues it until it is respawned
+ *
+ * @param worker [out] index of the worker, give it to fcgi_request_done
+ * once the request ended
+ * @return ** int connected socket, LISO_ERROR on failure
+ */
+int fcgi_connect(int *worker) {
+	int best = next_worker;
+	for(int n = 1; n < pool_size; n++) {
+		int i = (next_worker + n) % pool_size;
+		if(less_busy(&workers[i], &workers[best])) {
+			best = i;
+		}
+	}
+	// equally busy workers take turns
+	next_worker = (best + 1) % pool_size;
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if(fd < 0) {
+		return LISO_ERROR;
+	}
+
+	// fails with EAGAIN rather than waiting when the backlog is full
+	if(connect(fd, (struct sockaddr *)&workers[best].addr, sizeof(workers[best].addr)) != 0) {
+		LISOPRINTF("connect to CGI worker %d failed errno %d\n", best, errno);
+		close(fd);
+		return LISO_ERROR;
+	}
+
+	workers[best].active++;
+	*worker = best;
+	return fd;
+}
+
+/**
+ * @brief Note that a request connected with fcgi_connect ended
+ *
+ * @param worker index of the worker
+ * @return ** void
+ */
+void fcgi_request_done(int worker) {
+	workers[worker].active--;
+}
+
+/**
+ * @brief Restart a worker whose request ran past cgi_timeout, it gets
+ * SIGTERM now and SIGKILL cgi_kill_grace seconds later. Only the worker
+ * is signalled, it shares the process group of the server.
+ *
+ * @param worker index of the worker
+ * @return ** void
+ */
+void fcgi_stop_worker(int worker) {
+	fcgi_worker *w = &workers[worker];
+	if(w->pid == 0 || w->stopping) {
+		return;
+	}
+
+	LISO_LOG(LISO_LOG_WARN, "CGI worker %d busy past cgi_timeout, restarting it\n", w->pid);
+	kill(w->pid, SIGTERM);
+	w->stopping = true;
+	w->kill_at = time(NULL) + config.cgi_kill_grace;
+}
+
+/**
+ * @brief Queue one record to be sent by fcgi_send_stdin
+ *
+ * @param w writer of the request
+ * @param type record type
+ * @param data record content
+ * @param len content length, at most FCGI_MAX_CONTENT
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR if out of memory
+ */
+static int queue_record(fcgi_writer *w, int type, const char *data, int len) {
+	unsigned char header[FCGI_HEADER_LEN] = {
+		FCGI_VERSION_1, type,
+		FCGI_REQUEST_ID >> 8, FCGI_REQUEST_ID & 0xff,
+		len >> 8, len & 0xff,
+		0, 0
+	};
+
+	char *pending = realloc(w->pending, w->pending_len + FCGI_HEADER_LEN + len);
+	if(pending == NULL) {
+		return LISO_ERROR;
+	}
+	memcpy(pending + w->pending_len, header, FCGI_HEADER_LEN);
+	if(len > 0) {
+		memcpy(pending + w->pending_len + FCGI_HEADER_LEN, data, len);
+	}
+	w->pending = pending;
+	w->pending_len += FCGI_HEADER_LEN + len;
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Encode the length of a name or value of a param
+ *
+ * @param out where to put the length
+ * @param len length to encode
+ * @return ** int bytes used in out
+ */
+static int encode_length(unsigned char *out, int len) {
+	if(len < 128) {
+		out[0] = len;
+		return 1;
+	}
+	out[0] = (len >> 24) | 0x80;
+	out[1] = len >> 16;
+	out[2] = len >> 8;
+	out[3] = len;
+	return 4;
+}
+
+/**
+ * @brief Add bytes to the FCGI_PARAMS stream, a full record is queued
+ * whenever the buffer fills. Pairs may be split across records, the
+ * application joins the stream before decoding it.
+ *
+ * @param w writer of the request
+ * @param params record buffer of FCGI_MAX_CONTENT bytes
+ * @param len [in,out] bytes in params
+ * @param data bytes to add
+ * @param n number of bytes in data
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR if out of memory
+ */
+static int params_append(fcgi_writer *w, char *params, int *len, const char *data, int n) {
+	while(n > 0) {
+		if(*len == FCGI_MAX_CONTENT) {
+			if(queue_record(w, FCGI_PARAMS, params, *len) != LISO_SUCCESS) {
+				return LISO_ERROR;
+			}
+			*len = 0;
+		}
+
+		int take = n < FCGI_MAX_CONTENT - *len ? n : FCGI_MAX_CONTENT - *len;
+		memcpy(params + *len, data, take);
+		*len += take;
+		data += take;
+		n -= take;
+	}
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Start a request, FCGI_BEGIN_REQUEST and the CGI environment as
+ * FCGI_PARAMS are queued on the writer and go out ahead of the body
+ *
+ * @param w writer of the request, initialized
+ * @param env CGI environment as NAME=value strings, NULL terminated
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR otherwise
+ */
+int fcgi_begin_request(fcgi_writer *w, char *env[]) {
+	unsigned char begin[8] = {0, FCGI_RESPONDER, 0, 0, 0, 0, 0, 0};
+	char params[FCGI_MAX_CONTENT];
+	int len = 0;
+
+	if(queue_record(w, FCGI_BEGIN_REQUEST, (char *)begin, sizeof(begin)) != LISO_SUCCESS) {
+		return LISO_ERROR;
+	}
+
+	for(int i = 0; env[i] != NULL; i++) {
+		char *eq = strchr(env[i], '=');
+		if(eq == NULL) {
+			continue;
+		}
+		int name_len = eq - env[i];
+		int value_len = strlen(eq + 1);
+
+		unsigned char lengths[8];
+		int n = encode_length(lengths, name_len);
+		n += encode_length(lengths + n, value_len);
+
+		if(params_append(w, params, &len, (char *)lengths, n) != LISO_SUCCESS ||
+		   params_append(w, params, &len, env[i], name_len) != LISO_SUCCESS ||
+		   params_append(w, params, &len, eq + 1, value_len) != LISO_SUCCESS) {
+			return LISO_ERROR;
+		}
+	}
+
+	if(len > 0 && queue_record(w, FCGI_PARAMS, params, len) != LISO_SUCCESS) {
+		return LISO_ERROR;
+	}
+
+	// an empty record ends the params
+	return queue_record(w, FCGI_PARAMS, NULL, 0);
+}
+
+/**
+ * @brief Initialize the writer of a FCGI_STDIN stream
+ *
+ * @param w writer
+ * @return ** void
+ */
+void fcgi_writer_init(fcgi_writer *w) {
+	memset(w, 0, sizeof(fcgi_writer));
+	w->header_off = FCGI_HEADER_LEN;
+}
+
+/**
+ * @brief Free the records of a request start that were not sent
+ *
+ * @param w writer
+ * @return ** void
+ */
+void fcgi_writer_release(fcgi_writer *w) {
+	free(w->pending);
+	w->pending = NULL;
+	w->pending_len = w->pending_off = 0;
+}
+
+/**
+ * @brief Send request body bytes to a worker without blocking, the queued
+ * records starting the request go first. A record the socket took only
+ * part of is continued on the next call, which must offer the bytes that
+ * were not written again.
+ *
+ * @param fd connection to a worker
+ * @param w writer state of the connection
+ * @param data body bytes
+ * @param len number of bytes
+ * @param end true to end the body with an empty record once data is out
+ * @param written [out] bytes of data written
+ * @return ** int LISO_SUCCESS once everything is written, LISO_WOULD_BLOCK
+ * if the socket is full, LISO_ERROR if the worker went away
+ */
+int fcgi_send_stdin(int fd, fcgi_writer *w, const char *data, int len, int end, int *written) {
+	*written = 0;
+
+	while(1) {
+		int ret;
+
+		if(w->pending_off < w->pending_len) {
+			ret = send(fd, w->pending + w->pending_off, w->pending_len - w->pending_off,
+					   MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(ret < 0) {
+				return errno == EAGAIN ? LISO_WOULD_BLOCK : LISO_ERROR;
+			}
+			w->pending_off += ret;
+			if(w->pending_off == w->pending_len) {
+				fcgi_writer_release(w);
+			}
+			continue;
+		}
+
+		if(w->header_off < FCGI_HEADER_LEN) {
+			ret = send(fd, w->header + w->header_off, FCGI_HEADER_LEN - w->header_off,
+					   MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(ret < 0) {
+				return errno == EAGAIN ? LISO_WOULD_BLOCK : LISO_ERROR;
+			}
+			w->header_off += ret;
+			continue;
+		}
+
+		if(w->content_left > 0 && len > 0) {
+			int n = len < w->content_left ? len : w->content_left;
+			ret = send(fd, data, n, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(ret < 0) {
+				return errno == EAGAIN ? LISO_WOULD_BLOCK : LISO_ERROR;
+			}
+			data += ret;
+			len -= ret;
+			*written += ret;
+			w->content_left -= ret;
+			continue;
+		}
+
+		int n;
+		if(len > 0) {
+			n = len < FCGI_MAX_CONTENT ? len : FCGI_MAX_CONTENT;
+		} else if(end && !w->ended) {
+			// an empty record ends the body
+			n = 0;
+			w->ended = 1;
+		} else {
+			return LISO_SUCCESS;
+		}
+
+		w->header[0] = FCGI_VERSION_1;
+		w->header[1] = FCGI_STDIN;
+		w->header[2] = FCGI_REQUEST_ID >> 8;
+		w->header[3] = FCGI_REQUEST_ID & 0xff;
+		w->header[4] = n >> 8;
+		w->header[5] = n & 0xff;
+		w->header[6] = 0;
+		w->header[7] = 0;
+		w->header_off = 0;
+		w->content_left = n;
+	}
+}
+
+/**
+ * @brief Decode records read from a worker. The FCGI_STDOUT content is
+ * moved to the front of buf in place, everything else is consumed.
+ *
+ * @param s decoder state for this connection
+ * @param buf bytes read from the worker
+ * @param len number of bytes in buf
+ * @return ** int number of FCGI_STDOUT bytes at the start of buf, LISO_ERROR
+ * for a malformed record
+ */
+int fcgi_decode(fcgi_stream *s, char *buf, int len) {
+	int in = 0;
+	int out = 0;
+
+	while(in < len && !s->done) {
+		if(s->header_len < FCGI_HEADER_LEN) {
+			s->header[s->header_len++] = buf[in++];
+			if(s->header_len == FCGI_HEADER_LEN) {
+				if(s->header[0] != FCGI_VERSION_1) {
+					return LISO_ERROR;
+				}
+				s->type = s->header[1];
+				s->content_left = (s->header[4] << 8) | s->header[5];
+				s->padding_left = s->header[6];
+			}
+		} else if(s->content_left > 0) {
+			int n = len - in < s->content_left ? len - in : s->content_left;
+			if(s->type == FCGI_STDOUT) {
+				memmove(buf + out, buf + in, n);
+				out += n;
+			} else if(s->type == FCGI_STDERR) {
+				LISOPRINTF("CGI stderr: %.*s\n", n, buf + in);
+			}
+			in += n;
+			s->content_left -= n;
+		} else {
+			int n = len - in < s->padding_left ? len - in : s->padding_left;
+			in += n;
+			s->padding_left -= n;
+		}
+
+		if(s->header_len == FCGI_HEADER_LEN && s->content_left == 0 && s->padding_left == 0) {
+			// record complete
+			if(s->type == FCGI_END_REQUEST) {
+				s->done = 1;
+			}
+			s->header_len = 0;
+		}
+	}
+
+	return out;
+}
@@ -12,42 +12,18 @@
  * 
  */
 
+#define _GNU_SOURCE
 #include "liso.h"
 #include "sys/stat.h"
 #include <stdio.h>
+#include <errno.h>
 #include <time.h>
 #include "list.h"
-
-// Globals
-extern FILE* fp;
+#include "resolve.h"
 
 // Constants
 #define SIZE_STRING_BUF_SIZE 50
 const int HEADER_COUNT_INCREMENT =  5;
-char* ENVP[] = {
-                    "CONTENT_LENGTH=",
-                    "CONTENT_TYPE=",
-                    "GATEWAY_INTERFACE=",
-					"PATH_INFO=",
-                    "QUERY_STRING=",
-                    "REMOTE_ADDR=",
-                    "REQUEST_METHOD=",
-					"REQUEST_URI=",
-                    "SCRIPT_NAME=",
-                    "SERVER_PORT=",
-                    "SERVER_PROTOCOL=",
-                    "SERVER_SOFTWARE=",
-                    "HTTP_ACCEPT=",
-                    "HTTP_REFERER=",
-                    "HTTP_ACCEPT_ENCODING=",
-                    "HTTP_ACCEPT_LANGUAGE=",
-                    "HTTP_ACCEPT_CHARSET=",
-					"HTTP_HOST=",
-                    "HTTP_COOKIE=",
-                    "HTTP_USER_AGENT=",
-                    "HTTP_CONNECTION=",
-                    NULL
-               };
 
 // HTTP tokens
 const char version[] = {"HTTP/1.1"};
@@ -70,9 +46,13 @@ const char ACCEPT_ENCODING[] = {"Accept-Encoding"};
 const char ACCEPT_LANGUAGE[] = {"Accept-Language"};
 const char ACCEPT_CHARSET[] = {"Accept-Charset"};
 const char COOKIE[] = {"Cookie"};
+const char TRANSFER_ENCODING_HEADER[] = {"Transfer-Encoding"};
+const char RETRY_AFTER_HEADER[] = {"Retry-After"};
+const char ALLOW_HEADER[] = {"Allow"};
 
 const char CLOSE[] = {"close"};
 const char KEEP_ALIVE[] = {"keep-alive"};
+const char CHUNKED[] = {"chunked"};
 
 const char Non_descript_data_MIME[] = "application/octet-stream";
 
@@ -109,9 +89,19 @@ const int MIME_NUM_TYPES = 8;
 const char STATUS_400[] = {"400 Bad Request"};
 const char STATUS_404[] = {"404 Not Found"};
 const char STATUS_408[] = {"408 Connection timeout"};
+const char STATUS_413[] = {"413 Payload Too Large"};
+const char STATUS_405[] = {"405 Method Not Allowed"};
+const char STATUS_414[] = {"414 URI Too Long"};
+const char STATUS_431[] = {"431 Request Header Fields Too Large"};
 const char STATUS_501[] = {"501 Unsupported method"};
+const char STATUS_501_NOT_IMPLEMENTED[] = {"501 Not Implemented"};
+const char STATUS_502[] = {"502 Bad Gateway"};
+const char STATUS_503[] = {"503 Service Unavailable"};
+const char STATUS_504[] = {"504 Gateway Timeout"};
 const char STATUS_505[] = {"505 Bad version number"};
 
+const char STATUS_500[] = {"500 Internal Server Error"};
+
 const char STATUS_200[] = {"200 OK"};
 
 // liso storage Path
@@ -132,11 +122,14 @@ int add_header(Response *resp, const char* name, const char* value) {
 
 	if(resp->header_allocated == resp->header_count) {
 		// we need to allocate more headers
-		resp->headers = realloc(resp->headers, sizeof(Http_header) * (resp->header_count + 5));
-		if(resp->headers == NULL) {
+		Http_header *headers = arena_grow(resp->arena, resp->headers,
+			sizeof(Http_header) * resp->header_allocated,
+			sizeof(Http_header) * (resp->header_count + 5));
+		if(headers == NULL) {
 			// memory allocation failed
 			return LISO_MEM_FAIL;
 		}
+		resp->headers = headers;
 
 		// allocated 5 more headers in a batch
 		resp->header_allocated += 5;
@@ -196,27 +189,27 @@ int add_last_modified(Response *resp, struct timespec *tv) {
 }
 
 /**
- * @brief Add the file type header
+ * @brief Get the MIME type of a file from its extension
  * 
  * @param path path of the file
- * @param resp response to add to
- * @return ** int LISO_SUCCESS on success, error otherwise
+ * @return ** const char* MIME type, never NULL
  */
-int add_mime_extension(char *path, Response *resp) {
-	char *pch=strrchr(path,'.');
+const char* get_mime_type(const char *path) {
+	const char *pch = strrchr(path, '.');
+	const char *slash = strrchr(path, '/');
 
-	char extension[10];
-	strncpy(extension, pch, 10);
-	LISOPRINTF(fp,"extension is %s", extension);
+	if(pch == NULL || (slash != NULL && pch < slash)) {
+		return Non_descript_data_MIME;
+	}
 
 	for(int i = 0; TYPES[i] != NULL; i++) {
-		if(strncasecmp(extension, TYPES[i], strlen(TYPES[i])) == 0) {
+		if(strcasecmp(pch, TYPES[i]) == 0) {
 			// matching MIME extension found
-			return add_header(resp, MIME_HEADER, MIME[i]);
+			return MIME[i];
 		}
 	}
 
-	return add_header(resp, MIME_HEADER, Non_descript_data_MIME);
+	return Non_descript_data_MIME;
 }
 
 /**
@@ -232,7 +225,7 @@ int get_header_index(Http_header *header, const char* header_name, int header_co
 	int index;
 	for(index = 0; index < header_count; index++) {
 		if(strncasecmp(header[index].header_name, header_name, strlen(header_name)) == 0) {
-			LISOPRINTF(fp,"%s found content lenght \n", __func__);
+			LISOPRINTF("%s found content lenght \n", __func__);
 			return index;
 		}
 	}
@@ -256,181 +249,26 @@ char* get_header(Request *req, const char* name) {
 }
 
 /**
- * @brief Get the http env object created from the client request
+ * @brief Check if an error response ends the connection
  * 
- * @param env env array to fill
- * @param req request recieved
- * @param remote_address address of client
- * @param port port of client
- * @return ** int LISO_SUCCESS on success
+ * @param error error for the response
+ * @return ** int true if the connection is closed after the response
  */
-int get_http_env(char* env[], Request *req, char remote_address[], int port) {
-	int count = 0;
-	char* header;
-
-	for(int i = 0; i < ENV_NUM -1; i++) {
-		env[i] = malloc(ENV_SIZE);
-		memset(env[i], 0, ENV_SIZE);
-		assert(env[i] != NULL);
-	}
-
-	// content len
-	header = get_header(req, CONTENT_LEN_HEADER);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// content type
-	header = get_header(req, MIME_HEADER);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// "GATEWAY_INTERFACE=CGI/1.1"
-	snprintf(env[count], ENV_SIZE, "%sCGI/1.1", ENVP[count]);
-	count++;
-
-	// PATH_INFO=
-	char path_info[1024];
-	memset(path_info, 0, 1024);
-	header = strchr(req->http_uri, '?');
-	if(header != NULL) {
-		strncpy(path_info, req->http_uri+4, header- req->http_uri -4);
-	} else {
-		strncpy(path_info, req->http_uri, 1024);
-	}
-	snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], path_info);
-	count++;
-
-	// query string
-	header = strchr(req->http_uri, '?');
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-
-	// remote address
-	snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], remote_address);
-	count++;
-
-	// http method
-	snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], req->http_method);
-	count++;
-
-	// request uri
-	snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], req->http_uri);
-	count++;
-
-	// script name
-	char script_name[1024];
-	memset(script_name, 0, 1024);
-	header = strchr(req->http_uri, '?');
-	if(header != NULL) {
-		strncpy(script_name, req->http_uri, header - req->http_uri);
-	} else {
-		strncpy(script_name, req->http_uri, 1024);
-	}
-	snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], script_name);
-	count++;
-
-	// server_port
-	snprintf(env[count], ENV_SIZE, "%s%d", ENVP[count], port);
-	count++;
-
-	// server_protocol
-	snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], version);
-	count++;
-
-	// server_software
-	snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], LISO_NAME);
-	count++;
-
-	// http accept
-	header = get_header(req, ACCEPT);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// http REFERER
-	header = get_header(req, REFERER);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// http ACCEPT_ENCODING
-	header = get_header(req, ACCEPT_ENCODING);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// http ACCEPT_LANGUAGE
-	header = get_header(req, ACCEPT_LANGUAGE);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// http ACCEPT_CHARSET
-	header = get_header(req, ACCEPT_CHARSET);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// http COOKIE
-	header = get_header(req, COOKIE);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-	// http accept
-	header = get_header(req, CONNECTION_HEADER);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
-	}
-	count++;
-
-
-	// http HOST_HEADER
-	header = get_header(req, HOST_HEADER);
-	if(header != NULL) {
-		snprintf(env[count], ENV_SIZE, "%s%s", ENVP[count], header);
-	} else {
-		snprintf(env[count], ENV_SIZE, "%s", ENVP[count]);
+int error_closes_connection(int error) {
+	switch (error)
+	{
+	case LISO_TIMEOUT:
+	case LISO_PAYLOAD_TOO_LARGE:
+	case LISO_NOT_IMPLEMENTED:
+	case LISO_URI_TOO_LONG:
+	case LISO_HEADERS_TOO_LARGE:
+	case LISO_BAD_GATEWAY:
+	case LISO_GATEWAY_TIMEOUT:
+	case LISO_BAD_FRAMING:
+		return 1;
+	default:
+		return 0;
 	}
-	count++;
-
-	free(env[count]);
-	env[count] = NULL;
-
-	return LISO_SUCCESS;
 }
 
 /**
@@ -445,11 +283,8 @@ int generate_error_response(Request *req, Response *resp, int error) {
 
 	assert(resp != NULL);
 
-	if(resp->headers != NULL) {
-		free(resp->headers);
-	}
-
-	resp->headers = malloc(sizeof(Http_header) * HEADER_COUNT_INCREMENT);
+	// headers added so far are dropped, their memory goes with the arena
+	resp->headers = arena_alloc(resp->arena, sizeof(Http_header) * HEADER_COUNT_INCREMENT);
 
 	if(resp->headers == NULL) {
 		return LISO_MEM_FAIL;
@@ -460,10 +295,10 @@ int generate_error_response(Request *req, Response *resp, int error) {
 
 	// populate response line
 	strncpy(resp->http_version, version, strlen(version) + 1);
-	LISOPRINTF(fp,"Length of:+%s+ is %ld", version, strlen(version) + 1);
+	LISOPRINTF("Length of:+%s+ is %ld", version, strlen(version) + 1);
 
 	// add connection header
-	if((req != NULL && get_conn_header(req) == LISO_CLOSE_CONN) || error == LISO_TIMEOUT) {
+	if((req != NULL && get_conn_header(req) == LISO_CLOSE_CONN) || error_closes_connection(error)) {
 		add_header(resp, CONNECTION_HEADER, CLOSE);
 	} else {
 		add_header(resp, CONNECTION_HEADER, KEEP_ALIVE);
@@ -480,18 +315,53 @@ int generate_error_response(Request *req, Response *resp, int error) {
 	{
 	case LISO_LOAD_FAILED:
 		strncpy(resp->http_status_reason, STATUS_404, strlen(STATUS_404) +1);
-		LISOPRINTF(fp,"Length of:+%s+ is %ld", STATUS_404, strlen(STATUS_404) +1);
+		LISOPRINTF("Length of:+%s+ is %ld", STATUS_404, strlen(STATUS_404) +1);
 		break;
 	case LISO_UNSUPPORTED_METHOD:
 		strncpy(resp->http_status_reason, STATUS_501, strlen(STATUS_501) +1);
 		break;
+	case LISO_METHOD_NOT_ALLOWED:
+		// static content is only read
+		add_header(resp, ALLOW_HEADER, "GET, HEAD");
+		strncpy(resp->http_status_reason, STATUS_405, strlen(STATUS_405) +1);
+		break;
+	case LISO_NOT_IMPLEMENTED:
+		strncpy(resp->http_status_reason, STATUS_501_NOT_IMPLEMENTED, strlen(STATUS_501_NOT_IMPLEMENTED) +1);
+		break;
+	case LISO_PAYLOAD_TOO_LARGE:
+		strncpy(resp->http_status_reason, STATUS_413, strlen(STATUS_413) +1);
+		break;
+	case LISO_URI_TOO_LONG:
+		strncpy(resp->http_status_reason, STATUS_414, strlen(STATUS_414) +1);
+		break;
+	case LISO_HEADERS_TOO_LARGE:
+		strncpy(resp->http_status_reason, STATUS_431, strlen(STATUS_431) +1);
+		break;
 	case LISO_TIMEOUT:
 		strncpy(resp->http_status_reason, STATUS_408, strlen(STATUS_408) +1);
 		break;
+	case LISO_INTERNAL_ERROR:
+		strncpy(resp->http_status_reason, STATUS_500, strlen(STATUS_500) +1);
+		break;
+	case LISO_BAD_GATEWAY:
+		strncpy(resp->http_status_reason, STATUS_502, strlen(STATUS_502) +1);
+		break;
+	case LISO_GATEWAY_TIMEOUT:
+		strncpy(resp->http_status_reason, STATUS_504, strlen(STATUS_504) +1);
+		break;
+	case LISO_SERVICE_UNAVAILABLE: {
+		// a slot should free up within one queue timeout
+		char retry[SIZE_STRING_BUF_SIZE];
+		snprintf(retry, sizeof(retry), "%ld", config.cgi_queue_timeout);
+		add_header(resp, RETRY_AFTER_HEADER, retry);
+		strncpy(resp->http_status_reason, STATUS_503, strlen(STATUS_503) +1);
+		break;
+	}
 	case LISO_BAD_VERSION_NUMBER:
 		strncpy(resp->http_status_reason, STATUS_505, strlen(STATUS_505) +1);
 		break;
 	case LISO_BAD_REQUEST:
+	case LISO_BAD_FRAMING:
 		strncpy(resp->http_status_reason, STATUS_400, strlen(STATUS_400) +1);
 		break;
 	case LISO_MEM_FAIL:
@@ -515,7 +385,7 @@ int populate_basic_response(Response *resp) {
 
 	assert(resp != NULL);
 
-	resp->headers = malloc(sizeof(Http_header) * HEADER_COUNT_INCREMENT);
+	resp->headers = arena_alloc(resp->arena, sizeof(Http_header) * HEADER_COUNT_INCREMENT);
 	if(resp->headers == NULL) {
 		return LISO_MEM_FAIL;
 	}
@@ -546,42 +416,47 @@ int populate_basic_response(Response *resp) {
 int load_uri(Request *req, Response *resp) {
 	assert(req != NULL);
 	assert(resp != NULL);
-	size_t buf_space = 4096;
-	char path[PATH_MAX];
-
-	snprintf(path, buf_space, "%s%s", LISO_PATH, req->http_uri);
-	LISOPRINTF(fp," %s http req uri %s\n", __func__, req->http_uri );
+	resolved_file *file;
 
-	struct stat sfile;
-	int error = stat(path, &sfile);
+	LISOPRINTF(" %s http req uri %s\n", __func__, req->http_uri );
 
-	if(error != 0) {
-		LISOPRINTF(fp," liso path is, %s\n", LISO_PATH );
-		LISOPRINTF(fp," failed stat returned error for path, %s errno is \n", path );
-		perror("error returned");
-		return LISO_LOAD_FAILED;
+	int error = resolve_uri(req->http_uri, &file);
+	if(error != LISO_SUCCESS) {
+		LISOPRINTF(" failed to resolve uri %s error %d\n", req->http_uri, error);
+		return error;
 	}
 
-	LISOPRINTF(fp," the name of file is %s and lenght is %ld", path, sfile.st_size);
+	LISOPRINTF(" the name of file is %s and lenght is %ld", file->path, file->size);
 
-	resp->message_len = sfile.st_size;
-	resp->message = malloc(sfile.st_size);
+	char *message = arena_alloc(resp->arena, file->size);
+	if(message == NULL) {
+		return LISO_MEM_FAIL;
+	}
 
 	FILE *fp;
-	fp = fopen(path, "r");
+	// "e" opens it close-on-exec like every other fd of the server
+	fp = fopen(file->path, "re");
+	if(fp == NULL) {
+		invalidate_uri(file);
+		return LISO_LOAD_FAILED;
+	}
 
-	size_t read_size = fread(resp->message, sizeof(char), sfile.st_size, fp);
+	size_t read_size = fread(message, sizeof(char), file->size, fp);
+	fclose(fp);
 
-	if(read_size != sfile.st_size) {
-		LISOPRINTF(fp," failed read size mismatch for file on path for path, %s file size was %ld size read was %ld\n", path , sfile.st_size, read_size);
+	if(read_size != file->size) {
+		// file changed since it was cached
+		LISOPRINTF(" failed read size mismatch for file on path for path, %s file size was %ld size read was %ld\n", file->path , file->size, read_size);
+		invalidate_uri(file);
 		return LISO_LOAD_FAILED;
 	}
 
-	fclose(fp);
+	resp->message = file->size > 0 ? message : NULL;
+	resp->message_len = file->size;
 
-	add_mime_extension(path, resp);
-	add_content_length(resp, sfile.st_size);
-	add_last_modified(resp, &sfile.st_mtim);
+	add_header(resp, MIME_HEADER, file->mime);
+	add_content_length(resp, file->size);
+	add_last_modified(resp, &file->mtime);
 
 	return LISO_SUCCESS;
 }
@@ -608,6 +483,60 @@ int get_full_request_len(Request *req) {
 	return total_len;
 }
 
+/**
+ * @brief Work out how the body of a request is framed. A request with both
+ * Transfer-Encoding and Content-Length, or with Content-Length values that
+ * differ, is rejected: a proxy in front may have framed it the other way
+ * and the rest of the connection could be a smuggled request (RFC 7230
+ * 3.3.3).
+ * 
+ * @param req request
+ * @param content_len [out] length of the body, -1 if the body is chunked
+ * @return ** int LISO_SUCCESS on success, LISO_BAD_FRAMING for an invalid,
+ * repeated or conflicting framing header, LISO_NOT_IMPLEMENTED for transfer
+ * codings other than chunked
+ */
+int get_body_framing(Request *req, long *content_len) {
+	char *coding = NULL;
+	long len = -1;
+	*content_len = 0;
+
+	// every header is looked at, get_header() only finds the first
+	for(int i = 0; i < req->header_count; i++) {
+		char *value = req->headers[i].header_value;
+
+		if(strcasecmp(req->headers[i].header_name, TRANSFER_ENCODING_HEADER) == 0) {
+			if(coding != NULL) {
+				return LISO_BAD_FRAMING;
+			}
+			coding = value;
+		} else if(strcasecmp(req->headers[i].header_name, CONTENT_LEN_HEADER) == 0) {
+			char *end;
+			errno = 0;
+			long value_len = strtol(value, &end, 10);
+			if(end == value || *end != '\0' || value_len < 0 || errno == ERANGE ||
+			   (len >= 0 && value_len != len)) {
+				return LISO_BAD_FRAMING;
+			}
+			len = value_len;
+		}
+	}
+
+	if(coding != NULL) {
+		if(len >= 0) {
+			return LISO_BAD_FRAMING;
+		}
+		if(strcasecmp(coding, CHUNKED) != 0) {
+			return LISO_NOT_IMPLEMENTED;
+		}
+		*content_len = -1;
+	} else if(len >= 0) {
+		*content_len = len;
+	}
+
+	return LISO_SUCCESS;
+}
+
 /**
  * @brief Get the conn header of the request
  * 
@@ -632,20 +561,22 @@ int get_conn_header(Request *req) {
  * @brief Process a get rHTTP equest
  * 
  * @param req parsed request to process
+ * @param a arena the response is allocated from
  * @return ** Response* response for the request
  */
-Response* process_get(Request *req) {
-	LISOPRINTF(fp," %s http req uri %s\n", __func__, req->http_uri );
-	Response *resp = malloc(sizeof(Response));
-	memset(resp, 0,  sizeof(Response));
-
+Response* process_get(Request *req, arena *a) {
+	LISOPRINTF(" %s http req uri %s\n", __func__, req->http_uri );
+	Response *resp = arena_alloc(a, sizeof(Response));
 	assert(resp != NULL);
 
+	memset(resp, 0,  sizeof(Response));
+	resp->arena = a;
+
 	int error;
 
 	populate_basic_response(resp);
 
-	LISOPRINTF(fp," %s http req uri %s\n", __func__, req->http_uri );
+	LISOPRINTF(" %s http req uri %s\n", __func__, req->http_uri );
 	error = load_uri(req, resp);
 	if(error != LISO_SUCCESS) {
 		int err_err = generate_error_response(req, resp, error);
@@ -666,14 +597,14 @@ Response* process_get(Request *req) {
  * @brief Process a head HTTP equest
  * 
  * @param req parsed request to process
+ * @param a arena the response is allocated from
  * @return ** Response* response for the request
  */
-Response* process_head(Request *req) {
+Response* process_head(Request *req, arena *a) {
 
-	Response *resp = process_get(req);
+	Response *resp = process_get(req, a);
 
 	if(resp->message_len != 0) {
-		free(resp->message);
 		resp->message = NULL;
 		resp->message_len = 0;
 	}
@@ -696,13 +627,14 @@ int process_post(int client_socket, Request *req, char *buf, int bufsize) {
  * 
  * @param error error encountered
  * @param req parsed request to process
+ * @param a arena the response is allocated from
  * @return ** Response* response for the request
  */
-Response* process_error(int error, Request *req) {
-	Response *resp = malloc(sizeof(Response));
-	resp->headers = NULL;
-
+Response* process_error(int error, Request *req, arena *a) {
+	Response *resp = arena_alloc(a, sizeof(Response));
 	assert(resp != NULL);
+	memset(resp, 0, sizeof(Response));
+	resp->arena = a;
 
 	int err = generate_error_response(req, resp, error);
 	assert(err == LISO_SUCCESS);
@@ -711,7 +643,7 @@ Response* process_error(int error, Request *req) {
 
 /**
  * @brief Convert the respnse structure in to byte stream for
- * transmission
+ * transmission, allocated from the arena of the response
  * 
  * @param resp reponse to be translated
  * @param bufsize [out] bufsize of the bytestream
@@ -719,9 +651,13 @@ Response* process_error(int error, Request *req) {
  */
 char* convert_response_to_byte_stream(Response *resp, int *bufsize) {
 	
+	// status line and headers, the message is appended once they are known
 	int cur_bufsize = BUF_SIZE;
-	char* resp_buf = malloc(cur_bufsize);
-	memset(resp_buf, 0, cur_bufsize);
+	for(int i = 0 ; i < resp->header_count; i++) {
+		cur_bufsize += strlen(resp->headers[i].header_name) + strlen(resp->headers[i].header_value) + 4;
+	}
+	char* resp_buf = arena_alloc(resp->arena, cur_bufsize + resp->message_len);
+	assert(resp_buf != NULL);
 	int count = 0;
 
 	// response line
@@ -741,20 +677,10 @@ char* convert_response_to_byte_stream(Response *resp, int *bufsize) {
 
 	// message
 	if(resp->message_len > 0) {
-		if(resp->message_len + count > cur_bufsize) {
-			resp_buf = realloc(resp_buf, resp->message_len + count + 10);
-			cur_bufsize = resp->message_len + count + 10;
-		}
-
 		memcpy(resp_buf + count, resp->message, resp->message_len);
 		count += resp->message_len;
-
-		free(resp->message);
 	}
 
-	free(resp->headers);
-	free(resp);
-
 	*bufsize = count;
 	return resp_buf;
 }
@@ -765,34 +691,44 @@ char* convert_response_to_byte_stream(Response *resp, int *bufsize) {
  * @param error error for the response
  * @param resp_size [out] response size
  * @param req request to respond to
+ * @param a arena the response is allocated from
  * @return ** char* byte stream for the response
  */
-char* generate_error(int error, int *resp_size, Request *req) {
-	Response *resp = process_error(error, req);
+char* generate_error(int error, int *resp_size, Request *req, arena *a) {
+	Response *resp = process_error(error, req, a);
 
 	// convert to char array and return char* buffer
 	return convert_response_to_byte_stream(resp, resp_size);
 }
 
-char* generate_reply(Request *req, char *buf, int bufsize, int *resp_size) {
-	LISOPRINTF(fp,"inside %s\n", __func__);
-	LISOPRINTF(fp," %s http req uri %s\n", __func__, req->http_uri );
+/**
+ * @brief generate the reply for a request
+ * 
+ * @param req request to respond to
+ * @param buf request buffer
+ * @param bufsize request buffer size
+ * @param resp_size [out] response size
+ * @param a arena the response is allocated from
+ * @return ** char* byte stream for the response
+ */
+char* generate_reply(Request *req, char *buf, int bufsize, int *resp_size, arena *a) {
+	LISOPRINTF("inside %s\n", __func__);
+	LISOPRINTF(" %s http req uri %s\n", __func__, req->http_uri );
 	Response *resp;
 
 	if(strncasecmp(req->http_method, GET, strlen(GET)) == 0) {
-		LISOPRINTF(fp,"%s Processing Get \n", __func__);
-		resp = process_get(req);
+		LISOPRINTF("%s Processing Get \n", __func__);
+		resp = process_get(req, a);
 	} else if(strncasecmp(req->http_method, HEAD, strlen(HEAD)) == 0) {
-		LISOPRINTF(fp,"%s Processing HEAD \n", __func__);
-		resp = process_head(req);
+		LISOPRINTF("%s Processing HEAD \n", __func__);
+		resp = process_head(req, a);
 	} else if (strncasecmp(req->http_method, POST, strlen(POST)) == 0) {
-		LISOPRINTF(fp,"%s Processing Post \n", __func__);
-		// special case for now
-		*resp_size = bufsize;
-		return buf;
+		LISOPRINTF("%s Processing Post \n", __func__);
+		// POST only goes to CGI scripts and plugins
+		resp = process_error(LISO_METHOD_NOT_ALLOWED, req, a);
 	} else {
 		// invalid request
-		resp = process_error(LISO_UNSUPPORTED_METHOD, req);
+		resp = process_error(LISO_UNSUPPORTED_METHOD, req, a);
 	}
 
 	// convert to char array and return char* buffer
@@ -809,9 +745,83 @@ char* generate_reply(Request *req, char *buf, int bufsize, int *resp_size) {
 int sanity_check(Request *req) {
 	// check version
 	if(strncasecmp(req->http_version, version, strlen(version + 1)) != 0) {
-		LISOPRINTF(fp,"req method rx %s matching with %s failed \n", req->http_method, version);
+		LISOPRINTF("req method rx %s matching with %s failed \n", req->http_method, version);
 		return LISO_BAD_VERSION_NUMBER;
 	}
 
 	return LISO_SUCCESS;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Check a request head against the configured limits before it is
+ * parsed. Works on a partial head too so that oversize requests are
+ * refused before the rest of them is read or anything is allocated.
+ * 
+ * @param buf start of the request head
+ * @param len bytes of the head received so far
+ * @return ** int LISO_SUCCESS if the head is within limits, LISO_URI_TOO_LONG,
+ * LISO_HEADERS_TOO_LARGE or LISO_BAD_REQUEST otherwise
+ */
+int check_request_head(const char *buf, int len) {
+	const char *end = memmem(buf, len, "\r\n\r\n", 4);
+	const char *head_end = end != NULL ? end + 4 : buf + len;
+
+	if(head_end - buf > config.max_header_bytes) {
+		return LISO_HEADERS_TOO_LARGE;
+	}
+
+	// request line, method SP uri SP version
+	const char *line_end = memmem(buf, head_end - buf, "\r\n", 2);
+	const char *line_stop = line_end != NULL ? line_end : head_end;
+	const char *uri = memchr(buf, ' ', line_stop - buf);
+
+	if(uri == NULL) {
+		if(line_stop - buf >= HTTP_TOKEN_SIZE) {
+			return LISO_BAD_REQUEST;
+		}
+		return LISO_SUCCESS;
+	}
+
+	if(uri - buf >= HTTP_TOKEN_SIZE) {
+		return LISO_BAD_REQUEST;
+	}
+
+	uri++;
+	const char *uri_end = memchr(uri, ' ', line_stop - uri);
+	const char *uri_stop = uri_end != NULL ? uri_end : line_stop;
+	if(uri_stop - uri > config.max_uri_len || uri_stop - uri >= HTTP_FIELD_SIZE) {
+		return LISO_URI_TOO_LONG;
+	}
+
+	if(uri_end != NULL && line_stop - uri_end - 1 >= HTTP_TOKEN_SIZE) {
+		return LISO_BAD_REQUEST;
+	}
+
+	if(line_end == NULL) {
+		return LISO_SUCCESS;
+	}
+
+	// header fields, each has to fit an Http_header
+	int count = 0;
+	const char *p = line_end + 2;
+	while(p < head_end) {
+		const char *eol = memmem(p, head_end - p, "\r\n", 2);
+		const char *field_end = eol != NULL ? eol : head_end;
+
+		if(field_end == p) {
+			// blank line ends the head
+			break;
+		}
+
+		if(field_end - p >= HTTP_FIELD_SIZE || ++count > config.max_header_count) {
+			return LISO_HEADERS_TOO_LARGE;
+		}
+
+		if(eol == NULL) {
+			break;
+		}
+		p = eol + 2;
+	}
+
+	return LISO_SUCCESS;
+}
@@ -0,0 +1,215 @@
+/**
+ * @file latency.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Log-linear latency histograms of the phases of a request
+ *
+ * Like HdrHistogram, values below LATENCY_SUB nanoseconds get a bucket
+ * each and every power of two above is split in LATENCY_SUB linear
+ * buckets, so any latency from a nanosecond to minutes is kept with ~3%
+ * error in fixed memory. Recording is a clz and an increment, percentiles
+ * are only computed when they are read.
+ *
+ * The phases are timed by the event loop, the only thread recording, so
+ * the histograms are not locked. They count from the start of the server,
+ * SIGUSR1 writes their percentiles to the log and /server-status shows
+ * them.
+ *
+ * @version 0.1
+ * @date 2021-11-06
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <signal.h>
+#include <stdbool.h>
+#include <time.h>
+#include "log.h"
+#include "latency.h"
+
+static latency_hist hists[LATENCY_PHASES];
+static volatile sig_atomic_t dump_wanted = false;
+
+static const char *phase_names[LATENCY_PHASES] = {
+	"first_byte", "parse", "file", "cgi_spawn", "cgi_first_output", "response",
+};
+
+/**
+ * @brief Monotonic clock in nanoseconds
+ *
+ * @return ** uint64_t nanoseconds since an arbitrary point
+ */
+uint64_t latency_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Bucket of a value
+ *
+ * @param ns value
+ * @return ** int index in to latency_hist.buckets
+ */
+static int bucket_of(uint64_t ns) {
+	if(ns < LATENCY_SUB) {
+		return ns;
+	}
+
+	int bit = 63 - __builtin_clzll(ns);
+	if(bit > LATENCY_MAX_BIT) {
+		return LATENCY_BUCKETS - 1;
+	}
+	int shift = bit - LATENCY_SUB_BITS;
+	return (shift + 1) * LATENCY_SUB + (int)((ns >> shift) - LATENCY_SUB);
+}
+
+/**
+ * @brief Highest value counted in a bucket
+ *
+ * @param index bucket
+ * @return ** uint64_t value in nanoseconds
+ */
+static uint64_t bucket_high(int index) {
+	if(index < LATENCY_SUB) {
+		return index;
+	}
+
+	int shift = index / LATENCY_SUB - 1;
+	uint64_t low = (uint64_t)(index % LATENCY_SUB + LATENCY_SUB) << shift;
+	return low + ((1ULL << shift) - 1);
+}
+
+/**
+ * @brief Count a value in a histogram
+ *
+ * @param h histogram
+ * @param ns value in nanoseconds
+ * @return ** void
+ */
+void latency_hist_record(latency_hist *h, uint64_t ns) {
+	h->buckets[bucket_of(ns)]++;
+	h->count++;
+	h->sum += ns;
+	if(ns > h->max) {
+		h->max = ns;
+	}
+}
+
+/**
+ * @brief Add the counts of one histogram to another, e.g. of threads
+ * that recorded on their own
+ *
+ * @param dst histogram added to
+ * @param src histogram added
+ * @return ** void
+ */
+void latency_hist_merge(latency_hist *dst, const latency_hist *src) {
+	for(int i = 0; i < LATENCY_BUCKETS; i++) {
+		dst->buckets[i] += src->buckets[i];
+	}
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if(src->max > dst->max) {
+		dst->max = src->max;
+	}
+}
+
+/**
+ * @brief Count a latency
+ *
+ * @param phase enum latency_phases
+ * @param ns latency in nanoseconds
+ * @return ** void
+ */
+void latency_record(int phase, uint64_t ns) {
+	latency_hist_record(&hists[phase], ns);
+}
+
+/**
+ * @brief Count the time from start until now
+ *
+ * @param phase enum latency_phases
+ * @param start latency_now() when the phase started
+ * @return ** void
+ */
+void latency_since(int phase, uint64_t start) {
+	latency_record(phase, latency_now() - start);
+}
+
+/**
+ * @brief Histogram of a phase
+ *
+ * @param phase enum latency_phases
+ * @return ** const latency_hist* the histogram
+ */
+const latency_hist* latency_get(int phase) {
+	return &hists[phase];
+}
+
+/**
+ * @brief Name of a phase
+ *
+ * @param phase enum latency_phases
+ * @return ** const char* the name
+ */
+const char* latency_phase_name(int phase) {
+	return phase_names[phase];
+}
+
+/**
+ * @brief Value below which a share of the counted latencies fall
+ *
+ * @param h histogram
+ * @param q share, e.g. 0.99
+ * @return ** uint64_t nanoseconds, 0 if nothing was counted
+ */
+uint64_t latency_percentile(const latency_hist *h, double q) {
+	if(h->count == 0) {
+		return 0;
+	}
+
+	uint64_t rank = (uint64_t)(q * h->count + 0.5);
+	rank = rank < 1 ? 1 : rank;
+	uint64_t seen = 0;
+	for(int i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if(seen >= rank) {
+			uint64_t high = bucket_high(i);
+			return high < h->max ? high : h->max;
+		}
+	}
+	return h->max;
+}
+
+/**
+ * @brief Ask for the percentiles to be logged, done by latency_tick().
+ * Async signal safe.
+ *
+ * @return ** void
+ */
+void latency_request_dump() {
+	dump_wanted = true;
+}
+
+/**
+ * @brief Log the percentiles of every phase if a dump was asked for,
+ * called on every turn of the event loop
+ *
+ * @return ** void
+ */
+void latency_tick() {
+	if(!dump_wanted) {
+		return;
+	}
+	dump_wanted = false;
+
+	for(int i = 0; i < LATENCY_PHASES; i++) {
+		latency_hist *h = &hists[i];
+		LISO_LOG(LISO_LOG_INFO, "latency %s count %lu p50 %.1fus p99 %.1fus p999 %.1fus max %.1fus\n",
+				 phase_names[i], (unsigned long)h->count,
+				 latency_percentile(h, 0.5) / 1000.0, latency_percentile(h, 0.99) / 1000.0,
+				 latency_percentile(h, 0.999) / 1000.0, h->max / 1000.0);
+	}
+}
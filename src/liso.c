@@ -17,6 +17,8 @@
  * 
  */
 
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
 #include <syslog.h>
 #include <sys/types.h>
@@ -29,6 +31,14 @@
 #include <unistd.h>
 #include "liso.h"
 #include "parse.h"
+#include "access_log.h"
+#include "cgi_cache.h"
+#include "cgi_frame.h"
+#include "plugin.h"
+#include "stats.h"
+#include "latency.h"
+#include "lisotrace.h"
+#include "pool.h"
 #include <netinet/tcp.h>
 #include "list.h"
 #include <stdbool.h>
@@ -37,9 +47,13 @@
 // GLOBALS
 char LISO_PATH[1024];
 extern const char CONTENT_LEN_HEADER[];
-FILE *fp;
 char lock_file[1024];
 char cgi_script[BUF_SIZE];
+int server_port;					// port Liso listens on
+long body_memory_used = 0;		// memory held by in memory request bodies
+static pool rx_pool;				// receive buffers of rx_window bytes
+static pool tx_pool;				// send queues of tx_window bytes
+static int spare_fd = -1;			// given up to refuse connections at the fd limit
 
 /**
  * @brief Print buffer
@@ -54,11 +68,7 @@ void print_req_buf(char *buf, int len)
 	{
 		return;
 	}
-	LISOPRINTF(fp, "printing buffer of size %d\n", len);
-#ifdef LISODEBUG
-	fwrite(buf, 1, len, fp);
-#endif
-	LISOPRINTF(fp, "\n");
+	LISOPRINTF("printing buffer of size %d\n%.*s\n", len, len, buf);
 }
 
 /**
@@ -86,84 +96,236 @@ int close_socket(int sock)
  */
 int add_new_client(int client_sock, struct sockaddr_in *pV4Addr)
 {
-	client *c = malloc(sizeof(client));
+	client *c = new_client();
 	if (c == NULL)
 	{
 		return LISO_MEM_FAIL;
 	}
+	arena_init(&c->arena);
 	c->sock = client_sock;
 	c->pipeline_flag = false;
 	c->cgi_host = NULL;
+	c->body_fd = -1;
 
 	struct in_addr ipAddr = pV4Addr->sin_addr;
 
 	inet_ntop(AF_INET, &ipAddr, c->remote_address, INET_ADDRSTRLEN);
 	c->port = ntohs(pV4Addr->sin_port);
+	c->access.addr = ipAddr.s_addr;
+	c->accepted_at = latency_now();
 	add_client(c);
 
 	return LISO_SUCCESS;
 }
 
+/**
+ * @brief Give the send queue buffer of a client back, pooled buffers go to
+ * the pool and larger ones are freed
+ * 
+ * @param c client
+ * @return ** void 
+ */
+void release_tx_buffer(client *c)
+{
+	if (c->out_cap == config.tx_window)
+	{
+		pool_put(&tx_pool, c->out_buf);
+	}
+	else
+	{
+		free(c->out_buf);
+	}
+	c->out_buf = NULL;
+	c->out_cap = 0;
+}
+
+/**
+ * @brief Send data to a client without blocking, what the socket does not
+ * take right now is queued and sent once select() finds it writable.
+ * Queued data always goes out before anything sent later.
+ * 
+ * @param c client to send to
+ * @param data bytes to send
+ * @param len number of bytes
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR if the connection is
+ * broken
+ */
+int client_send(client *c, const char *data, int len)
+{
+	c->access.bytes += len;
+	stats.bytes_out += len;
+
+	if (c->out_len == 0)
+	{
+		int ret = send(c->sock, data, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0)
+		{
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+			{
+				perror("send recieved an error");
+				return LISO_ERROR;
+			}
+			ret = 0;
+		}
+		data += ret;
+		len -= ret;
+	}
+
+	if (len == 0)
+	{
+		return LISO_SUCCESS;
+	}
+
+	// queue the rest
+	if (c->out_off > 0)
+	{
+		memmove(c->out_buf, c->out_buf + c->out_off, c->out_len);
+		c->out_off = 0;
+	}
+
+	if (c->out_len + len > c->out_cap)
+	{
+		// a queue that fits tx_window takes a pooled buffer, a larger one
+		// is allocated for it and freed once it is sent
+		long cap = config.tx_window;
+		while (cap < c->out_len + len)
+		{
+			cap *= 2;
+		}
+		char *out_buf = cap == config.tx_window ? pool_get(&tx_pool) : malloc(cap);
+		if (out_buf == NULL)
+		{
+			return LISO_MEM_FAIL;
+		}
+		if (c->out_len > 0)
+		{
+			memcpy(out_buf, c->out_buf, c->out_len);
+		}
+		release_tx_buffer(c);
+		c->out_buf = out_buf;
+		c->out_cap = cap;
+	}
+
+	memcpy(c->out_buf + c->out_len, data, len);
+	c->out_len += len;
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Send as much of the queued output of a client as the socket takes
+ * 
+ * @param c client with queued output
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR if the connection is
+ * broken
+ */
+int flush_client(client *c)
+{
+	while (c->out_len > 0)
+	{
+		int ret = send(c->sock, c->out_buf + c->out_off, c->out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (ret < 0)
+		{
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				break;
+			}
+			return LISO_ERROR;
+		}
+		c->out_off += ret;
+		c->out_len -= ret;
+	}
+
+	if (c->out_len == 0)
+	{
+		// an idle connection holds no buffer
+		c->out_off = 0;
+		release_tx_buffer(c);
+
+		if (c->send_started != 0)
+		{
+			latency_since(LATENCY_RESPONSE, c->send_started);
+			c->send_started = 0;
+		}
+	}
+
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Status code of a response Liso generated
+ * 
+ * @param resp response starting with its status line
+ * @param len bytes of the response
+ * @return ** int the status code, 0 if there is none
+ */
+int response_status(const char *resp, int len)
+{
+	const char *sp = memchr(resp, ' ', len);
+	return sp != NULL ? atoi(sp + 1) : 0;
+}
+
 /**
  * @brief generate reply for the request recieved and send appropriate 
  * response
  * 
- * @param client_socket socket of the client that sent the request
+ * @param c client that sent the request
  * @param req Populated request with parsed values
  * @param buf reauest buffer
  * @param bufsize reauest buffer size
  * @return ** int 0 on success, nonzero otherwise 
  */
-int generate_and_send_reply(int client_socket, Request *req, char *buf, int bufsize)
+int generate_and_send_reply(client *c, Request *req, char *buf, int bufsize)
 {
-	LISOPRINTF(fp, "Processing request \n");
+	LISOPRINTF("Processing request \n");
 	print_req_buf(buf, bufsize);
 
+	// the response is freed with the request
 	int resp_size;
-	char *resp_buf = generate_reply(req, buf, bufsize, &resp_size);
+	uint64_t start = latency_now();
+	char *resp_buf = generate_reply(req, buf, bufsize, &resp_size, &c->arena);
+	latency_since(LATENCY_FILE, start);
+	c->access.status = response_status(resp_buf, resp_size);
+	LISO_TRACE2(response_start, c->sock, c->access.status);
 
 	// sending reply
-	LISOPRINTF(fp, "Sending reply \n");
+	LISOPRINTF("Sending reply \n");
 	print_req_buf(resp_buf, resp_size);
 
-	if (send(client_socket, resp_buf, resp_size, 0) != resp_size)
+	if (client_send(c, resp_buf, resp_size) != LISO_SUCCESS)
 	{
 		fprintf(stderr, "Error sending to client.\n");
-		perror("send recieved an error");
-		free(resp_buf);
 		return -1;
 	}
-
-	if (resp_buf != buf)
-	{ // TODO REMOVE WHEN IMPLEMENTING POST
-		free(resp_buf);
-	}
 	return 0;
 }
 
 /**
  * @brief send a error 400 malformed request
  * 
- * @param client_socket socket to send response at
+ * @param c client to send response to
  * @return ** int 0 on success, nonzero otherwise
  */
-int send_error_response(int client_socket, int error, Request *req)
+int send_error_response(client *c, int error, Request *req)
 {
 
+	// may be sent outside of a request, the memory is given back right away
+	arena_mark mark = arena_save(&c->arena);
 	int resp_size;
-	char *bad_request = generate_error(error, &resp_size, req);
+	char *bad_request = generate_error(error, &resp_size, req, &c->arena);
+	c->access.status = response_status(bad_request, resp_size);
+	LISO_TRACE2(response_start, c->sock, c->access.status);
 
-	LISOPRINTF(fp, " error response for socket %d\n", client_socket);
+	LISOPRINTF(" error response for socket %d\n", c->sock);
 	print_req_buf(bad_request, resp_size);
-	if (send(client_socket, bad_request, resp_size, 0) < 0)
+	int ret = client_send(c, bad_request, resp_size);
+	arena_rewind(&c->arena, mark);
+	if (ret != LISO_SUCCESS)
 	{
 
 		fprintf(stderr, "Error sending to client.\n");
-		LISOPRINTF(fp, "sent bad request\n");
-		free(bad_request);
+		LISOPRINTF("sent bad request\n");
 		return -1;
 	}
-	free(bad_request);
 	return 0;
 }
 
@@ -176,175 +338,779 @@ int send_error_response(int client_socket, int error, Request *req)
 void print_parse_req(Request *request)
 {
 	//Print the parsed request for DEBUG
-	LISOPRINTF(fp, "Http Method %s\n", request->http_method);
-	LISOPRINTF(fp, "Http Version %s\n", request->http_version);
-	LISOPRINTF(fp, "Http Uri %s\n", request->http_uri);
-	LISOPRINTF(fp, "number of Request Headers %d\n", request->header_count);
+	LISOPRINTF("Http Method %s\n", request->http_method);
+	LISOPRINTF("Http Version %s\n", request->http_version);
+	LISOPRINTF("Http Uri %s\n", request->http_uri);
+	LISOPRINTF("number of Request Headers %d\n", request->header_count);
 	for (int index = 0; index < request->header_count; index++)
 	{
-		LISOPRINTF(fp, "Request Header\n");
-		LISOPRINTF(fp, "Header name %s Header Value %s\n", request->headers[index].header_name, request->headers[index].header_value);
+		LISOPRINTF("Request Header\n");
+		LISOPRINTF("Header name %s Header Value %s\n", request->headers[index].header_name, request->headers[index].header_value);
 	}
 }
 
 /**
- * @brief Handle a received packet
+ * @brief Free the request a client is in the middle of receiving
  * 
- * @param buf buffer containing the packet
- * @param bufsize size data in the buffer
- * @return ** int >= 0 on success negative otherwise 
+ * @param c client
+ * @return ** void 
  */
-int handle_rx(int client_socket, int *pipefd)
+void free_client_request(client *c)
 {
+	// the request, its body and response all live in the arena
+	c->req = NULL;
+	arena_reset(&c->arena);
 
-	client *c = search_client(client_socket);
-	assert(c != NULL);
+	if (c->chunked != NULL)
+	{
+		chunk_decoder_free(c->chunked);
+		free(c->chunked);
+		c->chunked = NULL;
+	}
+
+	cgi_close_body(c);
+
+	// give the body memory back to everyone else
+	body_memory_used -= c->body_reserved;
+	c->body_reserved = 0;
+
+	c->req_error = LISO_SUCCESS;
+	c->cached_reply = false;
+	c->route = NULL;
+	c->body_left = 0;
+}
+
+/**
+ * @brief Give up filling the cache entry of a request whose script will
+ * not run, requests waiting on it go to the script themselves
+ * 
+ * @param c client of the request
+ * @return ** void 
+ */
+void abandon_cache_fill(client *c)
+{
+	if (c->cache_fill != NULL)
+	{
+		cgi_cache_finish(c->cache_fill, false);
+		c->cache_fill = NULL;
+	}
+}
+
+/**
+ * @brief Release all per connection state of a client before it is freed
+ * 
+ * @param c client being closed
+ * @return ** void 
+ */
+void release_client(client *c)
+{
+	// a request still being answered is recorded as it got so far
+	access_log_end(c);
+	stats.closed++;
+	LISO_TRACE1(conn_close, c->sock);
+	free_client_request(c);
+
+	pool_put(&rx_pool, c->buf);
+	c->buf = NULL;
+	c->buf_left = 0;
+
+	release_tx_buffer(c);
+	c->out_len = 0;
+	c->out_off = 0;
+
+	// a request waiting for a CGI slot gives up its place
+	cgi_dequeue(c);
+	cgi_cache_cancel_wait(c);
+	abandon_cache_fill(c);
+	plugin_cancel(c);
+
+	if (c->cgi_proc != NULL)
+	{
+		// script output has nowhere to go anymore
+		c->cgi_proc->cgi_host = NULL;
+		c->cgi_proc = NULL;
+	}
 
 	if (c->cgi_host != NULL)
 	{
-		// this is a cgi response from script
-		wrap_process_cgi(c);
-		return LISO_CGI_END;
+		c->cgi_host->cgi_proc = NULL;
+		c->cgi_host = NULL;
 	}
 
-	char *buf;
-	int alloc_count = 1;
-	int read_count = 0;
-	int readret;
-	*pipefd = -1;
+	if (c->is_pipe)
+	{
+		// output of a CGI request dropped before it ended, free its slot
+		cgi_load.active--;
+		free(c->fcgi);
+		c->fcgi = NULL;
+		free(c->frame);
+		c->frame = NULL;
+	}
+}
 
-	buf = malloc(BUF_SIZE);
-	if (buf == NULL)
+/**
+ * @brief Grow the in memory body of a request so len more bytes fit,
+ * charging the growth to the global body memory budget
+ * 
+ * @param c client receiving the body
+ * @param len bytes about to be added
+ * @return ** int LISO_SUCCESS on success, LISO_WOULD_BLOCK if the budget is
+ * used up right now, error otherwise
+ */
+int reserve_body_memory(client *c, int len)
+{
+	Request *req = c->req;
+	long need = req->message_len + len;
+
+	if (need > config.max_body)
+	{
+		return LISO_PAYLOAD_TOO_LARGE;
+	}
+
+	if (need <= c->body_reserved)
+	{
+		return LISO_SUCCESS;
+	}
+
+	long size;
+	if (c->chunked == NULL)
+	{
+		// length is known, reserve all of it once
+		size = req->message_len + c->body_left;
+	}
+	else
+	{
+		size = c->body_reserved * 2 > need ? c->body_reserved * 2 : need;
+		if (size > config.max_body)
+		{
+			size = config.max_body;
+		}
+	}
+
+	if (body_memory_used + size - c->body_reserved > config.max_body_memory)
+	{
+		return LISO_WOULD_BLOCK;
+	}
+
+	char *message = arena_grow(&c->arena, req->message,
+							   c->body_reserved > 0 ? c->body_reserved + 1 : 0, size + 1);
+	if (message == NULL)
 	{
 		return LISO_MEM_FAIL;
 	}
 
-	// read everything in OS socket buffer
-	do
+	req->message = message;
+	body_memory_used += size - c->body_reserved;
+	c->body_reserved = size;
+
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Sink for request body bytes. Bodies of CGI requests are streamed
+ * to the script stdin, bodies of requests that will get an error are
+ * dropped and other bodies are kept in req->message.
+ * 
+ * @param ctx client receiving the body
+ * @param data body bytes
+ * @param len number of body bytes
+ * @param accepted [out] number of bytes taken
+ * @return ** int LISO_SUCCESS on success, error otherwise
+ */
+int body_sink(void *ctx, const char *data, int len, int *accepted)
+{
+	client *c = ctx;
+	Request *req = c->req;
+	*accepted = len;
+
+	if (c->req_error != LISO_SUCCESS)
 	{
-		readret = recv(client_socket, buf + read_count, BUF_SIZE, 0);
-		read_count += readret;
+		return LISO_SUCCESS;
+	}
 
-		if (readret >= BUF_SIZE)
+	if (req->is_cgi)
+	{
+		if (c->body_fd < 0)
 		{
-			// reallocate and try to read everything in the socket
-			alloc_count++;
-			LISOPRINTF(fp, "reallocating buffer to size %d \n", BUF_SIZE * alloc_count);
-			buf = realloc(buf, BUF_SIZE * alloc_count);
-			assert(buf != NULL);
+			return LISO_SUCCESS;
 		}
 
-	} while (readret >= BUF_SIZE); // no more data in the socket
+		int error = cgi_write_body(c, data, len, accepted);
+		if (error == LISO_WOULD_BLOCK)
+		{
+			// script stdin is full, continue once it drained
+			c->paused = true;
+			c->body_blocked = true;
+		}
+		else if (error != LISO_SUCCESS)
+		{
+			// script stopped reading, drop the rest of the body
+			LISOPRINTF("CGI stdin closed early\n");
+			cgi_close_body(c);
+			*accepted = len;
+		}
+		return LISO_SUCCESS;
+	}
 
-	if (read_count <= 0)
+	int error = reserve_body_memory(c, len);
+	if (error == LISO_WOULD_BLOCK)
 	{
-		free(buf);
-		return LISO_CLOSE_CONN;
+		// out of body memory, stop reading this client for now
+		LISOPRINTF("pausing socket %d, body memory used %ld\n", c->sock, body_memory_used);
+		*accepted = 0;
+		c->paused = true;
+		return LISO_SUCCESS;
+	}
+	else if (error != LISO_SUCCESS)
+	{
+		return error;
 	}
 
-	// begin processing buffer
-	int cur_to_end_size = read_count;
-	bool pipelined;
-	char *cur_buf = buf;
-	int conn_close = LISO_SUCCESS;
-	LISOPRINTF(fp, "Printing whole request(s) \n");
-	print_req_buf(buf, read_count);
+	memcpy(req->message + req->message_len, data, len);
+	req->message_len += len;
+	req->message[req->message_len] = '\0';
 
-	int req_counter = 0;
-	do
-	{ // respond to all pipelined requests in buffer
-		req_counter++;
-		pipelined = false;
-		assert(cur_to_end_size > 0);
-		// we have all the data that the buffer had
-		//Parse the buffer to the parse function.
-		Request *req = parse(cur_buf, cur_to_end_size, 0);
-
-		// handle data from client
-		if (req == NULL)
-		{
-			// request is malformed
-			LISOPRINTF(fp, "request is malformed\n");
-			send_error_response(client_socket, LISO_BAD_REQUEST, req);
-			conn_close = LISO_SUCCESS;
-			break;
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Send a complete response in CGI output format, e.g. a cached one,
+ * to a client. It is framed for the request like the output of a script.
+ * 
+ * @param c client that sent the request
+ * @param req the request
+ * @param head header block, or all of the output
+ * @param head_len bytes of head
+ * @param body body following the header block, NULL if none
+ * @param body_len bytes of body
+ * @return ** void 
+ */
+void send_framed_output(client *c, Request *req, const char *head, int head_len,
+						const char *body, int body_len)
+{
+	// only ever used for one response at a time
+	static cgi_frame frame;
+
+	cgi_frame_init(&frame, req);
+	int ret = cgi_frame_output(&frame, c, head, head_len);
+	if (ret == LISO_SUCCESS && body_len > 0)
+	{
+		ret = cgi_frame_output(&frame, c, body, body_len);
+	}
+	if (ret == LISO_SUCCESS)
+	{
+		ret = cgi_frame_end(&frame, c);
+	}
+
+	if (ret != LISO_SUCCESS)
+	{
+		if (ret != LISO_CLOSE_CONN && !frame.head_done)
+		{
+			send_error_response(c, ret, NULL);
 		}
+		c->closing = true;
+	}
+	else if (!frame.keep_alive)
+	{
+		c->closing = true;
+	}
+}
 
-		int error = sanity_check(req);
-		int rlen = get_full_request_len(req);
+/**
+ * @brief Answer a CGI request from the cache, wait for a run of the script
+ * for the same response or a free slot, or start the script
+ * 
+ * @param c client that sent the request
+ * @param lookup false to go to the script without looking in the cache
+ * @param pipefd [out] pipe of a started CGI script
+ * @return ** int LISO_CGI_START if the script was started, LISO_WOULD_BLOCK
+ * if the request waits, LISO_SUCCESS if it was answered from the cache or
+ * c->req_error was set
+ */
+int dispatch_cgi_request(client *c, int lookup, int *pipefd)
+{
+	Request *req = c->req;
+	cgi_cache_entry *entry = NULL;
 
-		// get content len of request
-		int clen = 0;
-		int index = get_header_index(req->headers, CONTENT_LEN_HEADER, req->header_count);
+	*pipefd = -1;
+	if (lookup && c->chunked == NULL && c->body_left == 0)
+	{
+		// only requests without a body are looked up
+		int ret = cgi_cache_lookup(c, req, &entry);
+		if (ret == LISO_SUCCESS)
+		{
+			LISO_TRACE2(cache_hit, c->sock, req->http_uri);
+			send_framed_output(c, req, entry->response, entry->len, NULL, 0);
+			c->cached_reply = true;
+			c->access.cache = ACCESS_CACHE_HIT;
+			return LISO_SUCCESS;
+		}
+		if (ret == LISO_WOULD_BLOCK)
+		{
+			return LISO_WOULD_BLOCK;
+		}
+	}
+	c->cache_fill = entry;
+	if (entry != NULL)
+	{
+		LISO_TRACE2(cache_miss, c->sock, req->http_uri);
+		c->access.cache = ACCESS_CACHE_MISS;
+	}
 
-		if (index != LISO_ERROR)
+	if (cgi_queue_head() != NULL || !cgi_slot_free())
+	{
+		// wait behind the requests already queued, the body stays unread
+		c->req_error = cgi_enqueue(c);
+		if (c->req_error == LISO_SUCCESS)
 		{
-			clen = atoi(req->headers[index].header_value);
+			return LISO_WOULD_BLOCK;
 		}
+		abandon_cache_fill(c);
+		return LISO_SUCCESS;
+	}
+
+	*pipefd = start_process_cgi(req, c);
+	if (*pipefd < 0)
+	{
+		c->req_error = LISO_ERROR;
+		abandon_cache_fill(c);
+		return LISO_SUCCESS;
+	}
 
-		req->message = malloc(clen + 1);
-		memcpy(req->message, cur_buf + rlen, clen);
-		req->message[clen] = '\0';
-		req->message_len = clen;
+	return LISO_CGI_START;
+}
+
+/**
+ * @brief Set up receiving the body of a freshly parsed request, the CGI
+ * script is started here so the body streams to it as it arrives
+ * 
+ * @param c client that sent the request
+ * @param req parsed request, owned by the client from now on
+ * @param pipefd [out] pipe of a started CGI script
+ * @return ** int LISO_SUCCESS or LISO_CGI_START on success, LISO_WOULD_BLOCK
+ * if the request waits for a CGI slot, error otherwise in which case the
+ * connection must be closed
+ */
+int start_request(client *c, Request *req, int *pipefd)
+{
+	long content_len;
+	int ret = LISO_SUCCESS;
 
-		// process request
-		if (error != LISO_SUCCESS)
+	c->req = req;
+	req->message = NULL;
+	req->message_len = 0;
+	access_log_start(&c->access, req);
+
+	int error = get_body_framing(req, &content_len);
+	if (error != LISO_SUCCESS)
+	{
+		return error;
+	}
+
+	c->req_error = sanity_check(req);
+
+	c->route = plugin_find(req);
+	if (c->route != NULL)
+	{
+		// answered in process, the body is kept in memory for the handler
+		req->is_cgi = false;
+	}
+	else if (c->req_error == LISO_SUCCESS && !req->is_cgi &&
+			 strcasecmp(req->http_method, "POST") == 0)
+	{
+		// static content takes no body, it is read and dropped
+		c->req_error = LISO_METHOD_NOT_ALLOWED;
+	}
+
+	if (content_len < 0)
+	{
+		c->chunked = malloc(sizeof(chunk_decoder));
+		if (c->chunked == NULL)
 		{
-			send_error_response(client_socket, error, req);
+			return LISO_MEM_FAIL;
 		}
-		else
+		chunk_decoder_init(c->chunked, config.max_chunk_size);
+	}
+	else
+	{
+		c->body_left = content_len;
+		if (!req->is_cgi && c->req_error == LISO_SUCCESS && content_len > config.max_body)
+		{
+			// reject before reading any of it
+			return LISO_PAYLOAD_TOO_LARGE;
+		}
+	}
+
+	if (c->req_error == LISO_SUCCESS && req->is_cgi)
+	{
+		// request is dynamic uri
+		ret = dispatch_cgi_request(c, true, pipefd);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief Feed received bytes to the body of the current request
+ * 
+ * @param c client receiving a body
+ * @param buf received bytes
+ * @param len number of received bytes
+ * @param consumed [out] bytes that belonged to the body
+ * @return ** int LISO_SUCCESS if more body is expected, LISO_BODY_DONE once
+ * the body is complete, LISO_WOULD_BLOCK if the consumer is full, error
+ * otherwise
+ */
+int feed_request_body(client *c, char *buf, int len, int *consumed)
+{
+	*consumed = 0;
+
+	if (c->chunked != NULL)
+	{
+		int ret = chunk_decode(c->chunked, buf, len, consumed, body_sink, c);
+		if (ret == LISO_BODY_DONE && c->chunked->trailer_count > 0)
+		{
+			// merge trailer fields in to the request headers
+			Request *req = c->req;
+			Http_header *headers = arena_grow(&c->arena, req->headers,
+				sizeof(Http_header) * req->header_count,
+				sizeof(Http_header) * (req->header_count + c->chunked->trailer_count));
+			if (headers == NULL)
+			{
+				return LISO_MEM_FAIL;
+			}
+			memcpy(headers + req->header_count, c->chunked->trailers,
+				sizeof(Http_header) * c->chunked->trailer_count);
+			req->headers = headers;
+			req->header_count += c->chunked->trailer_count;
+			c->chunked->trailer_count = 0;
+		}
+		return ret;
+	}
+
+	int n = len < c->body_left ? len : c->body_left;
+	if (n > 0)
+	{
+		int accepted;
+		int ret = body_sink(c, buf, n, &accepted);
+		if (ret != LISO_SUCCESS)
+		{
+			return ret;
+		}
+		c->body_left -= accepted;
+		*consumed = accepted;
+		if (accepted < n)
+		{
+			return LISO_WOULD_BLOCK;
+		}
+	}
+
+	return c->body_left == 0 ? LISO_BODY_DONE : LISO_SUCCESS;
+}
+
+/**
+ * @brief Reply to a request whose body has been received completely
+ * 
+ * @param c client that sent the request
+ * @return ** int LISO_CLOSE_CONN if the connection should be closed,
+ * LISO_CGI_END if the script now has the whole request, LISO_WOULD_BLOCK if
+ * the end of the body could not be passed on yet, LISO_SUCCESS otherwise
+ */
+int finish_request(client *c)
+{
+	Request *req = c->req;
+	int ret = LISO_SUCCESS;
+
+	if (c->req_error != LISO_SUCCESS)
+	{
+		send_error_response(c, c->req_error, req);
+	}
+	else if (c->cached_reply)
+	{
+		// answered from the CGI cache when the request arrived
+	}
+	else if (c->route != NULL)
+	{
+		// LISO_CGI_END if the handler runs on the pool, answered later
+		ret = plugin_serve(c, c->route, req);
+	}
+	else if (req->is_cgi)
+	{
+		// the script has the whole body, closing stdin gives it EOF
+		if (cgi_end_body(c) == LISO_WOULD_BLOCK)
+		{
+			c->paused = true;
+			c->body_blocked = true;
+			return LISO_WOULD_BLOCK;
+		}
+		ret = LISO_CGI_END;
+	}
+	else
+	{
+		generate_and_send_reply(c, req, req->message, req->message_len);
+	}
+
+	if (ret != LISO_CGI_END)
+	{
+		// a script or offloaded handler records it once its output ended
+		access_log_end(c);
+		if (get_conn_header(req) == LISO_CLOSE_CONN)
+		{
+			ret = LISO_CLOSE_CONN;
+		}
+	}
+
+	free_client_request(c);
+	return ret;
+}
+
+/**
+ * @brief Process the data buffered for a client, every complete request
+ * in the buffer is answered and a partial request is left for later
+ * 
+ * @param c client to process
+ * @param pipefd [out] pipe of a CGI script started while processing
+ * @return ** int LISO_CLOSE_CONN if the connection should be closed,
+ * LISO_CGI_START if a script was started, LISO_SUCCESS otherwise
+ */
+int process_rx_buffer(client *c, int *pipefd)
+{
+	int cur_to_end_size = c->buf_left;
+	char *cur_buf = c->buf;
+	int conn_close = LISO_SUCCESS;
+	LISOPRINTF("Printing whole request(s) \n");
+	print_req_buf(c->buf, c->buf_left);
+
+	c->paused = false;
+	*pipefd = -1;
+
+	int req_counter = 0;
+	// a request with no bytes left may still be waiting to finish
+	while (cur_to_end_size > 0 || c->req != NULL)
+	{ // respond to all pipelined requests in buffer
+		if (c->req == NULL && (c->cgi_proc != NULL || c->plugin_job != NULL || c->closing))
 		{
+			// responses go out in order, the script or handler has to
+			// finish the one before, the client is not read until then
+			c->paused = !c->closing;
+			break;
+		}
 
-			LISOPRINTF(fp, "request is good and will be parsed\n");
-			if (req->is_cgi)
+		if (c->req == NULL)
+		{
+			// refuse oversize heads before parsing or reading the rest
+			int error = check_request_head(cur_buf, cur_to_end_size);
+			if (error != LISO_SUCCESS)
+			{
+				LISOPRINTF("request head over limits, error %d\n", error);
+				access_log_start(&c->access, NULL);
+				send_error_response(c, error, NULL);
+				access_log_end(c);
+				conn_close = LISO_CLOSE_CONN;
+				break;
+			}
+
+			if (memmem(cur_buf, cur_to_end_size, "\r\n\r\n", 4) == NULL)
+			{
+				if (cur_to_end_size < config.rx_window)
+				{
+					// rest of the headers are still in flight
+					break;
+				}
+
+				// headers do not fit the receive window
+				access_log_start(&c->access, NULL);
+				send_error_response(c, LISO_HEADERS_TOO_LARGE, NULL);
+				access_log_end(c);
+				conn_close = LISO_CLOSE_CONN;
+				break;
+			}
+
+			req_counter++;
+			if (req_counter > 1)
+			{
+				stats.pipelined++;
+			}
+			//Parse the buffer to the parse function.
+			LISO_TRACE2(parse_start, c->sock, cur_to_end_size);
+			uint64_t parse_start = latency_now();
+			Request *req = parse(cur_buf, cur_to_end_size, 0, &c->arena);
+			latency_since(LATENCY_PARSE, parse_start);
+			LISO_TRACE2(parse_end, c->sock, req != NULL ? req->http_uri : NULL);
+
+			// handle data from client
+			if (req == NULL)
+			{
+				// request is malformed
+				LISOPRINTF("request is malformed\n");
+				access_log_start(&c->access, NULL);
+				send_error_response(c, LISO_BAD_REQUEST, req);
+				access_log_end(c);
+				cur_to_end_size = 0;
+				break;
+			}
+
+			LISOPRINTF("request is good and will be parsed\n");
+			cur_buf += req->request_len;
+			cur_to_end_size -= req->request_len;
+
+			error = start_request(c, req, pipefd);
+			if (error == LISO_CGI_START)
 			{
-				// request is dynamic uri
-				*pipefd = start_process_cgi(req, c);
 				conn_close = LISO_CGI_START;
-				free(req->headers);
-				free(req->message);
-				free(req);
+			}
+			else if (error == LISO_WOULD_BLOCK)
+			{
+				// queued for a CGI slot, not read until it gets one
+				c->paused = true;
 				break;
-				// wrap_process_cgi(*pipefd, client_socket);
 			}
-			else
+			else if (error != LISO_SUCCESS)
 			{
-				generate_and_send_reply(client_socket, req, buf, rlen);
+				// body framing is unknown, can't find the next request
+				send_error_response(c, error, req);
+				access_log_end(c);
+				free_client_request(c);
+				conn_close = LISO_CLOSE_CONN;
+				break;
 			}
 		}
 
-		if (get_conn_header(req) == LISO_CLOSE_CONN)
+		int consumed;
+		int ret = feed_request_body(c, cur_buf, cur_to_end_size, &consumed);
+		cur_buf += consumed;
+		cur_to_end_size -= consumed;
+
+		if (ret == LISO_SUCCESS || ret == LISO_WOULD_BLOCK)
 		{
-			LISOPRINTF(fp, "GOt connection close for req number %d", req_counter);
+			// rest of the body is still in flight or the consumer is full
+			break;
+		}
+
+		if (ret != LISO_BODY_DONE)
+		{
+			LISOPRINTF("bad request body for req number %d\n", req_counter);
+			send_error_response(c, ret, c->req);
+			access_log_end(c);
+			free_client_request(c);
 			conn_close = LISO_CLOSE_CONN;
-			free(req->headers);
-			free(req->message);
-			free(req);
+			break;
+		}
+
+		ret = finish_request(c);
+		if (ret == LISO_WOULD_BLOCK)
+		{
+			// finished once the script takes the end of the body
+			break;
+		}
+
+		if (ret == LISO_CLOSE_CONN)
+		{
+			LISOPRINTF("GOt connection close for req number %d", req_counter);
+			conn_close = LISO_CLOSE_CONN;
+			break;
+		}
+
+		LISOPRINTF("Processing another pipelined request cur_to_end_size %d\n", cur_to_end_size);
+	}
+
+	LISOPRINTF("Processed %d pipelined requests", req_counter);
+
+	// keep what is left for the next packet
+	if (cur_to_end_size > 0 && cur_buf != c->buf)
+	{
+		memmove(c->buf, cur_buf, cur_to_end_size);
+	}
+	c->buf_left = cur_to_end_size;
+
+	if (c->buf_left == 0)
+	{
+		// nothing buffered, an idle connection holds no buffer
+		pool_put(&rx_pool, c->buf);
+		c->buf = NULL;
+	}
+
+	// start the clock on a request head that is not complete yet
+	if (c->req == NULL && c->buf_left > 0)
+	{
+		if (c->header_start == 0)
+		{
+			c->header_start = time(NULL);
+		}
+	}
+	else
+	{
+		c->header_start = 0;
+	}
+
+	return conn_close;
+}
+
+/**
+ * @brief Handle a received packet
+ * 
+ * At most one receive window of data is buffered per connection, a
+ * request whose headers or body are not complete yet stays attached to
+ * the client and continues with the next packet.
+ * 
+ * @param client_socket socket with data
+ * @param pipefd [out] pipe of a CGI script started for this packet
+ * @return ** int >= 0 on success negative otherwise 
+ */
+int handle_rx(int client_socket, int *pipefd)
+{
 
-			break;
-		}
+	client *c = search_client(client_socket);
+	assert(c != NULL);
+	*pipefd = -1;
 
-		// check if requests are pipelined
+	if (c->is_pipe)
+	{
+		// this is a cgi response from script
+		return forward_cgi_output(c);
+	}
 
-		if (rlen < cur_to_end_size)
+	if (c->buf == NULL)
+	{
+		c->buf = pool_get(&rx_pool);
+		if (c->buf == NULL)
 		{
-			// we have pipelined requests handle them
-			pipelined = true;
-			cur_to_end_size = cur_to_end_size - rlen;
-			cur_buf = cur_buf + rlen;
-			LISOPRINTF(fp, "Processing another pipelined request cur_to_end_size %d rlen %d, parse len %d\n", cur_to_end_size, rlen, req->request_len);
+			return LISO_MEM_FAIL;
 		}
+		c->buf_left = 0;
+	}
+
+	int space = config.rx_window - c->buf_left;
+	if (space == 0)
+	{
+		// window is full until the consumer takes some of it
+		c->paused = true;
+		return LISO_SUCCESS;
+	}
+
+	int readret = recv(client_socket, c->buf + c->buf_left, space, 0);
+	if (readret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	{
+		// spurious wake up, sockets are non-blocking
+		return LISO_SUCCESS;
+	}
 
-		free(req->headers);
-		free(req->message);
-		free(req);
+	if (readret <= 0)
+	{
+		return LISO_CLOSE_CONN;
+	}
+	c->buf_left += readret;
+	stats.bytes_in += readret;
 
-		LISOPRINTF(fp, "Processed %d pipelined requests", req_counter);
-	} while (pipelined == true);
+	if (c->accepted_at != 0)
+	{
+		latency_since(LATENCY_FIRST_BYTE, c->accepted_at);
+		c->accepted_at = 0;
+	}
 
+	int conn_close = process_rx_buffer(c, pipefd);
 	reinsert_client(c);
-	// SUCCESS
-	free(buf);
+
 	return conn_close;
 }
 
@@ -361,7 +1127,7 @@ int initialize_listen_socket(int listen_port, struct sockaddr_in *addr)
 	int listen_sock;
 
 	/* create our listen socket */
-	if ((listen_sock = socket(PF_INET, SOCK_STREAM, 0)) == -1)
+	if ((listen_sock = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1)
 	{
 		fprintf(stderr, "Failed creating socket.\n");
 		return -1;
@@ -393,6 +1159,47 @@ int initialize_listen_socket(int listen_port, struct sockaddr_in *addr)
 	return listen_sock;
 }
 
+/**
+ * @brief Decide whether a failed accept4() can be ignored. Running out of
+ * descriptors is transient: the spare descriptor is given up to accept and
+ * close the connection at the head of the backlog, otherwise the listen
+ * socket would stay readable and select() would spin on it.
+ * 
+ * @param listen_sock listen socket accept4() failed on
+ * @param error errno of the failed call
+ * @return ** int LISO_SUCCESS if the server can carry on, LISO_ERROR otherwise
+ */
+int accept_error_is_transient(int listen_sock, int error)
+{
+	switch (error)
+	{
+	case EMFILE:
+	case ENFILE:
+		LISO_LOG(LISO_LOG_WARN, "refused connection, out of descriptors\n");
+		if (spare_fd >= 0)
+		{
+			close(spare_fd);
+			int sock = accept4(listen_sock, NULL, NULL, SOCK_CLOEXEC);
+			if (sock >= 0)
+			{
+				close(sock);
+			}
+			spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+		}
+		return LISO_SUCCESS;
+	case EINTR:
+	case EAGAIN:
+	case ECONNABORTED:
+	case EPROTO:
+	case ENOBUFS:
+	case ENOMEM:
+		// the connection went away or the kernel is short for a moment
+		return LISO_SUCCESS;
+	default:
+		return LISO_ERROR;
+	}
+}
+
 /**
  * internal signal handler
  */
@@ -401,11 +1208,24 @@ void signal_handler(int sig)
 	switch (sig)
 	{
 	case SIGHUP:
-		/* rehash the server */
+		/* reopen the log files after they were rotated */
+		log_reopen();
+		access_log_reopen();
+		break;
+	case SIGUSR1:
+		/* log latency percentiles */
+		latency_request_dump();
+		break;
+	case SIGUSR2:
+		/* switch debug logging on or off */
+		log_toggle_debug();
 		break;
 	case SIGTERM:
+		/* one-shot scripts have groups of their own, pool workers share ours */
+		cgi_terminate_all();
 		killpg(getpid(), SIGTERM);
 		/* finalize and shutdown the server */
+		access_log_flush();
 		exit(EXIT_SUCCESS);
 		break;
 	default:
@@ -437,7 +1257,7 @@ int daemonize(char *lock_file)
 	dup(i); /* stderr */
 	umask(027);
 
-	lfp = open(lock_file, O_RDWR | O_CREAT, 0640);
+	lfp = open(lock_file, O_RDWR | O_CREAT | O_CLOEXEC, 0640);
 
 	if (lfp < 0)
 		exit(EXIT_FAILURE); /* can not open */
@@ -449,14 +1269,309 @@ int daemonize(char *lock_file)
 	sprintf(str, "%d\n", getpid());
 	write(lfp, str, strlen(str)); /* record pid to lockfile */
 
-	signal(SIGCHLD, SIG_IGN); /* child terminate signal */
+	/* children are reaped by waitpid so their exit status is seen,
+	 * SIG_IGN would have the kernel reap them first */
+	signal(SIGCHLD, SIG_DFL); /* child terminate signal */
 
 	signal(SIGHUP, signal_handler);	 /* hangup signal */
+	signal(SIGUSR1, signal_handler); /* latency dump */
+	signal(SIGUSR2, signal_handler); /* debug logging toggle */
 	signal(SIGTERM, signal_handler); /* software termination signal from kill */
 
 	return EXIT_SUCCESS;
 }
 
+/**
+ * @brief Close a client connection and free it
+ * 
+ * @param c client to close
+ * @param master_set select set of sockets to read
+ * @return ** void 
+ */
+void close_client(client *c, fd_set *master_set)
+{
+	int sock = c->sock;
+	close_socket(sock);
+	FD_CLR(sock, master_set);
+	delete_client(c);
+	release_client(c);
+	free_client(c);
+	LISOPRINTF("closed connection %d\n", sock);
+}
+
+/**
+ * @brief Close connections that are too slow sending a request head, a
+ * head has to arrive within header_timeout and, after header_grace, at
+ * min_header_rate bytes/sec at least. Trickling bytes does not help since
+ * the clock starts with the first byte of the head.
+ * 
+ * @param master_set select set of sockets to read
+ * @return ** void 
+ */
+void check_header_deadlines(fd_set *master_set)
+{
+	int slow[FD_SETSIZE];
+	int count = 0;
+	time_t now = time(NULL);
+
+	for (client *c = get_clients(); c != NULL && count < FD_SETSIZE; c = c->next)
+	{
+		if (c->is_pipe || c->header_start == 0)
+		{
+			continue;
+		}
+
+		time_t elapsed = now - c->header_start;
+		if (elapsed > config.header_timeout ||
+			(elapsed > config.header_grace && c->buf_left / elapsed < config.min_header_rate))
+		{
+			slow[count++] = c->sock;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		client *c = search_client(slow[i]);
+		LISOPRINTF("request head too slow on socket %d, %d bytes\n", c->sock, c->buf_left);
+		stats.header_timeouts++;
+		LISO_TRACE2(timeout, c->sock, TRACE_TIMEOUT_HEADER);
+		send_error_response(c, LISO_TIMEOUT, NULL);
+		close_client(c, master_set);
+	}
+}
+
+/**
+ * @brief End CGI requests that ran past cgi_timeout. The script is
+ * terminated, a client that got no response head yet is sent 504 and
+ * either way the client is closed since its response can not be finished.
+ * 
+ * @param master_set select set of sockets to read
+ * @return ** void 
+ */
+void check_cgi_deadlines(fd_set *master_set)
+{
+	int late[FD_SETSIZE];
+	int count = 0;
+	time_t now = time(NULL);
+
+	for (client *c = get_clients(); c != NULL && count < FD_SETSIZE; c = c->next)
+	{
+		if (c->is_pipe && c->cgi_deadline != 0 && now >= c->cgi_deadline)
+		{
+			late[count++] = c->sock;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		client *cgi_client = search_client(late[i]);
+
+		LISO_LOG(LISO_LOG_WARN, "CGI request timed out after %ld seconds\n", config.cgi_timeout);
+		LISO_TRACE2(timeout, cgi_client->cgi_host != NULL ? cgi_client->cgi_host->sock : -1,
+					TRACE_TIMEOUT_CGI);
+		cgi_load.timed_out++;
+		FD_CLR(late[i], master_set);
+		cgi_abort_output(cgi_client, LISO_GATEWAY_TIMEOUT);
+	}
+}
+
+/**
+ * @brief Act on what handle_rx or process_rx_buffer returned for a socket
+ * 
+ * @param sock socket that was handled
+ * @param rx_ret value returned for it
+ * @param pipe_fd pipe of a CGI script started while handling, -1 if none
+ * @param master_set select set of sockets to read
+ * @param fdrange [in,out] highest fd in master_set
+ * @return ** void 
+ */
+void handle_rx_result(int sock, int rx_ret, int pipe_fd, fd_set *master_set, int *fdrange)
+{
+	if (pipe_fd >= 0)
+	{
+		// we have a cgi script running add
+		// pipe to select FDs
+		if (pipe_fd > *fdrange)
+		{
+			*fdrange = pipe_fd;
+		}
+
+		FD_SET(pipe_fd, master_set);
+	}
+
+	// new data from an existing client
+	if (rx_ret == LISO_CLOSE_CONN)
+	{
+		client *c = search_client(sock);
+		if (c->out_len > 0)
+		{
+			// close once the queued responses are out
+			c->closing = true;
+		}
+		else
+		{
+			// client connection closed
+			close_client(c, master_set);
+		}
+	}
+	else if (rx_ret == LISO_CGI_END)
+	{
+		// cgi script ended remove from select
+		FD_CLR(sock, master_set);
+	}
+}
+
+/**
+ * @brief Send queued output of a client select() found writable
+ * 
+ * @param sock writable socket
+ * @param master_set select set of sockets to read
+ * @return ** int LISO_CLOSE_CONN if the client was closed, LISO_SUCCESS
+ * otherwise
+ */
+int handle_tx(int sock, fd_set *master_set)
+{
+	client *c = search_client(sock);
+	if (c == NULL)
+	{
+		return LISO_SUCCESS;
+	}
+
+	int queued = c->out_len;
+	c->tx_blocked = false;
+	if (flush_client(c) != LISO_SUCCESS || (c->closing && c->out_len == 0))
+	{
+		close_client(c, master_set);
+		return LISO_CLOSE_CONN;
+	}
+
+	if (c->out_len < queued)
+	{
+		// the client is reading, it is not idle
+		reinsert_client(c);
+	}
+
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Give paused clients another go at their buffered data, the
+ * consumer that paused them may have caught up by now. A client waiting
+ * for a full CGI stdin is only resumed once select() found it writable.
+ * 
+ * @param master_set select set of sockets to read
+ * @param fdrange [in,out] highest fd in master_set
+ * @param write_set fds select() found writable
+ * @return ** void 
+ */
+void resume_paused_clients(fd_set *master_set, int *fdrange, fd_set *write_set)
+{
+	int paused[FD_SETSIZE];
+	int count = 0;
+
+	// processing reorders the list, so collect first
+	for (client *c = get_clients(); c != NULL && count < FD_SETSIZE; c = c->next)
+	{
+		if (c->paused && !c->cgi_queued && c->cache_wait == NULL && !c->cache_woken &&
+			((c->cgi_proc == NULL && c->plugin_job == NULL) || c->req != NULL) && !c->closing &&
+			(!c->body_blocked || FD_ISSET(c->body_fd, write_set)))
+		{
+			paused[count++] = c->sock;
+		}
+	}
+
+	for (int i = 0; i < count; i++)
+	{
+		int pipe_fd;
+		client *c = search_client(paused[i]);
+		c->body_blocked = false;
+		int rx_ret = process_rx_buffer(c, &pipe_fd);
+		handle_rx_result(paused[i], rx_ret, pipe_fd, master_set, fdrange);
+	}
+}
+
+/**
+ * @brief Start queued CGI requests while slots are free and turn away the
+ * ones that waited longer than cgi_queue_timeout. Either way the client is
+ * left paused, resume_paused_clients then feeds the body to the script or
+ * drops it and sends the 503.
+ * 
+ * @param master_set select set of sockets to read
+ * @param fdrange [in,out] highest fd in master_set
+ * @return ** void 
+ */
+void admit_cgi_clients(fd_set *master_set, int *fdrange)
+{
+	time_t now = time(NULL);
+	client *c;
+
+	while ((c = cgi_queue_head()) != NULL)
+	{
+		if (now - c->cgi_queued_at >= config.cgi_queue_timeout)
+		{
+			cgi_dequeue(c);
+			cgi_load.expired++;
+			LISO_TRACE2(timeout, c->sock, TRACE_TIMEOUT_CGI_QUEUE);
+			LISO_LOG(LISO_LOG_WARN, "CGI request on socket %d waited too long, %ld waiting\n",
+					c->sock, cgi_load.queued);
+			c->req_error = LISO_SERVICE_UNAVAILABLE;
+			abandon_cache_fill(c);
+			continue;
+		}
+
+		if (!cgi_slot_free())
+		{
+			break;
+		}
+
+		cgi_dequeue(c);
+		cgi_load.admitted++;
+		int pipe_fd = start_process_cgi(c->req, c);
+		if (pipe_fd < 0)
+		{
+			c->req_error = LISO_ERROR;
+			abandon_cache_fill(c);
+			continue;
+		}
+
+		if (pipe_fd > *fdrange)
+		{
+			*fdrange = pipe_fd;
+		}
+		FD_SET(pipe_fd, master_set);
+		reinsert_client(c);
+	}
+}
+
+/**
+ * @brief Dispatch again the requests that waited for another run of the
+ * script to fill the CGI cache. They are left paused, resume_paused_clients
+ * carries on with them unless they wait once more.
+ * 
+ * @param master_set select set of sockets to read
+ * @param fdrange [in,out] highest fd in master_set
+ * @return ** void 
+ */
+void dispatch_cache_waiters(fd_set *master_set, int *fdrange)
+{
+	client *c;
+	int pass;
+
+	while ((c = cgi_cache_next_woken(&pass)) != NULL)
+	{
+		int pipe_fd;
+		if (dispatch_cgi_request(c, !pass, &pipe_fd) == LISO_CGI_START)
+		{
+			if (pipe_fd > *fdrange)
+			{
+				*fdrange = pipe_fd;
+			}
+			FD_SET(pipe_fd, master_set);
+		}
+		reinsert_client(c);
+	}
+}
+
 /**
  * @brief Main driver function for LISO
  * 
@@ -472,48 +1587,111 @@ int main(int argc, char *argv[])
 	int listen_sock, client_sock;
 	socklen_t cli_size;
 	struct sockaddr_in addr, cli_addr;
-	char buf[BUF_SIZE];
 
 	// get listen port from command line arguments
 	if (argc < 6)
 	{
 		fprintf(stderr, "Invalid arguments.\n");
-		fprintf(stderr, "Usage ./lisod <HTTP port> <log file> <lock file> <www folder> <CGI script path>\n");
+		fprintf(stderr, "Usage ./lisod <HTTP port> <log file> <lock file> <www folder> <CGI script path> [name=value ...] [plugin=<path> ...]\n");
+		fprintf(stderr, "Options and their defaults:\n");
+		print_config_options(stderr);
+		return -1;
+	}
+
+	// optional tunables and plugins
+	for (int i = 6; i < argc; i++)
+	{
+		if (strncmp(argv[i], "plugin=", strlen("plugin=")) == 0)
+		{
+			// loaded before daemonizing so errors reach the terminal
+			if (plugin_load(argv[i] + strlen("plugin=")) != LISO_SUCCESS)
+			{
+				return -1;
+			}
+		}
+		else if (set_config_option(argv[i]) != LISO_SUCCESS)
+		{
+			fprintf(stderr, "Invalid option %s\n", argv[i]);
+			return -1;
+		}
+	}
+
+	if (config.server_status && stats_init() != LISO_SUCCESS)
+	{
+		fprintf(stderr, "Serving %s failed.\n", STATS_URI);
 		return -1;
 	}
+
+	if (config.max_header_bytes > config.rx_window)
+	{
+		// a request head has to fit the receive window
+		config.max_header_bytes = config.rx_window;
+	}
+	pool_init_buffers(&rx_pool, config.rx_window, config.io_buffer_pool);
+	pool_init_buffers(&tx_pool, config.tx_window, config.io_buffer_pool);
+
 	int listen_port = atoi(argv[1]);
+	server_port = listen_port;
 
 	strncpy(LISO_PATH, argv[4], strlen(argv[4]) + 1);
 
 	daemonize(argv[3]);
 
-	// initialize logfile
-	fp = fopen(argv[2], "a+");
-	if (fp == NULL)
+	// initialize logfile, written by the log thread
+	log_level = config.log_level;
+	if (log_open(argv[2]) != 0)
 	{
-
 		perror("logfile open failed\n");
+		return EXIT_FAILURE;
+	}
+	LISO_LOG(LISO_LOG_INFO, "started on port %d with logfile %s\n", listen_port, argv[2]);
+
+	if (config.access_log_sample > 0)
+	{
+		// binary records next to the log, see access_dump
+		char access_path[PATH_MAX];
+		snprintf(access_path, sizeof(access_path), "%s.access", argv[2]);
+		if (access_log_open(access_path) != 0)
+		{
+			perror("access log open failed\n");
+			return EXIT_FAILURE;
+		}
 	}
-	fflush(stdout);
-	assert(fp != NULL);
-	setvbuf(fp, (char *)NULL, _IONBF, 0);
-	LISOPRINTF(fp, "started in logfile in %s\n", argv[2]);
 	strncpy(cgi_script, argv[5], BUF_SIZE);
 
 	// install sigpipe handler
 	sigaction(SIGPIPE, &(struct sigaction){SIG_IGN}, NULL);
 
+	if (config.cgi_workers > 0)
+	{
+		// workers speak FastCGI on a socket next to the lock file
+		char pool_path[BUF_SIZE];
+		snprintf(pool_path, sizeof(pool_path), "%s.fcgi", argv[3]);
+		if (fcgi_pool_start(cgi_script, pool_path, config.cgi_workers) != LISO_SUCCESS)
+		{
+			fprintf(stderr, "Starting CGI workers failed.\n");
+			return -1;
+		}
+	}
+
+	if (plugin_start(config.plugin_threads) != LISO_SUCCESS)
+	{
+		fprintf(stderr, "Starting plugin threads failed.\n");
+		return -1;
+	}
+
 	if ((listen_sock = initialize_listen_socket(listen_port, &addr)) < 0)
 	{
 		fprintf(stderr, "Initialize of listen socket failed.\n");
 		return -1;
 	}
 
-	LISOPRINTF(fp, "lisopath given is %s\n", LISO_PATH);
+	LISOPRINTF("lisopath given is %s\n", LISO_PATH);
 
 	// initialize file descriptor set for select
 	fd_set master_set; // master file descriptor list
 	fd_set tenp_set;   // temp file descriptor list for select()
+	fd_set write_set;  // sockets with queued output
 	int fdrange;	   // maximum file descriptor number
 	FD_ZERO(&master_set);
 	FD_ZERO(&tenp_set);
@@ -521,18 +1699,70 @@ int main(int argc, char *argv[])
 	FD_SET(listen_sock, &master_set);
 	fdrange = listen_sock;
 
+	// kept so a connection can still be refused when descriptors run out
+	spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
 	// Main Server Loop
 	while (1)
 	{
 
 		// set up select time out
+		// wake up every second to enforce request head deadlines
 		struct timeval timeout;
-		timeout.tv_sec = 10;
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
 		// copy master set to temporary set
 		tenp_set = master_set;
+		FD_ZERO(&write_set);
+		int maxfd = fdrange;
+
+		for (client *c = get_clients(); c != NULL; c = c->next)
+		{
+			// paused clients are not read until their consumer catches up
+			if (c->paused || c->closing)
+			{
+				FD_CLR(c->sock, &tenp_set);
+			}
+
+			// script output waits while its client has a full window queued
+			if (c->is_pipe && c->cgi_host != NULL &&
+				(c->cgi_host->out_len >= config.tx_window || c->cgi_host->tx_blocked))
+			{
+				FD_CLR(c->sock, &tenp_set);
+			}
+
+			// a closing client is closed by handle_tx once it drained
+			if (c->out_len > 0 || c->tx_blocked || c->closing)
+			{
+				FD_SET(c->sock, &write_set);
+			}
+
+			// CGI stdin that was full
+			if (c->body_blocked)
+			{
+				FD_SET(c->body_fd, &write_set);
+				maxfd = c->body_fd > maxfd ? c->body_fd : maxfd;
+			}
+		}
+
+		// running scripts, readable once they exit
+		maxfd = cgi_watch_children(&tenp_set, maxfd);
+
+		// offloaded plugin handlers that finished
+		int plugin_fd = plugin_event_fd();
+		if (plugin_fd >= 0)
+		{
+			FD_SET(plugin_fd, &tenp_set);
+			maxfd = plugin_fd > maxfd ? plugin_fd : maxfd;
+		}
 
-		if (select(fdrange + 1, &tenp_set, NULL, NULL, &timeout) == -1)
+		if (select(maxfd + 1, &tenp_set, &write_set, NULL, &timeout) == -1)
 		{
+			if (errno == EINTR)
+			{
+				// a signal was handled, e.g. SIGHUP to reopen the log
+				continue;
+			}
 			// select failed
 			fprintf(stderr, "select call failed\n");
 			close_socket(listen_sock);
@@ -540,6 +1770,24 @@ int main(int argc, char *argv[])
 			return EXIT_FAILURE;
 		}
 
+		// reap scripts first, their pidfds are not clients
+		cgi_check_children(&tenp_set);
+
+		if (plugin_fd >= 0 && FD_ISSET(plugin_fd, &tenp_set))
+		{
+			plugin_complete();
+			FD_CLR(plugin_fd, &tenp_set);
+		}
+
+		// send queued output first, a client closed here is not read
+		for (int i = 0; i < fdrange + 1; i++)
+		{
+			if (FD_ISSET(i, &write_set) && handle_tx(i, &master_set) == LISO_CLOSE_CONN)
+			{
+				FD_CLR(i, &tenp_set);
+			}
+		}
+
 		// iterate over all to see which one has new data
 		for (int i = 0; i < fdrange + 1; i++)
 		{
@@ -551,19 +1799,33 @@ int main(int argc, char *argv[])
 				{
 					// we have a new connection handle it'
 					cli_size = sizeof(cli_addr);
-					if ((client_sock = accept(listen_sock, (struct sockaddr *)&cli_addr,
-											  &cli_size)) == -1)
+					if ((client_sock = accept4(listen_sock, (struct sockaddr *)&cli_addr,
+											  &cli_size, SOCK_CLOEXEC | SOCK_NONBLOCK)) == -1)
 					{
+						if (accept_error_is_transient(listen_sock, errno) == LISO_SUCCESS)
+						{
+							continue;
+						}
 						close(listen_sock);
 						fprintf(stderr, "Error accepting connection.\n");
 						return EXIT_FAILURE;
 					}
+					else if (client_sock >= FD_SETSIZE)
+					{
+						// select() can not watch it, FD_SET would write past
+						// the end of the set
+						LISO_LOG(LISO_LOG_WARN, "refused connection on socket %d, at most %d descriptors\n",
+								 client_sock, FD_SETSIZE);
+						close(client_sock);
+					}
 					else
 					{
 						// successfully accepted a new connection, add it to
 						// and master set
-						LISOPRINTF(fp, "accepted a new connection\n");
+						LISOPRINTF("accepted a new connection\n");
 						add_new_client(client_sock, (struct sockaddr_in *)&cli_addr);
+						stats.accepted++;
+						LISO_TRACE2(conn_accept, client_sock, ntohs(cli_addr.sin_port));
 
 						if (client_sock > fdrange)
 						{
@@ -578,50 +1840,51 @@ int main(int argc, char *argv[])
 
 					int pipe_fd;
 					int rx_ret = handle_rx(i, &pipe_fd);
-					// new data from an existing client
-					if (rx_ret == LISO_CLOSE_CONN)
-					{
-						// client connection closed
-						client *c = search_client(i);
-						close_socket(i);
-						FD_CLR(i, &master_set);
-						delete_client(c);
-						free(c);
-						LISOPRINTF(fp, "closed connection %d\n", i);
-					}
-					else if (rx_ret == LISO_CGI_START)
-					{
-
-						// we have a cgi script running add
-						// pipe to select FDs
-						if (pipe_fd > fdrange)
-						{
-							fdrange = pipe_fd;
-						}
-
-						FD_SET(pipe_fd, &master_set);
-					}
-					else if (rx_ret == LISO_CGI_END)
-					{
-						// cgi script ended remove from select
-						FD_CLR(i, &master_set);
-					}
-
-					memset(buf, 0, BUF_SIZE);
+					handle_rx_result(i, rx_ret, pipe_fd, &master_set, &fdrange);
 				}
 			}
 		}
 
+		dispatch_cache_waiters(&master_set, &fdrange);
+		admit_cgi_clients(&master_set, &fdrange);
+		resume_paused_clients(&master_set, &fdrange, &write_set);
+		check_header_deadlines(&master_set);
+		check_cgi_deadlines(&master_set);
+
+		if (config.cgi_workers > 0)
+		{
+			// respawn CGI workers that exited
+			fcgi_pool_check();
+		}
+
+		// write access log records that waited long enough
+		access_log_tick();
+		latency_tick();
+
 		// check for timed out sockets
-		LISOPRINTF(fp, "going to check for timeouts\n");
+		LISOPRINTF("going to check for timeouts\n");
 		client *timeout_client;
 		while ((timeout_client = check_timeout()) != NULL)
 		{
-			send_error_response(timeout_client->sock, LISO_TIMEOUT, NULL);
+			if (timeout_client->is_pipe || timeout_client->cgi_proc != NULL ||
+				timeout_client->plugin_job != NULL ||
+				timeout_client->cgi_queued || timeout_client->cache_wait != NULL ||
+				timeout_client->cache_woken)
+			{
+				// waiting on a script, cgi_timeout and cgi_queue_timeout
+				// bound that instead of the idle timeout
+				add_client(timeout_client);
+				continue;
+			}
+
+			stats.idle_timeouts++;
+			LISO_TRACE2(timeout, timeout_client->sock, TRACE_TIMEOUT_IDLE);
+			send_error_response(timeout_client, LISO_TIMEOUT, NULL);
 			close_socket(timeout_client->sock);
 			FD_CLR(timeout_client->sock, &master_set);
-			LISOPRINTF(fp, "timeeout for socket %d\n", timeout_client->sock);
-			free(timeout_client);
+			LISOPRINTF("timeeout for socket %d\n", timeout_client->sock);
+			release_client(timeout_client);
+			free_client(timeout_client);
 		}
 	}
 
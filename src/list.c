@@ -14,6 +14,7 @@
  */
 
 #include "list.h"
+#include "pool.h"
 #include <stdlib.h>
 #include <assert.h>
 #include <stdio.h>
@@ -26,7 +27,34 @@
 // globals
 static client *root = NULL;
 static client *end = NULL;
-extern FILE* fp;
+static pool client_pool;
+
+/**
+ * @brief Allocate a client from the client slab pool
+ * 
+ * @return ** client* zeroed client, NULL if out of memory
+ */
+client* new_client() {
+	if(client_pool.size == 0) {
+		pool_init_slab(&client_pool, sizeof(client));
+	}
+
+	client *c = pool_get(&client_pool);
+	if(c != NULL) {
+		memset(c, 0, sizeof(client));
+	}
+	return c;
+}
+
+/**
+ * @brief Give a client that is not in the list back to the pool
+ * 
+ * @param c client to free
+ * @return ** void 
+ */
+void free_client(client *c) {
+	pool_put(&client_pool, c);
+}
 
 /**
  * @brief Search a client in the list
@@ -139,6 +167,15 @@ client* check_timeout() {
 	return NULL;
 }
 
+/**
+ * @brief Get the first client in the list, the rest follow through next
+ * 
+ * @return ** client* first client, NULL if the list is empty
+ */
+client* get_clients() {
+	return root;
+}
+
 /**
  * @brief Reinsert client in the list i.e. reset timeout
  * 
@@ -0,0 +1,1218 @@
+/**
+ * @file loadgen.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief HTTP load generator for LISO
+ *
+ * Every thread drives its share of the connections from its own epoll
+ * instance. A connection keeps up to the pipeline depth of requests in
+ * flight, with -C every request gets a connection of its own. Requests
+ * are the default GET (or POST with -P), or taken round-robin from request
+ * files like cp1/sample_request_*, a file can hold several requests.
+ *
+ * By default the generator runs closed loop, a connection sends its next
+ * request once a response came back. With -R it runs open loop at a
+ * constant rate: request k of a thread is due at start + k / rate and is
+ * timed from when it was due, not from when it could be sent, so a
+ * stalled server is charged for the requests that queued up behind the
+ * stall (coordinated omission). The time from the actual send is kept as
+ * the service time.
+ *
+ * Latencies go to the log-linear histograms of latency.c, one per thread,
+ * merged once the run is over.
+ *
+ * @version 0.1
+ * @date 2021-11-08
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include "latency.h"
+
+// Constants
+#define LG_MAX_THREADS 64
+#define LG_MAX_MIX 256
+#define LG_MAX_PIPELINE 64
+#define LG_MAX_FILE (1 << 20)
+#define LG_IN_SIZE 65536			// receive buffer, a response head must fit
+#define LG_IDLE_IN_SIZE 4096		// receive buffer of an idle connection
+#define LG_EVENTS 256
+#define LG_POLL_MS 100				// longest wait before the stop flag is checked
+#define LG_STALL_SECS 10			// no byte for this long ends the run
+#define LG_DEFAULT_DURATION 10
+#define LG_NAME_SIZE 64
+#define NS_PER_SEC 1000000000ULL
+
+enum conn_states {
+	CONN_CLOSED = 0,
+	CONN_CONNECTING,
+	CONN_OPEN,
+};
+
+enum resp_states {
+	RESP_HEAD = 0,
+	RESP_BODY,
+	RESP_CHUNK_SIZE,
+	RESP_CHUNK_DATA,
+	RESP_CHUNK_END,
+	RESP_TRAILER,
+	RESP_UNTIL_CLOSE,
+};
+
+// a request of the mix
+typedef struct {
+	char *data;
+	int len;
+	bool head;					// HEAD, the response has no body
+} lg_request;
+
+// a request waiting for its response
+typedef struct {
+	uint64_t intended;			// when it was due
+	uint64_t sent;				// when it was queued to be sent
+	bool head;
+} lg_inflight;
+
+typedef struct {
+	int fd;
+	int state;					// enum conn_states
+	bool idle;					// held open after one request
+	bool want_out;				// EPOLLOUT is set
+	lg_inflight ring[LG_MAX_PIPELINE];
+	int ring_first;
+	int inflight;
+	char *out;
+	int out_off;
+	int out_len;
+	int out_cap;
+	char *in;
+	int in_len;
+	int in_cap;
+	int resp_state;				// enum resp_states
+	int status;
+	long body_left;
+	bool close_after;
+} lg_conn;
+
+typedef struct {
+	int id;
+	pthread_t tid;
+	int epfd;
+	int timerfd;				// open loop, fires when the next request is due
+	lg_conn *conns;				// load connections, then idle ones
+	int load_count;
+	int conn_count;
+	long quota;					// requests to send, -1 for no limit
+	long started;
+	long inflight;
+	uint64_t interval;			// open loop, ns between sends, 0 for closed loop
+	uint64_t next_intended;
+	int next_conn;
+	int mix_next;
+	uint64_t start;
+	uint64_t deadline;
+	uint64_t last_progress;
+	uint64_t elapsed;
+	// results
+	long completed;
+	long errors;
+	long timeouts;
+	long connects;
+	long connect_errors;
+	long idle_open;
+	long idle_closed;
+	long status[6];
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	latency_hist latency;		// from when a request was due
+	latency_hist service;		// from when it was sent
+} lg_worker;
+
+typedef struct {
+	char host[NI_MAXHOST];
+	char port[NI_MAXSERV];
+	struct sockaddr_storage addr;
+	socklen_t addr_len;
+	char name[LG_NAME_SIZE];
+	int threads;
+	int connections;
+	int idle;
+	int depth;
+	bool keepalive;
+	double duration;			// seconds, 0 for no limit
+	long requests;				// 0 for no limit
+	double rate;				// requests per second, 0 for closed loop
+	bool json;
+	bool spectrum;
+} lg_options;
+
+static lg_options opts = {
+	.threads = 1,
+	.connections = 1,
+	.depth = 1,
+	.keepalive = true,
+};
+static lg_request mix[LG_MAX_MIX];
+static int mix_count = 0;
+static lg_worker workers[LG_MAX_THREADS];
+static volatile sig_atomic_t stop_wanted = false;
+
+/**************** BEGIN REQUEST MIX ***************/
+
+/**
+ * @brief Find a header in a head
+ *
+ * @param head start of the head
+ * @param end end of the last header line, after its CRLF
+ * @param name header name
+ * @return ** const char* start of its value, NULL if it is not there
+ */
+static const char* find_header(const char *head, const char *end, const char *name) {
+	int name_len = strlen(name);
+	const char *crlf = memmem(head, end - head, "\r\n", 2);
+
+	while(crlf != NULL && crlf + 2 < end) {
+		const char *line = crlf + 2;
+		if(end - line > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':') {
+			return line + name_len + 1;
+		}
+		crlf = memmem(line, end - line, "\r\n", 2);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Check if the value of a header holds a token
+ *
+ * @param head start of the head
+ * @param end end of the last header line, after its CRLF
+ * @param name header name
+ * @param token token looked for, e.g. "close"
+ * @return ** bool true if it does
+ */
+static bool header_has(const char *head, const char *end, const char *name, const char *token) {
+	const char *value = find_header(head, end, name);
+	if(value == NULL) {
+		return false;
+	}
+	const char *eol = memmem(value, end - value, "\r\n", 2);
+	return memmem(value, eol - value, token, strlen(token)) != NULL;
+}
+
+/**
+ * @brief Add a request to the mix, the data is copied
+ *
+ * @param data request bytes
+ * @param len number of request bytes
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int add_request(const char *data, int len) {
+	if(mix_count == LG_MAX_MIX) {
+		fprintf(stderr, "loadgen: at most %d requests in a mix\n", LG_MAX_MIX);
+		return -1;
+	}
+
+	lg_request *r = &mix[mix_count];
+	r->data = malloc(len);
+	if(r->data == NULL) {
+		return -1;
+	}
+	memcpy(r->data, data, len);
+	r->len = len;
+	r->head = len > 5 && memcmp(data, "HEAD ", 5) == 0;
+	mix_count++;
+	return 0;
+}
+
+/**
+ * @brief Add the requests of a file to the mix. Requests follow each other,
+ * blank lines between them are skipped and a body is framed by its
+ * Content-Length.
+ *
+ * @param path path of the file
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int add_file_requests(const char *path) {
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) {
+		fprintf(stderr, "loadgen: can not open %s\n", path);
+		return -1;
+	}
+
+	char *buf = malloc(LG_MAX_FILE);
+	int len = buf != NULL ? read(fd, buf, LG_MAX_FILE) : -1;
+	close(fd);
+	if(len <= 0) {
+		free(buf);
+		fprintf(stderr, "loadgen: can not read %s\n", path);
+		return -1;
+	}
+
+	int off = 0;
+	int ret = 0;
+	while(ret == 0) {
+		while(off < len && (buf[off] == '\r' || buf[off] == '\n')) {
+			off++;
+		}
+		if(off == len) {
+			break;
+		}
+
+		char *end = memmem(buf + off, len - off, "\r\n\r\n", 4);
+		if(end == NULL) {
+			fprintf(stderr, "loadgen: %s: request head without an empty line\n", path);
+			ret = -1;
+			break;
+		}
+
+		int rlen = end + 4 - (buf + off);
+		const char *cl = find_header(buf + off, end + 2, "Content-Length");
+		if(cl != NULL) {
+			rlen += strtol(cl, NULL, 10);
+		}
+		if(off + rlen > len) {
+			fprintf(stderr, "loadgen: %s: request body is cut short\n", path);
+			ret = -1;
+			break;
+		}
+
+		ret = add_request(buf + off, rlen);
+		off += rlen;
+	}
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * @brief Add the request used without request files
+ *
+ * @param uri URI requested
+ * @param post_bytes size of a POST body, 0 for a GET
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int add_default_request(const char *uri, long post_bytes) {
+	char head[PATH_MAX + 256];
+	int head_len = snprintf(head, sizeof(head), "%s %s HTTP/1.1\r\nHost: %s:%s\r\n%s",
+							post_bytes > 0 ? "POST" : "GET", uri, opts.host, opts.port,
+							opts.keepalive ? "" : "Connection: close\r\n");
+	if(post_bytes > 0) {
+		head_len += snprintf(head + head_len, sizeof(head) - head_len,
+							 "Content-Type: application/octet-stream\r\nContent-Length: %ld\r\n",
+							 post_bytes);
+	}
+	head_len += snprintf(head + head_len, sizeof(head) - head_len, "\r\n");
+
+	char *data = malloc(head_len + post_bytes);
+	if(data == NULL) {
+		return -1;
+	}
+	memcpy(data, head, head_len);
+	memset(data + head_len, 'x', post_bytes);
+	int ret = add_request(data, head_len + post_bytes);
+	free(data);
+	return ret;
+}
+/**************** END REQUEST MIX ***************/
+
+/**************** BEGIN CONNECTIONS ***************/
+
+/**
+ * @brief Check if a worker may queue one more request
+ *
+ * @param w worker
+ * @return ** bool true if it may
+ */
+static bool may_send(lg_worker *w) {
+	return w->quota < 0 || w->started < w->quota;
+}
+
+/**
+ * @brief Set the events a connection is waited for
+ *
+ * @param w worker
+ * @param c connection
+ * @param want_out also wait for it to be writable
+ * @return ** void
+ */
+static void conn_watch(lg_worker *w, lg_conn *c, bool want_out) {
+	if(c->want_out == want_out) {
+		return;
+	}
+	struct epoll_event ev = {.events = EPOLLIN | (want_out ? EPOLLOUT : 0), .data.ptr = c};
+	epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+	c->want_out = want_out;
+}
+
+/**
+ * @brief Close a connection, requests still in flight on a broken one are
+ * counted as errors
+ *
+ * @param w worker
+ * @param c connection
+ * @param failed the connection broke
+ * @return ** void
+ */
+static void conn_close(lg_worker *w, lg_conn *c, bool failed) {
+	if(c->idle) {
+		w->idle_closed++;
+	} else if(failed) {
+		w->errors += c->inflight;
+	}
+
+	close(c->fd);
+	w->inflight -= c->inflight;
+	c->fd = -1;
+	c->state = CONN_CLOSED;
+	c->want_out = false;
+	c->ring_first = 0;
+	c->inflight = 0;
+	c->out_off = 0;
+	c->out_len = 0;
+	c->in_len = 0;
+	c->resp_state = RESP_HEAD;
+}
+
+/**
+ * @brief Start connecting, requests can be queued right away
+ *
+ * @param w worker
+ * @param c closed connection
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int conn_open(lg_worker *w, lg_conn *c) {
+	int fd = socket(opts.addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if(fd < 0) {
+		w->connect_errors++;
+		return -1;
+	}
+
+	int one = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	w->connects++;
+	if(connect(fd, (struct sockaddr *)&opts.addr, opts.addr_len) != 0 && errno != EINPROGRESS) {
+		close(fd);
+		w->connect_errors++;
+		return -1;
+	}
+
+	struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+	if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		close(fd);
+		w->connect_errors++;
+		return -1;
+	}
+
+	c->fd = fd;
+	c->state = CONN_CONNECTING;
+	c->want_out = true;
+	return 0;
+}
+
+/**
+ * @brief Queue the next request of the mix on a connection, opening it if
+ * needed
+ *
+ * @param w worker
+ * @param c connection with room for a request
+ * @param intended when the request was due
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int conn_queue(lg_worker *w, lg_conn *c, uint64_t intended) {
+	if(c->state == CONN_CLOSED && conn_open(w, c) != 0) {
+		return -1;
+	}
+
+	lg_request *r = &mix[w->mix_next];
+	w->mix_next = (w->mix_next + 1) % mix_count;
+
+	if(c->out_off > 0) {
+		memmove(c->out, c->out + c->out_off, c->out_len - c->out_off);
+		c->out_len -= c->out_off;
+		c->out_off = 0;
+	}
+	if(c->out_len + r->len > c->out_cap) {
+		int cap = c->out_cap * 2 > c->out_len + r->len ? c->out_cap * 2 : c->out_len + r->len;
+		char *out = realloc(c->out, cap);
+		if(out == NULL) {
+			return -1;
+		}
+		c->out = out;
+		c->out_cap = cap;
+	}
+	memcpy(c->out + c->out_len, r->data, r->len);
+	c->out_len += r->len;
+
+	lg_inflight *f = &c->ring[(c->ring_first + c->inflight) % LG_MAX_PIPELINE];
+	f->intended = intended;
+	f->sent = latency_now();
+	f->head = r->head;
+	c->inflight++;
+	w->inflight++;
+	if(!c->idle) {
+		w->started++;
+	}
+	return 0;
+}
+
+/**
+ * @brief Send queued requests, a connection still connecting is sent to
+ * once it is writable
+ *
+ * @param w worker
+ * @param c connection
+ * @return ** int 0 on success, -1 if the connection broke
+ */
+static int conn_flush(lg_worker *w, lg_conn *c) {
+	if(c->state != CONN_OPEN) {
+		return 0;
+	}
+
+	while(c->out_off < c->out_len) {
+		ssize_t ret = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			if(errno == EAGAIN || errno == EWOULDBLOCK) {
+				conn_watch(w, c, true);
+				return 0;
+			}
+			return -1;
+		}
+		c->out_off += ret;
+		w->bytes_out += ret;
+	}
+
+	c->out_off = 0;
+	c->out_len = 0;
+	conn_watch(w, c, false);
+	return 0;
+}
+
+/**
+ * @brief Keep a closed loop connection filled up to the pipeline depth
+ *
+ * @param w worker
+ * @param c connection
+ * @return ** void
+ */
+static void conn_fill(lg_worker *w, lg_conn *c) {
+	if(c->idle || w->interval > 0) {
+		return;
+	}
+
+	uint64_t now = latency_now();
+	while(c->inflight < opts.depth && may_send(w) && now < w->deadline) {
+		if(conn_queue(w, c, now) != 0) {
+			return;
+		}
+	}
+	if(c->state == CONN_OPEN && conn_flush(w, c) != 0) {
+		conn_close(w, c, true);
+	}
+}
+
+/**
+ * @brief Count the response at the head of a connection
+ *
+ * @param w worker
+ * @param c connection
+ * @return ** void
+ */
+static void response_done(lg_worker *w, lg_conn *c) {
+	lg_inflight *f = &c->ring[c->ring_first];
+	c->ring_first = (c->ring_first + 1) % LG_MAX_PIPELINE;
+	c->inflight--;
+	w->inflight--;
+	c->resp_state = RESP_HEAD;
+
+	if(!c->idle) {
+		uint64_t now = latency_now();
+		latency_hist_record(&w->latency, now - f->intended);
+		latency_hist_record(&w->service, now - f->sent);
+		w->status[c->status >= 100 && c->status < 600 ? c->status / 100 : 0]++;
+		w->completed++;
+	}
+
+	if(c->close_after || (!opts.keepalive && !c->idle)) {
+		// requests behind it were not answered
+		conn_close(w, c, c->inflight > 0);
+	}
+}
+
+/**
+ * @brief Parse a response head at the start of the receive buffer
+ *
+ * @param c connection
+ * @param head start of the head
+ * @param end end of the last header line, after its CRLF
+ * @return ** int 0 on success, -1 if it is not a response
+ */
+static int parse_head(lg_conn *c, const char *head, const char *end) {
+	if(end - head < 12 || memcmp(head, "HTTP/1.", 7) != 0) {
+		return -1;
+	}
+
+	c->status = strtol(head + 9, NULL, 10);
+	c->close_after = header_has(head, end, "Connection", "close") ||
+					 (head[7] == '0' && !header_has(head, end, "Connection", "keep-alive"));
+
+	const char *cl = find_header(head, end, "Content-Length");
+	if(c->status < 200) {
+		// interim response, the final one follows
+		c->resp_state = RESP_HEAD;
+	} else if(c->ring[c->ring_first].head || c->status == 204 || c->status == 304) {
+		c->resp_state = RESP_BODY;
+		c->body_left = 0;
+	} else if(header_has(head, end, "Transfer-Encoding", "chunked")) {
+		c->resp_state = RESP_CHUNK_SIZE;
+	} else if(cl != NULL) {
+		c->resp_state = RESP_BODY;
+		c->body_left = strtol(cl, NULL, 10);
+	} else {
+		c->resp_state = RESP_UNTIL_CLOSE;
+		c->close_after = true;
+	}
+	return 0;
+}
+
+/**
+ * @brief Walk the receive buffer and count every complete response, body
+ * bytes are dropped as they come
+ *
+ * @param w worker
+ * @param c connection
+ * @return ** int 0 on success, -1 on a malformed or unexpected response
+ */
+static int parse_responses(lg_worker *w, lg_conn *c) {
+	int off = 0;
+
+	while(off < c->in_len && c->state != CONN_CLOSED) {
+		char *cur = c->in + off;
+		int avail = c->in_len - off;
+		char *eol;
+
+		if(c->resp_state == RESP_HEAD) {
+			if(c->inflight == 0) {
+				return -1;
+			}
+			eol = memmem(cur, avail, "\r\n\r\n", 4);
+			if(eol == NULL) {
+				break;
+			}
+			if(parse_head(c, cur, eol + 2) != 0) {
+				return -1;
+			}
+			off += eol + 4 - cur;
+			if(c->resp_state == RESP_BODY && c->body_left == 0) {
+				response_done(w, c);
+			}
+		} else if(c->resp_state == RESP_BODY || c->resp_state == RESP_CHUNK_DATA) {
+			int take = avail < c->body_left ? avail : c->body_left;
+			off += take;
+			c->body_left -= take;
+			if(c->body_left == 0) {
+				if(c->resp_state == RESP_BODY) {
+					response_done(w, c);
+				} else {
+					c->resp_state = RESP_CHUNK_END;
+				}
+			}
+		} else if(c->resp_state == RESP_CHUNK_SIZE) {
+			eol = memmem(cur, avail, "\r\n", 2);
+			if(eol == NULL) {
+				break;
+			}
+			c->body_left = strtol(cur, NULL, 16);
+			off += eol + 2 - cur;
+			c->resp_state = c->body_left > 0 ? RESP_CHUNK_DATA : RESP_TRAILER;
+		} else if(c->resp_state == RESP_CHUNK_END) {
+			if(avail < 2) {
+				break;
+			}
+			off += 2;
+			c->resp_state = RESP_CHUNK_SIZE;
+		} else if(c->resp_state == RESP_TRAILER) {
+			eol = memmem(cur, avail, "\r\n", 2);
+			if(eol == NULL) {
+				break;
+			}
+			off += eol + 2 - cur;
+			if(eol == cur) {
+				response_done(w, c);
+			}
+		} else {
+			off = c->in_len;
+		}
+	}
+
+	if(c->state == CONN_CLOSED) {
+		return 0;
+	}
+	if(off == 0 && c->in_len == c->in_cap) {
+		// a head or chunk line larger than the buffer
+		return -1;
+	}
+	memmove(c->in, c->in + off, c->in_len - off);
+	c->in_len -= off;
+	return 0;
+}
+
+/**
+ * @brief Read what a connection received
+ *
+ * @param w worker
+ * @param c open connection
+ * @return ** void
+ */
+static void conn_read(lg_worker *w, lg_conn *c) {
+	while(c->state == CONN_OPEN) {
+		ssize_t ret = recv(c->fd, c->in + c->in_len, c->in_cap - c->in_len, 0);
+		if(ret > 0) {
+			w->bytes_in += ret;
+			w->last_progress = latency_now();
+			c->in_len += ret;
+			if(parse_responses(w, c) != 0) {
+				conn_close(w, c, true);
+			}
+			continue;
+		}
+
+		if(ret == 0) {
+			if(c->resp_state == RESP_UNTIL_CLOSE) {
+				response_done(w, c);
+			} else {
+				conn_close(w, c, c->inflight > 0);
+			}
+		} else if(errno == EINTR) {
+			continue;
+		} else if(errno != EAGAIN && errno != EWOULDBLOCK) {
+			conn_close(w, c, true);
+		}
+		return;
+	}
+}
+
+/**
+ * @brief Handle the events of a connection
+ *
+ * @param w worker
+ * @param c connection
+ * @param events epoll events
+ * @return ** void
+ */
+static void conn_event(lg_worker *w, lg_conn *c, uint32_t events) {
+	if(c->state == CONN_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if(err != 0) {
+			w->connect_errors++;
+			conn_close(w, c, true);
+			conn_fill(w, c);
+			return;
+		}
+		c->state = CONN_OPEN;
+	}
+
+	if(events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+		conn_read(w, c);
+	}
+	if(c->state == CONN_OPEN && (events & EPOLLOUT) && conn_flush(w, c) != 0) {
+		conn_close(w, c, true);
+	}
+	conn_fill(w, c);
+}
+
+/**
+ * @brief Send every open loop request that is due, on the next connection
+ * with room. Requests that find every connection full wait and are still
+ * timed from when they were due.
+ *
+ * @param w worker
+ * @param now current time
+ * @return ** void
+ */
+static void pump(lg_worker *w, uint64_t now) {
+	while(w->next_intended <= now && may_send(w)) {
+		lg_conn *c = NULL;
+		for(int i = 0; i < w->load_count; i++) {
+			int index = (w->next_conn + i) % w->load_count;
+			if(w->conns[index].inflight < opts.depth) {
+				c = &w->conns[index];
+				w->next_conn = (index + 1) % w->load_count;
+				break;
+			}
+		}
+		if(c == NULL || conn_queue(w, c, w->next_intended) != 0) {
+			return;
+		}
+		if(conn_flush(w, c) != 0) {
+			conn_close(w, c, true);
+		}
+		w->next_intended += w->interval;
+	}
+}
+/**************** END CONNECTIONS ***************/
+
+/**
+ * @brief Run the connections of one thread until the run is over
+ *
+ * @param arg the lg_worker
+ * @return ** void* NULL
+ */
+static void* worker_run(void *arg) {
+	lg_worker *w = arg;
+	struct epoll_event events[LG_EVENTS];
+
+	w->start = latency_now();
+	w->last_progress = w->start;
+	w->deadline = opts.duration > 0 ? w->start + (uint64_t)(opts.duration * NS_PER_SEC) : UINT64_MAX;
+	// threads take turns, together they send at the total rate
+	w->next_intended = w->start + w->interval * w->id / opts.threads;
+
+	for(int i = w->load_count; i < w->conn_count; i++) {
+		lg_conn *c = &w->conns[i];
+		conn_queue(w, c, w->start);
+	}
+	for(int i = 0; i < w->load_count; i++) {
+		if(w->interval == 0) {
+			conn_fill(w, &w->conns[i]);
+		} else if(opts.keepalive) {
+			conn_open(w, &w->conns[i]);
+		}
+	}
+
+	while(!stop_wanted) {
+		uint64_t now = latency_now();
+		if(now >= w->deadline || (w->quota >= 0 && w->completed + w->errors >= w->quota)) {
+			break;
+		}
+		if(w->inflight > 0 && now - w->last_progress > LG_STALL_SECS * NS_PER_SEC) {
+			w->timeouts += w->inflight;
+			break;
+		}
+
+		uint64_t wake = now + LG_POLL_MS * 1000000ULL;
+		if(w->interval > 0) {
+			pump(w, now);
+			// epoll_wait only waits whole milliseconds, a late send would be
+			// charged to the server
+			if(may_send(w) && w->next_intended < wake) {
+				struct itimerspec due = {
+					.it_value.tv_sec = w->next_intended / NS_PER_SEC,
+					.it_value.tv_nsec = w->next_intended % NS_PER_SEC,
+				};
+				timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &due, NULL);
+			}
+		}
+		if(w->deadline < wake) {
+			wake = w->deadline;
+		}
+		int timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+
+		int count = epoll_wait(w->epfd, events, LG_EVENTS, timeout);
+		for(int i = 0; i < count; i++) {
+			if(events[i].data.ptr == NULL) {
+				uint64_t expired;
+				read(w->timerfd, &expired, sizeof(expired));
+				continue;
+			}
+			conn_event(w, events[i].data.ptr, events[i].events);
+		}
+	}
+
+	w->elapsed = latency_now() - w->start;
+	for(int i = 0; i < w->conn_count; i++) {
+		lg_conn *c = &w->conns[i];
+		if(c->idle && c->state == CONN_OPEN) {
+			w->idle_open++;
+		}
+		if(c->state != CONN_CLOSED) {
+			close(c->fd);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * @brief Give a worker its share of the connections, requests and rate
+ *
+ * @param w worker
+ * @param id index of the worker
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int worker_init(lg_worker *w, int id) {
+	int threads = opts.threads;
+
+	w->id = id;
+	w->load_count = opts.connections / threads + (id < opts.connections % threads);
+	w->conn_count = w->load_count + opts.idle / threads + (id < opts.idle % threads);
+	w->quota = opts.requests > 0 ? opts.requests / threads + (id < opts.requests % threads) : -1;
+	w->interval = opts.rate > 0 ? (uint64_t)(threads * NS_PER_SEC / opts.rate) : 0;
+	w->interval = opts.rate > 0 && w->interval == 0 ? 1 : w->interval;
+	w->mix_next = id % mix_count;
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	w->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	w->conns = calloc(w->conn_count, sizeof(lg_conn));
+	if(w->epfd < 0 || w->timerfd < 0 || w->conns == NULL) {
+		return -1;
+	}
+
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+	if(epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timerfd, &ev) != 0) {
+		return -1;
+	}
+
+	for(int i = 0; i < w->conn_count; i++) {
+		lg_conn *c = &w->conns[i];
+		c->fd = -1;
+		c->idle = i >= w->load_count;
+		c->in_cap = c->idle ? LG_IDLE_IN_SIZE : LG_IN_SIZE;
+		c->in = malloc(c->in_cap);
+		if(c->in == NULL) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**************** BEGIN REPORT ***************/
+
+/**
+ * @brief Print the latencies of a histogram
+ *
+ * @param label name of the line
+ * @param h histogram
+ * @return ** void
+ */
+static void print_latency(const char *label, const latency_hist *h) {
+	printf("  %-8s mean %.1fus p50 %.1fus p90 %.1fus p99 %.1fus p99.9 %.1fus max %.1fus\n", label,
+		   h->count > 0 ? h->sum / 1000.0 / h->count : 0,
+		   latency_percentile(h, 0.5) / 1000.0, latency_percentile(h, 0.9) / 1000.0,
+		   latency_percentile(h, 0.99) / 1000.0, latency_percentile(h, 0.999) / 1000.0,
+		   h->max / 1000.0);
+}
+
+/**
+ * @brief Print the percentile distribution of a histogram
+ *
+ * @param h histogram
+ * @return ** void
+ */
+static void print_spectrum(const latency_hist *h) {
+	static const double quantiles[] = {
+		0.1, 0.2, 0.3, 0.4, 0.5, 0.6, 0.7, 0.75, 0.8, 0.85, 0.9, 0.95,
+		0.99, 0.995, 0.999, 0.9995, 0.9999, 0.99999, 1.0,
+	};
+
+	printf("  %12s %10s %12s\n", "value(us)", "percentile", "count");
+	for(unsigned i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+		printf("  %12.1f %10.5f %12lu\n", latency_percentile(h, quantiles[i]) / 1000.0,
+			   quantiles[i], (unsigned long)(quantiles[i] * h->count + 0.5));
+	}
+}
+
+/**
+ * @brief Print the latencies of a histogram as a JSON object member
+ *
+ * @param name member name
+ * @param h histogram
+ * @return ** void
+ */
+static void json_latency(const char *name, const latency_hist *h) {
+	printf(",\"%s\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}",
+		   name, h->count > 0 ? h->sum / 1000.0 / h->count : 0,
+		   latency_percentile(h, 0.5) / 1000.0, latency_percentile(h, 0.9) / 1000.0,
+		   latency_percentile(h, 0.99) / 1000.0, latency_percentile(h, 0.999) / 1000.0,
+		   h->max / 1000.0);
+}
+
+/**
+ * @brief Merge the results of the workers and print them
+ *
+ * @return ** void
+ */
+static void report() {
+	static lg_worker total;
+	uint64_t elapsed = 0;
+
+	for(int i = 0; i < opts.threads; i++) {
+		lg_worker *w = &workers[i];
+		total.completed += w->completed;
+		total.errors += w->errors;
+		total.timeouts += w->timeouts;
+		total.connects += w->connects;
+		total.connect_errors += w->connect_errors;
+		total.idle_open += w->idle_open;
+		total.idle_closed += w->idle_closed;
+		total.bytes_in += w->bytes_in;
+		total.bytes_out += w->bytes_out;
+		for(int s = 0; s < 6; s++) {
+			total.status[s] += w->status[s];
+		}
+		latency_hist_merge(&total.latency, &w->latency);
+		latency_hist_merge(&total.service, &w->service);
+		elapsed = w->elapsed > elapsed ? w->elapsed : elapsed;
+	}
+
+	double secs = elapsed > 0 ? (double)elapsed / NS_PER_SEC : 1;
+
+	if(opts.json) {
+		printf("{\"bench\":\"loadgen\",\"case\":\"%s\",\"threads\":%d,\"connections\":%d,"
+			   "\"idle\":%d,\"pipeline\":%d,\"keepalive\":%s,\"rate\":%.0f,\"seconds\":%.3f,"
+			   "\"requests\":%ld,\"rps\":%.1f,\"errors\":%ld,\"connect_errors\":%ld,"
+			   "\"timeouts\":%ld,\"connects\":%ld,\"bytes_in\":%lu,\"bytes_out\":%lu,"
+			   "\"status\":{\"none\":%ld,\"1xx\":%ld,\"2xx\":%ld,\"3xx\":%ld,\"4xx\":%ld,\"5xx\":%ld},"
+			   "\"idle_open\":%ld",
+			   opts.name, opts.threads, opts.connections, opts.idle, opts.depth,
+			   opts.keepalive ? "true" : "false", opts.rate, secs, total.completed,
+			   total.completed / secs, total.errors, total.connect_errors, total.timeouts,
+			   total.connects, (unsigned long)total.bytes_in, (unsigned long)total.bytes_out,
+			   total.status[0], total.status[1], total.status[2], total.status[3],
+			   total.status[4], total.status[5], total.idle_open);
+		json_latency("latency_us", &total.latency);
+		json_latency("service_us", &total.service);
+		printf("}\n");
+		return;
+	}
+
+	printf("loadgen %s:%s, %d threads, %d connections, pipeline %d, %s, ",
+		   opts.host, opts.port, opts.threads, opts.connections, opts.depth,
+		   opts.keepalive ? "keep-alive" : "connection per request");
+	if(opts.rate > 0) {
+		printf("open loop at %.0f requests/s\n", opts.rate);
+	} else {
+		printf("closed loop\n");
+	}
+	printf("  %.2fs, %ld requests, %.1f requests/s, %.2f MB/s in, %.2f MB/s out\n",
+		   secs, total.completed, total.completed / secs,
+		   total.bytes_in / secs / 1e6, total.bytes_out / secs / 1e6);
+	printf("  errors %ld, connect errors %ld, timeouts %ld, connects %ld\n",
+		   total.errors, total.connect_errors, total.timeouts, total.connects);
+	printf("  status 1xx %ld, 2xx %ld, 3xx %ld, 4xx %ld, 5xx %ld, other %ld\n",
+		   total.status[1], total.status[2], total.status[3], total.status[4],
+		   total.status[5], total.status[0]);
+	if(opts.idle > 0) {
+		printf("  idle connections %d, open at the end %ld, closed by the server %ld\n",
+			   opts.idle, total.idle_open, total.idle_closed);
+	}
+	// closed loop requests are sent when due, the two are the same
+	print_latency("latency", &total.latency);
+	if(opts.rate > 0) {
+		print_latency("service", &total.service);
+	}
+	if(opts.spectrum) {
+		print_spectrum(&total.latency);
+	}
+}
+/**************** END REPORT ***************/
+
+/**
+ * @brief Stop the run and report what was counted so far
+ *
+ * @param sig signal
+ * @return ** void
+ */
+static void stop_handler(int sig) {
+	stop_wanted = true;
+}
+
+/**
+ * @brief Let the process hold all connections
+ *
+ * @return ** void
+ */
+static void raise_fd_limit() {
+	struct rlimit rl;
+	if(getrlimit(RLIMIT_NOFILE, &rl) != 0) {
+		return;
+	}
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	if(rl.rlim_cur != RLIM_INFINITY && (rlim_t)opts.connections + opts.idle + 64 > rl.rlim_cur) {
+		fprintf(stderr, "loadgen: only %lu file descriptors, connections will fail\n",
+				(unsigned long)rl.rlim_cur);
+	}
+}
+
+void usage() {
+	fprintf(stderr,
+			"Usage ./loadgen [options] <server-ip> <port>\n"
+			"  -c connections  connections sending requests (1)\n"
+			"  -t threads      threads, each with its own epoll (1)\n"
+			"  -d seconds      length of the run (%d, none with -n)\n"
+			"  -n requests     stop after this many requests\n"
+			"  -p depth        requests in flight per connection (1)\n"
+			"  -k              keep connections alive, the default\n"
+			"  -C              close after each request, a connection per request\n"
+			"  -R rate         open loop at this many requests/s in total\n"
+			"  -i idle         extra keep-alive connections held idle after one request\n"
+			"  -u uri          URI of the default GET (/)\n"
+			"  -P bytes        make the default request a POST with a body this large\n"
+			"  -N name         case name put in the JSON output\n"
+			"  -j              print one JSON line\n"
+			"  -l              print the latency distribution\n"
+			"  Request files given after the port replace the default request,\n"
+			"  their requests are sent round-robin.\n",
+			LG_DEFAULT_DURATION);
+}
+
+/**
+ * @brief Main driver for the load generator
+ *
+ * @param argc number of command line arguments
+ * @param argv command line arguments
+ * @return ** int
+ */
+int main(int argc, char *argv[]) {
+	const char *uri = "/";
+	long post_bytes = 0;
+	int opt;
+
+	opts.duration = -1;
+	while((opt = getopt(argc, argv, "c:t:d:n:p:kCR:i:u:P:N:jlh")) != -1) {
+		switch(opt) {
+		case 'c':
+			opts.connections = atoi(optarg);
+			break;
+		case 't':
+			opts.threads = atoi(optarg);
+			break;
+		case 'd':
+			opts.duration = atof(optarg);
+			break;
+		case 'n':
+			opts.requests = atol(optarg);
+			break;
+		case 'p':
+			opts.depth = atoi(optarg);
+			break;
+		case 'k':
+			// as in ab, where keep-alive is off unless asked for
+			opts.keepalive = true;
+			break;
+		case 'C':
+			opts.keepalive = false;
+			break;
+		case 'R':
+			opts.rate = atof(optarg);
+			break;
+		case 'i':
+			opts.idle = atoi(optarg);
+			break;
+		case 'u':
+			uri = optarg;
+			break;
+		case 'P':
+			post_bytes = atol(optarg);
+			break;
+		case 'N':
+			snprintf(opts.name, sizeof(opts.name), "%s", optarg);
+			break;
+		case 'j':
+			opts.json = true;
+			break;
+		case 'l':
+			opts.spectrum = true;
+			break;
+		default:
+			usage();
+			return EXIT_FAILURE;
+		}
+	}
+
+	if(argc - optind < 2 || opts.connections < 1 || opts.threads < 1 || opts.idle < 0 ||
+	   opts.depth < 1 || opts.depth > LG_MAX_PIPELINE || opts.rate < 0 || post_bytes < 0 ||
+	   opts.requests < 0) {
+		usage();
+		return EXIT_FAILURE;
+	}
+	opts.threads = opts.threads > opts.connections ? opts.connections : opts.threads;
+	opts.threads = opts.threads > LG_MAX_THREADS ? LG_MAX_THREADS : opts.threads;
+	opts.depth = opts.keepalive ? opts.depth : 1;
+	if(opts.duration < 0) {
+		opts.duration = opts.requests > 0 ? 0 : LG_DEFAULT_DURATION;
+	}
+
+	struct addrinfo hints;
+	struct addrinfo *servinfo;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	int status = getaddrinfo(argv[optind], argv[optind + 1], &hints, &servinfo);
+	if(status != 0) {
+		fprintf(stderr, "loadgen: getaddrinfo error: %s\n", gai_strerror(status));
+		return EXIT_FAILURE;
+	}
+	memcpy(&opts.addr, servinfo->ai_addr, servinfo->ai_addrlen);
+	opts.addr_len = servinfo->ai_addrlen;
+	freeaddrinfo(servinfo);
+	snprintf(opts.host, sizeof(opts.host), "%s", argv[optind]);
+	snprintf(opts.port, sizeof(opts.port), "%s", argv[optind + 1]);
+
+	for(int i = optind + 2; i < argc; i++) {
+		if(add_file_requests(argv[i]) != 0) {
+			return EXIT_FAILURE;
+		}
+	}
+	if(mix_count == 0 && add_default_request(uri, post_bytes) != 0) {
+		return EXIT_FAILURE;
+	}
+
+	raise_fd_limit();
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = stop_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// signals are taken by the main thread only
+	sigset_t all;
+	sigset_t old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	int started = 0;
+	for(; started < opts.threads; started++) {
+		lg_worker *w = &workers[started];
+		if(worker_init(w, started) != 0 || pthread_create(&w->tid, NULL, worker_run, w) != 0) {
+			fprintf(stderr, "loadgen: can not start thread %d\n", started);
+			stop_wanted = true;
+			break;
+		}
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	for(int i = 0; i < started; i++) {
+		pthread_join(workers[i].tid, NULL);
+	}
+	if(started < opts.threads) {
+		return EXIT_FAILURE;
+	}
+
+	report();
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,315 @@
+/**
+ * @file log.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Asynchronous logger of LISO
+ *
+ * Threads logging a record only format it in to a slot of a ring buffer,
+ * nothing is written in the event loop. A slot is claimed with a compare
+ * and swap on the tail and published through its sequence number, so any
+ * thread may log without a lock. When the ring is full the record is
+ * dropped and counted instead of waiting for the writer.
+ *
+ * A background thread takes published records in order, adds their time
+ * and level and writes them out in batches of up to LOG_BATCH_SIZE bytes.
+ * log_reopen() makes it reopen the log file before the next batch, it is
+ * safe to call from a signal handler so logs can be rotated with SIGHUP.
+ *
+ * @version 0.1
+ * @date 2021-11-03
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+
+typedef struct {
+	atomic_ulong seq;			// position it holds a record for, plus one once published
+	struct timespec time;
+	int level;
+	int len;
+	char msg[LOG_MSG_MAX];
+} log_slot;
+
+volatile sig_atomic_t log_level = LISO_LOG_INFO;
+static volatile sig_atomic_t saved_level = LISO_LOG_INFO;	// level before debug was toggled on
+
+static log_slot ring[LOG_RING_SLOTS];
+static atomic_ulong ring_tail = 0;		// next position a record is written to
+static unsigned long ring_head = 0;		// next position the log thread reads, its own
+static atomic_int ring_ready = 0;
+static atomic_long dropped = 0;
+static atomic_int reopen_wanted = 0;
+
+static char log_path[4096];
+static int log_fd = -1;
+
+static const char *level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+/**
+ * @brief Set the sequence numbers of the ring, done once before the first
+ * record
+ *
+ * @return ** void
+ */
+static void ring_init() {
+	int expected = 0;
+	if(!atomic_compare_exchange_strong(&ring_ready, &expected, 1)) {
+		while(atomic_load(&ring_ready) != 2) {
+			;
+		}
+		return;
+	}
+
+	for(unsigned long i = 0; i < LOG_RING_SLOTS; i++) {
+		atomic_store_explicit(&ring[i].seq, i, memory_order_relaxed);
+	}
+	atomic_store(&ring_ready, 2);
+}
+
+/**
+ * @brief Queue a record, called through LISO_LOG once the level passed.
+ * Never blocks, the record is dropped if the ring is full.
+ *
+ * @param level level of the record
+ * @param format printf style format
+ * @return ** void
+ */
+void liso_log(int level, const char *format, ...) {
+	if(atomic_load_explicit(&ring_ready, memory_order_acquire) != 2) {
+		ring_init();
+	}
+
+	unsigned long pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+	log_slot *slot;
+	while(1) {
+		slot = &ring[pos % LOG_RING_SLOTS];
+		unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		long diff = (long)(seq - pos);
+		if(diff == 0) {
+			if(atomic_compare_exchange_weak_explicit(&ring_tail, &pos, pos + 1,
+					memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if(diff < 0) {
+			// the log thread is a whole ring behind
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			pos = atomic_load_explicit(&ring_tail, memory_order_relaxed);
+		}
+	}
+
+	clock_gettime(CLOCK_REALTIME, &slot->time);
+	slot->level = level;
+
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(slot->msg, LOG_MSG_MAX, format, args);
+	va_end(args);
+	slot->len = len < 0 ? 0 : (len >= LOG_MSG_MAX ? LOG_MSG_MAX - 1 : len);
+
+	atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/**
+ * @brief Open the log file, or open it again after a rotation
+ *
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int open_log_file() {
+	int fd = open(log_path, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0640);
+	if(fd < 0) {
+		return -1;
+	}
+
+	if(log_fd >= 0) {
+		close(log_fd);
+	}
+	log_fd = fd;
+	return 0;
+}
+
+/**
+ * @brief Write all of a batch, records are lost if the file is broken
+ *
+ * @param buf batch
+ * @param len bytes in it
+ * @return ** void
+ */
+static void write_batch(const char *buf, size_t len) {
+	while(len > 0 && log_fd >= 0) {
+		ssize_t ret = write(log_fd, buf, len);
+		if(ret < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return;
+		}
+		buf += ret;
+		len -= ret;
+	}
+}
+
+/**
+ * @brief Format a record as a line of the log file
+ *
+ * @param out where the line goes, has room for LOG_MSG_MAX + 64 bytes
+ * @param time time of the record
+ * @param level level of the record
+ * @param msg message
+ * @param len length of the message
+ * @return ** int bytes written to out
+ */
+static int format_line(char *out, struct timespec *time, int level, const char *msg, int len) {
+	struct tm tm;
+	gmtime_r(&time->tv_sec, &tm);
+	int n = strftime(out, 32, "%Y-%m-%d %H:%M:%S", &tm);
+	n += sprintf(out + n, ".%03ld %s ", time->tv_nsec / 1000000,
+				 level >= 0 && level <= LISO_LOG_DEBUG ? level_names[level] : "?");
+	memcpy(out + n, msg, len);
+	n += len;
+	if(len == 0 || msg[len - 1] != '\n') {
+		out[n++] = '\n';
+	}
+	return n;
+}
+
+/**
+ * @brief Log thread, drains the ring in to the log file
+ *
+ * @param arg unused
+ * @return ** void* never returns
+ */
+static void* log_thread(void *arg) {
+	static char batch[LOG_BATCH_SIZE];
+	size_t batch_len = 0;
+	long reported = 0;
+
+	while(1) {
+		if(atomic_exchange(&reopen_wanted, 0)) {
+			write_batch(batch, batch_len);
+			batch_len = 0;
+			open_log_file();
+		}
+
+		log_slot *slot = &ring[ring_head % LOG_RING_SLOTS];
+		unsigned long seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+		if(seq == ring_head + 1) {
+			if(batch_len + LOG_MSG_MAX + 64 > LOG_BATCH_SIZE) {
+				write_batch(batch, batch_len);
+				batch_len = 0;
+			}
+			batch_len += format_line(batch + batch_len, &slot->time, slot->level,
+									 slot->msg, slot->len);
+
+			// the slot is free for the record one ring later
+			atomic_store_explicit(&slot->seq, ring_head + LOG_RING_SLOTS, memory_order_release);
+			ring_head++;
+			continue;
+		}
+
+		// ring is empty, write what was collected and wait for more
+		long lost = atomic_load_explicit(&dropped, memory_order_relaxed);
+		if(lost != reported) {
+			char line[LOG_MSG_MAX + 64];
+			char msg[LOG_MSG_MAX];
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			int len = snprintf(msg, sizeof(msg), "%ld log records dropped, ring full", lost - reported);
+			int n = format_line(line, &now, LISO_LOG_WARN, msg, len);
+			if(batch_len + n <= LOG_BATCH_SIZE) {
+				memcpy(batch + batch_len, line, n);
+				batch_len += n;
+			}
+			reported = lost;
+		}
+
+		if(batch_len > 0) {
+			write_batch(batch, batch_len);
+			batch_len = 0;
+		}
+
+		struct timespec idle = {0, LOG_IDLE_MS * 1000000L};
+		nanosleep(&idle, NULL);
+	}
+
+	return NULL;
+}
+
+/**
+ * @brief Open the log file and start the log thread, must be called after
+ * daemonizing since threads do not survive fork(). Records logged before
+ * are queued and written once it runs.
+ *
+ * @param path path of the log file
+ * @return ** int 0 on success, -1 otherwise
+ */
+int log_open(const char *path) {
+	snprintf(log_path, sizeof(log_path), "%s", path);
+	if(open_log_file() != 0) {
+		return -1;
+	}
+
+	if(atomic_load(&ring_ready) != 2) {
+		ring_init();
+	}
+
+	// signals are handled by the event loop thread only
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	pthread_t thread;
+	int ret = pthread_create(&thread, NULL, log_thread, NULL);
+	if(ret == 0) {
+		pthread_detach(thread);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return ret == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Make the log thread reopen the log file, e.g. after it was
+ * rotated. Async signal safe.
+ *
+ * @return ** void
+ */
+void log_reopen() {
+	atomic_store(&reopen_wanted, 1);
+}
+
+/**
+ * @brief Switch debug records on, or back to the level before. Async
+ * signal safe.
+ *
+ * @return ** void
+ */
+void log_toggle_debug() {
+	if(log_level == LISO_LOG_DEBUG) {
+		log_level = saved_level;
+	} else {
+		saved_level = log_level;
+		log_level = LISO_LOG_DEBUG;
+	}
+}
+
+/**
+ * @brief Number of records dropped because the ring was full
+ *
+ * @return ** long records dropped so far
+ */
+long log_dropped() {
+	return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
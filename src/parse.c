@@ -19,9 +19,10 @@
 // extern FILE* fp;
 
 /**
-* Given a char buffer returns the parsed request headers
+* Given a char buffer returns the parsed request headers, allocated from
+* the arena a. Nothing is left in the arena if parsing fails.
 */
-Request * parse(char *buffer, int size, int socketFd) {
+Request * parse(char *buffer, int size, int socketFd, arena *a) {
 
 	//Differant states in the state machine
 	enum {
@@ -29,12 +30,9 @@ Request * parse(char *buffer, int size, int socketFd) {
 	};
 
 	int i = 0, state;
-	size_t offset = 0;
 	char ch;
-	// char buf[8192];
-	char* buf = malloc(size);
-	memset(buf, 0, size);
 
+	// the lexer reads the head straight from the receive buffer
 	state = STATE_START;
 	while (state != STATE_CRLFCRLF) {
 		char expected = 0;
@@ -43,7 +41,6 @@ Request * parse(char *buffer, int size, int socketFd) {
 			break;
 
 		ch = buffer[i++];
-		buf[offset++] = ch;
 
 		switch (state) {
 		case STATE_START:
@@ -68,15 +65,21 @@ Request * parse(char *buffer, int size, int socketFd) {
 
     //Valid End State
 	if (state == STATE_CRLFCRLF) {
+		arena_mark mark = arena_save(a);
 
-		Request *request = (Request *) malloc(sizeof(Request));
+		Request *request = arena_alloc(a, sizeof(Request));
+		if (request == NULL) {
+			return NULL;
+		}
         request->header_count=0;
 		request->request_len=i;
-        //TODO You will need to handle resizing this in parser.y
-        request->headers = (Http_header *) malloc(sizeof(Http_header));
+        request->headers = arena_alloc(a, sizeof(Http_header));
+		if (request->headers == NULL) {
+			arena_rewind(a, mark);
+			return NULL;
+		}
 
-		assert(request->headers != NULL);
-		set_parsing_options(buf, i, request);
+		set_parsing_options(buffer, i, request, a);
 
 		if (yyparse() == SUCCESS) {
 			if(strstr(request->http_uri, "/cgi/") != NULL) {
@@ -85,15 +88,13 @@ Request * parse(char *buffer, int size, int socketFd) {
 				request->is_cgi = 0;
 			}
 
-			free(buf);
             return request;
 		}
 
 		yyrestart(NULL);
+		arena_rewind(a, mark);
 	}
 
-    // LISOPRINTF(fp,"Parsing Failed\n");
-	free(buf);
+    // LISOPRINTF("Parsing Failed\n");
 	return NULL;
 }
-
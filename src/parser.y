@@ -20,7 +20,7 @@
 /* yyparse() calls yyerror() on error */
 void yyerror (const char *s);
 
-void set_parsing_options(char *buf, size_t siz, Request *parsing_request);
+void set_parsing_options(char *buf, size_t siz, Request *parsing_request, arena *a);
 
 /* yyparse() calls yylex() to get tokens */
 extern int yylex();
@@ -43,6 +43,9 @@ size_t parsing_buf_siz;
 /* Current parsing_request Header Struct */
 Request *parsing_request;
 
+/* Arena the headers of parsing_request are allocated from */
+arena *parsing_arena;
+
 %}
 
 
@@ -206,7 +209,14 @@ request_line: token t_sp text t_sp text t_crlf {
 
 Http_header: token ows t_colon ows text ows t_crlf {
 	if(parsing_request->header_count > 0) {
-		parsing_request->headers = realloc(parsing_request->headers, sizeof(Http_header) * (parsing_request->header_count + 1));
+		// nothing else is allocated while parsing, this grows in place
+		Http_header *headers = arena_grow(parsing_arena, parsing_request->headers,
+			sizeof(Http_header) * parsing_request->header_count,
+			sizeof(Http_header) * (parsing_request->header_count + 1));
+		if(headers == NULL) {
+			YYABORT;
+		}
+		parsing_request->headers = headers;
 	}
 	YPRINTF("Http_header:\n%s\n%s\n",$1,$5);
     strcpy(parsing_request->headers[parsing_request->header_count].header_name, $1);
@@ -233,12 +243,13 @@ request: request_line header {
 
 /* C code */
 
-void set_parsing_options(char *buf, size_t siz, Request *request)
+void set_parsing_options(char *buf, size_t siz, Request *request, arena *a)
 {
     parsing_buf = buf;
 	parsing_offset = 0;
 	parsing_buf_siz = siz;
     parsing_request = request;
+	parsing_arena = a;
 }
 
 void yyerror (const char *s) {fprintf (stderr, "%s\n", s);}
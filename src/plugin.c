@@ -0,0 +1,516 @@
+/**
+ * @file plugin.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief In-process handler plugins for LISO
+ *
+ * Plugins are shared objects loaded with dlopen() at startup. They
+ * register URI prefixes with liso_register_handler(), a request for a
+ * registered prefix is answered by calling the handler in the server
+ * process, so a dynamic endpoint costs no process spawn.
+ *
+ * Handlers write their response through a liso_writer that collects a CGI
+ * style header block and the body. The result is sent like script output
+ * through cgi_frame, so status, keep-alive, HEAD and pipelining work the
+ * same as for CGI.
+ *
+ * Handlers registered with LISO_HANDLER_OFFLOAD run on a pool of
+ * plugin_threads threads. The request moves to a job owned by the pool,
+ * the finished job is queued back and the event loop is woken through a
+ * pipe it selects on. The client waits like one waiting on a CGI script,
+ * a client that closes in the mean time only drops its job.
+ *
+ * @version 0.1
+ * @date 2021-10-31
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <string.h>
+#include "liso.h"
+#include "access_log.h"
+#include "plugin.h"
+
+#define SIZE_STRING_BUF_SIZE 50
+
+// Globals
+static plugin_route routes[PLUGIN_MAX_ROUTES];
+static int route_count = 0;
+
+// offload pool, jobs waiting for a thread and finished ones
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_work = PTHREAD_COND_INITIALIZER;
+static plugin_job *todo_head = NULL;
+static plugin_job *todo_tail = NULL;
+static plugin_job *done_head = NULL;
+static plugin_job *done_tail = NULL;
+static int thread_count = 0;
+static int event_pipe[2] = {-1, -1};
+
+/**
+ * @brief Append a job to a job list
+ *
+ * @param head [in,out] first job of the list
+ * @param tail [in,out] last job of the list
+ * @param job job to append
+ * @return ** void
+ */
+static void push_job(plugin_job **head, plugin_job **tail, plugin_job *job) {
+	job->next = NULL;
+	if(*tail == NULL) {
+		*head = job;
+	} else {
+		(*tail)->next = job;
+	}
+	*tail = job;
+}
+
+/**
+ * @brief Thread of the offload pool, runs handlers of queued jobs and
+ * hands the finished jobs back to the event loop
+ *
+ * @param unused
+ * @return ** void* never returns
+ */
+static void* plugin_worker(void *unused) {
+	while(true) {
+		pthread_mutex_lock(&pool_lock);
+		while(todo_head == NULL) {
+			pthread_cond_wait(&pool_work, &pool_lock);
+		}
+		plugin_job *job = todo_head;
+		todo_head = job->next;
+		if(todo_head == NULL) {
+			todo_tail = NULL;
+		}
+		pthread_mutex_unlock(&pool_lock);
+
+		job->ret = job->route->handler(job->req, &job->w, job->route->arg);
+
+		pthread_mutex_lock(&pool_lock);
+		push_job(&done_head, &done_tail, job);
+		pthread_mutex_unlock(&pool_lock);
+
+		// a full pipe already wakes the event loop
+		char wake = 1;
+		write(event_pipe[1], &wake, 1);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Load a plugin and let it register its handlers
+ *
+ * @param path path of the shared object
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR otherwise
+ */
+int plugin_load(const char *path) {
+	void *so = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if(so == NULL) {
+		fprintf(stderr, "Loading plugin failed: %s\n", dlerror());
+		return LISO_ERROR;
+	}
+
+	int (*init)(void) = (int (*)(void))dlsym(so, "liso_plugin_init");
+	if(init == NULL) {
+		fprintf(stderr, "Plugin %s has no liso_plugin_init\n", path);
+		dlclose(so);
+		return LISO_ERROR;
+	}
+
+	if(init() != 0) {
+		fprintf(stderr, "Plugin %s failed to initialize\n", path);
+		return LISO_ERROR;
+	}
+
+	// the plugin stays loaded for the life of the server
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Start the offload pool, must be called after daemonizing since
+ * threads do not survive fork()
+ *
+ * @param threads number of threads, 0 runs offloaded handlers in the
+ * event loop too
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR otherwise
+ */
+int plugin_start(long threads) {
+	int offload = false;
+	for(int i = 0; i < route_count; i++) {
+		offload |= routes[i].flags & LISO_HANDLER_OFFLOAD;
+	}
+	if(!offload || threads == 0) {
+		return LISO_SUCCESS;
+	}
+
+	if(pipe2(event_pipe, O_CLOEXEC | O_NONBLOCK) < 0) {
+		return LISO_ERROR;
+	}
+	if(event_pipe[0] >= FD_SETSIZE) {
+		// the event loop could not select() on it
+		close(event_pipe[0]);
+		close(event_pipe[1]);
+		event_pipe[0] = event_pipe[1] = -1;
+		return LISO_ERROR;
+	}
+
+	// signals are handled by the event loop thread only
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for(long i = 0; i < threads; i++) {
+		pthread_t thread;
+		if(pthread_create(&thread, NULL, plugin_worker, NULL) != 0) {
+			break;
+		}
+		pthread_detach(thread);
+		thread_count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	return thread_count > 0 ? LISO_SUCCESS : LISO_ERROR;
+}
+
+/**
+ * @brief fd that becomes readable when offloaded jobs finished
+ *
+ * @return ** int the fd, -1 if there is no offload pool
+ */
+int plugin_event_fd() {
+	return event_pipe[0];
+}
+
+/**
+ * @brief Register a handler for requests whose URI starts with prefix,
+ * the longest matching prefix wins
+ *
+ * @param prefix URI prefix, starting with '/'
+ * @param handler handler of the requests
+ * @param arg passed to the handler
+ * @param flags LISO_HANDLER_OFFLOAD or 0
+ * @return ** int 0 on success, -1 otherwise
+ */
+int liso_register_handler(const char *prefix, liso_handler handler, void *arg, int flags) {
+	if(prefix == NULL || prefix[0] != '/' || handler == NULL || route_count == PLUGIN_MAX_ROUTES) {
+		return -1;
+	}
+
+	plugin_route *route = &routes[route_count];
+	route->prefix = strdup(prefix);
+	if(route->prefix == NULL) {
+		return -1;
+	}
+	route->prefix_len = strlen(prefix);
+	route->handler = handler;
+	route->arg = arg;
+	route->flags = flags;
+	route_count++;
+	return 0;
+}
+
+/**
+ * @brief Find the handler of a request
+ *
+ * @param req parsed request
+ * @return ** plugin_route* route of the request, NULL if no plugin has it
+ */
+plugin_route* plugin_find(Request *req) {
+	plugin_route *best = NULL;
+	for(int i = 0; i < route_count; i++) {
+		if(strncmp(req->http_uri, routes[i].prefix, routes[i].prefix_len) == 0 &&
+		   (best == NULL || routes[i].prefix_len > best->prefix_len)) {
+			best = &routes[i];
+		}
+	}
+	return best;
+}
+
+/**
+ * @brief Append bytes to a growing writer buffer
+ *
+ * @param w writer, marked failed when out of memory
+ * @param buf [in,out] buffer
+ * @param len [in,out] bytes used
+ * @param cap [in,out] size of buffer
+ * @param data bytes to append
+ * @param data_len number of bytes
+ * @return ** int 0 on success, -1 otherwise
+ */
+static int writer_append(liso_writer *w, char **buf, long *len, long *cap,
+						 const void *data, size_t data_len) {
+	if(*len + (long)data_len > *cap) {
+		long new_cap = *cap > 0 ? *cap : BUF_SIZE;
+		while(new_cap < *len + (long)data_len) {
+			new_cap *= 2;
+		}
+		char *grown = realloc(*buf, new_cap);
+		if(grown == NULL) {
+			w->failed = true;
+			return -1;
+		}
+		*buf = grown;
+		*cap = new_cap;
+	}
+
+	memcpy(*buf + *len, data, data_len);
+	*len += data_len;
+	return 0;
+}
+
+/**
+ * @brief Set the status of the response, 200 OK if never called
+ *
+ * @param w writer of the response
+ * @param status status code
+ * @param reason reason phrase, NULL for the usual one
+ * @return ** int 0 on success, -1 for an invalid status
+ */
+int liso_set_status(liso_writer *w, int status, const char *reason) {
+	if(status < 100 || status > 599 || (reason != NULL && strpbrk(reason, "\r\n") != NULL)) {
+		return -1;
+	}
+	w->status = status;
+	snprintf(w->reason, sizeof(w->reason), "%s", reason != NULL ? reason : "");
+	return 0;
+}
+
+/**
+ * @brief Add a header to the response. Content-Length and the connection
+ * headers are set by Liso.
+ *
+ * @param w writer of the response
+ * @param name header name
+ * @param value header value
+ * @return ** int 0 on success, -1 otherwise
+ */
+int liso_add_header(liso_writer *w, const char *name, const char *value) {
+	if(name[0] == '\0' || strpbrk(name, ":\r\n") != NULL || strpbrk(value, "\r\n") != NULL) {
+		return -1;
+	}
+
+	long len = w->head_len;
+	long cap = w->head_cap;
+	int ret = writer_append(w, &w->head, &len, &cap, name, strlen(name));
+	ret |= writer_append(w, &w->head, &len, &cap, ": ", 2);
+	ret |= writer_append(w, &w->head, &len, &cap, value, strlen(value));
+	ret |= writer_append(w, &w->head, &len, &cap, "\r\n", 2);
+	w->head_len = len;
+	w->head_cap = cap;
+	return ret;
+}
+
+/**
+ * @brief Append to the body of the response
+ *
+ * @param w writer of the response
+ * @param data bytes to append
+ * @param len number of bytes
+ * @return ** int 0 on success, -1 otherwise
+ */
+int liso_write(liso_writer *w, const void *data, size_t len) {
+	return writer_append(w, &w->body, &w->body_len, &w->body_cap, data, len);
+}
+
+/**
+ * @brief Send the response of a handler to its client
+ *
+ * @param c client of the request
+ * @param req the request
+ * @param w writer the handler filled
+ * @param ret what the handler returned
+ * @return ** void
+ */
+static void plugin_respond(client *c, Request *req, liso_writer *w, int ret) {
+	// without a reason cgi_frame adds the usual one
+	char status[HTTP_TOKEN_SIZE + SIZE_STRING_BUF_SIZE];
+	int status_len = snprintf(status, sizeof(status), "Status: %d%s%s\r\n",
+							  w->status != 0 ? w->status : 200,
+							  w->reason[0] != '\0' ? " " : "", w->reason);
+
+	char length[SIZE_STRING_BUF_SIZE];
+	int length_len = snprintf(length, sizeof(length), "Content-Length: %ld\r\n\r\n", w->body_len);
+
+	long len = 0;
+	long cap = 0;
+	char *head = NULL;
+	if(ret == 0) {
+		writer_append(w, &head, &len, &cap, status, status_len);
+		writer_append(w, &head, &len, &cap, w->head, w->head_len);
+		writer_append(w, &head, &len, &cap, length, length_len);
+	}
+
+	if(ret != 0 || w->failed) {
+		LISOPRINTF("%s handler of %s failed\n", __func__, req->http_uri);
+		send_error_response(c, LISO_INTERNAL_ERROR, req);
+		if(get_conn_header(req) == LISO_CLOSE_CONN) {
+			c->closing = true;
+		}
+	} else {
+		send_framed_output(c, req, head, len, w->body, w->body_len);
+	}
+	free(head);
+}
+
+/**
+ * @brief Free what a writer holds
+ *
+ * @param w writer
+ * @return ** void
+ */
+static void writer_free(liso_writer *w) {
+	free(w->head);
+	free(w->body);
+}
+
+/**
+ * @brief Copy a request out of the arena of its client, a job may outlive
+ * the client
+ *
+ * @param req request to copy
+ * @return ** Request* copy on the heap, NULL if out of memory
+ */
+static Request* copy_request(Request *req) {
+	Request *copy = malloc(sizeof(Request));
+	if(copy == NULL) {
+		return NULL;
+	}
+	memcpy(copy, req, sizeof(Request));
+
+	copy->headers = malloc(sizeof(Http_header) * (req->header_count > 0 ? req->header_count : 1));
+	copy->message = malloc(req->message_len + 1);
+	if(copy->headers == NULL || copy->message == NULL) {
+		free(copy->headers);
+		free(copy->message);
+		free(copy);
+		return NULL;
+	}
+	memcpy(copy->headers, req->headers, sizeof(Http_header) * req->header_count);
+	if(req->message_len > 0) {
+		memcpy(copy->message, req->message, req->message_len);
+	}
+	copy->message[req->message_len] = '\0';
+
+	return copy;
+}
+
+/**
+ * @brief Free a request made by copy_request
+ *
+ * @param req request
+ * @return ** void
+ */
+static void free_request(Request *req) {
+	free(req->headers);
+	free(req->message);
+	free(req);
+}
+
+/**
+ * @brief Answer a request with its plugin handler. Offloaded handlers get
+ * the request handed over to the pool, the client waits for the job. A
+ * loopback only handler answers other clients with 404.
+ *
+ * @param c client that sent the request
+ * @param route route of the request
+ * @param req the request with its whole body
+ * @return ** int LISO_SUCCESS if the response was sent, LISO_CGI_END if it
+ * is sent once the pool ran the handler
+ */
+int plugin_serve(client *c, plugin_route *route, Request *req) {
+	if((route->flags & LISO_HANDLER_LOOPBACK) && strncmp(c->remote_address, "127.", 4) != 0) {
+		// the handler is not there for remote clients
+		send_error_response(c, LISO_LOAD_FAILED, req);
+		return LISO_SUCCESS;
+	}
+
+	if(!(route->flags & LISO_HANDLER_OFFLOAD) || thread_count == 0) {
+		liso_writer w;
+		memset(&w, 0, sizeof(w));
+		int ret = route->handler(req, &w, route->arg);
+		plugin_respond(c, req, &w, ret);
+		writer_free(&w);
+		return LISO_SUCCESS;
+	}
+
+	plugin_job *job = calloc(1, sizeof(plugin_job));
+	if(job != NULL) {
+		job->req = copy_request(req);
+	}
+	if(job == NULL || job->req == NULL) {
+		free(job);
+		send_error_response(c, LISO_INTERNAL_ERROR, req);
+		return LISO_SUCCESS;
+	}
+	job->c = c;
+	job->route = route;
+
+	// the job has its own copy, the client's is freed with its arena
+	c->req = NULL;
+	c->plugin_job = job;
+
+	pthread_mutex_lock(&pool_lock);
+	push_job(&todo_head, &todo_tail, job);
+	pthread_cond_signal(&pool_work);
+	pthread_mutex_unlock(&pool_lock);
+
+	return LISO_CGI_END;
+}
+
+/**
+ * @brief Send the responses of finished offloaded jobs, called by the
+ * event loop once plugin_event_fd() is readable
+ *
+ * @return ** void
+ */
+void plugin_complete() {
+	char drain[BUF_SIZE];
+	while(read(event_pipe[0], drain, sizeof(drain)) > 0) {
+		;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	plugin_job *job = done_head;
+	done_head = done_tail = NULL;
+	pthread_mutex_unlock(&pool_lock);
+
+	while(job != NULL) {
+		plugin_job *next = job->next;
+		client *c = job->c;
+		if(c != NULL) {
+			c->plugin_job = NULL;
+			plugin_respond(c, job->req, &job->w, job->ret);
+			access_log_end(c);
+			// carry on with requests pipelined behind this one
+			reinsert_client(c);
+		}
+
+		writer_free(&job->w);
+		free_request(job->req);
+		free(job);
+		job = next;
+	}
+}
+
+/**
+ * @brief Forget the offloaded job of a client that is closed, the job
+ * still runs but its response is dropped
+ *
+ * @param c client being closed
+ * @return ** void
+ */
+void plugin_cancel(client *c) {
+	if(c->plugin_job != NULL) {
+		c->plugin_job->c = NULL;
+		c->plugin_job = NULL;
+	}
+}
@@ -0,0 +1,136 @@
+/**
+ * @file pool.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Pools of fixed size objects and I/O buffers
+ *
+ * A slab pool carves small objects, like clients, out of page aligned
+ * slabs and keeps freed objects on a free list for the next one. Slabs are
+ * never given back, there are as many as the busiest moment needed.
+ *
+ * A buffer pool hands out page aligned buffers that are allocated one by
+ * one, so a burst of connections does not pin their buffers forever: at
+ * most max_free of them are kept for reuse and the rest are freed.
+ *
+ * The server is single threaded, pools are not locked.
+ *
+ * @version 0.1
+ * @date 2021-11-02
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <stdlib.h>
+#include <assert.h>
+#include "pool.h"
+
+static size_t round_up(size_t size, size_t to) {
+	return (size + to - 1) / to * to;
+}
+
+/**
+ * @brief Initialize a pool of small objects carved from slabs
+ *
+ * @param p pool
+ * @param size bytes of an object, at most POOL_SLAB_SIZE
+ * @return ** void
+ */
+void pool_init_slab(pool *p, size_t size) {
+	p->size = round_up(size < sizeof(void *) ? sizeof(void *) : size, POOL_ALIGN);
+	assert(p->size <= POOL_SLAB_SIZE);
+	p->slab = 1;
+	p->max_free = 0;
+	p->free_list = NULL;
+	p->free_count = 0;
+	p->in_use = 0;
+}
+
+/**
+ * @brief Initialize a pool of page aligned buffers
+ *
+ * @param p pool
+ * @param size bytes of a buffer
+ * @param max_free free buffers kept for reuse
+ * @return ** void
+ */
+void pool_init_buffers(pool *p, size_t size, long max_free) {
+	p->size = size;
+	p->slab = 0;
+	p->max_free = max_free;
+	p->free_list = NULL;
+	p->free_count = 0;
+	p->in_use = 0;
+}
+
+/**
+ * @brief Carve a new slab in to free objects
+ *
+ * @param p slab pool
+ * @return ** int 0 on success, -1 if out of memory
+ */
+static int add_slab(pool *p) {
+	char *slab;
+	if(posix_memalign((void **)&slab, POOL_PAGE_SIZE, POOL_SLAB_SIZE) != 0) {
+		return -1;
+	}
+
+	for(size_t off = 0; off + p->size <= POOL_SLAB_SIZE; off += p->size) {
+		*(void **)(slab + off) = p->free_list;
+		p->free_list = slab + off;
+		p->free_count++;
+	}
+	return 0;
+}
+
+/**
+ * @brief Get an object from a pool, its contents are undefined
+ *
+ * @param p pool
+ * @return ** void* the object, NULL if out of memory
+ */
+void* pool_get(pool *p) {
+	if(p->free_list == NULL) {
+		if(p->slab) {
+			if(add_slab(p) != 0) {
+				return NULL;
+			}
+		} else {
+			void *buf;
+			if(posix_memalign(&buf, POOL_PAGE_SIZE, round_up(p->size, POOL_PAGE_SIZE)) != 0) {
+				return NULL;
+			}
+			p->in_use++;
+			return buf;
+		}
+	}
+
+	void *obj = p->free_list;
+	p->free_list = *(void **)obj;
+	p->free_count--;
+	p->in_use++;
+	return obj;
+}
+
+/**
+ * @brief Give an object back to its pool
+ *
+ * @param p pool the object came from
+ * @param obj object, NULL is ignored
+ * @return ** void
+ */
+void pool_put(pool *p, void *obj) {
+	if(obj == NULL) {
+		return;
+	}
+	p->in_use--;
+
+	if(!p->slab && p->free_count >= p->max_free) {
+		free(obj);
+		return;
+	}
+
+	*(void **)obj = p->free_list;
+	p->free_list = obj;
+	p->free_count++;
+}
@@ -0,0 +1,300 @@
+/**
+ * @file resolve.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ * 
+ * @brief Resolution of request URIs to files in the www folder
+ * 
+ * A URI is canonicalized first: the query and fragment are stripped, 
+ * percent escapes are decoded and dot segments are removed (RFC 3986
+ * 5.2.4) so a URI can never point outside the www folder. Directories
+ * resolve to their index file.
+ * 
+ * Resolved files are kept in a direct mapped cache keyed by the URI as
+ * received, so a repeated request skips canonicalization, path building
+ * and the directory stat and goes straight to the cached file. Entries
+ * are stat()ed again once they are older than resolve_cache_ttl seconds
+ * and a colliding URI simply replaces the entry in its slot.
+ * 
+ * @version 0.1
+ * @date 2021-10-25
+ * 
+ * @copyright Copyright (c) 2021
+ * 
+ */
+
+#include <ctype.h>
+#include <sys/stat.h>
+#include "liso.h"
+#include "resolve.h"
+
+// Globals
+extern char LISO_PATH[PATH_MAX];
+
+static resolved_file *cache = NULL;
+static long cache_size = 0;
+
+/**
+ * @brief FNV-1a hash of a string
+ * 
+ * @param str string to hash
+ * @return ** unsigned int hash
+ */
+static unsigned int hash_uri(const char *str) {
+	unsigned int hash = 2166136261u;
+	while(*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+/**
+ * @brief Value of a hex digit
+ * 
+ * @param ch hex digit
+ * @return ** int value, -1 if ch is not a hex digit
+ */
+static int hex_value(char ch) {
+	if(ch >= '0' && ch <= '9') {
+		return ch - '0';
+	}
+	if(ch >= 'a' && ch <= 'f') {
+		return ch - 'a' + 10;
+	}
+	if(ch >= 'A' && ch <= 'F') {
+		return ch - 'A' + 10;
+	}
+	return -1;
+}
+
+/**
+ * @brief Canonicalize the path of a request URI
+ * 
+ * @param uri URI from the request line
+ * @param out [out] canonical path, always starts with '/'
+ * @param size size of out
+ * @return ** int LISO_SUCCESS on success, LISO_BAD_REQUEST for invalid
+ * escapes or a path that does not fit out
+ */
+int canonicalize_uri(const char *uri, char *out, int size) {
+	int len = 0;
+
+	if(size < 2) {
+		return LISO_BAD_REQUEST;
+	}
+
+	// absolute form, skip scheme and authority
+	if(strncasecmp(uri, "http://", 7) == 0) {
+		uri = strchr(uri + 7, '/');
+		if(uri == NULL) {
+			uri = "/";
+		}
+	}
+
+	if(*uri != '/') {
+		out[len++] = '/';
+	}
+
+	// decode up to the query or fragment
+	for(; *uri != '\0' && *uri != '?' && *uri != '#'; uri++) {
+		char ch = *uri;
+
+		if(ch == '%') {
+			int hi = hex_value(uri[1]);
+			int lo = hi < 0 ? -1 : hex_value(uri[2]);
+			if(lo < 0) {
+				return LISO_BAD_REQUEST;
+			}
+			ch = hi * 16 + lo;
+			if(ch == '\0') {
+				return LISO_BAD_REQUEST;
+			}
+			uri += 2;
+		}
+
+		if(len == size - 1) {
+			return LISO_BAD_REQUEST;
+		}
+		out[len++] = ch;
+	}
+	out[len] = '\0';
+
+	// remove dot segments in place, out only ever shrinks
+	int r = 0;
+	int w = 0;
+	while(r < len) {
+		// r always points at a '/'
+		int seg = r + 1;
+		int seg_end = seg;
+		while(seg_end < len && out[seg_end] != '/') {
+			seg_end++;
+		}
+		int seg_len = seg_end - seg;
+
+		if(seg_len == 1 && out[seg] == '.') {
+			// "/." stays in the same directory
+			if(seg_end == len) {
+				out[w++] = '/';
+			}
+		} else if(seg_len == 2 && out[seg] == '.' && out[seg + 1] == '.') {
+			// "/.." drops the last segment written, never above root
+			while(w > 0 && out[--w] != '/');
+			if(seg_end == len) {
+				out[w++] = '/';
+			}
+		} else {
+			memmove(out + w, out + r, seg_end - r);
+			w += seg_end - r;
+		}
+		r = seg_end;
+	}
+
+	if(w == 0) {
+		out[w++] = '/';
+	}
+	out[w] = '\0';
+
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief stat a file and fill in the size and modification time
+ * 
+ * @param file resolved file with path set
+ * @return ** int LISO_SUCCESS if the path is a regular file, error otherwise
+ */
+static int stat_resolved(resolved_file *file) {
+	struct stat sfile;
+
+	if(stat(file->path, &sfile) != 0 || !S_ISREG(sfile.st_mode)) {
+		return LISO_LOAD_FAILED;
+	}
+
+	file->size = sfile.st_size;
+	file->mtime = sfile.st_mtim;
+	file->checked = time(NULL);
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Resolve a canonical URI to a file the slow way
+ * 
+ * @param uri request URI as received
+ * @param file [out] entry to fill, uri and path are allocated
+ * @return ** int LISO_SUCCESS on success, error otherwise
+ */
+static int resolve_uncached(const char *uri, resolved_file *file) {
+	char canonical[HTTP_FIELD_SIZE];
+	char path[PATH_MAX];
+	struct stat sfile;
+
+	int error = canonicalize_uri(uri, canonical, sizeof(canonical));
+	if(error != LISO_SUCCESS) {
+		return error;
+	}
+
+	int len = snprintf(path, sizeof(path), "%s%s", LISO_PATH, canonical);
+	if(len >= (int)sizeof(path)) {
+		return LISO_LOAD_FAILED;
+	}
+	LISOPRINTF(" %s uri %s resolved to %s\n", __func__, uri, path);
+
+	if(stat(path, &sfile) != 0) {
+		return LISO_LOAD_FAILED;
+	}
+
+	if(S_ISDIR(sfile.st_mode)) {
+		// serve the index file of a directory
+		len += snprintf(path + len, sizeof(path) - len, "%s%s",
+			path[len - 1] == '/' ? "" : "/", INDEX_FILE);
+		if(len >= (int)sizeof(path) || stat(path, &sfile) != 0) {
+			return LISO_LOAD_FAILED;
+		}
+	}
+
+	if(!S_ISREG(sfile.st_mode)) {
+		return LISO_LOAD_FAILED;
+	}
+
+	file->uri = strdup(uri);
+	file->path = strdup(path);
+	if(file->uri == NULL || file->path == NULL) {
+		free(file->uri);
+		free(file->path);
+		file->uri = file->path = NULL;
+		return LISO_MEM_FAIL;
+	}
+
+	file->size = sfile.st_size;
+	file->mtime = sfile.st_mtim;
+	file->mime = get_mime_type(path);
+	file->checked = time(NULL);
+
+	return LISO_SUCCESS;
+}
+
+/**
+ * @brief Drop a resolved file from the cache, e.g. when it could not be
+ * read any more
+ * 
+ * @param file entry returned by resolve_uri
+ * @return ** void 
+ */
+void invalidate_uri(resolved_file *file) {
+	free(file->uri);
+	free(file->path);
+	file->uri = NULL;
+	file->path = NULL;
+}
+
+/**
+ * @brief Resolve a request URI to a file in the www folder
+ * 
+ * @param uri URI from the request line
+ * @param file [out] resolved file, valid until the next call
+ * @return ** int LISO_SUCCESS on success, LISO_LOAD_FAILED if there is no
+ * such file, LISO_BAD_REQUEST for a malformed URI
+ */
+int resolve_uri(const char *uri, resolved_file **file) {
+	static resolved_file uncached;
+
+	if(cache == NULL && config.resolve_cache_size > 0) {
+		cache = calloc(config.resolve_cache_size, sizeof(resolved_file));
+		if(cache != NULL) {
+			cache_size = config.resolve_cache_size;
+		}
+	}
+
+	if(cache == NULL) {
+		// cache is disabled
+		invalidate_uri(&uncached);
+		*file = &uncached;
+		return resolve_uncached(uri, &uncached);
+	}
+
+	unsigned int hash = hash_uri(uri);
+	resolved_file *entry = &cache[hash % cache_size];
+
+	if(entry->uri != NULL && entry->hash == hash && strcmp(entry->uri, uri) == 0) {
+		if(time(NULL) - entry->checked < config.resolve_cache_ttl) {
+			*file = entry;
+			return LISO_SUCCESS;
+		}
+
+		// entry is stale, one stat tells if the file is still there
+		if(stat_resolved(entry) == LISO_SUCCESS) {
+			*file = entry;
+			return LISO_SUCCESS;
+		}
+	}
+
+	invalidate_uri(entry);
+	int error = resolve_uncached(uri, entry);
+	if(error != LISO_SUCCESS) {
+		return error;
+	}
+
+	entry->hash = hash;
+	*file = entry;
+	return LISO_SUCCESS;
+}
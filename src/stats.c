@@ -0,0 +1,220 @@
+/**
+ * @file stats.c
+ * @author Apoorv Gupta <apoorvgu@andrew.cmu.edu>
+ *
+ * @brief Server counters of LISO and the /server-status endpoint
+ *
+ * The data path only increments counters of the event loop, nothing is
+ * locked or formatted while requests are served. /server-status is a
+ * built in handler answered in the event loop like an inline plugin, it
+ * reads the counters, walks the connections for the gauges, takes the
+ * latency percentiles from the histograms and formats them as
+ * "name: value" lines, or in the Prometheus text format with
+ * ?format=prometheus.
+ *
+ * @version 0.1
+ * @date 2021-11-05
+ *
+ * @copyright Copyright (c) 2021
+ *
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "liso.h"
+#include "liso_plugin.h"
+#include "cgi_cache.h"
+#include "latency.h"
+#include "stats.h"
+
+#define METRIC_LINE_SIZE 256
+
+liso_stats stats;
+
+static time_t started;
+
+static const char *method_names[STATS_METHODS] = {"other", "GET", "HEAD", "POST"};
+static const char *status_names[STATS_STATUS_CLASSES] = {"none", "1xx", "2xx", "3xx", "4xx", "5xx"};
+
+// output of one scrape
+typedef struct {
+	liso_writer *w;
+	int prometheus;
+	const char *last_name;		// HELP and TYPE are written once per name
+	int failed;
+} metric_out;
+
+/**
+ * @brief Write one value
+ *
+ * @param m output
+ * @param name metric name
+ * @param type "counter" or "gauge"
+ * @param help description of the metric
+ * @param value value of the metric
+ * @param labels number of label name and value pairs following
+ * @return ** void
+ */
+static void put(metric_out *m, const char *name, const char *type, const char *help,
+				double value, int labels, ...) {
+	char line[METRIC_LINE_SIZE];
+	int len = 0;
+	va_list args;
+
+	if(m->prometheus && (m->last_name == NULL || strcmp(m->last_name, name) != 0)) {
+		len += snprintf(line + len, sizeof(line) - len, "# HELP liso_%s %s\n# TYPE liso_%s %s\n",
+						name, help, name, type);
+		m->last_name = name;
+	}
+	len += snprintf(line + len, sizeof(line) - len, m->prometheus ? "liso_%s" : "%s", name);
+
+	va_start(args, labels);
+	for(int i = 0; i < labels && len < (int)sizeof(line); i++) {
+		const char *label = va_arg(args, const char *);
+		const char *label_value = va_arg(args, const char *);
+		if(m->prometheus) {
+			len += snprintf(line + len, sizeof(line) - len, "%s%s=\"%s\"%s", i == 0 ? "{" : ",",
+							label, label_value, i == labels - 1 ? "}" : "");
+		} else {
+			len += snprintf(line + len, sizeof(line) - len, "_%s", label_value);
+		}
+	}
+	va_end(args);
+
+	if(len < (int)sizeof(line)) {
+		len += snprintf(line + len, sizeof(line) - len, m->prometheus ? " %.15g\n" : ": %.15g\n", value);
+	}
+
+	if(len >= (int)sizeof(line) || liso_write(m->w, line, len) != 0) {
+		m->failed = true;
+	}
+}
+
+/**
+ * @brief Handler of STATS_URI, runs in the event loop
+ *
+ * @param req the request
+ * @param w response writer
+ * @param arg unused
+ * @return ** int 0 on success
+ */
+static int server_status(Request *req, liso_writer *w, void *arg) {
+	// the route is a prefix, only the URI itself and its query are ours
+	char next = req->http_uri[strlen(STATS_URI)];
+	if(next != '\0' && next != '?') {
+		return liso_set_status(w, 404, "Not Found");
+	}
+
+	metric_out m = {w, strstr(req->http_uri, "format=prometheus") != NULL, NULL, false};
+
+	// gauges of the connections, counters do not need the walk
+	long active = 0;
+	long idle = 0;
+	for(client *c = get_clients(); c != NULL; c = c->next) {
+		if(c->is_pipe) {
+			continue;
+		}
+		active++;
+		if(c->req == NULL && c->cgi_proc == NULL && c->plugin_job == NULL &&
+		   !c->cgi_queued && c->cache_wait == NULL && c->buf_left == 0 && c->out_len == 0) {
+			idle++;
+		}
+	}
+
+	liso_add_header(w, "Content-Type", m.prometheus ? "text/plain; version=0.0.4" : "text/plain");
+	liso_add_header(w, "Cache-Control", "no-store");
+
+	put(&m, "uptime_seconds", "gauge", "Seconds since the server started.",
+		time(NULL) - started, 0);
+	put(&m, "connections", "gauge", "Open client connections.",
+		active, 1, "state", "active");
+	put(&m, "connections", "gauge", "Open client connections.",
+		idle, 1, "state", "idle");
+	put(&m, "connections_accepted_total", "counter", "Connections accepted.",
+		stats.accepted, 0);
+	put(&m, "connections_closed_total", "counter", "Connections closed.",
+		stats.closed, 0);
+
+	for(int i = 0; i < STATS_METHODS; i++) {
+		put(&m, "requests_total", "counter", "Requests answered by method.",
+			stats.requests[i], 1, "method", method_names[i]);
+	}
+	for(int i = 0; i < STATS_STATUS_CLASSES; i++) {
+		put(&m, "responses_total", "counter", "Requests answered by status class.",
+			stats.responses[i], 1, "code", status_names[i]);
+	}
+	put(&m, "pipelined_requests_total", "counter", "Requests read behind another in one buffer.",
+		stats.pipelined, 0);
+	put(&m, "received_bytes_total", "counter", "Bytes received from clients.",
+		stats.bytes_in, 0);
+	put(&m, "sent_bytes_total", "counter", "Response bytes sent to clients.",
+		stats.bytes_out, 0);
+
+	put(&m, "cgi_requests", "gauge", "CGI requests being served or waiting for a slot.",
+		cgi_load.active, 1, "state", "running");
+	put(&m, "cgi_requests", "gauge", "CGI requests being served or waiting for a slot.",
+		cgi_load.queued, 1, "state", "queued");
+	put(&m, "cgi_rejected_total", "counter", "CGI requests refused because the queue was full.",
+		cgi_load.rejected, 0);
+	put(&m, "cgi_cache_hits_total", "counter", "CGI requests answered from the cache.",
+		cgi_cache_load.hits, 0);
+	put(&m, "cgi_cache_misses_total", "counter", "CGI requests looked up and not found.",
+		cgi_cache_load.misses, 0);
+	long lookups = cgi_cache_load.hits + cgi_cache_load.misses;
+	put(&m, "cgi_cache_hit_ratio", "gauge", "Share of CGI cache lookups that hit.",
+		lookups > 0 ? (double)cgi_cache_load.hits / lookups : 0, 0);
+	put(&m, "cgi_cache_bytes", "gauge", "Bytes held by the CGI cache.",
+		cgi_cache_load.bytes, 0);
+
+	put(&m, "timeouts_total", "counter", "Timeouts fired by kind.",
+		stats.idle_timeouts, 1, "kind", "idle");
+	put(&m, "timeouts_total", "counter", "Timeouts fired by kind.",
+		stats.header_timeouts, 1, "kind", "header");
+	put(&m, "timeouts_total", "counter", "Timeouts fired by kind.",
+		cgi_load.timed_out, 1, "kind", "cgi");
+	put(&m, "timeouts_total", "counter", "Timeouts fired by kind.",
+		cgi_load.expired, 1, "kind", "cgi_queue");
+
+	// percentiles of the phases since the start, in seconds
+	static const double quantiles[] = {0.5, 0.99, 0.999};
+	static const char *quantile_names[] = {"0.5", "0.99", "0.999"};
+	for(int i = 0; i < LATENCY_PHASES; i++) {
+		const latency_hist *h = latency_get(i);
+		for(int q = 0; q < 3; q++) {
+			put(&m, "latency_seconds", "gauge", "Latency percentiles of the phases of a request.",
+				latency_percentile(h, quantiles[q]) / 1e9, 2,
+				"phase", latency_phase_name(i), "quantile", quantile_names[q]);
+		}
+	}
+	for(int i = 0; i < LATENCY_PHASES; i++) {
+		put(&m, "latency_max_seconds", "gauge", "Longest latency of the phases of a request.",
+			latency_get(i)->max / 1e9, 1, "phase", latency_phase_name(i));
+	}
+	for(int i = 0; i < LATENCY_PHASES; i++) {
+		put(&m, "latency_samples_total", "counter", "Latencies counted for the phases of a request.",
+			latency_get(i)->count, 1, "phase", latency_phase_name(i));
+	}
+
+	put(&m, "log_dropped_total", "counter", "Log records dropped because the ring was full.",
+		log_dropped(), 0);
+
+	return m.failed ? -1 : 0;
+}
+
+/**
+ * @brief Start counting and serve STATS_URI, to loopback clients only
+ * unless server_status is 2
+ *
+ * @return ** int LISO_SUCCESS on success, LISO_ERROR if the handler could
+ * not be registered
+ */
+int stats_init() {
+	started = time(NULL);
+	int flags = config.server_status == 1 ? LISO_HANDLER_LOOPBACK : 0;
+	if(liso_register_handler(STATS_URI, server_status, NULL, flags) != 0) {
+		return LISO_ERROR;
+	}
+	return LISO_SUCCESS;
+}